@@ -454,10 +454,23 @@ convert_from_qoir_to_png(    //
 int  //
 usage() {
   fprintf(stderr,
-          "Usage:\n"                                              //
-          "  qoirconv --lossiness=L --dither foo.png foo.qoir\n"  //
-          "  qoirconv foo.qoir foo.png\n"                         //
-          "  L ranges in 0 ..= 7; the default (0) means lossless\n");
+          "Usage:\n"                                                         //
+          "  qoirconv --lossiness=L --alpha-lossiness=A --dither \\\n"       //
+          "           --mipmap-levels=M \\\n"                                //
+          "           --preview --tile-size=T --lz4-tile-group-size=G \\\n"  //
+          "           --huffman --ops-version=V --near-lossless=K \\\n"      //
+          "           --chroma-subsampling --alpha-plane \\\n"               //
+          "           --target-size=N --lossless-synthetic-tiles \\\n"       //
+          "           foo.png foo.qoir\n"                                    //
+          "  qoirconv foo.qoir foo.png\n"                                    //
+          "  L ranges in 0 ..= 7; the default (0) means lossless\n"          //
+          "  A ranges in 0 ..= 7; the default is the same as L\n"            //
+          "  M ranges in 0 ..= 24; the default (0) means none\n"             //
+          "  T is one of 64, 128 or 256; the default is 64\n"                //
+          "  G is a number of tiles; the default (0) means none\n"           //
+          "  V is 1 or 2; the default is 1\n"                                //
+          "  K ranges in 0 ..= 255; the default (0) means lossless\n"        //
+          "  N is a number of bytes; the default (0) means no target\n");
   return 1;
 }
 
@@ -491,6 +504,64 @@ main(          //
         encopts.lossiness = x;
         continue;
       }
+    } else if (!strncmp(arg, "-alpha-lossiness=", 17)) {
+      long int x = strtol(arg + 17, NULL, 10);
+      if ((0 <= x) && (x < 8)) {
+        encopts.separate_alpha_lossiness = true;
+        encopts.alpha_lossiness = x;
+        continue;
+      }
+    } else if (!strncmp(arg, "-tile-size=", 11)) {
+      long int x = strtol(arg + 11, NULL, 10);
+      if ((x == 64) || (x == 128) || (x == 256)) {
+        encopts.tile_size_in_pixels = x;
+        continue;
+      }
+    } else if (!strncmp(arg, "-lz4-tile-group-size=", 21)) {
+      long int x = strtol(arg + 21, NULL, 10);
+      if ((x >= 0) && (x <= 0xFFFFFF)) {
+        encopts.lz4_tile_group_size = x;
+        continue;
+      }
+    } else if (!strncmp(arg, "-huffman", 8)) {
+      encopts.huffman_coding = true;
+      continue;
+    } else if (!strncmp(arg, "-ops-version=", 13)) {
+      long int x = strtol(arg + 13, NULL, 10);
+      if ((x == 1) || (x == 2)) {
+        encopts.ops_version = x;
+        continue;
+      }
+    } else if (!strncmp(arg, "-chroma-subsampling", 19)) {
+      encopts.chroma_subsampling = true;
+      continue;
+    } else if (!strncmp(arg, "-alpha-plane", 12)) {
+      encopts.alpha_plane = true;
+      continue;
+    } else if (!strncmp(arg, "-near-lossless=", 15)) {
+      long int x = strtol(arg + 15, NULL, 10);
+      if ((0 <= x) && (x <= 255)) {
+        encopts.near_lossless_tolerance = x;
+        continue;
+      }
+    } else if (!strncmp(arg, "-target-size=", 13)) {
+      long long int x = strtoll(arg + 13, NULL, 10);
+      if (x >= 0) {
+        encopts.target_dst_len = (size_t)x;
+        continue;
+      }
+    } else if (!strncmp(arg, "-lossless-synthetic-tiles", 25)) {
+      encopts.lossless_synthetic_tiles = true;
+      continue;
+    } else if (!strncmp(arg, "-preview", 8)) {
+      encopts.preview = true;
+      continue;
+    } else if (!strncmp(arg, "-mipmap-levels=", 15)) {
+      long int x = strtol(arg + 15, NULL, 10);
+      if ((0 <= x) && (x <= 24)) {
+        encopts.mipmap_levels = x;
+        continue;
+      }
     }
     return usage();
   }
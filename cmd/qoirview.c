@@ -81,8 +81,9 @@ multithreaded_decode(        //
     return res;
   }
 
+  uint32_t tile_size = config.tile_size_in_pixels;
   uint32_t height_in_tiles =
-      qoir_calculate_number_of_tiles_1d(config.dst_pixcfg.height_in_pixels);
+      (config.dst_pixcfg.height_in_pixels + tile_size - 1) / tile_size;
   if (height_in_tiles <= 1) {
     return qoir_decode(src_ptr, src_len, options);
   }
@@ -131,8 +132,8 @@ multithreaded_decode(        //
     data[i].src_ptr = src_ptr;
     data[i].src_len = src_len;
     data[i].options = &opts;
-    data[i].y0 = (((i + 0) * height_in_tiles) / num_threads) * QOIR_TILE_SIZE;
-    data[i].y1 = (((i + 1) * height_in_tiles) / num_threads) * QOIR_TILE_SIZE;
+    data[i].y0 = (((i + 0) * height_in_tiles) / num_threads) * tile_size;
+    data[i].y1 = (((i + 1) * height_in_tiles) / num_threads) * tile_size;
     threads[i] = SDL_CreateThread(&work, "worker", &data[i]);
     if (!threads[i]) {
       status_message = "main: could not create thread";
@@ -0,0 +1,61 @@
+// Copyright 2022 Nigel Tao.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//go:build ignore
+
+package main
+
+// This program prints the qoir_private_table_op_lengths values.
+
+import (
+	"fmt"
+)
+
+func opLength(opcode uint32) uint32 {
+	switch {
+	case (opcode & 0x03) == 0: // QOIR_OP_INDEX
+		return 1
+	case (opcode & 0x03) == 1: // QOIR_OP_BGR2
+		return 1
+	case (opcode & 0x03) == 2: // QOIR_OP_LUMA
+		return 2
+	case (opcode & 0x07) == 3: // QOIR_OP_BGR7
+		return 3
+	case opcode < 0xD7: // QOIR_OP_RUNS
+		return 1
+	case opcode == 0xD7: // QOIR_OP_RUNL
+		return 2
+	case opcode == 0xDF: // QOIR_OP_BGRA2
+		return 2
+	case opcode == 0xE7: // QOIR_OP_BGRA4
+		return 3
+	case opcode == 0xEF: // QOIR_OP_BGRA8
+		return 5
+	case opcode == 0xF7: // QOIR_OP_BGR8
+		return 4
+	}
+	return 2 // QOIR_OP_A8
+}
+
+func main() {
+	for i := uint32(0); i < 256; i++ {
+		if (i & 15) == 0 {
+			fmt.Printf("  ")
+		}
+		fmt.Printf("%d,", opLength(i))
+		if (i & 15) == 15 {
+			fmt.Println()
+		}
+	}
+}
@@ -47,8 +47,10 @@ extern "C" {
 // -------- Compile-time Configuration
 
 // The compile-time configuration macros are:
+//  - QOIR_CONFIG__CACHE_SCRATCH_BUFFERS
 //  - QOIR_CONFIG__DISABLE_LARGE_LOOK_UP_TABLES
 //  - QOIR_CONFIG__DISABLE_SIMD
+//  - QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS
 //  - QOIR_CONFIG__STATIC_FUNCTIONS
 //  - QOIR_CONFIG__USE_OFFICIAL_LZ4_LIBRARY
 
@@ -60,6 +62,27 @@ extern "C" {
 
 // ----
 
+// Define QOIR_CONFIG__CACHE_SCRATCH_BUFFERS (combined with QOIR_IMPLEMENTATION)
+// to keep each thread's most recently used 'scratch space' (the decode and
+// encode buffers that are otherwise allocated and freed per call, when the
+// options' decbuf or encbuf are NULL or too short) for re-use by that thread's
+// next call, one buffer per tile size. Repeatedly decoding or encoding many
+// images then no longer calls malloc and free for tens or hundreds of
+// kilobytes each time. Each thread that does so should call
+// qoir_free_cached_scratch_buffers before it exits.
+
+// ----
+
+// Define QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS (combined with
+// QOIR_IMPLEMENTATION) to enable the encoder's split_ops option and decoding
+// the tiles that it produces. This is for experiments only. Split ops are not
+// part of the QOIR file format: they borrow an unassigned tile format (0x07),
+// so the encoded files are not valid QOIR files and other decoders will reject
+// them. That tile format may be assigned to something else in the future.
+// Without this macro, the split_ops option is ignored.
+
+// ----
+
 // Define QOIR_CONFIG__STATIC_FUNCTIONS (combined with QOIR_IMPLEMENTATION) to
 // make all of QOIR's functions have static storage.
 //
@@ -97,11 +120,13 @@ extern const char qoir_lz4_status_message__error_src_is_too_long[];
 
 extern const char qoir_status_message__error_invalid_argument[];
 extern const char qoir_status_message__error_invalid_data[];
+extern const char qoir_status_message__error_no_preview[];
 extern const char qoir_status_message__error_out_of_memory[];
 extern const char qoir_status_message__error_unsupported_metadata_size[];
 extern const char qoir_status_message__error_unsupported_pixbuf_dimensions[];
 extern const char qoir_status_message__error_unsupported_pixfmt[];
 extern const char qoir_status_message__error_unsupported_tile_format[];
+extern const char qoir_status_message__error_unsupported_tile_size[];
 
 // -------- Pixel Buffers
 
@@ -226,17 +251,36 @@ qoir_rectangle__height(  //
 
 // -------- Tiling
 
+// QOIR_TILE_SIZE is the default (and minimum) tile width and height, in
+// pixels. An image's QOIR chunk can select a larger tile size, up to
+// QOIR_MAX_TILE_SIZE. The qoir_calculate_number_of_tiles_etc functions assume
+// the default tile size.
 #define QOIR_TILE_MASK 0x3F
 #define QOIR_TILE_SIZE 0x40
 #define QOIR_TILE_SHIFT 6
 
+#define QOIR_MAX_TILE_SIZE 0x100
+#define QOIR_MAX_TILE_SHIFT 8
+
 // QOIR_LITERALS_PRE_PADDING is large enough to hold the previous pixel, at 4
 // bytes per pixel.
 #define QOIR_LITERALS_PRE_PADDING 4
 
-// QOIR_TS2 is the maximum (inclusive) number of pixels in a tile.
+// QOIR_TS2 is the maximum (inclusive) number of pixels in a default sized
+// tile. The qoir_etc_buffer types are sized accordingly. Images with larger
+// tiles need larger scratch space: see the qoir_etc_buffer_len functions.
 #define QOIR_TS2 (QOIR_TILE_SIZE * QOIR_TILE_SIZE)
 
+// QOIR_PREVIEW_MAX_DIMENSION is the maximum (inclusive) width and height, in
+// pixels, of the preview images that qoir_encode generates. It is at most
+// QOIR_TILE_SIZE, so that a preview image always fits in a single tile.
+#define QOIR_PREVIEW_MAX_DIMENSION 16
+
+// QOIR_LZ4_HISTORY_SIZE is the number of bytes of previous tiles' ops that an
+// "LZ4-Chained-Ops" tile can refer back to. It is at least LZ4's maximum match
+// offset (0xFFFF).
+#define QOIR_LZ4_HISTORY_SIZE 0x10000
+
 static inline uint32_t              //
 qoir_calculate_number_of_tiles_1d(  //
     uint32_t number_of_pixels) {
@@ -280,6 +324,18 @@ qoir_lz4_block_decode(                     //
     const uint8_t* QOIR_RESTRICT src_ptr,  //
     size_t src_len);
 
+// qoir_lz4_block_decode_with_prefix is like qoir_lz4_block_decode except that
+// LZ4 matches can also refer back to the prefix_len bytes immediately before
+// dst_ptr, which should hold previously decompressed data (what the official
+// LZ4 implementation calls a prefix dictionary).
+QOIR_MAYBE_STATIC qoir_size_result         //
+qoir_lz4_block_decode_with_prefix(         //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_len,                        //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_len,                        //
+    size_t prefix_len);
+
 // -------- LZ4 Encode
 
 // QOIR_LZ4_BLOCK_ENCODE_MAX_INCL_SRC_LEN is the maximum (inclusive) supported
@@ -311,11 +367,30 @@ qoir_lz4_block_encode(                     //
     const uint8_t* QOIR_RESTRICT src_ptr,  //
     size_t src_len);
 
+// qoir_lz4_block_encode_with_prefix is like qoir_lz4_block_encode except that
+// LZ4 matches can also refer back to the prefix_len bytes immediately before
+// src_ptr. Decoding its output requires qoir_lz4_block_decode_with_prefix,
+// with the same prefix bytes immediately before the decoder's dst_ptr.
+//
+// LZ4's maximum match offset is 0xFFFF, so only that many prefix bytes are
+// reachable. A longer prefix_len is equivalent to 0xFFFF.
+QOIR_MAYBE_STATIC qoir_size_result         //
+qoir_lz4_block_encode_with_prefix(         //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_len,                        //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_len,                        //
+    size_t prefix_len);
+
 // -------- QOIR Decode
 
 typedef struct qoir_decode_pixel_configuration_result_struct {
   const char* status_message;
   qoir_pixel_configuration dst_pixcfg;
+
+  // The tile width and height (64, 128 or 256). Multi-threaded decoders might
+  // want to divide the work at tile boundaries.
+  uint32_t tile_size_in_pixels;
 } qoir_decode_pixel_configuration_result;
 
 QOIR_MAYBE_STATIC qoir_decode_pixel_configuration_result  //
@@ -332,11 +407,27 @@ typedef struct qoir_decode_buffer_struct {
   } private_impl;
 } qoir_decode_buffer;
 
+// Returns the length of the 'scratch space' (see the qoir_decode_options
+// decbuf field) needed to decode images whose tiles are tile_size_in_pixels
+// wide and high. For QOIR_TILE_SIZE, it is sizeof(qoir_decode_buffer). It
+// returns zero if tile_size_in_pixels is not a valid QOIR tile size.
+QOIR_MAYBE_STATIC size_t  //
+qoir_decode_buffer_len(   //
+    uint32_t tile_size_in_pixels);
+
 typedef struct qoir_decode_result_struct {
   const char* status_message;
   void* owned_memory;
   qoir_pixel_buffer dst_pixbuf;
 
+  // The number of animation frames: one (for the QPIX chunk) plus the number
+  // of "fPIX" chunks. It is 1 for a still image.
+  uint32_t num_frames;
+
+  // The decoded frame's delay, in milliseconds, after the previous frame. It
+  // is zero for the first frame.
+  uint32_t frame_delay_ms;
+
   // Optional metadata chunks.
 
   const uint8_t* metadata_cicp_ptr;
@@ -352,6 +443,10 @@ typedef struct qoir_decode_result_struct {
   size_t metadata_xmp_len;
 } qoir_decode_result;
 
+// QOIR_MAX_EXECUTOR_CONCURRENCY is the maximum number of tasks that work is
+// divided into (see the qoir_decode_options executor_concurrency field).
+#define QOIR_MAX_EXECUTOR_CONCURRENCY 64
+
 typedef struct qoir_decode_options_struct {
   // Custom malloc/free implementations. NULL etc_func pointers means to use
   // the standard malloc and free functions. Non-NULL etc_func pointers will be
@@ -361,10 +456,18 @@ typedef struct qoir_decode_options_struct {
   void* memory_func_context;
 
   // Pre-allocated 'scratch space' used during decoding. Its contents need not
-  // be initialized when passed to qoir_decode.
+  // be initialized when passed to qoir_decode. It is decbuf_len bytes long,
+  // where a zero decbuf_len means sizeof(qoir_decode_buffer).
+  //
+  // It is only used for images whose tile size's qoir_decode_buffer_len is at
+  // most decbuf_len. A sizeof(qoir_decode_buffer) buffer is only long enough
+  // for QOIR_TILE_SIZE tiles. Pass qoir_decode_buffer_len(QOIR_MAX_TILE_SIZE)
+  // bytes to cover every tile size.
   //
-  // If NULL, the 'scratch space' will be dynamically allocated and freed.
+  // If NULL, or if too short, the 'scratch space' will be dynamically
+  // allocated and freed.
   qoir_decode_buffer* decbuf;
+  size_t decbuf_len;
 
   // Pre-allocated pixel buffer to decode into.
   //
@@ -393,6 +496,100 @@ typedef struct qoir_decode_options_struct {
   // corner of the decoded source image. The Y axis grows down.
   int32_t offset_x;
   int32_t offset_y;
+
+  // If either is non-zero then, instead of the full sized image, decode the
+  // smallest mipmap level (see the "mPIX" chunk) whose width and height are
+  // both at least these minimums. If no mipmap level is large enough (or the
+  // source has no mipmap levels) then the full sized image is decoded.
+  //
+  // When a mipmap level is chosen, the "source image" in the other fields'
+  // documentation (e.g. the src_clip_rectangle field's coordinate space) means
+  // that reduced-resolution image, and a dynamically allocated dst_pixbuf has
+  // that level's (smaller) width and height.
+  uint32_t mipmap_min_width_in_pixels;
+  uint32_t mipmap_min_height_in_pixels;
+
+  // Which animation frame to decode. Zero means the first frame (the QPIX
+  // chunk). Mipmap levels only apply to the first frame: the mipmap_etc fields
+  // are ignored if frame_index is positive.
+  //
+  // An "fPIX" frame only encodes the tiles that differ from its previous
+  // frame. By default, qoir_decode reconstructs frame N by decoding frames 0,
+  // 1, ..., N in turn. If pixbuf_holds_previous_frame is true (and frame_index
+  // is positive and the pixbuf field is non-zero) then the caller promises
+  // that the pixbuf already holds frame (N - 1), decoded with the same
+  // options, and qoir_decode only re-decodes frame N's changed tiles. Playing
+  // an animation then costs time proportional to the changed area.
+  uint32_t frame_index;
+  bool pixbuf_holds_previous_frame;
+
+  // If non-NULL, the image is decoded one band (one tile row, up to
+  // tile_size_in_pixels pixel rows) at a time, so that the whole image never
+  // needs to be in memory. Each band is decoded into the same band buffer,
+  // after which band_func is called with that buffer (whose height is that of
+  // the band) and the band's top Y coordinate in the source image. A non-NULL
+  // return value aborts decoding and becomes the qoir_decode status message.
+  //
+  // In this mode, the pixbuf field (if non-zero) is the band buffer, which
+  // must be at least as wide as the image and as high as a tile (or as the
+  // image, if shorter). If zero, a band buffer is dynamically allocated (and
+  // freed). The qoir_decode_result dst_pixbuf and owned_memory fields are
+  // zero, the clip rectangles and offsets are ignored and frame_index must be
+  // zero.
+  const char* (*band_func)(void* band_func_context,
+                           const qoir_pixel_buffer* band_pixbuf,
+                           uint32_t band_y_in_pixels);
+  void* band_func_context;
+
+  // An optional executor, for spreading work over multiple threads. If
+  // executor_concurrency is greater than one then executor_func must call
+  // task_func(task_context, i), possibly concurrently, once for each i in
+  // [0, num_tasks) and return only after all of those calls have returned.
+  // num_tasks is at most executor_concurrency (which is typically the number
+  // of threads) and at most QOIR_MAX_EXECUTOR_CONCURRENCY. Each task uses its
+  // own qoir_decode_buffer (the decbuf field, if non-NULL, is one of them).
+  //
+  // An executor_concurrency of zero or one means to do all of the work on the
+  // calling thread, without calling executor_func.
+  void (*executor_func)(void* executor_context,
+                        void (*task_func)(void* task_context,
+                                          uint32_t task_index),
+                        void* task_context,
+                        uint32_t num_tasks);
+  void* executor_context;
+  uint32_t executor_concurrency;
+
+  // If non-NULL, an 'arena': arena_len bytes of contiguous memory that
+  // qoir_decode lays out all of its allocations (its 'scratch space' and, if
+  // the pixbuf field is zero, its destination pixels or band buffer) in,
+  // instead of calling malloc or the contextual_malloc_func. The layout is
+  // deterministic: the destination pixels (or band buffer), if any, start at
+  // arena_ptr. qoir_decode_arena_len returns a sufficient arena_len.
+  //
+  // The qoir_decode_result owned_memory field is then NULL. The dst_pixbuf
+  // (if non-zero) points into the arena, which the caller still owns.
+  //
+  // Only qoir_decode uses an arena. Other functions that take these options
+  // (e.g. qoir_decode_preview and qoir_decode_batch) ignore the arena_etc
+  // fields.
+  uint8_t* arena_ptr;
+  size_t arena_len;
+
+  // If non-NULL, an earlier qoir_decode_result (e.g. from decoding the
+  // previous image of a stream of similarly sized images) whose owned_memory
+  // can be re-used when qoir_decode (or qoir_decode_preview) would otherwise
+  // dynamically allocate the dst_pixbuf. That avoids allocating, and page
+  // faulting, fresh memory each time. If the new dst_pixbuf fits (in bytes)
+  // in the earlier result's dst_pixbuf then its memory is re-used, otherwise
+  // it is freed before fresh memory is allocated. Either way, ownership moves
+  // to qoir_decode, which sets the earlier result's owned_memory to NULL and
+  // its dst_pixbuf to zero. The caller should still free the earlier result's
+  // owned_memory after qoir_decode returns, as it is untouched if qoir_decode
+  // fails before allocating.
+  //
+  // The earlier owned_memory must have come from the same memory functions.
+  // This field is ignored if the arena_ptr field is non-NULL.
+  qoir_decode_result* reusable_result;
 } qoir_decode_options;
 
 // Decodes a pixel buffer from the QOIR format.
@@ -405,6 +602,283 @@ qoir_decode(                          //
     const size_t src_len,             //
     const qoir_decode_options* options);
 
+// Returns an arena_len (see qoir_decode_options) that is large enough for
+// qoir_decode, with these options, to decode the QOIR image at src_ptr
+// without dynamically allocating memory. Only the QOIR chunk (the first 20
+// bytes) is examined, so it always allows for images that use LZ4 tile
+// groups. The options' arena_etc fields are ignored.
+//
+// A NULL options is valid and is equivalent to a non-NULL pointer to a
+// zero-valued struct (where all fields are zero / NULL / false).
+QOIR_MAYBE_STATIC qoir_size_result  //
+qoir_decode_arena_len(              //
+    const uint8_t* src_ptr,         //
+    size_t src_len,                 //
+    const qoir_decode_options* options);
+
+// Decodes only the preview (see the "PRVW" chunk) of a QOIR image, not the
+// full sized image. src_ptr and src_len need only hold a prefix of the QOIR
+// file: up to the end of the PRVW chunk plus at least 8 further bytes. If the
+// image has no preview then the qoir_status_message__error_no_preview status
+// message is returned.
+//
+// The options are interpreted as for qoir_decode, where the "source image"
+// means the preview image. The mipmap_etc fields are ignored. The result's
+// metadata_etc fields are not set.
+//
+// A NULL options is valid and is equivalent to a non-NULL pointer to a
+// zero-valued struct (where all fields are zero / NULL / false).
+QOIR_MAYBE_STATIC qoir_decode_result  //
+qoir_decode_preview(                  //
+    const uint8_t* src_ptr,           //
+    const size_t src_len,             //
+    const qoir_decode_options* options);
+
+typedef struct qoir_decode_batch_item_struct {
+  // The input: one QOIR image.
+  const uint8_t* src_ptr;
+  size_t src_len;
+
+  // The output, as if from qoir_decode. Its dst_pixbuf points into the arena
+  // and its owned_memory is always NULL.
+  qoir_decode_result result;
+} qoir_decode_batch_item;
+
+typedef struct qoir_decode_batch_result_struct {
+  // NULL if every image decoded successfully. Otherwise, the first failing
+  // item's status message. Each item has its own status message.
+  const char* status_message;
+
+  // How many bytes of the arena were used.
+  size_t arena_used_len;
+} qoir_decode_batch_result;
+
+// Decodes many (typically small) images, such as icons or thumbnails, with
+// less per-image overhead than calling qoir_decode for each one. One decode
+// buffer is shared by all of the images. Their pixel buffers are carved, in
+// order, out of the caller's arena, with no padding between rows. An image
+// that does not fit in what is left of the arena fails with
+// qoir_status_message__error_out_of_memory but later, smaller ones may fit.
+//
+// The options are interpreted as for qoir_decode (with the pixfmt field
+// selecting the pixel format) but the pixbuf, clip rectangle, offset,
+// mipmap_etc, pixbuf_holds_previous_frame and band_etc fields are ignored.
+// Every item is decoded whole.
+//
+// A NULL options is valid and is equivalent to a non-NULL pointer to a
+// zero-valued struct (where all fields are zero / NULL / false).
+QOIR_MAYBE_STATIC qoir_decode_batch_result  //
+qoir_decode_batch(                          //
+    qoir_decode_batch_item* items_ptr,      //
+    size_t items_len,                       //
+    uint8_t* arena_ptr,                     //
+    size_t arena_len,                       //
+    const qoir_decode_options* options);
+
+typedef struct qoir_decode_atlas_item_struct {
+  // The input: one QOIR image and where, in the atlas, to decode it to. The
+  // image's top-left corner goes at the rectangle's top-left corner and the
+  // image is clipped to the rectangle.
+  const uint8_t* src_ptr;
+  size_t src_len;
+  qoir_rectangle dst_rectangle;
+
+  // The output: whether this image was decoded successfully.
+  const char* status_message;
+} qoir_decode_atlas_item;
+
+typedef struct qoir_decode_atlas_result_struct {
+  // NULL if every image decoded successfully. Otherwise, the first failing
+  // item's status message (each item also has its own) or an error that
+  // prevented decoding anything, such as overlapping dst_rectangle fields.
+  const char* status_message;
+} qoir_decode_atlas_result;
+
+// Decodes many images into a single pixel buffer (a texture atlas), each into
+// its own rectangle. The rectangles must not overlap, so that the images can
+// be decoded in parallel (see the options' executor_etc fields), each task
+// using its own qoir_decode_buffer. Pixels outside of the rectangles, and
+// inside them but outside of their images, are left as they were.
+//
+// Checking for overlap sorts the rectangles and then compares each with those
+// that start on a lower row, but above its bottom edge. That is fast for grid
+// or shelf packed atlases but, for many tall rectangles whose top edges all
+// differ, approaches comparing every pair.
+//
+// The options are interpreted as for qoir_decode but the pixbuf, pixfmt, clip
+// rectangle, offset, pixbuf_holds_previous_frame and band_etc fields are
+// ignored. The per-item equivalents come from the items and dst_pixbuf.
+//
+// A NULL options is valid and is equivalent to a non-NULL pointer to a
+// zero-valued struct (where all fields are zero / NULL / false).
+QOIR_MAYBE_STATIC qoir_decode_atlas_result  //
+qoir_decode_atlas(                          //
+    const qoir_pixel_buffer* dst_pixbuf,    //
+    qoir_decode_atlas_item* items_ptr,      //
+    size_t items_len,                       //
+    const qoir_decode_options* options);
+
+typedef struct qoir_probe_result_struct {
+  const char* status_message;
+
+  // The image's pixel configuration and tile size, as per
+  // qoir_decode_pixel_configuration.
+  qoir_pixel_configuration dst_pixcfg;
+  uint32_t tile_size_in_pixels;
+
+  // The image's lossiness and, if separate_alpha_lossiness, its alpha
+  // lossiness. Individual tiles may be lossier (see the tile format byte).
+  uint32_t lossiness;
+  bool separate_alpha_lossiness;
+  uint32_t alpha_lossiness;
+
+  // The number of animation frames (see qoir_decode_result), mipmap levels
+  // ("mPIX" chunks) and whether there is a preview ("PRVW" chunk).
+  uint32_t num_frames;
+  uint32_t num_mipmap_levels;
+  bool has_preview;
+
+  // The QPIX chunk's payload: the full sized image's encoded tiles.
+  const uint8_t* qpix_payload_ptr;
+  size_t qpix_payload_len;
+
+  // Optional metadata chunks.
+
+  const uint8_t* metadata_cicp_ptr;
+  size_t metadata_cicp_len;
+
+  const uint8_t* metadata_iccp_ptr;
+  size_t metadata_iccp_len;
+
+  const uint8_t* metadata_exif_ptr;
+  size_t metadata_exif_len;
+
+  const uint8_t* metadata_xmp_ptr;
+  size_t metadata_xmp_len;
+} qoir_probe_result;
+
+// Walks and validates a QOIR file's chunk structure, returning its header
+// fields and where its metadata and QPIX chunks are, without decoding any
+// pixels. The chunk checks are the same as qoir_decode's but the tiles
+// themselves are not checked, so qoir_decode can still fail after a
+// successful qoir_probe. The result's pointers point into src_ptr.
+QOIR_MAYBE_STATIC qoir_probe_result  //
+qoir_probe(                          //
+    const uint8_t* src_ptr,          //
+    size_t src_len);
+
+// Checks that a QOIR file is valid, without decoding it to a pixel buffer.
+// This is like qoir_probe but also checks every tile of every pixel-holding
+// chunk (QPIX, fPIX, mPIX and PRVW). The tiles are decoded (e.g. LZ4
+// decompressed and their ops run) but the resultant pixels are discarded.
+//
+// The options are interpreted as for qoir_decode but only the contextual_etc,
+// memory_func_context, decbuf and executor_etc fields are used. The work is
+// divided among the executor's tasks by tile rows.
+//
+// A NULL options is valid and is equivalent to a non-NULL pointer to a
+// zero-valued struct (where all fields are zero / NULL / false).
+QOIR_MAYBE_STATIC qoir_probe_result  //
+qoir_validate(                       //
+    const uint8_t* src_ptr,          //
+    size_t src_len,                  //
+    const qoir_decode_options* options);
+
+// qoir_decoder is a push-style (resumable) decoder, for QOIR images that
+// arrive incrementally, such as over a network. The caller passes each piece
+// of input to qoir_decoder__feed as it arrives. Each tile is decoded once its
+// bytes (and those of any tile it is LZ4-chained to) are complete, so pixel
+// rows become available from the top down before the whole file has arrived.
+//
+// It decodes the full sized image (the QPIX chunk) only. The options' clip
+// rectangles, offsets, mipmap_etc, frame_etc and band_etc fields are ignored
+// and metadata chunks are skipped. The options' pixbuf is decoded into only
+// where it overlaps the image.
+//
+// Its fields are private. Call qoir_decoder__initialize before the first
+// qoir_decoder__feed call and qoir_decoder__destroy after the last one.
+typedef struct qoir_decoder_struct {
+  struct {
+    qoir_decode_options options;
+    const char* status_message;
+    uint32_t stage;
+    bool done;
+
+    // chunk_remaining is the number of bytes left in the current chunk's
+    // payload (when skipping it or decoding the QPIX chunk's tiles).
+    uint64_t chunk_remaining;
+    bool seen_qpix;
+
+    qoir_pixel_format src_pixfmt;
+    uint32_t tile_shift;
+    uint32_t width_in_pixels;
+    uint32_t height_in_pixels;
+    uint32_t lossiness;
+    int32_t alpha_lossiness;
+
+    // tx and ty are the next tile to decode, measured in tiles.
+    uint32_t tx;
+    uint32_t ty;
+    uint64_t num_decoded_tiles;
+
+    qoir_pixel_buffer dst_pixbuf;
+    void* owned_pixels;
+    uint8_t* scratch;
+    bool owns_scratch;
+    uint8_t* lz4_history;
+
+    // buf holds input that has been fed but not yet consumed.
+    uint8_t* buf_ptr;
+    size_t buf_len;
+    size_t buf_cap;
+  } private_impl;
+} qoir_decoder;
+
+typedef struct qoir_decoder_feed_result_struct {
+  // A NULL status_message does not mean that decoding is complete (see the
+  // done field), only that there has been no error so far. Errors are sticky:
+  // later qoir_decoder__feed calls return the same status_message.
+  const char* status_message;
+
+  // dst_pixbuf is zero until the image header has been received. Its memory
+  // is owned by the qoir_decoder (unless it came from the options).
+  qoir_pixel_buffer dst_pixbuf;
+
+  // decoded_height_in_pixels is how many pixel rows, from the top, are fully
+  // decoded. It grows a tile row at a time.
+  uint32_t decoded_height_in_pixels;
+  uint64_t num_decoded_tiles;
+
+  // done is whether the whole file (up to and including the QEND chunk) has
+  // been received and decoded. Feeding further bytes is an error.
+  bool done;
+} qoir_decoder_feed_result;
+
+// Initializes a qoir_decoder. The options (which are copied) are interpreted
+// as for qoir_decode, other than the ignored fields listed above.
+//
+// A NULL options is valid and is equivalent to a non-NULL pointer to a
+// zero-valued struct (where all fields are zero / NULL / false).
+QOIR_MAYBE_STATIC void     //
+qoir_decoder__initialize(  //
+    qoir_decoder* self,    //
+    const qoir_decode_options* options);
+
+// Feeds the next src_len bytes of the QOIR file to the decoder. The pieces can
+// be of any size, including zero. Input that cannot be consumed yet (such as a
+// partially received tile) is copied, so src_ptr need not outlive the call.
+QOIR_MAYBE_STATIC qoir_decoder_feed_result  //
+qoir_decoder__feed(                         //
+    qoir_decoder* self,                     //
+    const uint8_t* src_ptr,                 //
+    size_t src_len);
+
+// Frees the memory owned by the decoder, including any dynamically allocated
+// dst_pixbuf, after which that pixel buffer is no longer valid.
+QOIR_MAYBE_STATIC void  //
+qoir_decoder__destroy(  //
+    qoir_decoder* self);
+
 // -------- QOIR Encode
 
 typedef struct qoir_encode_buffer_struct {
@@ -419,6 +893,15 @@ typedef struct qoir_encode_buffer_struct {
   } private_impl;
 } qoir_encode_buffer;
 
+// Returns the length of the 'scratch space' (see the qoir_encode_options
+// encbuf field) needed to encode images with tiles that are
+// tile_size_in_pixels wide and high. For QOIR_TILE_SIZE, it is
+// sizeof(qoir_encode_buffer). It returns zero if tile_size_in_pixels is not a
+// valid QOIR tile size.
+QOIR_MAYBE_STATIC size_t  //
+qoir_encode_buffer_len(   //
+    uint32_t tile_size_in_pixels);
+
 typedef struct qoir_encode_result_struct {
   const char* status_message;
   void* owned_memory;
@@ -435,10 +918,18 @@ typedef struct qoir_encode_options_struct {
   void* memory_func_context;
 
   // Pre-allocated 'scratch space' used during encoding. Its contents need not
-  // be initialized when passed to qoir_encode.
+  // be initialized when passed to qoir_encode. It is encbuf_len bytes long,
+  // where a zero encbuf_len means sizeof(qoir_encode_buffer).
+  //
+  // It is only used when the tile size's qoir_encode_buffer_len is at most
+  // encbuf_len. A sizeof(qoir_encode_buffer) buffer is only long enough for
+  // QOIR_TILE_SIZE tiles. Pass qoir_encode_buffer_len(QOIR_MAX_TILE_SIZE)
+  // bytes to cover every tile size.
   //
-  // If NULL, the 'scratch space' will be dynamically allocated and freed.
+  // If NULL, or if too short, the 'scratch space' will be dynamically
+  // allocated and freed.
   qoir_encode_buffer* encbuf;
+  size_t encbuf_len;
 
   // Optional metadata chunks.
 
@@ -454,9 +945,19 @@ typedef struct qoir_encode_options_struct {
   const uint8_t* metadata_xmp_ptr;
   size_t metadata_xmp_len;
 
-  // Lossiness ranges from 0 (lossless) to 7 (very lossy), inclusive.
+  // Lossiness ranges from 0 (lossless) to 7 (very lossy), inclusive. It
+  // applies to the full sized image and to any mipmap levels.
   uint32_t lossiness;
 
+  // Whether alpha_lossiness, instead of lossiness, applies to the alpha
+  // channel. For example, UI assets often need exact alpha (for clean edges)
+  // but can lose some color precision, while soft shadows are the reverse.
+  // These options have no effect for opaque or premultiplied alpha pixel
+  // formats. Decoders that predate this option apply lossiness to the alpha
+  // channel too, decoding such images incorrectly.
+  bool separate_alpha_lossiness;
+  uint32_t alpha_lossiness;
+
   // Whether to dither the lossy encoding. This option has no effect if
   // lossiness is zero.
   //
@@ -467,6 +968,144 @@ typedef struct qoir_encode_options_struct {
   // use alternative dithering algorithms, apply them to src_pixbuf before
   // passing to qoir_encode.
   bool dither;
+
+  // The near-lossless tolerance, in the spirit of JPEG-LS. Zero means off.
+  // Otherwise, the encoder may change each pixel's B, G and R values by up to
+  // this much (after any lossiness), where that lets a cheaper op (a run, a
+  // color cache index or a shorter delta) replace a more expensive one. Alpha
+  // values (and gray tiles) are unchanged. Unlike lossiness, this needs no
+  // decoder support (or decoder time): the output is an ordinary lossless
+  // encoding of the changed pixels.
+  uint32_t near_lossless_tolerance;
+
+  // The number of reduced-resolution mipmap levels (each one an "mPIX" chunk)
+  // to generate, in addition to the full sized image. Level N is a box
+  // filtered, 1/(2**N) scale (rounding up) version of the full sized image.
+  // Generation stops early, after producing a 1 × 1 pixel level.
+  //
+  // Zero means to generate no mipmap levels.
+  uint32_t mipmap_levels;
+
+  // Additional animation frames, after the first frame (the src_pixbuf
+  // argument to qoir_encode). Each one becomes an "fPIX" chunk, in which tiles
+  // that are unchanged from the previous frame cost only 4 bytes. Every frame
+  // must have the same pixel configuration (pixel format, width and height) as
+  // src_pixbuf. The preview and mipmap levels only apply to the first frame.
+  const qoir_pixel_buffer* animation_frames_ptr;
+  size_t animation_frames_len;
+
+  // Optional (NULL means all zero) delays, in milliseconds, between showing
+  // each additional animation frame's previous frame and that frame. If
+  // non-NULL, it points to animation_frames_len elements.
+  const uint32_t* animation_delays_ms_ptr;
+
+  // The tile width and height: 64, 128 or 256. Zero means the default
+  // (QOIR_TILE_SIZE, 64). Larger tiles give LZ4 a larger window and amortize
+  // per-tile overhead, but there are fewer of them to decode in parallel.
+  // Decoders that predate this option only support 64 pixel tiles.
+  uint32_t tile_size_in_pixels;
+
+  // Whether to generate a "PRVW" chunk: a tiny (at most
+  // QOIR_PREVIEW_MAX_DIMENSION pixels wide and high) placeholder version of
+  // the image, placed before the bulky QPIX chunk so that qoir_decode_preview
+  // only needs the first few hundred bytes of the file.
+  bool preview;
+
+  // The number of horizontally adjacent tiles (within a tile row) that form
+  // an LZ4 tile group. Within a group, each tile's LZ4 compression can refer
+  // back to the earlier tiles' ops, improving the compression ratio for
+  // images with repetition across tile boundaries (e.g. text or UI bars).
+  //
+  // The cost is random access: decoding a tile (e.g. for a clip rectangle)
+  // also requires decompressing the earlier tiles in its group. Parallelism
+  // is unaffected at the tile row level, as groups never span tile rows.
+  //
+  // Zero or one means that every tile is compressed independently. A value
+  // at least the image's width in tiles means one group per tile row.
+  uint32_t lz4_tile_group_size;
+
+  // Whether to also consider Huffman coding (instead of LZ4 compression) for
+  // each tile's ops. LZ4 does no entropy coding, so Huffman coding often
+  // compresses better, at some cost in encoding and decoding speed. The
+  // encoder picks whichever is smaller, per tile.
+  bool huffman_coding;
+
+  // Whether to use (experimental) split ops tiles instead of LZ4-Ops. They
+  // store all of a tile's opcodes before all of their payloads, so that a
+  // decoder can locate each op's payload without first decoding the earlier
+  // ops. Tiles that continue an LZ4 tile group are unaffected. This option is
+  // ignored unless QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS is defined. See that
+  // macro's comment.
+  bool split_ops;
+
+  // The op set for ops tiles. Zero or one means the original op set. Two means
+  // Ops2, which adds a second, 256 entry (hash addressed) color cache, used by
+  // a 2 byte index op, and variable length (instead of at most 256 pixel)
+  // runs. Ops2 suits large flat regions and images with many recurring
+  // colors, but decoders that predate it cannot decode it. Ops2 tiles do not
+  // use LZ4 tile groups, Huffman coding or split ops.
+  uint32_t ops_version;
+
+  // Whether to use the (lossy, even if lossiness is zero) YCoCg-420 tile
+  // formats, which keep a luma plane at full resolution but share each 2 × 2
+  // block's chroma. This suits photographic content, as the eye is less
+  // sensitive to chroma detail. The planes are Huffman coded or LZ4
+  // compressed, whichever is smaller. Alpha stays lossless (apart from
+  // lossiness). Tiles are still encoded losslessly when that is smaller, and
+  // this option has no effect for premultiplied alpha pixel formats.
+  bool chroma_subsampling;
+
+  // Whether to also consider the Alpha-Plane tile formats for tiles with
+  // fully transparent pixels (e.g. sprites with hard edged masks). They store
+  // the alpha channel as runs and then only the other pixels' colors. They are
+  // kept only where smaller than the other tile formats. This option has no
+  // effect for opaque pixel formats or with chroma_subsampling. Decoders that
+  // predate this option cannot decode such tiles.
+  bool alpha_plane;
+
+  // The target (maximum) encoded length, in bytes. Zero means no target.
+  // Otherwise, if the image does not already fit, individual tiles of the
+  // full sized image (but not any preview, mipmap levels or further animation
+  // frames) are made lossier than the lossiness option: the most where that
+  // saves the most bytes per unit of distortion. The per-tile choice costs
+  // one cheap analysis pass and one or two more encodes. It is based on
+  // estimates, so the result can occasionally still be longer than the
+  // target, as it always is if even lossiness 7 does not fit.
+  //
+  // Decoders that predate per-tile lossiness cannot decode such tiles.
+  size_t target_dst_len;
+
+  // If non-NULL, a quality map: one lossiness value (from 0 to 7 inclusive;
+  // larger values mean 7) per tile of the full sized image, in the natural
+  // order. There are ((width + T - 1) / T) × ((height + T - 1) / T) of them,
+  // for T the tile size in pixels. Each tile's lossiness is the larger of its
+  // map value and the lossiness option. This lets a region of interest keep
+  // more detail than its surroundings. Decoders that predate per-tile
+  // lossiness cannot decode the lossier tiles.
+  const uint8_t* tile_lossiness_map;
+
+  // Whether to keep the tiles that look synthetic (e.g. text, line art or
+  // flat user interface elements, whose colors repeat exactly) lossless,
+  // regardless of the lossiness option or tile_lossiness_map. For example,
+  // the photographic parts of a screenshot can then be lossy while its text
+  // stays sharp. The classification costs one more (cheap) pass over the
+  // source pixels.
+  bool lossless_synthetic_tiles;
+
+  // If non-NULL, an 'arena': arena_len bytes of contiguous memory that
+  // qoir_encode lays out all of its allocations (its 'scratch space' and its
+  // worst case sized output) in, instead of calling malloc or the
+  // contextual_malloc_func. The layout is deterministic, for the same
+  // src_pixbuf configuration and options. qoir_encode_arena_len returns a
+  // sufficient arena_len.
+  //
+  // The qoir_encode_result owned_memory field is then NULL. The dst_ptr
+  // points into the arena, which the caller still owns.
+  //
+  // Rate control needs several encodings alive at once, so a non-zero
+  // target_dst_len is an invalid argument when there is an arena.
+  uint8_t* arena_ptr;
+  size_t arena_len;
 } qoir_encode_options;
 
 // Encodes a pixel buffer to the QOIR format.
@@ -478,6 +1117,25 @@ qoir_encode(                              //
     const qoir_pixel_buffer* src_pixbuf,  //
     const qoir_encode_options* options);
 
+// Returns an arena_len (see qoir_encode_options) that is large enough for
+// qoir_encode, with these options, to encode a pixel buffer with
+// src_pixbuf's configuration without dynamically allocating memory. The
+// pixel data is not examined. The options' arena_etc fields are ignored.
+//
+// A NULL options is valid and is equivalent to a non-NULL pointer to a
+// zero-valued struct (where all fields are zero / NULL / false).
+QOIR_MAYBE_STATIC qoir_size_result        //
+qoir_encode_arena_len(                    //
+    const qoir_pixel_buffer* src_pixbuf,  //
+    const qoir_encode_options* options);
+
+// -------- Scratch Buffer Cache
+
+// Frees the calling thread's cached 'scratch space'. It is a no-op unless
+// QOIR_CONFIG__CACHE_SCRATCH_BUFFERS is defined. See that macro's comment.
+QOIR_MAYBE_STATIC void  //
+qoir_free_cached_scratch_buffers(void);
+
 // ================================ -Public Interface
 
 #ifdef QOIR_IMPLEMENTATION
@@ -633,6 +1291,31 @@ static uint8_t qoir_private_table_unlossify[7][256] = {{
   0x00,0xFF,0x00,0xFF,0x00,0xFF,0x00,0xFF,0x00,0xFF,0x00,0xFF,0x00,0xFF,0x00,0xFF,
 }};
 
+#if defined(QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS)
+// qoir_private_table_op_lengths gives the total length (opcode byte plus
+// payload bytes) of each op, indexed by its opcode byte.
+//
+// The table was generated by script/gen_table_op_lengths.go
+static uint8_t qoir_private_table_op_lengths[256] = {
+  1,1,2,3,1,1,2,1,1,1,2,3,1,1,2,1,
+  1,1,2,3,1,1,2,1,1,1,2,3,1,1,2,1,
+  1,1,2,3,1,1,2,1,1,1,2,3,1,1,2,1,
+  1,1,2,3,1,1,2,1,1,1,2,3,1,1,2,1,
+  1,1,2,3,1,1,2,1,1,1,2,3,1,1,2,1,
+  1,1,2,3,1,1,2,1,1,1,2,3,1,1,2,1,
+  1,1,2,3,1,1,2,1,1,1,2,3,1,1,2,1,
+  1,1,2,3,1,1,2,1,1,1,2,3,1,1,2,1,
+  1,1,2,3,1,1,2,1,1,1,2,3,1,1,2,1,
+  1,1,2,3,1,1,2,1,1,1,2,3,1,1,2,1,
+  1,1,2,3,1,1,2,1,1,1,2,3,1,1,2,1,
+  1,1,2,3,1,1,2,1,1,1,2,3,1,1,2,1,
+  1,1,2,3,1,1,2,1,1,1,2,3,1,1,2,1,
+  1,1,2,3,1,1,2,2,1,1,2,3,1,1,2,2,
+  1,1,2,3,1,1,2,3,1,1,2,3,1,1,2,5,
+  1,1,2,3,1,1,2,4,1,1,2,3,1,1,2,2,
+};
+#endif  // defined(QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS)
+
 #if !defined(QOIR_CONFIG__DISABLE_LARGE_LOOK_UP_TABLES)
 // The table was generated by script/gen_table_luma.go
 static uint8_t qoir_private_table_luma[65536] = {
@@ -4853,19 +5536,40 @@ qoir_private_u64_overflow_add(  //
   return *x < old;
 }
 
-static inline uint32_t        //
-qoir_private_tile_dimension(  //
-    bool interior,            //
-    uint32_t pixel_dimension) {
-  return interior ? QOIR_TILE_SIZE
-                  : (((pixel_dimension - 1) & QOIR_TILE_MASK) + 1);
+static inline uint32_t         //
+qoir_private_tile_dimension(   //
+    bool interior,             //
+    uint32_t pixel_dimension,  //
+    uint32_t tile_shift) {
+  uint32_t tile_size = 1u << tile_shift;
+  return interior ? tile_size
+                  : (((pixel_dimension - 1) & (tile_size - 1)) + 1);
+}
+
+static inline uint32_t            //
+qoir_private_number_of_tiles_1d(  //
+    uint32_t number_of_pixels,    //
+    uint32_t tile_shift) {
+  uint64_t rounded_up = (uint64_t)number_of_pixels + (1u << tile_shift) - 1;
+  return (uint32_t)(rounded_up >> tile_shift);
+}
+
+// qoir_private_mipmap_dimension returns the width (or height) of the given
+// mipmap level: the full sized dimension divided by (1 << level), rounding
+// up, but never zero unless the full sized dimension is zero.
+static inline uint32_t          //
+qoir_private_mipmap_dimension(  //
+    uint32_t pixel_dimension,   //
+    uint32_t level) {
+  return (uint32_t)((((uint64_t)pixel_dimension) + (1u << level) - 1) >>
+                    level);
 }
 
-// QOIR_TILE_LZ4_COMPRESSION_WORST_CASE equals
-// qoir_lz4_block_encode_worst_case_dst_len(4 * QTS * QTS).
-#define QOIR_TILE_LZ4_COMPRESSION_WORST_CASE \
-  ((4 * QOIR_TILE_SIZE * QOIR_TILE_SIZE) +   \
-   ((4 * QOIR_TILE_SIZE * QOIR_TILE_SIZE) / 255) + 16)
+// QOIR_TILE_LZ4_COMPRESSION_WORST_CASE(tile_shift) equals
+// qoir_lz4_block_encode_worst_case_dst_len(4 << (2 * tile_shift)), for a tile
+// of (1 << tile_shift) by (1 << tile_shift) pixels.
+#define QOIR_TILE_LZ4_COMPRESSION_WORST_CASE(tile_shift) \
+  ((4u << (2 * (tile_shift))) + ((4u << (2 * (tile_shift))) / 255) + 16)
 
 // -------- SWAR (SIMD Within a Register)
 
@@ -4912,6 +5616,286 @@ qoir_private_free(                               //
   free(ptr);
 }
 
+// -------- Arenas
+
+// QOIR_PRIVATE_ARENA_ALIGNMENT is the granularity (relative to the arena's
+// start) of each arena allocation.
+#define QOIR_PRIVATE_ARENA_ALIGNMENT 16
+
+// qoir_private_arena is a bump allocator. Freeing the most recent allocation
+// gives its memory back. Freeing any other allocation is a no-op.
+typedef struct qoir_private_arena_struct {
+  uint8_t* ptr;
+  size_t len;
+  size_t used;
+  size_t last;
+} qoir_private_arena;
+
+// qoir_private_arena_add_len adds the arena footprint of a len byte
+// allocation to *total, returning false on overflow.
+static inline bool           //
+qoir_private_arena_add_len(  //
+    size_t* total,           //
+    uint64_t len) {
+  uint64_t n = (len + (QOIR_PRIVATE_ARENA_ALIGNMENT - 1)) &
+               ~((uint64_t)(QOIR_PRIVATE_ARENA_ALIGNMENT - 1));
+  if ((n < len) || (n > (SIZE_MAX - *total))) {
+    return false;
+  }
+  *total += (size_t)n;
+  return true;
+}
+
+static void*                //
+qoir_private_arena_malloc(  //
+    void* context,          //
+    size_t len) {
+  qoir_private_arena* arena = (qoir_private_arena*)context;
+  size_t used = arena->used;
+  if (!qoir_private_arena_add_len(&used, len) || (used > arena->len)) {
+    return NULL;
+  }
+  arena->last = arena->used;
+  arena->used = used;
+  return arena->ptr + arena->last;
+}
+
+static void               //
+qoir_private_arena_free(  //
+    void* context,        //
+    void* ptr) {
+  qoir_private_arena* arena = (qoir_private_arena*)context;
+  if (ptr && (ptr == (arena->ptr + arena->last))) {
+    arena->used = arena->last;
+  }
+}
+
+// -------- Scratch Buffers
+
+#define QOIR_PRIVATE_SCRATCH__DECBUF 0
+#define QOIR_PRIVATE_SCRATCH__ENCBUF 1
+#define QOIR_PRIVATE_SCRATCH__LZ4_HISTORY 2
+#define QOIR_PRIVATE_SCRATCH__NUM_KINDS 3
+
+// A decode (or encode) scratch buffer has the same layout as a
+// qoir_decode_buffer (or qoir_encode_buffer), but with its ops and literals
+// arrays sized for the image's tile size instead of QOIR_TILE_SIZE.
+// qoir_private_scratch_view points into one.
+//
+// An LZ4 history scratch buffer is only needed for LZ4 tile groups. It holds
+// a QOIR_LZ4_HISTORY_SIZE byte history immediately followed by a second ops
+// array (as large as an encode scratch buffer's), so that the two form a
+// contiguous LZ4 prefix dictionary and input (or output) buffer. Once a
+// decoder or encoder has one, qoir_private_scratch_view__use_lz4_history
+// points the view's ops there instead.
+typedef struct qoir_private_scratch_view_struct {
+  uint8_t* lz4_history;  // This is NULL if there is no LZ4 history.
+  uint8_t* ops;
+  size_t ops_len;
+  uint8_t* literals;  // This includes the QOIR_LITERALS_PRE_PADDING.
+  size_t literals_len;
+} qoir_private_scratch_view;
+
+static inline qoir_private_scratch_view  //
+qoir_private_make_scratch_view(          //
+    uint32_t kind,                       //
+    uint32_t tile_shift,                 //
+    uint8_t* ptr) {
+  size_t ts2 = (size_t)1 << (2 * tile_shift);
+  qoir_private_scratch_view v;
+  v.lz4_history = NULL;
+  v.ops = ptr;
+  v.ops_len = (kind == QOIR_PRIVATE_SCRATCH__ENCBUF) ? ((5 * ts2) + 64)  //
+                                                     : (4 * ts2);
+  v.literals = v.ops + v.ops_len;
+  v.literals_len = QOIR_LITERALS_PRE_PADDING + (4 * ts2);
+  return v;
+}
+
+// qoir_private_scratch_view__use_lz4_history points v's lz4_history and ops
+// into ptr, an LZ4 history scratch buffer. Its ops array is at least as long
+// as v's, and v's own ops array is no longer used.
+static inline void                           //
+qoir_private_scratch_view__use_lz4_history(  //
+    qoir_private_scratch_view* v,            //
+    uint8_t* ptr) {
+  v->lz4_history = ptr;
+  v->ops = ptr + QOIR_LZ4_HISTORY_SIZE;
+}
+
+// qoir_private_scratch_len returns the length of a scratch buffer. For
+// QOIR_TILE_SHIFT, a decode (or encode) scratch buffer's length is the sizeof
+// a qoir_decode_buffer (or qoir_encode_buffer).
+static inline size_t       //
+qoir_private_scratch_len(  //
+    uint32_t kind,         //
+    uint32_t tile_shift) {
+  size_t ts2 = (size_t)1 << (2 * tile_shift);
+  switch (kind) {
+    case QOIR_PRIVATE_SCRATCH__DECBUF:
+      return (4 * ts2) + QOIR_LITERALS_PRE_PADDING + (4 * ts2);
+    case QOIR_PRIVATE_SCRATCH__ENCBUF:
+      return ((5 * ts2) + 64) + QOIR_LITERALS_PRE_PADDING + (4 * ts2);
+  }
+  return QOIR_LZ4_HISTORY_SIZE + ((5 * ts2) + 64);
+}
+
+// qoir_private_supplied_scratch returns ptr, a caller-supplied decode (or
+// encode) scratch buffer that is len bytes long, if it is long enough for
+// tile_shift. Otherwise, it returns NULL. A zero len means the sizeof a
+// qoir_decode_buffer (or qoir_encode_buffer).
+static inline uint8_t*          //
+qoir_private_supplied_scratch(  //
+    uint32_t kind,              //
+    uint32_t tile_shift,        //
+    void* ptr,                  //
+    size_t len) {
+  if (len == 0) {
+    len = (kind == QOIR_PRIVATE_SCRATCH__DECBUF) ? sizeof(qoir_decode_buffer)
+                                                 : sizeof(qoir_encode_buffer);
+  }
+  return (len >= qoir_private_scratch_len(kind, tile_shift)) ? (uint8_t*)ptr
+                                                             : NULL;
+}
+
+#if defined(QOIR_CONFIG__CACHE_SCRATCH_BUFFERS)
+
+#if defined(__cplusplus) && (__cplusplus >= 201103L)
+#define QOIR_PRIVATE_THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+#define QOIR_PRIVATE_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define QOIR_PRIVATE_THREAD_LOCAL __thread
+#else
+#define QOIR_PRIVATE_THREAD_LOCAL _Thread_local
+#endif
+
+// A cached buffer remembers the memory functions that allocated it. It is
+// only re-used by calls with the same memory functions, as they are the ones
+// that will eventually free it.
+typedef struct qoir_private_scratch_struct {
+  void* ptr;
+  void* (*contextual_malloc_func)(void*, size_t);
+  void (*contextual_free_func)(void*, void*);
+  void* memory_func_context;
+} qoir_private_scratch;
+
+// The cache has one slot per kind and per tile size.
+static QOIR_PRIVATE_THREAD_LOCAL qoir_private_scratch
+    qoir_private_scratch_cache[QOIR_PRIVATE_SCRATCH__NUM_KINDS]
+                              [QOIR_MAX_TILE_SHIFT - QOIR_TILE_SHIFT + 1];
+
+#endif  // defined(QOIR_CONFIG__CACHE_SCRATCH_BUFFERS)
+
+#define QOIR_ACQUIRE_SCRATCH(kind, tile_shift)                            \
+  qoir_private_acquire_scratch(                                           \
+      kind, tile_shift, options ? options->contextual_malloc_func : NULL, \
+      options ? options->contextual_free_func : NULL,                     \
+      options ? options->memory_func_context : NULL)
+
+#define QOIR_RELEASE_SCRATCH(kind, tile_shift, ptr)                            \
+  qoir_private_release_scratch(                                                \
+      kind, tile_shift, ptr, options ? options->contextual_malloc_func : NULL, \
+      options ? options->contextual_free_func : NULL,                          \
+      options ? options->memory_func_context : NULL)
+
+// qoir_private_acquire_scratch takes (not shares) the cached buffer, if any,
+// so that a re-entrant call (e.g. from a band_func) allocates its own.
+static uint8_t*                                      //
+qoir_private_acquire_scratch(                        //
+    uint32_t kind,                                   //
+    uint32_t tile_shift,                             //
+    void* (*contextual_malloc_func)(void*, size_t),  //
+    void (*contextual_free_func)(void*, void*),      //
+    void* memory_func_context) {
+#if defined(QOIR_CONFIG__CACHE_SCRATCH_BUFFERS)
+  qoir_private_scratch* s =
+      &qoir_private_scratch_cache[kind][tile_shift - QOIR_TILE_SHIFT];
+  if (s->ptr && (s->contextual_malloc_func == contextual_malloc_func) &&
+      (s->contextual_free_func == contextual_free_func) &&
+      (s->memory_func_context == memory_func_context)) {
+    void* ptr = s->ptr;
+    s->ptr = NULL;
+    return (uint8_t*)ptr;
+  }
+#else
+  (void)contextual_free_func;
+#endif
+  return (uint8_t*)qoir_private_malloc(
+      contextual_malloc_func, memory_func_context,
+      qoir_private_scratch_len(kind, tile_shift));
+}
+
+// qoir_private_release_scratch gives the buffer back to the cache, if that
+// slot is empty, or frees it.
+static void                                          //
+qoir_private_release_scratch(                        //
+    uint32_t kind,                                   //
+    uint32_t tile_shift,                             //
+    void* ptr,                                       //
+    void* (*contextual_malloc_func)(void*, size_t),  //
+    void (*contextual_free_func)(void*, void*),      //
+    void* memory_func_context) {
+  if (!ptr) {
+    return;
+  }
+#if defined(QOIR_CONFIG__CACHE_SCRATCH_BUFFERS)
+  qoir_private_scratch* s =
+      &qoir_private_scratch_cache[kind][tile_shift - QOIR_TILE_SHIFT];
+  // Arena memory does not outlive its call, so it is never cached.
+  if (!s->ptr && (contextual_free_func != &qoir_private_arena_free)) {
+    s->ptr = ptr;
+    s->contextual_malloc_func = contextual_malloc_func;
+    s->contextual_free_func = contextual_free_func;
+    s->memory_func_context = memory_func_context;
+    return;
+  }
+#else
+  (void)kind;
+  (void)tile_shift;
+  (void)contextual_malloc_func;
+#endif
+  qoir_private_free(contextual_free_func, memory_func_context, ptr);
+}
+
+QOIR_MAYBE_STATIC void  //
+qoir_free_cached_scratch_buffers(void) {
+#if defined(QOIR_CONFIG__CACHE_SCRATCH_BUFFERS)
+  for (int kind = 0; kind < QOIR_PRIVATE_SCRATCH__NUM_KINDS; kind++) {
+    for (int i = 0; i <= (QOIR_MAX_TILE_SHIFT - QOIR_TILE_SHIFT); i++) {
+      qoir_private_scratch* s = &qoir_private_scratch_cache[kind][i];
+      if (s->ptr) {
+        qoir_private_free(s->contextual_free_func, s->memory_func_context,
+                          s->ptr);
+        s->ptr = NULL;
+      }
+    }
+  }
+#endif
+}
+
+QOIR_MAYBE_STATIC size_t  //
+qoir_decode_buffer_len(   //
+    uint32_t tile_size_in_pixels) {
+  for (uint32_t s = QOIR_TILE_SHIFT; s <= QOIR_MAX_TILE_SHIFT; s++) {
+    if (tile_size_in_pixels == (1u << s)) {
+      return qoir_private_scratch_len(QOIR_PRIVATE_SCRATCH__DECBUF, s);
+    }
+  }
+  return 0;
+}
+
+QOIR_MAYBE_STATIC size_t  //
+qoir_encode_buffer_len(   //
+    uint32_t tile_size_in_pixels) {
+  for (uint32_t s = QOIR_TILE_SHIFT; s <= QOIR_MAX_TILE_SHIFT; s++) {
+    if (tile_size_in_pixels == (1u << s)) {
+      return qoir_private_scratch_len(QOIR_PRIVATE_SCRATCH__ENCBUF, s);
+    }
+  }
+  return 0;
+}
+
 // -------- Status Messages
 
 const char qoir_lz4_status_message__error_dst_is_too_short[] =  //
@@ -4925,6 +5909,8 @@ const char qoir_status_message__error_invalid_argument[] =  //
     "#qoir: invalid argument";
 const char qoir_status_message__error_invalid_data[] =  //
     "#qoir: invalid data";
+const char qoir_status_message__error_no_preview[] =  //
+    "#qoir: no preview";
 const char qoir_status_message__error_out_of_memory[] =  //
     "#qoir: out of memory";
 const char qoir_status_message__error_unsupported_metadata_size[] =  //
@@ -4935,6 +5921,8 @@ const char qoir_status_message__error_unsupported_pixfmt[] =  //
     "#qoir: unsupported pixfmt";
 const char qoir_status_message__error_unsupported_tile_format[] =  //
     "#qoir: unsupported tile format";
+const char qoir_status_message__error_unsupported_tile_size[] =  //
+    "#qoir: unsupported tile size";
 
 // -------- Pixel Swizzlers
 
@@ -5330,6 +6318,17 @@ qoir_lz4_block_decode(                     //
     size_t dst_len,                        //
     const uint8_t* QOIR_RESTRICT src_ptr,  //
     size_t src_len) {
+  return qoir_lz4_block_decode_with_prefix(dst_ptr, dst_len, src_ptr, src_len,
+                                           0);
+}
+
+QOIR_MAYBE_STATIC qoir_size_result         //
+qoir_lz4_block_decode_with_prefix(         //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_len,                        //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_len,                        //
+    size_t prefix_len) {
   qoir_size_result result = {0};
 
   if (src_len > QOIR_LZ4_BLOCK_DECODE_MAX_INCL_SRC_LEN) {
@@ -5338,9 +6337,10 @@ qoir_lz4_block_decode(                     //
   }
 
 #if defined(QOIR_CONFIG__USE_OFFICIAL_LZ4_LIBRARY)
-  int n =
-      LZ4_decompress_safe((const char*)src_ptr, (char*)dst_ptr, (int)src_len,
-                          ((dst_len > INT_MAX) ? INT_MAX : (int)dst_len));
+  int n = LZ4_decompress_safe_usingDict(
+      (const char*)src_ptr, (char*)dst_ptr, (int)src_len,
+      ((dst_len > INT_MAX) ? INT_MAX : (int)dst_len),
+      (const char*)(dst_ptr - prefix_len), (int)prefix_len);
   if (n < 0) {
     result.status_message = qoir_lz4_status_message__error_invalid_data;
     return result;
@@ -5397,7 +6397,7 @@ qoir_lz4_block_decode(                     //
     src_ptr += 2;
     src_len -= 2;
     if ((copy_off == 0) ||  //
-        (copy_off > ((size_t)(dst_ptr - original_dst_ptr)))) {
+        (copy_off > (prefix_len + (size_t)(dst_ptr - original_dst_ptr)))) {
       goto fail_invalid_data;
     }
 
@@ -5484,6 +6484,17 @@ qoir_lz4_block_encode(                     //
     size_t dst_len,                        //
     const uint8_t* QOIR_RESTRICT src_ptr,  //
     size_t src_len) {
+  return qoir_lz4_block_encode_with_prefix(dst_ptr, dst_len, src_ptr, src_len,
+                                           0);
+}
+
+QOIR_MAYBE_STATIC qoir_size_result         //
+qoir_lz4_block_encode_with_prefix(         //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_len,                        //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_len,                        //
+    size_t prefix_len) {
   // This function does not switch on QOIR_CONFIG__USE_OFFICIAL_LZ4_LIBRARY.
   // We'd like the encoder's output to be the same regardless of configuration.
 
@@ -5496,8 +6507,12 @@ qoir_lz4_block_encode(                     //
     return result;
   }
   result.value = 0;
+  if (prefix_len > 0xFFFF) {
+    prefix_len = 0xFFFF;
+  }
 
   uint8_t* dp = dst_ptr;
+  const uint8_t* const base = src_ptr - prefix_len;
   const uint8_t* sp = src_ptr;
   const uint8_t* literal_start = src_ptr;
 
@@ -5509,10 +6524,18 @@ qoir_lz4_block_encode(                     //
     const size_t final_literals_limit = src_len - 11;
 
     // hash_table maps from QOIR_LZ4_HASH_TABLE_SHIFT-bit keys to 32-bit
-    // values. Each value is an offset o, relative to src_ptr, initialized to
-    // zero. Each key, when set, is a hash of 4 bytes src_ptr[o .. o+4].
+    // values. Each value is an offset o, relative to base, initialized to
+    // zero. Each key, when set, is a hash of 4 bytes base[o .. o+4].
     uint32_t hash_table[1 << QOIR_LZ4_HASH_TABLE_SHIFT] = {0};
 
+    // Seed the hash table with the prefix. Like the official implementation's
+    // LZ4_loadDict, only hash every third position, trading a little
+    // compression for speed.
+    for (const uint8_t* p = base; p < src_ptr; p += 3) {
+      hash_table[qoir_lz4_private_hash(qoir_private_peek_u32le(p))] =
+          (uint32_t)(p - base);
+    }
+
     while (1) {
       // Start with 1-byte steps, accelerating when not finding any matches
       // (e.g. when compressing binary data, not text data).
@@ -5534,14 +6557,14 @@ qoir_lz4_block_encode(                     //
           goto final_literals;
         }
         uint32_t* hash_table_entry = &hash_table[next_hash];
-        match = src_ptr + *hash_table_entry;
+        match = base + *hash_table_entry;
         next_hash = qoir_lz4_private_hash(qoir_private_peek_u32le(next_sp));
-        *hash_table_entry = (uint32_t)(sp - src_ptr);
+        *hash_table_entry = (uint32_t)(sp - base);
       } while (((sp - match) > 0xFFFF) ||
                (qoir_private_peek_u32le(sp) != qoir_private_peek_u32le(match)));
 
       // Extend the match backwards.
-      while ((sp > literal_start) && (match > src_ptr) &&
+      while ((sp > literal_start) && (match > base) &&
              (sp[-1] == match[-1])) {
         sp--;
         match--;
@@ -5598,16 +6621,16 @@ qoir_lz4_block_encode(                     //
         // minimum match length is 4. Update the hash table for one of those
         // skipped positions.
         hash_table[qoir_lz4_private_hash(qoir_private_peek_u32le(sp - 2))] =
-            (uint32_t)(sp - 2 - src_ptr);
+            (uint32_t)(sp - 2 - base);
 
         // Check if this match can be followed immediately by another match.
         // If so, continue the loop. Otherwise, break.
         uint32_t* hash_table_entry =
             &hash_table[qoir_lz4_private_hash(qoir_private_peek_u32le(sp))];
         uint32_t old_offset = *hash_table_entry;
-        uint32_t new_offset = (uint32_t)(sp - src_ptr);
+        uint32_t new_offset = (uint32_t)(sp - base);
         *hash_table_entry = new_offset;
-        match = src_ptr + old_offset;
+        match = base + old_offset;
         if (((new_offset - old_offset) > 0xFFFF) ||
             (qoir_private_peek_u32le(sp) != qoir_private_peek_u32le(match))) {
           break;
@@ -5639,27 +6662,425 @@ final_literals:
   return result;
 }
 
-// -------- QOIR Decode
+// -------- Huffman Decode
+
+// The Huffman-Ops tile format's payload is a QOIR_HUFFMAN_HEADER_LEN byte
+// header (a 3 byte decoded length, 256 4-bit code lengths and 3 3-byte stream
+// lengths) followed by 4 interleaved bitstreams. Byte i of the decoded output
+// comes from stream (i & 3). Independent streams let the CPU decode 4 symbols
+// in parallel (instruction level parallelism), as each one's bit position
+// doesn't depend on the others.
+#define QOIR_HUFFMAN_HEADER_LEN 140
+#define QOIR_HUFFMAN_MAX_CODE_LEN 11
+#define QOIR_HUFFMAN_TABLE_MASK ((1 << QOIR_HUFFMAN_MAX_CODE_LEN) - 1)
+
+typedef struct qoir_private_huffman_reader_struct {
+  uint64_t bits;
+  int32_t num_bits;
+  const uint8_t* ptr;
+  const uint8_t* start;
+  const uint8_t* end;
+} qoir_private_huffman_reader;
+
+// qoir_private_huffman_refill tops up r->bits to at least 56 bits, reading 8
+// bytes at a time. It needs 8 readable bytes past r->end (see §). Once every
+// stream byte has been read, it does nothing: decoding invalid data can then
+// drive num_bits negative, which the final length check catches.
+static inline void            //
+qoir_private_huffman_refill(  //
+    qoir_private_huffman_reader* r) {
+  if (r->ptr < r->end) {
+    r->bits |= qoir_private_peek_u64le(r->ptr) << r->num_bits;
+    r->ptr += (63 - r->num_bits) >> 3;
+    r->num_bits |= 56;
+  }
+}
 
-QOIR_MAYBE_STATIC qoir_decode_pixel_configuration_result  //
-qoir_decode_pixel_configuration(                          //
-    const uint8_t* src_ptr,                               //
-    size_t src_len) {
-  qoir_decode_pixel_configuration_result result = {0};
+static inline uint8_t                //
+qoir_private_huffman_decode_symbol(  //
+    qoir_private_huffman_reader* r,  //
+    const uint16_t* table) {
+  uint32_t entry = table[r->bits & QOIR_HUFFMAN_TABLE_MASK];
+  r->bits >>= entry & 15;
+  r->num_bits -= (int32_t)(entry & 15);
+  return (uint8_t)(entry >> 4);
+}
 
-  if ((src_len < 20) ||
-      (qoir_private_peek_u32le(src_ptr) != 0x52494F51)) {  // "QOIR"le.
-    result.status_message = qoir_status_message__error_invalid_data;
-    return result;
+static inline qoir_size_result        //
+qoir_private_make_size_result_error(  //
+    const char* status_message) {
+  qoir_size_result result = {0};
+  result.status_message = status_message;
+  return result;
+}
+
+static inline uint32_t      //
+qoir_private_reverse_bits(  //
+    uint32_t x,             //
+    uint32_t n) {
+  uint32_t y = 0;
+  for (; n > 0; n--) {
+    y = (y << 1) | (x & 1);
+    x >>= 1;
   }
-  uint64_t qoir_chunk_payload_len = qoir_private_peek_u64le(src_ptr + 4);
-  if ((qoir_chunk_payload_len < 8) ||
-      (qoir_chunk_payload_len > 0x7FFFFFFFFFFFFFFFull)) {
-    result.status_message = qoir_status_message__error_invalid_data;
-    return result;
+  return y;
+}
+
+// qoir_private_huffman_decode decodes a Huffman-Ops tile's payload. Like
+// qoir_private_decode_tile_ops, it needs 8 readable bytes past the end of src.
+// See §.
+static qoir_size_result                    //
+qoir_private_huffman_decode(               //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_len,                        //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_len) {
+  if (src_len < QOIR_HUFFMAN_HEADER_LEN) {
+    return qoir_private_make_size_result_error(
+        qoir_status_message__error_invalid_data);
+  }
+  size_t n = qoir_private_peek_u32le(src_ptr) & 0xFFFFFF;
+  if (n > dst_len) {
+    return qoir_private_make_size_result_error(
+        qoir_status_message__error_invalid_data);
   }
 
-  uint32_t header0 = qoir_private_peek_u32le(src_ptr + 12);
+  // Build the canonical Huffman code's look-up table, indexed by the next
+  // QOIR_HUFFMAN_MAX_CODE_LEN bits (low bits first). Each entry holds the
+  // symbol (high bits) and the code length (low 4 bits).
+  uint16_t table[1 << QOIR_HUFFMAN_MAX_CODE_LEN];
+  uint32_t counts[16] = {0};
+  for (int i = 0; i < 128; i++) {
+    counts[src_ptr[3 + i] & 15]++;
+    counts[src_ptr[3 + i] >> 4]++;
+  }
+  uint32_t kraft_sum = 0;
+  uint32_t next_code[16] = {0};
+  for (uint32_t len = 1; len < 16; len++) {
+    if (counts[len] == 0) {
+      continue;
+    } else if (len > QOIR_HUFFMAN_MAX_CODE_LEN) {
+      return qoir_private_make_size_result_error(
+          qoir_status_message__error_invalid_data);
+    }
+    kraft_sum += counts[len] << (QOIR_HUFFMAN_MAX_CODE_LEN - len);
+  }
+  for (uint32_t len = 2; len <= QOIR_HUFFMAN_MAX_CODE_LEN; len++) {
+    next_code[len] = (next_code[len - 1] + counts[len - 1]) << 1;
+  }
+  if ((counts[1] == 1) &&
+      (kraft_sum == (1u << (QOIR_HUFFMAN_MAX_CODE_LEN - 1)))) {
+    // A single symbol, with a 1-bit code. Either bit value decodes to it.
+    for (uint32_t s = 0; s < 256; s++) {
+      if (((src_ptr[3 + (s >> 1)] >> (4 * (s & 1))) & 15) != 0) {
+        for (uint32_t i = 0; i <= QOIR_HUFFMAN_TABLE_MASK; i++) {
+          table[i] = (uint16_t)((s << 4) | 1);
+        }
+        break;
+      }
+    }
+  } else if (kraft_sum != (1u << QOIR_HUFFMAN_MAX_CODE_LEN)) {
+    return qoir_private_make_size_result_error(
+        qoir_status_message__error_invalid_data);
+  } else {
+    for (uint32_t s = 0; s < 256; s++) {
+      uint32_t len = (src_ptr[3 + (s >> 1)] >> (4 * (s & 1))) & 15;
+      if (len == 0) {
+        continue;
+      }
+      uint32_t i = qoir_private_reverse_bits(next_code[len]++, len);
+      for (; i <= QOIR_HUFFMAN_TABLE_MASK; i += 1u << len) {
+        table[i] = (uint16_t)((s << 4) | len);
+      }
+    }
+  }
+
+  // Set up the 4 stream readers.
+  qoir_private_huffman_reader r[4];
+  const uint8_t* p = src_ptr + QOIR_HUFFMAN_HEADER_LEN;
+  size_t remaining = src_len - QOIR_HUFFMAN_HEADER_LEN;
+  for (int k = 0; k < 4; k++) {
+    size_t stream_len =
+        (k < 3) ? (qoir_private_peek_u32le(src_ptr + 131 + (3 * k)) & 0xFFFFFF)
+                : remaining;
+    if (stream_len > remaining) {
+      return qoir_private_make_size_result_error(
+          qoir_status_message__error_invalid_data);
+    }
+    r[k].bits = 0;
+    r[k].num_bits = 0;
+    r[k].ptr = p;
+    r[k].start = p;
+    r[k].end = p + stream_len;
+    p += stream_len;
+    remaining -= stream_len;
+  }
+
+  // Decode 4 symbols (one per stream) at a time. After a refill, each stream
+  // holds at least 56 bits, enough for 5 maximum length codes.
+  uint8_t* dp = dst_ptr;
+  for (size_t num_quads = n / 4; num_quads > 0;) {
+    qoir_private_huffman_refill(&r[0]);
+    qoir_private_huffman_refill(&r[1]);
+    qoir_private_huffman_refill(&r[2]);
+    qoir_private_huffman_refill(&r[3]);
+    size_t m = (num_quads < 5) ? num_quads : 5;
+    num_quads -= m;
+    for (; m > 0; m--) {
+      dp[0] = qoir_private_huffman_decode_symbol(&r[0], table);
+      dp[1] = qoir_private_huffman_decode_symbol(&r[1], table);
+      dp[2] = qoir_private_huffman_decode_symbol(&r[2], table);
+      dp[3] = qoir_private_huffman_decode_symbol(&r[3], table);
+      dp += 4;
+    }
+  }
+  for (size_t k = 0; k < (n & 3); k++) {
+    qoir_private_huffman_refill(&r[k]);
+    *dp++ = qoir_private_huffman_decode_symbol(&r[k], table);
+  }
+
+  // Every stream must be consumed exactly, up to its final byte's padding.
+  for (int k = 0; k < 4; k++) {
+    int64_t consumed_bits =
+        (8 * (int64_t)(r[k].ptr - r[k].start)) - (int64_t)r[k].num_bits;
+    int64_t stream_bits = 8 * (int64_t)(r[k].end - r[k].start);
+    if ((consumed_bits > stream_bits) || ((consumed_bits + 8) <= stream_bits)) {
+      return qoir_private_make_size_result_error(
+          qoir_status_message__error_invalid_data);
+    }
+  }
+
+  qoir_size_result result = {0};
+  result.value = n;
+  return result;
+}
+
+// -------- Huffman Encode
+
+static int                 //
+qoir_private_compare_u32(  //
+    const void* p,         //
+    const void* q) {
+  uint32_t x = *(const uint32_t*)p;
+  uint32_t y = *(const uint32_t*)q;
+  return (x > y) - (x < y);
+}
+
+// qoir_private_huffman_code_lengths sets lengths[s], for each byte value s, to
+// a Huffman code length (at most QOIR_HUFFMAN_MAX_CODE_LEN) for the given
+// frequencies, or to zero if freqs[s] is zero.
+static void                         //
+qoir_private_huffman_code_lengths(  //
+    uint8_t* lengths,               //
+    const uint32_t* freqs) {
+  memset(lengths, 0, 256);
+
+  // Sort the used symbols by ascending frequency. They are the leaf nodes 0
+  // .. n. Internal nodes n .. (2n - 1) are created in ascending weight order,
+  // so that the two-queue algorithm always finds the two lightest nodes at
+  // the queues' fronts.
+  //
+  // Each key packs a frequency (at most 0xFFFFFF) and a symbol.
+  uint32_t symbols[256];
+  uint32_t n = 0;
+  for (uint32_t s = 0; s < 256; s++) {
+    if (freqs[s] != 0) {
+      symbols[n++] = (freqs[s] << 8) | s;
+    }
+  }
+  qsort(symbols, n, sizeof(symbols[0]), &qoir_private_compare_u32);
+  for (uint32_t i = 0; i < n; i++) {
+    symbols[i] &= 0xFF;
+  }
+  if (n == 0) {
+    return;
+  } else if (n == 1) {
+    lengths[symbols[0]] = 1;
+    return;
+  }
+
+  uint32_t weights[512];
+  uint32_t parents[512];
+  uint32_t depths[512];
+  for (uint32_t i = 0; i < n; i++) {
+    weights[i] = freqs[symbols[i]];
+  }
+  uint32_t leaf = 0;
+  uint32_t node = n;
+  for (uint32_t next = n; next < ((2 * n) - 1); next++) {
+    for (int j = 0; j < 2; j++) {
+      uint32_t lightest =
+          ((leaf < n) && ((node >= next) || (weights[leaf] <= weights[node])))
+              ? leaf++
+              : node++;
+      parents[lightest] = next;
+      weights[next] =
+          (j == 0) ? weights[lightest] : (weights[next] + weights[lightest]);
+    }
+  }
+
+  // Count the leaves at each depth, clamping to QOIR_HUFFMAN_MAX_CODE_LEN.
+  uint32_t num_codes[QOIR_HUFFMAN_MAX_CODE_LEN + 1] = {0};
+  uint32_t root = (2 * n) - 2;
+  depths[root] = 0;
+  for (uint32_t i = root; i > 0; i--) {
+    depths[i - 1] = depths[parents[i - 1]] + 1;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    num_codes[(depths[i] < QOIR_HUFFMAN_MAX_CODE_LEN)
+                  ? depths[i]
+                  : QOIR_HUFFMAN_MAX_CODE_LEN]++;
+  }
+
+  // Clamping can over-subscribe the code space (the Kraft sum exceeds 1).
+  // Fix that by repeatedly moving a maximum length code to become the sibling
+  // of a shorter code, as miniz's tdefl_huffman_enforce_max_code_size does.
+  uint32_t kraft_sum = 0;
+  for (uint32_t len = 1; len <= QOIR_HUFFMAN_MAX_CODE_LEN; len++) {
+    kraft_sum += num_codes[len] << (QOIR_HUFFMAN_MAX_CODE_LEN - len);
+  }
+  for (; kraft_sum > (1u << QOIR_HUFFMAN_MAX_CODE_LEN); kraft_sum--) {
+    num_codes[QOIR_HUFFMAN_MAX_CODE_LEN]--;
+    for (uint32_t len = QOIR_HUFFMAN_MAX_CODE_LEN - 1; len > 0; len--) {
+      if (num_codes[len] > 0) {
+        num_codes[len]--;
+        num_codes[len + 1] += 2;
+        break;
+      }
+    }
+  }
+
+  // Give the shortest codes to the most frequent symbols.
+  uint32_t i = n;
+  for (uint32_t len = 1; len <= QOIR_HUFFMAN_MAX_CODE_LEN; len++) {
+    for (uint32_t c = num_codes[len]; c > 0; c--) {
+      lengths[symbols[--i]] = (uint8_t)len;
+    }
+  }
+}
+
+// qoir_private_huffman_encode writes src's Huffman-Ops tile payload to dst.
+// It fails, without writing the streams, if that would need more than dst_len
+// bytes.
+static qoir_size_result                    //
+qoir_private_huffman_encode(               //
+    uint8_t* QOIR_RESTRICT dst_ptr,        //
+    size_t dst_len,                        //
+    const uint8_t* QOIR_RESTRICT src_ptr,  //
+    size_t src_len) {
+  qoir_size_result result = {0};
+  if ((src_len == 0) || (src_len > 0xFFFFFF)) {
+    result.status_message = qoir_status_message__error_invalid_argument;
+    return result;
+  }
+
+  uint32_t freqs[256] = {0};
+  for (size_t i = 0; i < src_len; i++) {
+    freqs[src_ptr[i]]++;
+  }
+  uint8_t lengths[256];
+  qoir_private_huffman_code_lengths(lengths, freqs);
+
+  // Bound the encoded length before writing anything. Each of the 4 streams
+  // is padded to a whole number of bytes.
+  uint64_t total_bits = 0;
+  for (uint32_t s = 0; s < 256; s++) {
+    total_bits += (uint64_t)freqs[s] * lengths[s];
+  }
+  if ((QOIR_HUFFMAN_HEADER_LEN + (total_bits / 8) + 4) > dst_len) {
+    result.status_message = qoir_lz4_status_message__error_dst_is_too_short;
+    return result;
+  }
+
+  // Assign the canonical codes, bit-reversed for writing low bits first.
+  uint32_t counts[16] = {0};
+  for (uint32_t s = 0; s < 256; s++) {
+    counts[lengths[s]]++;
+  }
+  counts[0] = 0;
+  uint32_t next_code[16] = {0};
+  for (uint32_t len = 2; len < 16; len++) {
+    next_code[len] = (next_code[len - 1] + counts[len - 1]) << 1;
+  }
+  uint32_t codes[256];
+  for (uint32_t s = 0; s < 256; s++) {
+    codes[s] = lengths[s]
+                   ? qoir_private_reverse_bits(next_code[lengths[s]]++,
+                                               lengths[s])
+                   : 0;
+  }
+
+  // Write the header.
+  qoir_private_poke_u32le(dst_ptr, (uint32_t)src_len);
+  for (int i = 0; i < 128; i++) {
+    dst_ptr[3 + i] = (uint8_t)(lengths[2 * i] | (lengths[(2 * i) + 1] << 4));
+  }
+
+  // Write the streams, and then the first 3 streams' lengths.
+  uint8_t* dp = dst_ptr + QOIR_HUFFMAN_HEADER_LEN;
+  uint32_t stream_lens[4] = {0};
+  for (size_t k = 0; k < 4; k++) {
+    uint8_t* stream_start = dp;
+    uint64_t bits = 0;
+    uint32_t num_bits = 0;
+    for (size_t i = k; i < src_len; i += 4) {
+      uint8_t s = src_ptr[i];
+      bits |= ((uint64_t)codes[s]) << num_bits;
+      num_bits += lengths[s];
+      while (num_bits >= 8) {
+        *dp++ = (uint8_t)bits;
+        bits >>= 8;
+        num_bits -= 8;
+      }
+    }
+    if (num_bits > 0) {
+      *dp++ = (uint8_t)bits;
+    }
+    stream_lens[k] = (uint32_t)(dp - stream_start);
+  }
+  for (int k = 0; k < 3; k++) {
+    dst_ptr[131 + (3 * k)] = (uint8_t)(stream_lens[k] >> 0);
+    dst_ptr[132 + (3 * k)] = (uint8_t)(stream_lens[k] >> 8);
+    dst_ptr[133 + (3 * k)] = (uint8_t)(stream_lens[k] >> 16);
+  }
+
+  result.value = (size_t)(dp - dst_ptr);
+  return result;
+}
+
+// -------- QOIR Decode
+
+// qoir_private_decode_tile_shift returns the log2 of the tile size selected by
+// the high 4 bits of the QOIR chunk's PixelFormat byte, or zero if that is
+// unsupported.
+static inline uint32_t           //
+qoir_private_decode_tile_shift(  //
+    uint32_t header0) {
+  uint32_t code = header0 >> 28;
+  return (code <= (QOIR_MAX_TILE_SHIFT - QOIR_TILE_SHIFT))
+             ? (QOIR_TILE_SHIFT + code)
+             : 0;
+}
+
+QOIR_MAYBE_STATIC qoir_decode_pixel_configuration_result  //
+qoir_decode_pixel_configuration(                          //
+    const uint8_t* src_ptr,                               //
+    size_t src_len) {
+  qoir_decode_pixel_configuration_result result = {0};
+
+  if ((src_len < 20) ||
+      (qoir_private_peek_u32le(src_ptr) != 0x52494F51)) {  // "QOIR"le.
+    result.status_message = qoir_status_message__error_invalid_data;
+    return result;
+  }
+  uint64_t qoir_chunk_payload_len = qoir_private_peek_u64le(src_ptr + 4);
+  if ((qoir_chunk_payload_len < 8) ||
+      (qoir_chunk_payload_len > 0x7FFFFFFFFFFFFFFFull)) {
+    result.status_message = qoir_status_message__error_invalid_data;
+    return result;
+  }
+
+  uint32_t header0 = qoir_private_peek_u32le(src_ptr + 12);
   uint32_t width_in_pixels = 0xFFFFFF & header0;
   qoir_pixel_format src_pixfmt = 0x0F & (header0 >> 24);
   switch (src_pixfmt) {
@@ -5671,12 +7092,18 @@ qoir_decode_pixel_configuration(                          //
       result.status_message = qoir_status_message__error_invalid_data;
       return result;
   }
+  uint32_t tile_shift = qoir_private_decode_tile_shift(header0);
+  if (tile_shift == 0) {
+    result.status_message = qoir_status_message__error_unsupported_tile_size;
+    return result;
+  }
   uint32_t header1 = qoir_private_peek_u32le(src_ptr + 16);
   uint32_t height_in_pixels = 0xFFFFFF & header1;
 
   result.dst_pixcfg.pixfmt = src_pixfmt;
   result.dst_pixcfg.width_in_pixels = width_in_pixels;
   result.dst_pixcfg.height_in_pixels = height_in_pixels;
+  result.tile_size_in_pixels = 1u << tile_shift;
   return result;
 }
 
@@ -5781,14 +7208,36 @@ qoir_private_choose_decode_swizzle_func(  //
 // so that the decode loop can always refer (by a simple offset of -4) to the
 // pixel left of the current pixel.
 //
+// qoir_private_color_cache2_offset returns where (as a byte offset) a BGRA
+// color goes in color_cache2, which is conceptually "uint8_t
+// color_cache2[256][4]". Only the Ops2 tile formats use color_cache2.
+static QOIR_ALWAYS_INLINE uint32_t  //
+qoir_private_color_cache2_offset(   //
+    const uint8_t* bgra) {
+  // 2654435761u is Knuth's magic constant.
+  return ((qoir_private_peek_u32le(bgra) * 2654435761u) >> 24) << 2;
+}
+
 // Callers should pass (total_ops_length + 8) for src_len so the decode loop
 // can always peek for 8 bytes, even at the end of the stream. Reference: §
-static qoir_size_result        //
-qoir_private_decode_tile_ops(  //
-    uint8_t* dst_ptr,          //
-    size_t dst_len,            //
-    const uint8_t* src_ptr,    //
-    size_t src_len) {
+//
+// dst_stop_len is how many dst bytes the caller needs, usually dst_len. If it
+// is less (e.g. when the rows below are clipped out, as pixels are row-major)
+// then decoding stops once at least that many bytes are written, and the
+// final ops are not checked. Runs are still bounded by dst_len.
+//
+// The ops2 argument is whether to decode the Ops2 op set (with an additional
+// color cache and longer runs) instead of the original one. Callers should
+// pass a compile-time constant, so that the inlined code has no extra
+// branches.
+static QOIR_ALWAYS_INLINE qoir_size_result  //
+qoir_private_decode_tile_ops(               //
+    uint8_t* dst_ptr,                       //
+    size_t dst_len,                         //
+    size_t dst_stop_len,                    //
+    const uint8_t* src_ptr,                 //
+    size_t src_len,                         //
+    bool ops2) {
   qoir_size_result result = {0};
 
   if ((dst_len < QOIR_LITERALS_PRE_PADDING) || (src_len < 8)) {
@@ -5807,12 +7256,22 @@ qoir_private_decode_tile_ops(  //
     color_cache[i + 3] = 0xFF;
   }
   uint8_t next_color_index = 0;
+  uint8_t color_cache2[1024];
+  if (ops2) {
+    for (int i = 0; i < 1024; i += 4) {
+      color_cache2[i + 0] = 0x00;
+      color_cache2[i + 1] = 0x00;
+      color_cache2[i + 2] = 0x00;
+      color_cache2[i + 3] = 0xFF;
+    }
+  }
 
   uint8_t* dp = dst_ptr + QOIR_LITERALS_PRE_PADDING;
   uint8_t* dq = dst_ptr + dst_len;
+  uint8_t* ds = dst_ptr + dst_stop_len;
   const uint8_t* sp = src_ptr;
   const uint8_t* sq = src_ptr + src_len - 8;
-  while (dp < dq) {
+  while (dp < ds) {
     if (sp >= sq) {
       result.status_message = qoir_status_message__error_invalid_data;
       return result;
@@ -5829,6 +7288,10 @@ qoir_private_decode_tile_ops(  //
       sp += 4;
       memcpy(color_cache + next_color_index, pixel, 4);
       next_color_index += 4;
+      if (ops2) {
+        memcpy(color_cache2 + qoir_private_color_cache2_offset(pixel), pixel,
+               4);
+      }
       memcpy(dp, pixel, 4);
       dp += 4;
 
@@ -5856,6 +7319,10 @@ qoir_private_decode_tile_ops(  //
       sp += 1;
       memcpy(color_cache + next_color_index, pixel, 4);
       next_color_index += 4;
+      if (ops2) {
+        memcpy(color_cache2 + qoir_private_color_cache2_offset(pixel), pixel,
+               4);
+      }
       memcpy(dp, pixel, 4);
       dp += 4;
 
@@ -5881,6 +7348,10 @@ qoir_private_decode_tile_ops(  //
       sp += 2;
       memcpy(color_cache + next_color_index, pixel, 4);
       next_color_index += 4;
+      if (ops2) {
+        memcpy(color_cache2 + qoir_private_color_cache2_offset(pixel), pixel,
+               4);
+      }
       memcpy(dp, pixel, 4);
       dp += 4;
 
@@ -5901,10 +7372,14 @@ qoir_private_decode_tile_ops(  //
       sp += 3;
       memcpy(color_cache + next_color_index, pixel, 4);
       next_color_index += 4;
+      if (ops2) {
+        memcpy(color_cache2 + qoir_private_color_cache2_offset(pixel), pixel,
+               4);
+      }
       memcpy(dp, pixel, 4);
       dp += 4;
 
-    } else if ((s64 & 0xFF) < 0xD7) {  // QOIR_OP_RUNS
+    } else if ((s64 & 0xFF) < (ops2 ? 0xCF : 0xD7)) {  // QOIR_OP_RUNS
       size_t run_length = (s64 & 0xFF) >> 0x03;
       if (((size_t)(dq - dp)) < (4 * (run_length + 1))) {
         result.status_message = qoir_status_message__error_invalid_data;
@@ -5916,8 +7391,31 @@ qoir_private_decode_tile_ops(  //
       } while (run_length--);
       sp += 1;
 
-    } else if ((s64 & 0xFF) == 0xD7) {  // QOIR_OP_RUNL
+    } else if (ops2 && ((s64 & 0xFF) == 0xCF)) {  // QOIR_OP_INDEX2
+      memcpy(pixel, color_cache2 + ((s64 >> 0x06) & 0x3FC), 4);
+      sp += 2;
+      memcpy(color_cache + next_color_index, pixel, 4);
+      next_color_index += 4;
+      memcpy(dp, pixel, 4);
+      dp += 4;
+
+    } else if ((s64 & 0xFF) == 0xD7) {  // QOIR_OP_RUNL or QOIR_OP_RUNV
       size_t run_length = (s64 >> 0x08) & 0xFF;
+      if (!ops2) {
+        sp += 2;
+      } else if (!(s64 & 0x8000)) {
+        sp += 2;
+      } else if (!(s64 & 0x800000)) {
+        run_length = ((s64 >> 0x08) & 0x7F) | ((s64 >> 0x09) & 0x3F80);
+        sp += 3;
+      } else if (!(s64 & 0x80000000)) {
+        run_length = ((s64 >> 0x08) & 0x7F) | ((s64 >> 0x09) & 0x3F80) |
+                     ((s64 >> 0x0A) & 0x1FC000);
+        sp += 4;
+      } else {
+        result.status_message = qoir_status_message__error_invalid_data;
+        return result;
+      }
       if (((size_t)(dq - dp)) < (4 * (run_length + 1))) {
         result.status_message = qoir_status_message__error_invalid_data;
         return result;
@@ -5926,7 +7424,6 @@ qoir_private_decode_tile_ops(  //
         memcpy(dp, pixel, 4);
         dp += 4;
       } while (run_length--);
-      sp += 2;
 
     } else if ((s64 & 0xFF) == 0xDF) {  // QOIR_OP_BGRA2
       pixel[0] += ((s64 >> 0x08) & 0x03) - 2;
@@ -5936,6 +7433,10 @@ qoir_private_decode_tile_ops(  //
       sp += 2;
       memcpy(color_cache + next_color_index, pixel, 4);
       next_color_index += 4;
+      if (ops2) {
+        memcpy(color_cache2 + qoir_private_color_cache2_offset(pixel), pixel,
+               4);
+      }
       memcpy(dp, pixel, 4);
       dp += 4;
 
@@ -5947,6 +7448,10 @@ qoir_private_decode_tile_ops(  //
       sp += 3;
       memcpy(color_cache + next_color_index, pixel, 4);
       next_color_index += 4;
+      if (ops2) {
+        memcpy(color_cache2 + qoir_private_color_cache2_offset(pixel), pixel,
+               4);
+      }
       memcpy(dp, pixel, 4);
       dp += 4;
 
@@ -5958,6 +7463,10 @@ qoir_private_decode_tile_ops(  //
       sp += 5;
       memcpy(color_cache + next_color_index, pixel, 4);
       next_color_index += 4;
+      if (ops2) {
+        memcpy(color_cache2 + qoir_private_color_cache2_offset(pixel), pixel,
+               4);
+      }
       memcpy(dp, pixel, 4);
       dp += 4;
 
@@ -5966,12 +7475,16 @@ qoir_private_decode_tile_ops(  //
       sp += 2;
       memcpy(color_cache + next_color_index, pixel, 4);
       next_color_index += 4;
+      if (ops2) {
+        memcpy(color_cache2 + qoir_private_color_cache2_offset(pixel), pixel,
+               4);
+      }
       memcpy(dp, pixel, 4);
       dp += 4;
     }
   }
 
-  if (sp != sq) {
+  if ((sp != sq) && (ds == dq)) {
     result.status_message = qoir_status_message__error_invalid_data;
     return result;
   }
@@ -5979,148 +7492,1018 @@ qoir_private_decode_tile_ops(  //
   return result;
 }
 
-static const char*                      //
-qoir_private_decode_qpix_payload(       //
-    qoir_decode_buffer* decbuf,         //
-    qoir_pixel_buffer dst_pixbuf,       //
-    qoir_rectangle dst_clip_rectangle,  //
-    qoir_pixel_format src_pixfmt,       //
-    uint32_t src_width_in_pixels,       //
-    uint32_t src_height_in_pixels,      //
-    const uint8_t* src_ptr,             //
-    size_t src_len,                     //
-    qoir_rectangle src_clip_rectangle,  //
-    int32_t offset_x,                   //
-    int32_t offset_y,                   //
-    uint32_t lossiness) {
-  do {
-    qoir_rectangle dst_clip_rect =
-        qoir_make_rectangle(0, 0, (int32_t)dst_pixbuf.pixcfg.width_in_pixels,
-                            (int32_t)dst_pixbuf.pixcfg.height_in_pixels);
-    dst_clip_rect =
-        qoir_rectangle__intersect(dst_clip_rect, dst_clip_rectangle);
-    qoir_rectangle dst_clip_rect_in_src_space;
-    dst_clip_rect_in_src_space.x0 = dst_clip_rect.x0 - offset_x;
-    dst_clip_rect_in_src_space.y0 = dst_clip_rect.y0 - offset_y;
-    dst_clip_rect_in_src_space.x1 = dst_clip_rect.x1 - offset_x;
-    dst_clip_rect_in_src_space.y1 = dst_clip_rect.y1 - offset_y;
+static qoir_size_result         //
+qoir_private_decode_tile_ops1(  //
+    uint8_t* dst_ptr,           //
+    size_t dst_len,             //
+    size_t dst_stop_len,        //
+    const uint8_t* src_ptr,     //
+    size_t src_len) {
+  return qoir_private_decode_tile_ops(dst_ptr, dst_len, dst_stop_len, src_ptr,
+                                      src_len, false);
+}
 
-    size_t height_in_tiles =
-        qoir_calculate_number_of_tiles_1d(src_height_in_pixels);
-    size_t width_in_tiles =
-        qoir_calculate_number_of_tiles_1d(src_width_in_pixels);
-    if ((height_in_tiles == 0) || (width_in_tiles == 0)) {
-      goto done;
-    }
-    size_t ty1 = (height_in_tiles - 1) << QOIR_TILE_SHIFT;
-    size_t tx1 = (width_in_tiles - 1) << QOIR_TILE_SHIFT;
+static qoir_size_result         //
+qoir_private_decode_tile_ops2(  //
+    uint8_t* dst_ptr,           //
+    size_t dst_len,             //
+    size_t dst_stop_len,        //
+    const uint8_t* src_ptr,     //
+    size_t src_len) {
+  return qoir_private_decode_tile_ops(dst_ptr, dst_len, dst_stop_len, src_ptr,
+                                      src_len, true);
+}
 
-    qoir_private_swizzle_func swizzle_func =
-        qoir_private_choose_decode_swizzle_func(dst_pixbuf.pixcfg.pixfmt,
-                                                src_pixfmt);
-    if (!swizzle_func) {
-      return qoir_status_message__error_unsupported_pixfmt;
+#if defined(QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS)
+// qoir_private_decode_op executes a single op, whose opcode and payload bytes
+// are the low bytes of s64. It has the same semantics as one iteration of the
+// qoir_private_decode_tile_ops loop, which keeps its own copy of this code
+// (measured to be faster than calling this function) as it also advances its
+// src pointer in each branch. It returns the advanced dp, or NULL if a run
+// would go past dq.
+static QOIR_ALWAYS_INLINE uint8_t*  //
+qoir_private_decode_op(             //
+    uint8_t* dp,                    //
+    uint8_t* dq,                    //
+    uint8_t* color_cache,           //
+    uint8_t* next_color_index,      //
+    uint64_t s64) {
+  uint8_t pixel[4];
+  memcpy(pixel, dp - 4, 4);
+
+  if ((s64 & 0xFF) == 0xF7) {  // QOIR_OP_BGR8
+    pixel[0] += (uint8_t)(s64 >> 0x08);
+    pixel[1] += (uint8_t)(s64 >> 0x10);
+    pixel[2] += (uint8_t)(s64 >> 0x18);
+    memcpy(color_cache + *next_color_index, pixel, 4);
+    *next_color_index += 4;
+    memcpy(dp, pixel, 4);
+    dp += 4;
+
+  } else if ((s64 & 0x03) == 0) {  // QOIR_OP_INDEX
+    memcpy(pixel, color_cache + (uint8_t)s64, 4);
+    memcpy(dp, pixel, 4);
+    dp += 4;
+
+  } else if ((s64 & 0x03) == 1) {  // QOIR_OP_BGR2
+    uint32_t delta8x4 = (uint32_t)(((s64 >> 0x02) & 0x000003) |  //
+                                   ((s64 << 0x04) & 0x000300) |  //
+                                   ((s64 << 0x0A) & 0x030000));
+    delta8x4 = QOIR_SWAR_PSUBB(delta8x4, 0x020202);
+    uint32_t pixel8x4;
+    memcpy(&pixel8x4, pixel, 4);
+#if defined(QOIR_USE_SIMD_SSE2)
+    pixel8x4 = (uint32_t)_mm_cvtsi128_si32(_mm_add_epi8(
+        _mm_cvtsi32_si128((int)pixel8x4), _mm_cvtsi32_si128((int)delta8x4)));
+#else
+    pixel8x4 = QOIR_SWAR_PADDB(pixel8x4, delta8x4);
+#endif
+    memcpy(pixel, &pixel8x4, 4);
+
+    memcpy(color_cache + *next_color_index, pixel, 4);
+    *next_color_index += 4;
+    memcpy(dp, pixel, 4);
+    dp += 4;
+
+  } else if ((s64 & 0x03) == 2) {  // QOIR_OP_LUMA
+#if !defined(QOIR_CONFIG__DISABLE_LARGE_LOOK_UP_TABLES)
+    uint32_t delta8x4;
+    memcpy(&delta8x4, qoir_private_table_luma - 2 + (uint16_t)s64, 4);
+    uint32_t pixel8x4;
+    memcpy(&pixel8x4, pixel, 4);
+#if defined(QOIR_USE_SIMD_SSE2)
+    pixel8x4 = (uint32_t)_mm_cvtsi128_si32(_mm_add_epi8(
+        _mm_cvtsi32_si128((int)pixel8x4), _mm_cvtsi32_si128((int)delta8x4)));
+#else
+    pixel8x4 = QOIR_SWAR_PADDB(pixel8x4, delta8x4);
+#endif
+    memcpy(pixel, &pixel8x4, 4);
+#else
+    uint8_t delta_g = ((uint8_t)s64 >> 0x02) - 32;
+    pixel[0] += delta_g - 8 + ((s64 >> 0x08) & 0x0F);
+    pixel[1] += delta_g;
+    pixel[2] += delta_g - 8 + ((s64 >> 0x0C) & 0x0F);
+#endif
+    memcpy(color_cache + *next_color_index, pixel, 4);
+    *next_color_index += 4;
+    memcpy(dp, pixel, 4);
+    dp += 4;
+
+  } else if ((s64 & 0x07) == 3) {  // QOIR_OP_BGR7
+    uint32_t delta8x4 = (uint32_t)((((s64 >> 0x03) - 0x000040) & 0x00007F) |
+                                   (((s64 >> 0x02) - 0x004000) & 0x007F00) |
+                                   (((s64 >> 0x01) - 0x400000) & 0x7F0000));
+    delta8x4 |= (delta8x4 & 0x404040) << 1;
+    uint32_t pixel8x4;
+    memcpy(&pixel8x4, pixel, 4);
+#if defined(QOIR_USE_SIMD_SSE2)
+    pixel8x4 = (uint32_t)_mm_cvtsi128_si32(_mm_add_epi8(
+        _mm_cvtsi32_si128((int)pixel8x4), _mm_cvtsi32_si128((int)delta8x4)));
+#else
+    pixel8x4 = QOIR_SWAR_PADDB(pixel8x4, delta8x4);
+#endif
+    memcpy(pixel, &pixel8x4, 4);
+    memcpy(color_cache + *next_color_index, pixel, 4);
+    *next_color_index += 4;
+    memcpy(dp, pixel, 4);
+    dp += 4;
+
+  } else if ((s64 & 0xFF) < 0xD7) {  // QOIR_OP_RUNS
+    size_t run_length = (s64 & 0xFF) >> 0x03;
+    if (((size_t)(dq - dp)) < (4 * (run_length + 1))) {
+      return NULL;
     }
-    size_t num_dst_channels =
-        qoir_pixel_format__bytes_per_pixel(dst_pixbuf.pixcfg.pixfmt);
+    do {
+      memcpy(dp, pixel, 4);
+      dp += 4;
+    } while (run_length--);
 
-    uint8_t* literals_pre_padding = decbuf->private_impl.literals;
-    for (int i = 0; i < QOIR_LITERALS_PRE_PADDING; i += 4) {
-      literals_pre_padding[i + 0] = 0x00;
-      literals_pre_padding[i + 1] = 0x00;
-      literals_pre_padding[i + 2] = 0x00;
-      literals_pre_padding[i + 3] = 0xFF;
+  } else if ((s64 & 0xFF) == 0xD7) {  // QOIR_OP_RUNL
+    size_t run_length = (s64 >> 0x08) & 0xFF;
+    if (((size_t)(dq - dp)) < (4 * (run_length + 1))) {
+      return NULL;
     }
+    do {
+      memcpy(dp, pixel, 4);
+      dp += 4;
+    } while (run_length--);
+
+  } else if ((s64 & 0xFF) == 0xDF) {  // QOIR_OP_BGRA2
+    pixel[0] += ((s64 >> 0x08) & 0x03) - 2;
+    pixel[1] += ((s64 >> 0x0A) & 0x03) - 2;
+    pixel[2] += ((s64 >> 0x0C) & 0x03) - 2;
+    pixel[3] += ((s64 >> 0x0E) & 0x03) - 2;
+    memcpy(color_cache + *next_color_index, pixel, 4);
+    *next_color_index += 4;
+    memcpy(dp, pixel, 4);
+    dp += 4;
+
+  } else if ((s64 & 0xFF) == 0xE7) {  // QOIR_OP_BGRA4
+    pixel[0] += ((s64 >> 0x08) & 0x0F) - 8;
+    pixel[1] += ((s64 >> 0x0C) & 0x0F) - 8;
+    pixel[2] += ((s64 >> 0x10) & 0x0F) - 8;
+    pixel[3] += ((s64 >> 0x14) & 0x0F) - 8;
+    memcpy(color_cache + *next_color_index, pixel, 4);
+    *next_color_index += 4;
+    memcpy(dp, pixel, 4);
+    dp += 4;
+
+  } else if ((s64 & 0xFF) == 0xEF) {  // QOIR_OP_BGRA8
+    pixel[0] += (uint8_t)(s64 >> 0x08);
+    pixel[1] += (uint8_t)(s64 >> 0x10);
+    pixel[2] += (uint8_t)(s64 >> 0x18);
+    pixel[3] += (uint8_t)(s64 >> 0x20);
+    memcpy(color_cache + *next_color_index, pixel, 4);
+    *next_color_index += 4;
+    memcpy(dp, pixel, 4);
+    dp += 4;
+
+  } else {  // QOIR_OP_A8
+    pixel[3] += (uint8_t)(s64 >> 0x08);
+    memcpy(color_cache + *next_color_index, pixel, 4);
+    *next_color_index += 4;
+    memcpy(dp, pixel, 4);
+    dp += 4;
+  }
+  return dp;
+}
 
-    // ty, tx, tw and th are the tile's top-left offset, width and height, all
-    // measured in pixels.
-    for (size_t ty = 0; ty <= ty1; ty += QOIR_TILE_SIZE) {
-      for (size_t tx = 0; tx <= tx1; tx += QOIR_TILE_SIZE) {
-        size_t tw = qoir_private_tile_dimension(tx < tx1, src_width_in_pixels);
-        size_t th = qoir_private_tile_dimension(ty < ty1, src_height_in_pixels);
-        qoir_rectangle src_clip_rect =
-            qoir_make_rectangle((int32_t)(tx + 0), (int32_t)(ty + 0),
-                                (int32_t)(tx + tw), (int32_t)(ty + th));
-        src_clip_rect =
-            qoir_rectangle__intersect(src_clip_rect, src_clip_rectangle);
-        src_clip_rect = qoir_rectangle__intersect(src_clip_rect,
-                                                  dst_clip_rect_in_src_space);
+// qoir_private_decode_tile_split_ops is like qoir_private_decode_tile_ops but
+// for the "split ops" layout: a 3 byte (u24le) number of ops, N, then the N
+// opcode bytes, then every op's payload bytes (those after the opcode byte).
+//
+// Each op's payload offset is a prefix sum of the earlier ops' payload
+// lengths, which (unlike the unsplit layout) does not depend on the earlier
+// ops' payloads. It is computed for blocks of 16 ops at a time. The payload
+// bytes must be consumed exactly. Split ops tiles do not start LZ4 tile groups.
+//
+// Callers should pass (total_split_ops_length + 8) for src_len. Reference: §
+// dst_stop_len is as for qoir_private_decode_tile_ops.
+static qoir_size_result              //
+qoir_private_decode_tile_split_ops(  //
+    uint8_t* dst_ptr,                //
+    size_t dst_len,                  //
+    size_t dst_stop_len,             //
+    const uint8_t* src_ptr,          //
+    size_t src_len) {
+  qoir_size_result result = {0};
 
-        if (src_len < 4) {
-          return qoir_status_message__error_invalid_data;
-        }
-        uint32_t prefix = qoir_private_peek_u32le(src_ptr);
-        src_ptr += 4;
-        src_len -= 4;
-        size_t tile_len = prefix & 0xFFFFFF;
-        if ((src_len < (tile_len + 8)) ||  //
-            (((4 * QOIR_TS2) < tile_len) && ((prefix >> 31) != 0))) {
-          return qoir_status_message__error_invalid_data;
-        }
+  if ((dst_len < QOIR_LITERALS_PRE_PADDING) || (src_len < 11)) {
+    result.status_message = qoir_status_message__error_invalid_argument;
+    return result;
+  }
 
-        if (qoir_rectangle__is_empty(src_clip_rect)) {
-          src_ptr += tile_len;
-          src_len -= tile_len;
-          continue;
-        }
+  uint8_t color_cache[256];
+  for (int i = 0; i < 256; i += 4) {
+    color_cache[i + 0] = 0x00;
+    color_cache[i + 1] = 0x00;
+    color_cache[i + 2] = 0x00;
+    color_cache[i + 3] = 0xFF;
+  }
+  uint8_t next_color_index = 0;
 
-        const uint8_t* literals = NULL;
-        switch (prefix >> 24) {
-          case 0: {  // Literals tile format.
-            if (tile_len != (4 * tw * th)) {
-              return qoir_status_message__error_invalid_data;
+  size_t num_ops = qoir_private_peek_u32le(src_ptr) & 0xFFFFFF;
+  const uint8_t* op_ptr = src_ptr + 3;
+  const uint8_t* src_end = src_ptr + src_len - 8;
+  if (((size_t)(src_end - op_ptr)) < num_ops) {
+    result.status_message = qoir_status_message__error_invalid_data;
+    return result;
+  }
+  const uint8_t* op_end = op_ptr + num_ops;
+  const uint8_t* payload_ptr = op_end;
+
+  uint8_t* dp = dst_ptr + QOIR_LITERALS_PRE_PADDING;
+  uint8_t* dq = dst_ptr + dst_len;
+  uint8_t* ds = dst_ptr + dst_stop_len;
+  while (op_ptr < op_end) {
+    size_t n = (size_t)(op_end - op_ptr);
+    if (n > 16) {
+      n = 16;
+    }
+
+    // offsets[i] is the sum of the payload lengths of ops 0 to (i - 1) of this
+    // block, which is at most (15 * 4). block_len is the sum for all n ops.
+    uint8_t offsets[16];
+    size_t block_len = 0;
+#if defined(QOIR_USE_SIMD_SSE2)
+    if (n == 16) {
+      // Calculate the 16 payload lengths (see script/gen_table_op_lengths.go)
+      // without a table look-up, then their prefix sums in log2(16) steps.
+      __m128i o = _mm_loadu_si128((const __m128i*)(const void*)op_ptr);
+      __m128i o3 = _mm_and_si128(o, _mm_set1_epi8(0x03));
+      __m128i o7 = _mm_and_si128(o, _mm_set1_epi8(0x07));
+      __m128i x = _mm_and_si128(_mm_cmpeq_epi8(o3, _mm_set1_epi8(0x02)),
+                                _mm_set1_epi8(1));
+      x = _mm_or_si128(x, _mm_and_si128(_mm_cmpeq_epi8(o7, _mm_set1_epi8(3)),
+                                        _mm_set1_epi8(2)));
+      __m128i len1 = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(o, _mm_set1_epi8((char)0xD7)),
+                       _mm_cmpeq_epi8(o, _mm_set1_epi8((char)0xDF))),
+          _mm_cmpeq_epi8(o, _mm_set1_epi8((char)0xFF)));
+      x = _mm_or_si128(x, _mm_and_si128(len1, _mm_set1_epi8(1)));
+      x = _mm_or_si128(
+          x, _mm_and_si128(_mm_cmpeq_epi8(o, _mm_set1_epi8((char)0xE7)),
+                           _mm_set1_epi8(2)));
+      x = _mm_or_si128(
+          x, _mm_and_si128(_mm_cmpeq_epi8(o, _mm_set1_epi8((char)0xEF)),
+                           _mm_set1_epi8(4)));
+      x = _mm_or_si128(
+          x, _mm_and_si128(_mm_cmpeq_epi8(o, _mm_set1_epi8((char)0xF7)),
+                           _mm_set1_epi8(3)));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+      block_len = (size_t)(_mm_extract_epi16(x, 7) >> 8);
+      _mm_storeu_si128((__m128i*)(void*)offsets, _mm_slli_si128(x, 1));
+    } else
+#endif
+    {
+      for (size_t i = 0; i < n; i++) {
+        offsets[i] = (uint8_t)block_len;
+        block_len += qoir_private_table_op_lengths[op_ptr[i]] - 1;
+      }
+    }
+    if (((size_t)(src_end - payload_ptr)) < block_len) {
+      result.status_message = qoir_status_message__error_invalid_data;
+      return result;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      if (dp >= ds) {
+        if (ds == dq) {
+          result.status_message = qoir_status_message__error_invalid_data;
+          return result;
+        }
+        break;
+      }
+      uint64_t s64 = ((uint64_t)op_ptr[i]) |
+                     (qoir_private_peek_u64le(payload_ptr + offsets[i]) << 8);
+      dp = qoir_private_decode_op(dp, dq, color_cache, &next_color_index, s64);
+      if (!dp) {
+        result.status_message = qoir_status_message__error_invalid_data;
+        return result;
+      }
+    }
+    op_ptr += n;
+    payload_ptr += block_len;
+    if ((dp >= ds) && (ds != dq)) {
+      break;
+    }
+  }
+
+  if ((payload_ptr != src_end) && (ds == dq)) {
+    result.status_message = qoir_status_message__error_invalid_data;
+    return result;
+  }
+  result.value = (size_t)(dp - dst_ptr);
+  return result;
+}
+#endif  // defined(QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS)
+
+// qoir_private_decode_tile_gray reconstructs n BGRA pixels (writing to dst_ptr)
+// from the LZ4-Gray or LZ4-Gray-Alpha tile formats' n delta-coded gray bytes
+// (followed, if has_alpha, by n delta-coded alpha bytes) at src_ptr.
+static void                     //
+qoir_private_decode_tile_gray(  //
+    uint8_t* dst_ptr,           //
+    const uint8_t* src_ptr,     //
+    size_t n,                   //
+    bool has_alpha) {
+  const uint8_t* alpha_ptr = src_ptr + n;
+  uint8_t gray = 0x00;
+  uint8_t alpha = 0xFF;
+  size_t i = 0;
+
+#if defined(QOIR_USE_SIMD_SSE2)
+  // Calculate 16 prefix sums at a time (in log2(16) steps), then broadcast
+  // each gray value to the B, G and R channels.
+  __m128i gray_carry = _mm_setzero_si128();
+  __m128i alpha_carry = _mm_set1_epi8((char)0xFF);
+  for (; (i + 16) <= n; i += 16) {
+    __m128i g = _mm_loadu_si128((const __m128i*)(const void*)(src_ptr + i));
+    g = _mm_add_epi8(g, _mm_slli_si128(g, 1));
+    g = _mm_add_epi8(g, _mm_slli_si128(g, 2));
+    g = _mm_add_epi8(g, _mm_slli_si128(g, 4));
+    g = _mm_add_epi8(g, _mm_slli_si128(g, 8));
+    g = _mm_add_epi8(g, gray_carry);
+    gray_carry = _mm_shuffle_epi32(
+        _mm_shufflehi_epi16(_mm_unpackhi_epi8(g, g), 0xFF), 0xFF);
+
+    __m128i a = alpha_carry;
+    if (has_alpha) {
+      a = _mm_loadu_si128((const __m128i*)(const void*)(alpha_ptr + i));
+      a = _mm_add_epi8(a, _mm_slli_si128(a, 1));
+      a = _mm_add_epi8(a, _mm_slli_si128(a, 2));
+      a = _mm_add_epi8(a, _mm_slli_si128(a, 4));
+      a = _mm_add_epi8(a, _mm_slli_si128(a, 8));
+      a = _mm_add_epi8(a, alpha_carry);
+      alpha_carry = _mm_shuffle_epi32(
+          _mm_shufflehi_epi16(_mm_unpackhi_epi8(a, a), 0xFF), 0xFF);
+    }
+
+    __m128i gg_lo = _mm_unpacklo_epi8(g, g);
+    __m128i gg_hi = _mm_unpackhi_epi8(g, g);
+    __m128i ga_lo = _mm_unpacklo_epi8(g, a);
+    __m128i ga_hi = _mm_unpackhi_epi8(g, a);
+    uint8_t* dp = dst_ptr + (4 * i);
+    _mm_storeu_si128((__m128i*)(void*)(dp + 0x00),
+                     _mm_unpacklo_epi16(gg_lo, ga_lo));
+    _mm_storeu_si128((__m128i*)(void*)(dp + 0x10),
+                     _mm_unpackhi_epi16(gg_lo, ga_lo));
+    _mm_storeu_si128((__m128i*)(void*)(dp + 0x20),
+                     _mm_unpacklo_epi16(gg_hi, ga_hi));
+    _mm_storeu_si128((__m128i*)(void*)(dp + 0x30),
+                     _mm_unpackhi_epi16(gg_hi, ga_hi));
+  }
+  gray = (uint8_t)_mm_cvtsi128_si32(gray_carry);
+  alpha = (uint8_t)_mm_cvtsi128_si32(alpha_carry);
+#endif
+
+  for (; i < n; i++) {
+    gray += src_ptr[i];
+    if (has_alpha) {
+      alpha += alpha_ptr[i];
+    }
+    uint8_t* dp = dst_ptr + (4 * i);
+    dp[0] = gray;
+    dp[1] = gray;
+    dp[2] = gray;
+    dp[3] = alpha;
+  }
+}
+
+// qoir_private_decode_tile_alpha_plane reconstructs n BGRA pixels (writing to
+// dst_ptr + QOIR_LITERALS_PRE_PADDING) from the Alpha-Plane tile format's
+// src_len (decompressed) bytes at src_ptr: the transparent pixels' B, G and R
+// values, the alpha plane's runs and then the other pixels' ops. The src bytes
+// must be followed by 8 readable bytes (see §).
+static const char*                     //
+qoir_private_decode_tile_alpha_plane(  //
+    uint8_t* dst_ptr,                  //
+    const uint8_t* src_ptr,            //
+    size_t src_len,                    //
+    size_t n) {
+  if (src_len < 3) {
+    return qoir_status_message__error_invalid_data;
+  }
+  const uint8_t* src_end = src_ptr + src_len;
+  const uint8_t* runs_ptr = src_ptr + 3;
+
+  // Validate the runs and count m, the number of non-transparent pixels.
+  const uint8_t* sp = runs_ptr;
+  size_t m = 0;
+  for (size_t i = 0; i < n;) {
+    if ((src_end - sp) < 2) {
+      return qoir_status_message__error_invalid_data;
+    }
+    uint8_t alpha = *sp++;
+    uint32_t run = 0;
+    for (uint32_t shift = 0;; shift += 7) {
+      if ((shift == 21) || (sp == src_end)) {
+        return qoir_status_message__error_invalid_data;
+      }
+      uint8_t c = *sp++;
+      run |= (uint32_t)(c & 0x7F) << shift;
+      if (c < 0x80) {
+        break;
+      }
+    }
+    if (run >= (n - i)) {
+      return qoir_status_message__error_invalid_data;
+    }
+    i += run + 1;
+    m += (alpha != 0) ? (run + 1) : 0;
+  }
+
+  // Decode the non-transparent pixels' colors so that they end where the
+  // tile ends. Expanding them (below) then works in place, front to back,
+  // as the read position is never behind the write position.
+  uint8_t* colors_ptr = dst_ptr + (4 * (n - m));
+  for (int i = 0; i < QOIR_LITERALS_PRE_PADDING; i += 4) {
+    colors_ptr[i + 0] = 0x00;
+    colors_ptr[i + 1] = 0x00;
+    colors_ptr[i + 2] = 0x00;
+    colors_ptr[i + 3] = 0xFF;
+  }
+  qoir_size_result r = qoir_private_decode_tile_ops1(
+      colors_ptr, QOIR_LITERALS_PRE_PADDING + (4 * m),  //
+      QOIR_LITERALS_PRE_PADDING + (4 * m),              //
+      sp, (size_t)(src_end - sp) + 8);                  // See § for +8.
+  if (r.status_message) {
+    return r.status_message;
+  } else if (r.value != (QOIR_LITERALS_PRE_PADDING + (4 * m))) {
+    return qoir_status_message__error_invalid_data;
+  }
+
+  uint32_t transparent = qoir_private_peek_u32le(src_ptr) & 0x00FFFFFF;
+  uint8_t* dp = dst_ptr + QOIR_LITERALS_PRE_PADDING;
+  const uint8_t* cp = colors_ptr + QOIR_LITERALS_PRE_PADDING;
+  for (sp = runs_ptr; dp < (dst_ptr + QOIR_LITERALS_PRE_PADDING + (4 * n));) {
+    uint32_t alpha = *sp++;
+    uint32_t run = 0;
+    for (uint32_t shift = 0;; shift += 7) {
+      uint8_t c = *sp++;
+      run |= (uint32_t)(c & 0x7F) << shift;
+      if (c < 0x80) {
+        break;
+      }
+    }
+    if (alpha == 0) {
+      for (uint32_t j = 0; j <= run; j++) {
+        qoir_private_poke_u32le(dp, transparent);
+        dp += 4;
+      }
+    } else {
+      for (uint32_t j = 0; j <= run; j++) {
+        qoir_private_poke_u32le(
+            dp, (qoir_private_peek_u32le(cp) & 0x00FFFFFF) | (alpha << 24));
+        dp += 4;
+        cp += 4;
+      }
+    }
+  }
+  return NULL;
+}
+
+// qoir_private_predict_med returns the LOCO-I median edge detector's
+// prediction of a value from its left (a), above (b) and above-left (c)
+// neighbors.
+static QOIR_ALWAYS_INLINE uint32_t  //
+qoir_private_predict_med(           //
+    uint32_t a,                     //
+    uint32_t b,                     //
+    uint32_t c) {
+  // This is equivalent to the usual three-way branch on c, but clamping the
+  // gradient (a + b - c) is easier to compile to branch-free code.
+  int32_t lo = (int32_t)((a < b) ? a : b);
+  int32_t hi = (int32_t)((a < b) ? b : a);
+  int32_t g = (int32_t)(a + b) - (int32_t)c;
+  g = (g > lo) ? g : lo;
+  return (uint32_t)((g < hi) ? g : hi);
+}
+
+// qoir_private_decode_plane_med replaces, in place, a w × h plane of residuals
+// (modulo 256) with the values they are relative to. Each value is predicted
+// by qoir_private_predict_med, except that the first row predicts from the
+// left (and the very first value from 0x80) and the first column predicts
+// from above.
+static void                     //
+qoir_private_decode_plane_med(  //
+    uint8_t* p,                 //
+    size_t w,                   //
+    size_t h) {
+  p[0] += 0x80;
+  for (size_t x = 1; x < w; x++) {
+    p[x] += p[x - 1];
+  }
+  for (size_t y = 1; y < h; y++) {
+    const uint8_t* above = p + ((y - 1) * w);
+    uint8_t* q = p + (y * w);
+    uint32_t left = q[0] += above[0];
+    uint32_t above_left = above[0];
+    for (size_t x = 1; x < w; x++) {
+      uint32_t a = above[x];
+      left = (uint8_t)(q[x] + qoir_private_predict_med(left, a, above_left));
+      q[x] = (uint8_t)left;
+      above_left = a;
+    }
+  }
+}
+
+// qoir_private_decode_tile_ycocg reconstructs the tw × th BGRA pixels (writing
+// to dst_ptr) of the YCoCg-420 tile formats from their residual planes at
+// src_ptr, which it modifies. The planes are a full resolution Y, half
+// resolution (rounding up) Co and Cg and then, if has_alpha, a full
+// resolution alpha. B, G and R are clamped to max_value. The alpha value is
+// alpha_max_value if there is no alpha plane.
+static void                      //
+qoir_private_decode_tile_ycocg(  //
+    uint8_t* dst_ptr,            //
+    uint8_t* src_ptr,            //
+    size_t tw,                   //
+    size_t th,                   //
+    bool has_alpha,              //
+    int32_t max_value,           //
+    int32_t alpha_max_value) {
+  size_t cw = (tw + 1) / 2;
+  size_t ch = (th + 1) / 2;
+  uint8_t* y_ptr = src_ptr;
+  uint8_t* co_ptr = y_ptr + (tw * th);
+  uint8_t* cg_ptr = co_ptr + (cw * ch);
+  uint8_t* alpha_ptr = cg_ptr + (cw * ch);
+  qoir_private_decode_plane_med(y_ptr, tw, th);
+  qoir_private_decode_plane_med(co_ptr, cw, ch);
+  qoir_private_decode_plane_med(cg_ptr, cw, ch);
+  if (has_alpha) {
+    qoir_private_decode_plane_med(alpha_ptr, tw, th);
+  }
+
+  // Upsample the chroma (by repeating it) as the pixels are converted from
+  // YCoCg to BGRA. Co and Cg are stored as (0x80 + (R - B) / 2) and (0x80 +
+  // (2*G - R - B) / 4).
+  for (size_t y = 0; y < th; y++) {
+    const uint8_t* y_row = y_ptr + (y * tw);
+    const uint8_t* co_row = co_ptr + ((y / 2) * cw);
+    const uint8_t* cg_row = cg_ptr + ((y / 2) * cw);
+    const uint8_t* alpha_row = alpha_ptr + (y * tw);
+    uint8_t* dp = dst_ptr + (4 * y * tw);
+    size_t x = 0;
+
+#if defined(QOIR_USE_SIMD_SSE2)
+    // Convert 16 pixels at a time, with 16 bit arithmetic. Packing back to 8
+    // bits saturates at 0x00. Other upper bounds need an explicit minimum.
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(0x80);
+    const __m128i max8 = _mm_set1_epi8((char)max_value);
+    for (; (x + 16) <= tw; x += 16) {
+      __m128i l8 = _mm_loadu_si128((const __m128i*)(const void*)(y_row + x));
+      __m128i co8 =
+          _mm_loadl_epi64((const __m128i*)(const void*)(co_row + (x / 2)));
+      __m128i cg8 =
+          _mm_loadl_epi64((const __m128i*)(const void*)(cg_row + (x / 2)));
+      co8 = _mm_unpacklo_epi8(co8, co8);
+      cg8 = _mm_unpacklo_epi8(cg8, cg8);
+
+      __m128i l_lo = _mm_unpacklo_epi8(l8, zero);
+      __m128i l_hi = _mm_unpackhi_epi8(l8, zero);
+      __m128i co_lo = _mm_sub_epi16(_mm_unpacklo_epi8(co8, zero), bias);
+      __m128i co_hi = _mm_sub_epi16(_mm_unpackhi_epi8(co8, zero), bias);
+      __m128i cg_lo = _mm_sub_epi16(_mm_unpacklo_epi8(cg8, zero), bias);
+      __m128i cg_hi = _mm_sub_epi16(_mm_unpackhi_epi8(cg8, zero), bias);
+      __m128i t_lo = _mm_sub_epi16(l_lo, cg_lo);
+      __m128i t_hi = _mm_sub_epi16(l_hi, cg_hi);
+      __m128i b8 = _mm_min_epu8(
+          max8, _mm_packus_epi16(_mm_sub_epi16(t_lo, co_lo),
+                                 _mm_sub_epi16(t_hi, co_hi)));
+      __m128i g8 = _mm_min_epu8(
+          max8, _mm_packus_epi16(_mm_add_epi16(l_lo, cg_lo),
+                                 _mm_add_epi16(l_hi, cg_hi)));
+      __m128i r8 = _mm_min_epu8(
+          max8, _mm_packus_epi16(_mm_add_epi16(t_lo, co_lo),
+                                 _mm_add_epi16(t_hi, co_hi)));
+      __m128i a8 = has_alpha ? _mm_loadu_si128((const __m128i*)(const void*)(
+                                   alpha_row + x))
+                             : _mm_set1_epi8((char)alpha_max_value);
+
+      __m128i bg_lo = _mm_unpacklo_epi8(b8, g8);
+      __m128i bg_hi = _mm_unpackhi_epi8(b8, g8);
+      __m128i ra_lo = _mm_unpacklo_epi8(r8, a8);
+      __m128i ra_hi = _mm_unpackhi_epi8(r8, a8);
+      _mm_storeu_si128((__m128i*)(void*)(dp + 0x00),
+                       _mm_unpacklo_epi16(bg_lo, ra_lo));
+      _mm_storeu_si128((__m128i*)(void*)(dp + 0x10),
+                       _mm_unpackhi_epi16(bg_lo, ra_lo));
+      _mm_storeu_si128((__m128i*)(void*)(dp + 0x20),
+                       _mm_unpacklo_epi16(bg_hi, ra_hi));
+      _mm_storeu_si128((__m128i*)(void*)(dp + 0x30),
+                       _mm_unpackhi_epi16(bg_hi, ra_hi));
+      dp += 64;
+    }
+#endif
+
+    for (; x < tw; x++) {
+      int32_t luma = y_row[x];
+      int32_t co = (int32_t)co_row[x / 2] - 0x80;
+      int32_t cg = (int32_t)cg_row[x / 2] - 0x80;
+      int32_t b = luma - cg - co;
+      int32_t g = luma + cg;
+      int32_t r = luma - cg + co;
+      dp[0] = (uint8_t)((b < 0) ? 0 : (b > max_value) ? max_value : b);
+      dp[1] = (uint8_t)((g < 0) ? 0 : (g > max_value) ? max_value : g);
+      dp[2] = (uint8_t)((r < 0) ? 0 : (r > max_value) ? max_value : r);
+      dp[3] = has_alpha ? alpha_row[x] : (uint8_t)alpha_max_value;
+      dp += 4;
+    }
+  }
+}
+
+// qoir_private_append_lz4_history appends a tile's n bytes of ops, at p, to an
+// LZ4 tile group's history, whose most recent old_len bytes end at (history +
+// QOIR_LZ4_HISTORY_SIZE). The history array must be immediately followed by at
+// least n bytes of scratch space: the ops array. It returns the new history
+// length, which is at most QOIR_LZ4_HISTORY_SIZE.
+static size_t                     //
+qoir_private_append_lz4_history(  //
+    uint8_t* history,             //
+    size_t old_len,               //
+    const uint8_t* p,             //
+    size_t n) {
+  uint8_t* history_end = history + QOIR_LZ4_HISTORY_SIZE;
+  if (p != history_end) {
+    memcpy(history_end, p, n);
+  }
+  size_t new_len = old_len + n;
+  if (new_len > QOIR_LZ4_HISTORY_SIZE) {
+    new_len = QOIR_LZ4_HISTORY_SIZE;
+  }
+  memmove(history_end - new_len, history_end + n - new_len, new_len);
+  return new_len;
+}
+
+// qoir_private_decode_qpix_payload decodes a sequence of encoded tiles into
+// dst_pixbuf. If validate_only then every tile is decoded (and so checked) but
+// the pixels are not written anywhere and dst_pixbuf may be zero. scratch_ptr
+// is a decode scratch buffer for tile_shift.
+//
+// *lz4_history_ptr is an LZ4 history scratch buffer for tile_shift, or NULL.
+// If NULL, one is acquired (using the options' memory functions) when a tile
+// starts an LZ4 tile group. Either way, the caller should release it.
+static const char*                      //
+qoir_private_decode_qpix_payload(       //
+    uint8_t* scratch_ptr,               //
+    uint8_t** lz4_history_ptr,          //
+    qoir_pixel_buffer dst_pixbuf,       //
+    qoir_rectangle dst_clip_rectangle,  //
+    qoir_pixel_format src_pixfmt,       //
+    uint32_t tile_shift,                //
+    uint32_t src_width_in_pixels,       //
+    uint32_t src_height_in_pixels,      //
+    const uint8_t* src_ptr,             //
+    size_t src_len,                     //
+    qoir_rectangle src_clip_rectangle,  //
+    int32_t offset_x,                   //
+    int32_t offset_y,                   //
+    uint32_t lossiness,                 //
+    int32_t alpha_lossiness,            //
+    bool unchanged_tiles_allowed,       //
+    bool validate_only,                 //
+    const qoir_decode_options* options) {
+  do {
+    qoir_rectangle dst_clip_rect =
+        qoir_make_rectangle(0, 0, (int32_t)dst_pixbuf.pixcfg.width_in_pixels,
+                            (int32_t)dst_pixbuf.pixcfg.height_in_pixels);
+    dst_clip_rect =
+        qoir_rectangle__intersect(dst_clip_rect, dst_clip_rectangle);
+    qoir_rectangle dst_clip_rect_in_src_space;
+    dst_clip_rect_in_src_space.x0 = dst_clip_rect.x0 - offset_x;
+    dst_clip_rect_in_src_space.y0 = dst_clip_rect.y0 - offset_y;
+    dst_clip_rect_in_src_space.x1 = dst_clip_rect.x1 - offset_x;
+    dst_clip_rect_in_src_space.y1 = dst_clip_rect.y1 - offset_y;
+
+    size_t height_in_tiles =
+        qoir_private_number_of_tiles_1d(src_height_in_pixels, tile_shift);
+    size_t width_in_tiles =
+        qoir_private_number_of_tiles_1d(src_width_in_pixels, tile_shift);
+    if ((height_in_tiles == 0) || (width_in_tiles == 0)) {
+      goto done;
+    }
+    size_t ty1 = (height_in_tiles - 1) << tile_shift;
+    size_t tx1 = (width_in_tiles - 1) << tile_shift;
+    size_t tile_mask = (1u << tile_shift) - 1;
+    size_t max_tile_len = 4u << (2 * tile_shift);
+    qoir_private_scratch_view scratch = qoir_private_make_scratch_view(
+        QOIR_PRIVATE_SCRATCH__DECBUF, tile_shift, scratch_ptr);
+    if (*lz4_history_ptr) {
+      qoir_private_scratch_view__use_lz4_history(&scratch, *lz4_history_ptr);
+    }
+
+    qoir_private_swizzle_func swizzle_func =
+        qoir_private_choose_decode_swizzle_func(dst_pixbuf.pixcfg.pixfmt,
+                                                src_pixfmt);
+    if (!swizzle_func && !validate_only) {
+      return qoir_status_message__error_unsupported_pixfmt;
+    }
+    size_t num_dst_channels =
+        qoir_pixel_format__bytes_per_pixel(dst_pixbuf.pixcfg.pixfmt);
+
+    uint8_t* literals_pre_padding = scratch.literals;
+    for (int i = 0; i < QOIR_LITERALS_PRE_PADDING; i += 4) {
+      literals_pre_padding[i + 0] = 0x00;
+      literals_pre_padding[i + 1] = 0x00;
+      literals_pre_padding[i + 2] = 0x00;
+      literals_pre_padding[i + 3] = 0xFF;
+    }
+
+    // ty, tx, tw and th are the tile's top-left offset, width and height, all
+    // measured in pixels.
+    for (size_t ty = 0; ty <= ty1; ty += tile_mask + 1) {
+      size_t th = qoir_private_tile_dimension(ty < ty1, src_height_in_pixels,
+                                              tile_shift);
+
+      // LZ4 tile groups never span tile rows. In tile rows that are entirely
+      // clipped out, every tile can be skipped without decompressing it.
+      qoir_rectangle row_clip_rect =
+          qoir_make_rectangle(0, (int32_t)ty, (int32_t)src_width_in_pixels,
+                              (int32_t)(ty + th));
+      row_clip_rect =
+          qoir_rectangle__intersect(row_clip_rect, src_clip_rectangle);
+      row_clip_rect =
+          qoir_rectangle__intersect(row_clip_rect, dst_clip_rect_in_src_space);
+      bool row_is_visible = !qoir_rectangle__is_empty(row_clip_rect);
+
+      // lz4_history_len is the length of the LZ4 tile group's history: the
+      // previous tiles' ops, ending at scratch.ops. It is only maintained when
+      // the next tile needs it.
+      size_t lz4_history_len = 0;
+      bool next_tile_can_chain = false;
+
+      for (size_t tx = 0; tx <= tx1; tx += tile_mask + 1) {
+        size_t tw = qoir_private_tile_dimension(tx < tx1, src_width_in_pixels,
+                                                tile_shift);
+        qoir_rectangle src_clip_rect =
+            qoir_make_rectangle((int32_t)(tx + 0), (int32_t)(ty + 0),
+                                (int32_t)(tx + tw), (int32_t)(ty + th));
+        src_clip_rect =
+            qoir_rectangle__intersect(src_clip_rect, src_clip_rectangle);
+        src_clip_rect = qoir_rectangle__intersect(src_clip_rect,
+                                                  dst_clip_rect_in_src_space);
+
+        if (src_len < 4) {
+          return qoir_status_message__error_invalid_data;
+        }
+        uint32_t prefix = qoir_private_peek_u32le(src_ptr);
+        src_ptr += 4;
+        src_len -= 4;
+        size_t tile_len = prefix & 0xFFFFFF;
+        // Earlier encoders could write LZ4-Literals tiles slightly longer than
+        // the spec's (4 * TileSize * TileSize) limit, so the limit does not
+        // apply to the original (64 pixel tile, format 0 to 3) tiles.
+        bool exempt = (tile_shift == QOIR_TILE_SHIFT) && ((prefix >> 24) <= 3);
+        if ((src_len < (tile_len + 8)) ||  //
+            ((max_tile_len < tile_len) && !exempt)) {
+          return qoir_status_message__error_invalid_data;
+        }
+
+        // The format byte's bits 4 to 6 hold the tile's extra lossiness, on top
+        // of the image's.
+        uint32_t tile_format = 0x8F & (prefix >> 24);
+        uint32_t tile_lossiness = lossiness + (0x07 & (prefix >> 28));
+        if (tile_lossiness > 7) {
+          return qoir_status_message__error_invalid_data;
+        }
+        uint32_t tile_alpha_lossiness = (alpha_lossiness >= 0)
+                                            ? (uint32_t)alpha_lossiness
+                                            : tile_lossiness;
+        size_t prev_lz4_history_len = 0;
+        if (tile_format == 5) {  // LZ4-Chained-Ops tile format.
+          if (!next_tile_can_chain) {
+            return qoir_status_message__error_invalid_data;
+          }
+          prev_lz4_history_len = lz4_history_len;
+        }
+        lz4_history_len = 0;
+        next_tile_can_chain = (tile_format == 1) || (tile_format == 3) ||
+                              (tile_format == 5) || (tile_format == 6);
+
+        // The src_len check above means that we can peek at the next tile's
+        // prefix, even if this is the final tile.
+        bool next_tile_chains =
+            next_tile_can_chain && (row_is_visible || validate_only) &&
+            (tx < tx1) &&
+            ((0x8F & (qoir_private_peek_u32le(src_ptr + tile_len) >> 24)) ==
+             5);
+        bool skip_pixels =
+            !validate_only && qoir_rectangle__is_empty(src_clip_rect);
+        // Pixels are row-major within a tile, so the ops VMs can stop early,
+        // after the last row that is not clipped out. num_bytes is how many
+        // bytes (of scratch.literals) they have to produce.
+        size_t num_rows = (skip_pixels || validate_only)
+                              ? th
+                              : ((size_t)src_clip_rect.y1 - ty);
+        size_t num_bytes = QOIR_LITERALS_PRE_PADDING + (4 * tw * num_rows);
+
+        if (skip_pixels && !next_tile_chains) {
+          src_ptr += tile_len;
+          src_len -= tile_len;
+          continue;
+        } else if (tile_format == 4) {  // Unchanged tile format.
+          if ((tile_len != 0) || !unchanged_tiles_allowed) {
+            return qoir_status_message__error_invalid_data;
+          }
+          // Leave the destination pixels as they are.
+          continue;
+        }
+
+        const uint8_t* literals = NULL;
+        switch (tile_format) {
+          case 0: {  // Literals tile format.
+            if (tile_len != (4 * tw * th)) {
+              return qoir_status_message__error_invalid_data;
             }
             literals = src_ptr;
             break;
           }
-          case 1: {  // Ops tile format.
-            qoir_size_result r = qoir_private_decode_tile_ops(
-                decbuf->private_impl.literals,              //
-                QOIR_LITERALS_PRE_PADDING + (4 * tw * th),  //
-                src_ptr, tile_len + 8);                     // See § for +8.
-            if (r.status_message) {
-              return r.status_message;
-            } else if (r.value != (QOIR_LITERALS_PRE_PADDING + (4 * tw * th))) {
+          case 1:    // Ops tile format.
+          case 3:    // LZ4-Ops tile format.
+          case 5:    // LZ4-Chained-Ops tile format.
+          case 6: {  // Huffman-Ops tile format.
+            const uint8_t* ops_ptr = src_ptr;
+            size_t ops_len = tile_len;
+            if (tile_format != 1) {
+              qoir_size_result r0 =
+                  (tile_format == 6)
+                      ? qoir_private_huffman_decode(
+                            scratch.ops, scratch.ops_len, src_ptr, tile_len)
+                      : qoir_lz4_block_decode_with_prefix(
+                            scratch.ops, scratch.ops_len, src_ptr, tile_len,
+                            prev_lz4_history_len);
+              if (r0.status_message) {
+                return qoir_status_message__error_invalid_data;
+              }
+              ops_ptr = scratch.ops;
+              ops_len = r0.value;
+            }
+            if (!skip_pixels) {
+              qoir_size_result r1 = qoir_private_decode_tile_ops1(
+                  scratch.literals,                           //
+                  QOIR_LITERALS_PRE_PADDING + (4 * tw * th),  //
+                  num_bytes,                                  //
+                  ops_ptr, ops_len + 8);                      // See § for +8.
+              if (r1.status_message) {
+                return r1.status_message;
+              } else if (r1.value < num_bytes) {
+                return qoir_status_message__error_invalid_data;
+              }
+              literals = scratch.literals + QOIR_LITERALS_PRE_PADDING;
+            }
+            if (next_tile_chains) {
+              // The history is followed by only scratch.ops_len bytes of room.
+              if (ops_len > scratch.ops_len) {
+                return qoir_status_message__error_invalid_data;
+              } else if (!scratch.lz4_history) {
+                *lz4_history_ptr = QOIR_ACQUIRE_SCRATCH(
+                    QOIR_PRIVATE_SCRATCH__LZ4_HISTORY, tile_shift);
+                if (!*lz4_history_ptr) {
+                  return qoir_status_message__error_out_of_memory;
+                }
+                qoir_private_scratch_view__use_lz4_history(&scratch,
+                                                           *lz4_history_ptr);
+              }
+              lz4_history_len = qoir_private_append_lz4_history(
+                  scratch.lz4_history, prev_lz4_history_len, ops_ptr, ops_len);
+            }
+            break;
+          }
+#if defined(QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS)
+          case 7: {  // Split ops (see QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS).
+            qoir_size_result r0 = qoir_lz4_block_decode(
+                scratch.ops, scratch.ops_len, src_ptr, tile_len);
+            if (r0.status_message) {
               return qoir_status_message__error_invalid_data;
             }
-            literals =
-                decbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING;
+            if (!skip_pixels) {
+              qoir_size_result r1 = qoir_private_decode_tile_split_ops(
+                  scratch.literals,                           //
+                  QOIR_LITERALS_PRE_PADDING + (4 * tw * th),  //
+                  num_bytes,                                  //
+                  scratch.ops, r0.value + 8);                 // See § for +8.
+              if (r1.status_message) {
+                return r1.status_message;
+              } else if (r1.value < num_bytes) {
+                return qoir_status_message__error_invalid_data;
+              }
+              literals = scratch.literals + QOIR_LITERALS_PRE_PADDING;
+            }
             break;
           }
-          case 2: {  // LZ4-Literals tile format.
+#endif  // defined(QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS)
+          case 8:    // Ops2 tile format.
+          case 9: {  // LZ4-Ops2 tile format.
+            const uint8_t* ops_ptr = src_ptr;
+            size_t ops_len = tile_len;
+            if (tile_format == 9) {
+              qoir_size_result r0 = qoir_lz4_block_decode(
+                  scratch.ops, scratch.ops_len, src_ptr, tile_len);
+              if (r0.status_message) {
+                return qoir_status_message__error_invalid_data;
+              }
+              ops_ptr = scratch.ops;
+              ops_len = r0.value;
+            }
+            if (!skip_pixels) {
+              qoir_size_result r1 = qoir_private_decode_tile_ops2(
+                  scratch.literals,                           //
+                  QOIR_LITERALS_PRE_PADDING + (4 * tw * th),  //
+                  num_bytes,                                  //
+                  ops_ptr, ops_len + 8);                      // See § for +8.
+              if (r1.status_message) {
+                return r1.status_message;
+              } else if (r1.value < num_bytes) {
+                return qoir_status_message__error_invalid_data;
+              }
+              literals = scratch.literals + QOIR_LITERALS_PRE_PADDING;
+            }
+            break;
+          }
+          case 10:    // LZ4-Gray tile format.
+          case 11: {  // LZ4-Gray-Alpha tile format.
+            size_t num_planes = (tile_format == 11) ? 2 : 1;
             qoir_size_result r = qoir_lz4_block_decode(
-                decbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING,
-                sizeof(decbuf->private_impl.literals) -
-                    QOIR_LITERALS_PRE_PADDING,
-                src_ptr, tile_len);
+                scratch.ops, scratch.ops_len, src_ptr, tile_len);
             if (r.status_message) {
               return qoir_status_message__error_invalid_data;
-            } else if (r.value != (4 * tw * th)) {
+            } else if (r.value != (num_planes * tw * th)) {
               return qoir_status_message__error_invalid_data;
             }
-            literals =
-                decbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING;
+            if (!skip_pixels) {
+              qoir_private_decode_tile_gray(
+                  scratch.literals + QOIR_LITERALS_PRE_PADDING, scratch.ops,
+                  tw * th, num_planes == 2);
+              literals = scratch.literals + QOIR_LITERALS_PRE_PADDING;
+            }
             break;
           }
-          case 3: {  // LZ4-Ops tile format.
-            qoir_size_result r0 = qoir_lz4_block_decode(
-                decbuf->private_impl.ops, sizeof(decbuf->private_impl.ops),
-                src_ptr, tile_len);
+          case 12:    // Alpha-Plane tile format.
+          case 13: {  // LZ4-Alpha-Plane tile format.
+            const uint8_t* plane_ptr = src_ptr;
+            size_t plane_len = tile_len;
+            if (tile_format == 13) {
+              qoir_size_result r0 = qoir_lz4_block_decode(
+                  scratch.ops, scratch.ops_len, src_ptr, tile_len);
+              if (r0.status_message) {
+                return qoir_status_message__error_invalid_data;
+              }
+              plane_ptr = scratch.ops;
+              plane_len = r0.value;
+            }
+            if (!skip_pixels) {
+              const char* status_message = qoir_private_decode_tile_alpha_plane(
+                  scratch.literals, plane_ptr, plane_len, tw * th);
+              if (status_message) {
+                return status_message;
+              }
+              literals = scratch.literals + QOIR_LITERALS_PRE_PADDING;
+            }
+            break;
+          }
+          case 14:    // LZ4-YCoCg-420 tile format.
+          case 15: {  // Huffman-YCoCg-420 tile format.
+            qoir_size_result r0 =
+                (tile_format == 15)
+                    ? qoir_private_huffman_decode(scratch.ops, scratch.ops_len,
+                                                  src_ptr, tile_len)
+                    : qoir_lz4_block_decode(scratch.ops, scratch.ops_len,
+                                            src_ptr, tile_len);
             if (r0.status_message) {
               return qoir_status_message__error_invalid_data;
             }
-            qoir_size_result r1 = qoir_private_decode_tile_ops(
-                decbuf->private_impl.literals,              //
-                QOIR_LITERALS_PRE_PADDING + (4 * tw * th),  //
-                decbuf->private_impl.ops, r0.value + 8);    // See § for +8.
-            if (r1.status_message) {
-              return r1.status_message;
-            } else if (r1.value !=
-                       (QOIR_LITERALS_PRE_PADDING + (4 * tw * th))) {
+            size_t n = tw * th;
+            size_t c = ((tw + 1) / 2) * ((th + 1) / 2);
+            bool has_alpha = r0.value == ((2 * n) + (2 * c));
+            if (!has_alpha && (r0.value != (n + (2 * c)))) {
+              return qoir_status_message__error_invalid_data;
+            }
+            if (!skip_pixels && !validate_only) {
+              qoir_private_decode_tile_ycocg(
+                  scratch.literals + QOIR_LITERALS_PRE_PADDING, scratch.ops, tw,
+                  th, has_alpha, 0xFF >> tile_lossiness,
+                  0xFF >> tile_alpha_lossiness);
+              literals = scratch.literals + QOIR_LITERALS_PRE_PADDING;
+            }
+            break;
+          }
+          case 2: {  // LZ4-Literals tile format.
+            qoir_size_result r = qoir_lz4_block_decode(
+                scratch.literals + QOIR_LITERALS_PRE_PADDING,
+                scratch.literals_len - QOIR_LITERALS_PRE_PADDING, src_ptr,
+                tile_len);
+            if (r.status_message) {
+              return qoir_status_message__error_invalid_data;
+            } else if (r.value != (4 * tw * th)) {
               return qoir_status_message__error_invalid_data;
             }
-            literals =
-                decbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING;
+            literals = scratch.literals + QOIR_LITERALS_PRE_PADDING;
             break;
           }
           default:
@@ -6129,16 +8512,43 @@ qoir_private_decode_qpix_payload(       //
 
         src_ptr += tile_len;
         src_len -= tile_len;
+        if (skip_pixels || validate_only) {
+          continue;
+        }
 
-        if (lossiness) {
-          uint8_t* p = decbuf->private_impl.ops;
+        if (tile_lossiness == tile_alpha_lossiness) {
+          if (tile_lossiness) {
+            uint8_t* p = scratch.ops;
+            const uint8_t* q = literals;
+            const uint8_t* unlossify =
+                qoir_private_table_unlossify[tile_lossiness - 1];
+            for (size_t i = 4 * tw * num_rows; i > 0; i--) {
+              *p++ = unlossify[*q++];
+            }
+            literals = scratch.ops;
+          }
+        } else {
+          // At most one of the color and alpha lossiness is zero, meaning no
+          // look-up table.
+          uint8_t* p = scratch.ops;
           const uint8_t* q = literals;
           const uint8_t* unlossify =
-              qoir_private_table_unlossify[lossiness - 1];
-          for (uint32_t i = 4 * tw * th; i > 0; i--) {
-            *p++ = unlossify[*q++];
+              tile_lossiness
+                  ? qoir_private_table_unlossify[tile_lossiness - 1]
+                  : NULL;
+          const uint8_t* alpha_unlossify =
+              tile_alpha_lossiness
+                  ? qoir_private_table_unlossify[tile_alpha_lossiness - 1]
+                  : NULL;
+          for (size_t i = tw * num_rows; i > 0; i--) {
+            p[0] = unlossify ? unlossify[q[0]] : q[0];
+            p[1] = unlossify ? unlossify[q[1]] : q[1];
+            p[2] = unlossify ? unlossify[q[2]] : q[2];
+            p[3] = alpha_unlossify ? alpha_unlossify[q[3]] : q[3];
+            p += 4;
+            q += 4;
           }
-          literals = decbuf->private_impl.ops;
+          literals = scratch.ops;
         }
 
         uint8_t* dp =
@@ -6146,8 +8556,8 @@ qoir_private_decode_qpix_payload(       //
             ((src_clip_rect.y0 + offset_y) * dst_pixbuf.stride_in_bytes) +
             ((src_clip_rect.x0 + offset_x) * num_dst_channels);
         const uint8_t* sp = literals +
-                            ((src_clip_rect.y0 & QOIR_TILE_MASK) * 4 * tw) +
-                            ((src_clip_rect.x0 & QOIR_TILE_MASK) * 4);
+                            ((src_clip_rect.y0 & tile_mask) * 4 * tw) +
+                            ((src_clip_rect.x0 & tile_mask) * 4);
         (*swizzle_func)(dp, dst_pixbuf.stride_in_bytes, sp, 4 * tw,
                         qoir_rectangle__width(src_clip_rect),
                         qoir_rectangle__height(src_clip_rect));
@@ -6170,83 +8580,419 @@ qoir_private_make_decode_result_error(  //
   return result;
 }
 
-QOIR_MAYBE_STATIC qoir_decode_result  //
-qoir_decode(                          //
-    const uint8_t* src_ptr,           //
-    const size_t src_len,             //
-    const qoir_decode_options* options) {
-  qoir_decode_result result = {0};
-
-  do {
-    qoir_rectangle dst_clip_rectangle =
-        qoir_make_rectangle(0, 0, 0xFFFFFF, 0xFFFFFF);
-    qoir_rectangle src_clip_rectangle =
-        qoir_make_rectangle(0, 0, 0xFFFFFF, 0xFFFFFF);
-    int32_t offset_x = 0;
-    int32_t offset_y = 0;
-    if (options) {
-      if ((options->pixbuf.pixcfg.width_in_pixels > 0xFFFFFF) ||
-          (options->pixbuf.pixcfg.height_in_pixels > 0xFFFFFF)) {
-        return qoir_private_make_decode_result_error(
-            qoir_status_message__error_unsupported_pixbuf_dimensions);
-      }
-      memcpy(&result.dst_pixbuf, &options->pixbuf, sizeof(options->pixbuf));
-      if (options->use_dst_clip_rectangle) {
-        memcpy(&dst_clip_rectangle, &options->dst_clip_rectangle,
-               sizeof(options->dst_clip_rectangle));
-      }
-      if (options->use_src_clip_rectangle) {
-        memcpy(&src_clip_rectangle, &options->src_clip_rectangle,
-               sizeof(options->src_clip_rectangle));
-      }
-      if ((-0xFFFFFF <= options->offset_x) && (options->offset_x <= 0xFFFFFF) &&
-          (-0xFFFFFF <= options->offset_y) && (options->offset_y <= 0xFFFFFF)) {
-        offset_x = options->offset_x;
-        offset_y = options->offset_y;
-      } else {
-        dst_clip_rectangle = qoir_make_rectangle(0, 0, 0, 0);
-        src_clip_rectangle = qoir_make_rectangle(0, 0, 0, 0);
-      }
-    }
-
-    if ((src_len < 44) ||
-        (qoir_private_peek_u32le(src_ptr) != 0x52494F51)) {  // "QOIR"le.
-      return qoir_private_make_decode_result_error(
-          qoir_status_message__error_invalid_data);
+// qoir_private_tile_row_length returns the length of the tile row (of
+// width_in_tiles tiles, including their prefixes) that src_ptr starts with.
+// It does not check the tiles themselves, only that they fit in src_len.
+static qoir_size_result        //
+qoir_private_tile_row_length(  //
+    const uint8_t* src_ptr,    //
+    size_t src_len,            //
+    uint32_t width_in_tiles) {
+  qoir_size_result result = {0};
+  for (uint32_t tx = 0; tx < width_in_tiles; tx++) {
+    if ((src_len - result.value) < 4) {
+      result.status_message = qoir_status_message__error_invalid_data;
+      return result;
     }
-    uint64_t qoir_chunk_payload_len = qoir_private_peek_u64le(src_ptr + 4);
-    if ((qoir_chunk_payload_len < 8) ||
-        (qoir_chunk_payload_len > 0x7FFFFFFFFFFFFFFFull) ||
-        (qoir_chunk_payload_len > (src_len - 44))) {
-      return qoir_private_make_decode_result_error(
-          qoir_status_message__error_invalid_data);
+    size_t tile_len =
+        4 + (0xFFFFFF & qoir_private_peek_u32le(src_ptr + result.value));
+    if ((src_len - result.value) < tile_len) {
+      result.status_message = qoir_status_message__error_invalid_data;
+      return result;
     }
+    result.value += tile_len;
+  }
+  return result;
+}
 
-    uint32_t header0 = qoir_private_peek_u32le(src_ptr + 12);
-    uint32_t width_in_pixels = 0xFFFFFF & header0;
-    qoir_pixel_format src_pixfmt = 0x0F & (header0 >> 24);
-    switch (src_pixfmt) {
-      case QOIR_PIXEL_FORMAT__BGRX:
-      case QOIR_PIXEL_FORMAT__BGRA_NONPREMUL:
-      case QOIR_PIXEL_FORMAT__BGRA_PREMUL:
-        break;
-      default:
-        goto fail_invalid_data;
-    }
-    uint32_t header1 = qoir_private_peek_u32le(src_ptr + 16);
-    uint32_t height_in_pixels = 0xFFFFFF & header1;
-    uint32_t lossiness = 0x07 & (header1 >> 24);
+// qoir_private_decode_bands decodes a pixel payload one tile row at a time
+// into a band buffer, calling the options' band_func after each tile row. Per
+// §, at least 8 bytes past the end of the payload must also be readable.
+static const char*                 //
+qoir_private_decode_bands(         //
+    qoir_pixel_format src_pixfmt,  //
+    uint32_t tile_shift,           //
+    uint32_t width_in_pixels,      //
+    uint32_t height_in_pixels,     //
+    uint32_t lossiness,            //
+    int32_t alpha_lossiness,       //
+    const uint8_t* payload_ptr,    //
+    size_t payload_len,            //
+    const qoir_decode_options* options) {
+  uint32_t max_band_height = 1u << tile_shift;
+  if (max_band_height > height_in_pixels) {
+    max_band_height = height_in_pixels;
+  }
 
+  qoir_pixel_buffer band_pixbuf = options->pixbuf;
+  void* owned_band = NULL;
+  if (qoir_pixel_buffer__is_zero(band_pixbuf)) {
     qoir_pixel_format dst_pixfmt =
-        (options && !qoir_pixel_buffer__is_zero(options->pixbuf))
-            ? options->pixbuf.pixcfg.pixfmt
-            : ((options && options->pixfmt)
-                   ? options->pixfmt
-                   : QOIR_PIXEL_FORMAT__RGBA_NONPREMUL);
+        options->pixfmt ? options->pixfmt : QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
     uint64_t dst_width_in_bytes =
         width_in_pixels * qoir_pixel_format__bytes_per_pixel(dst_pixfmt);
-
-    bool seen_qpix = false;
+    uint64_t band_len = dst_width_in_bytes * (uint64_t)max_band_height;
+    if (band_len > SIZE_MAX) {
+      return qoir_status_message__error_unsupported_pixbuf_dimensions;
+    } else if (band_len == 0) {
+      return (payload_len == 0) ? NULL
+                                : qoir_status_message__error_invalid_data;
+    }
+    owned_band = QOIR_MALLOC((size_t)band_len);
+    if (!owned_band) {
+      return qoir_status_message__error_out_of_memory;
+    }
+    band_pixbuf.pixcfg.pixfmt = dst_pixfmt;
+    band_pixbuf.pixcfg.width_in_pixels = width_in_pixels;
+    band_pixbuf.pixcfg.height_in_pixels = max_band_height;
+    band_pixbuf.data = (uint8_t*)owned_band;
+    band_pixbuf.stride_in_bytes = dst_width_in_bytes;
+  } else if ((band_pixbuf.pixcfg.width_in_pixels < width_in_pixels) ||
+             (band_pixbuf.pixcfg.height_in_pixels < max_band_height)) {
+    return qoir_status_message__error_invalid_argument;
+  }
+  band_pixbuf.pixcfg.width_in_pixels = width_in_pixels;
+
+  uint8_t* scratch = qoir_private_supplied_scratch(
+      QOIR_PRIVATE_SCRATCH__DECBUF, tile_shift, options->decbuf,
+      options->decbuf_len);
+  bool free_scratch = false;
+  if (!scratch) {
+    scratch = QOIR_ACQUIRE_SCRATCH(QOIR_PRIVATE_SCRATCH__DECBUF, tile_shift);
+    if (!scratch) {
+      QOIR_FREE(owned_band);
+      return qoir_status_message__error_out_of_memory;
+    }
+    free_scratch = true;
+  }
+
+  // Tile rows are independent (LZ4 tile groups never span tile rows), so
+  // each can be decoded as an image of its own, once its length is known.
+  const char* status_message = NULL;
+  uint8_t* lz4_history = NULL;
+  uint32_t width_in_tiles =
+      qoir_private_number_of_tiles_1d(width_in_pixels, tile_shift);
+  uint32_t height_in_tiles =
+      qoir_private_number_of_tiles_1d(height_in_pixels, tile_shift);
+  for (uint32_t ty = 0; (ty < height_in_tiles) && !status_message; ty++) {
+    qoir_size_result row =
+        qoir_private_tile_row_length(payload_ptr, payload_len, width_in_tiles);
+    if (row.status_message) {
+      status_message = row.status_message;
+      break;
+    }
+    size_t row_len = row.value;
+
+    band_pixbuf.pixcfg.height_in_pixels = qoir_private_tile_dimension(
+        ty < (height_in_tiles - 1), height_in_pixels, tile_shift);
+    status_message = qoir_private_decode_qpix_payload(
+        scratch, &lz4_history, band_pixbuf,
+        qoir_make_rectangle(0, 0, 0xFFFFFF, 0xFFFFFF), src_pixfmt, tile_shift,
+        width_in_pixels, band_pixbuf.pixcfg.height_in_pixels, payload_ptr,
+        row_len + 8,  // See § for +8.
+        qoir_make_rectangle(0, 0, 0xFFFFFF, 0xFFFFFF), 0, 0, lossiness,
+        alpha_lossiness, false, false, options);
+    if (!status_message) {
+      status_message = (*options->band_func)(options->band_func_context,
+                                             &band_pixbuf, ty << tile_shift);
+    }
+    payload_ptr += row_len;
+    payload_len -= row_len;
+  }
+  if (!status_message && (payload_len != 0)) {
+    status_message = qoir_status_message__error_invalid_data;
+  }
+
+  QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__LZ4_HISTORY, tile_shift,
+                       lz4_history);
+  if (free_scratch) {
+    QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__DECBUF, tile_shift, scratch);
+  }
+  QOIR_FREE(owned_band);
+  return status_message;
+}
+
+// qoir_private_zero_outside zeroes the pixels of pixbuf that are outside of
+// r. Decoding into a dynamically allocated pixbuf only writes the pixels
+// inside the clipped (and offset) source image. The other pixels have
+// unspecified values (fresh or re-used memory) unless zeroed.
+static void                           //
+qoir_private_zero_outside(            //
+    const qoir_pixel_buffer* pixbuf,  //
+    qoir_rectangle r) {
+  size_t width = pixbuf->pixcfg.width_in_pixels;
+  size_t height = pixbuf->pixcfg.height_in_pixels;
+  r = qoir_rectangle__intersect(
+      r, qoir_make_rectangle(0, 0, (int32_t)width, (int32_t)height));
+  if (qoir_rectangle__is_empty(r)) {
+    r = qoir_make_rectangle(0, 0, 0, 0);
+  } else if ((r.x0 == 0) && (r.y0 == 0) && ((size_t)r.x1 == width) &&
+             ((size_t)r.y1 == height)) {
+    return;
+  }
+  size_t bpp = qoir_pixel_format__bytes_per_pixel(pixbuf->pixcfg.pixfmt);
+  size_t x0 = bpp * (size_t)r.x0;
+  size_t x1 = bpp * (size_t)r.x1;
+  size_t w = bpp * width;
+  uint8_t* row = pixbuf->data;
+  for (size_t y = 0; y < height; y++) {
+    if ((y < (size_t)r.y0) || (y >= (size_t)r.y1)) {
+      memset(row, 0, w);
+    } else {
+      memset(row, 0, x0);
+      memset(row + x1, 0, w - x1);
+    }
+    row += pixbuf->stride_in_bytes;
+  }
+}
+
+// qoir_private_decode_pixels decodes a pixel payload (a sequence of encoded
+// tiles, such as the QPIX chunk's payload) into result->dst_pixbuf. If that is
+// zero then it is set from the options, or allocated if the options do not
+// supply one. Per §, at least 8 bytes past the end of the payload must also be
+// readable. On failure, it frees any owned_memory. If the options have a
+// band_func then it decodes in bands instead, leaving result alone.
+static const char*                 //
+qoir_private_decode_pixels(        //
+    qoir_decode_result* result,    //
+    qoir_pixel_format src_pixfmt,  //
+    uint32_t tile_shift,           //
+    uint32_t width_in_pixels,      //
+    uint32_t height_in_pixels,     //
+    uint32_t lossiness,            //
+    int32_t alpha_lossiness,       //
+    const uint8_t* payload_ptr,    //
+    size_t payload_len,            //
+    bool unchanged_tiles_allowed,  //
+    const qoir_decode_options* options) {
+  if (options && options->band_func) {
+    return qoir_private_decode_bands(src_pixfmt, tile_shift, width_in_pixels,
+                                     height_in_pixels, lossiness,
+                                     alpha_lossiness, payload_ptr, payload_len,
+                                     options);
+  }
+
+  qoir_rectangle dst_clip_rectangle =
+      qoir_make_rectangle(0, 0, 0xFFFFFF, 0xFFFFFF);
+  qoir_rectangle src_clip_rectangle =
+      qoir_make_rectangle(0, 0, 0xFFFFFF, 0xFFFFFF);
+  int32_t offset_x = 0;
+  int32_t offset_y = 0;
+  if (options) {
+    if ((options->pixbuf.pixcfg.width_in_pixels > 0xFFFFFF) ||
+        (options->pixbuf.pixcfg.height_in_pixels > 0xFFFFFF)) {
+      return qoir_status_message__error_unsupported_pixbuf_dimensions;
+    }
+    if (qoir_pixel_buffer__is_zero(result->dst_pixbuf)) {
+      memcpy(&result->dst_pixbuf, &options->pixbuf, sizeof(options->pixbuf));
+    }
+    if (options->use_dst_clip_rectangle) {
+      memcpy(&dst_clip_rectangle, &options->dst_clip_rectangle,
+             sizeof(options->dst_clip_rectangle));
+    }
+    if (options->use_src_clip_rectangle) {
+      memcpy(&src_clip_rectangle, &options->src_clip_rectangle,
+             sizeof(options->src_clip_rectangle));
+    }
+    if ((-0xFFFFFF <= options->offset_x) && (options->offset_x <= 0xFFFFFF) &&
+        (-0xFFFFFF <= options->offset_y) && (options->offset_y <= 0xFFFFFF)) {
+      offset_x = options->offset_x;
+      offset_y = options->offset_y;
+    } else {
+      dst_clip_rectangle = qoir_make_rectangle(0, 0, 0, 0);
+      src_clip_rectangle = qoir_make_rectangle(0, 0, 0, 0);
+    }
+  }
+
+  qoir_pixel_format dst_pixfmt =
+      (options && !qoir_pixel_buffer__is_zero(options->pixbuf))
+          ? options->pixbuf.pixcfg.pixfmt
+          : ((options && options->pixfmt)
+                 ? options->pixfmt
+                 : QOIR_PIXEL_FORMAT__RGBA_NONPREMUL);
+  uint64_t dst_width_in_bytes =
+      width_in_pixels * qoir_pixel_format__bytes_per_pixel(dst_pixfmt);
+  uint64_t pixbuf_len = dst_width_in_bytes * (uint64_t)height_in_pixels;
+  if (pixbuf_len > SIZE_MAX) {
+    return qoir_status_message__error_unsupported_pixbuf_dimensions;
+
+  } else if (pixbuf_len == 0) {
+    return (payload_len == 0) ? NULL : qoir_status_message__error_invalid_data;
+  }
+
+  if (qoir_pixel_buffer__is_zero(result->dst_pixbuf)) {
+    qoir_decode_result* reusable = options ? options->reusable_result : NULL;
+    if (reusable && reusable->owned_memory) {
+      uint64_t reusable_len =
+          (uint64_t)reusable->dst_pixbuf.stride_in_bytes *
+          (uint64_t)reusable->dst_pixbuf.pixcfg.height_in_pixels;
+      if (reusable_len >= pixbuf_len) {
+        result->owned_memory = reusable->owned_memory;
+      } else {
+        QOIR_FREE(reusable->owned_memory);
+      }
+      reusable->owned_memory = NULL;
+      memset(&reusable->dst_pixbuf, 0, sizeof(reusable->dst_pixbuf));
+    }
+    if (!result->owned_memory) {
+      result->owned_memory = QOIR_MALLOC((size_t)pixbuf_len);
+      if (!result->owned_memory) {
+        return qoir_status_message__error_out_of_memory;
+      }
+    }
+    result->dst_pixbuf.pixcfg.pixfmt = dst_pixfmt;
+    result->dst_pixbuf.pixcfg.width_in_pixels = width_in_pixels;
+    result->dst_pixbuf.pixcfg.height_in_pixels = height_in_pixels;
+    result->dst_pixbuf.data = (uint8_t*)result->owned_memory;
+    result->dst_pixbuf.stride_in_bytes = dst_width_in_bytes;
+
+    // Zero only what the decode will not overwrite: the pixels outside the
+    // source image (clipped and then offset) and the destination clip.
+    qoir_rectangle r = qoir_rectangle__intersect(
+        qoir_make_rectangle(0, 0, (int32_t)width_in_pixels,
+                            (int32_t)height_in_pixels),
+        src_clip_rectangle);
+    r.x0 += offset_x;
+    r.y0 += offset_y;
+    r.x1 += offset_x;
+    r.y1 += offset_y;
+    qoir_private_zero_outside(&result->dst_pixbuf,
+                              qoir_rectangle__intersect(r, dst_clip_rectangle));
+  }
+  uint8_t* scratch =
+      options ? qoir_private_supplied_scratch(QOIR_PRIVATE_SCRATCH__DECBUF,
+                                              tile_shift, options->decbuf,
+                                              options->decbuf_len)
+              : NULL;
+  bool free_scratch = false;
+  if (!scratch) {
+    scratch = QOIR_ACQUIRE_SCRATCH(QOIR_PRIVATE_SCRATCH__DECBUF, tile_shift);
+    if (!scratch) {
+      QOIR_FREE(result->owned_memory);
+      result->owned_memory = NULL;
+      return qoir_status_message__error_out_of_memory;
+    }
+    free_scratch = true;
+  }
+  uint8_t* lz4_history = NULL;
+  const char* status_message = qoir_private_decode_qpix_payload(
+      scratch, &lz4_history, result->dst_pixbuf, dst_clip_rectangle,
+      src_pixfmt, tile_shift, width_in_pixels, height_in_pixels, payload_ptr,
+      payload_len + 8,  // See § for +8.
+      src_clip_rectangle, offset_x, offset_y, lossiness, alpha_lossiness,
+      unchanged_tiles_allowed, false, options);
+  QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__LZ4_HISTORY, tile_shift,
+                       lz4_history);
+  if (free_scratch) {
+    QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__DECBUF, tile_shift, scratch);
+  }
+  if (status_message) {
+    QOIR_FREE(result->owned_memory);
+    result->owned_memory = NULL;
+  }
+  return status_message;
+}
+
+// qoir_private_header is a QOIR file's first chunk, as parsed by
+// qoir_private_decode_header.
+typedef struct qoir_private_header_struct {
+  uint64_t qoir_chunk_payload_len;
+  qoir_pixel_format src_pixfmt;
+  uint32_t tile_shift;
+  uint32_t width_in_pixels;
+  uint32_t height_in_pixels;
+  uint32_t lossiness;
+  int32_t alpha_lossiness;
+} qoir_private_header;
+
+// qoir_private_decode_header parses the QOIR chunk of a whole QOIR file,
+// returning NULL on success or an error status message.
+static const char*             //
+qoir_private_decode_header(    //
+    qoir_private_header* dst,  //
+    const uint8_t* src_ptr,    //
+    const size_t src_len) {
+  if ((src_len < 44) ||
+      (qoir_private_peek_u32le(src_ptr) != 0x52494F51)) {  // "QOIR"le.
+    return qoir_status_message__error_invalid_data;
+  }
+  uint64_t qoir_chunk_payload_len = qoir_private_peek_u64le(src_ptr + 4);
+  if ((qoir_chunk_payload_len < 8) ||
+      (qoir_chunk_payload_len > 0x7FFFFFFFFFFFFFFFull) ||
+      (qoir_chunk_payload_len > (src_len - 44))) {
+    return qoir_status_message__error_invalid_data;
+  }
+
+  uint32_t header0 = qoir_private_peek_u32le(src_ptr + 12);
+  qoir_pixel_format src_pixfmt = 0x0F & (header0 >> 24);
+  switch (src_pixfmt) {
+    case QOIR_PIXEL_FORMAT__BGRX:
+    case QOIR_PIXEL_FORMAT__BGRA_NONPREMUL:
+    case QOIR_PIXEL_FORMAT__BGRA_PREMUL:
+      break;
+    default:
+      return qoir_status_message__error_invalid_data;
+  }
+  uint32_t tile_shift = qoir_private_decode_tile_shift(header0);
+  if (tile_shift == 0) {
+    return qoir_status_message__error_unsupported_tile_size;
+  }
+  uint32_t header1 = qoir_private_peek_u32le(src_ptr + 16);
+  // If bit 3 is set then bits 4 to 6 hold a separate alpha lossiness. That is
+  // only valid for nonpremultiplied alpha.
+  int32_t alpha_lossiness = -1;
+  if (header1 & 0x08000000) {
+    if (src_pixfmt != QOIR_PIXEL_FORMAT__BGRA_NONPREMUL) {
+      return qoir_status_message__error_invalid_data;
+    }
+    alpha_lossiness = 0x07 & (header1 >> 28);
+  }
+
+  dst->qoir_chunk_payload_len = qoir_chunk_payload_len;
+  dst->src_pixfmt = src_pixfmt;
+  dst->tile_shift = tile_shift;
+  dst->width_in_pixels = 0xFFFFFF & header0;
+  dst->height_in_pixels = 0xFFFFFF & header1;
+  dst->lossiness = 0x07 & (header1 >> 24);
+  dst->alpha_lossiness = alpha_lossiness;
+  return NULL;
+}
+
+// qoir_private_decode_with_header is qoir_decode but it ignores the options'
+// arena_etc fields, allocating memory with the memory functions. The caller
+// has already parsed the QOIR chunk into header.
+static qoir_decode_result               //
+qoir_private_decode_with_header(        //
+    const qoir_private_header* header,  //
+    const uint8_t* src_ptr,             //
+    const size_t src_len,               //
+    const qoir_decode_options* options) {
+  qoir_decode_result result = {0};
+
+  do {
+    uint64_t qoir_chunk_payload_len = header->qoir_chunk_payload_len;
+    qoir_pixel_format src_pixfmt = header->src_pixfmt;
+    uint32_t tile_shift = header->tile_shift;
+    uint32_t width_in_pixels = header->width_in_pixels;
+    uint32_t height_in_pixels = header->height_in_pixels;
+    uint32_t lossiness = header->lossiness;
+    int32_t alpha_lossiness = header->alpha_lossiness;
+
+    uint32_t mipmap_min_width_in_pixels =
+        options ? options->mipmap_min_width_in_pixels : 0;
+    uint32_t mipmap_min_height_in_pixels =
+        options ? options->mipmap_min_height_in_pixels : 0;
+    bool want_mipmap =
+        (mipmap_min_width_in_pixels > 0) || (mipmap_min_height_in_pixels > 0);
+    uint32_t mipmap_level = 0;
+    uint32_t frame_index = options ? options->frame_index : 0;
+
+    // Walk the chunks, noting (but not yet decoding) the pixel payloads.
+    const uint8_t* qpix_payload_ptr = NULL;
+    size_t qpix_payload_len = 0;
+    const uint8_t* first_fpix_chunk_ptr = NULL;
+    const uint8_t* mpix_payload_ptr = NULL;
+    size_t mpix_payload_len = 0;
     const uint8_t* sp = src_ptr + (12 + qoir_chunk_payload_len);
     size_t sn = src_len - (12 + qoir_chunk_payload_len);
     while (1) {
@@ -6276,60 +9022,42 @@ qoir_decode(                          //
       }
 
       if (chunk_type == 0x58495051) {  // "QPIX"le.
-        if (seen_qpix) {
+        if (qpix_payload_ptr) {
           goto fail_invalid_data;
         }
-        seen_qpix = true;
-
-        uint64_t pixbuf_len = dst_width_in_bytes * (uint64_t)height_in_pixels;
-        if (pixbuf_len > SIZE_MAX) {
-          return qoir_private_make_decode_result_error(
-              qoir_status_message__error_unsupported_pixbuf_dimensions);
-
-        } else if (pixbuf_len > 0) {
-          if (qoir_pixel_buffer__is_zero(result.dst_pixbuf)) {
-            result.owned_memory = QOIR_MALLOC((size_t)pixbuf_len);
-            if (!result.owned_memory) {
-              return qoir_private_make_decode_result_error(
-                  qoir_status_message__error_out_of_memory);
-            }
-            if (options && (options->use_dst_clip_rectangle ||
-                            options->use_src_clip_rectangle)) {
-              memset(result.owned_memory, 0, pixbuf_len);
-            }
-            result.dst_pixbuf.pixcfg.pixfmt = dst_pixfmt;
-            result.dst_pixbuf.pixcfg.width_in_pixels = width_in_pixels;
-            result.dst_pixbuf.pixcfg.height_in_pixels = height_in_pixels;
-            result.dst_pixbuf.data = (uint8_t*)result.owned_memory;
-            result.dst_pixbuf.stride_in_bytes = dst_width_in_bytes;
-          }
-          qoir_decode_buffer* decbuf = options ? options->decbuf : NULL;
-          bool free_decbuf = false;
-          if (!decbuf) {
-            decbuf =
-                (qoir_decode_buffer*)QOIR_MALLOC(sizeof(qoir_decode_buffer));
-            if (!decbuf) {
-              QOIR_FREE(result.owned_memory);
-              return qoir_private_make_decode_result_error(
-                  qoir_status_message__error_out_of_memory);
-            }
-            free_decbuf = true;
-          }
-          const char* status_message = qoir_private_decode_qpix_payload(
-              decbuf, result.dst_pixbuf, dst_clip_rectangle, src_pixfmt,
-              width_in_pixels, height_in_pixels, sp,
-              payload_len + 8,  // See § for +8.
-              src_clip_rectangle, offset_x, offset_y, lossiness);
-          if (free_decbuf) {
-            QOIR_FREE(decbuf);
-          }
-          if (status_message) {
-            QOIR_FREE(result.owned_memory);
-            return qoir_private_make_decode_result_error(status_message);
-          }
+        qpix_payload_ptr = sp;
+        qpix_payload_len = payload_len;
 
-        } else if (payload_len != 0) {
+      } else if (chunk_type == 0x58495066) {  // "fPIX"le.
+        if (!qpix_payload_ptr || (payload_len < 8) ||
+            (result.num_frames >= 0xFFFFFFFE)) {
           goto fail_invalid_data;
+        } else if (!first_fpix_chunk_ptr) {
+          first_fpix_chunk_ptr = sp - 12;
+        }
+        result.num_frames++;
+
+      } else if (chunk_type == 0x5849506D) {  // "mPIX"le.
+        if (payload_len < 8) {
+          goto fail_invalid_data;
+        }
+        uint32_t m0 = qoir_private_peek_u32le(sp + 0);
+        uint32_t m1 = qoir_private_peek_u32le(sp + 4);
+        uint32_t level = m0 >> 24;
+        uint32_t w = 0xFFFFFF & m0;
+        uint32_t h = 0xFFFFFF & m1;
+        if ((level == 0) || (level > 24) ||
+            (w != qoir_private_mipmap_dimension(width_in_pixels, level)) ||
+            (h != qoir_private_mipmap_dimension(height_in_pixels, level))) {
+          goto fail_invalid_data;
+        }
+        // Prefer the smallest (highest level) large enough mipmap.
+        if (want_mipmap && (level > mipmap_level) &&
+            (w >= mipmap_min_width_in_pixels) &&
+            (h >= mipmap_min_height_in_pixels)) {
+          mipmap_level = level;
+          mpix_payload_ptr = sp + 8;
+          mpix_payload_len = payload_len - 8;
         }
 
       } else if (chunk_type == 0x50434943) {  // "CICP"le.
@@ -6365,9 +9093,70 @@ qoir_decode(                          //
       sn -= payload_len;
     }
 
-    if (!seen_qpix) {
+    if (!qpix_payload_ptr) {
       goto fail_invalid_data;
     }
+    result.num_frames++;  // Count the QPIX chunk as well as the fPIX chunks.
+    if (frame_index >= result.num_frames) {
+      return qoir_private_make_decode_result_error(
+          qoir_status_message__error_invalid_argument);
+    }
+    bool resume = (frame_index > 0) && options->pixbuf_holds_previous_frame;
+    if (resume && qoir_pixel_buffer__is_zero(options->pixbuf)) {
+      return qoir_private_make_decode_result_error(
+          qoir_status_message__error_invalid_argument);
+    } else if (frame_index > 0) {
+      if (options->band_func) {
+        return qoir_private_make_decode_result_error(
+            qoir_status_message__error_invalid_argument);
+      }
+      mipmap_level = 0;
+    }
+
+    const uint8_t* pixel_payload_ptr = qpix_payload_ptr;
+    size_t pixel_payload_len = qpix_payload_len;
+    if (mipmap_level > 0) {
+      width_in_pixels =
+          qoir_private_mipmap_dimension(width_in_pixels, mipmap_level);
+      height_in_pixels =
+          qoir_private_mipmap_dimension(height_in_pixels, mipmap_level);
+      pixel_payload_ptr = mpix_payload_ptr;
+      pixel_payload_len = mpix_payload_len;
+    }
+
+    if (!resume) {
+      const char* status_message = qoir_private_decode_pixels(
+          &result, src_pixfmt, tile_shift, width_in_pixels, height_in_pixels,
+          lossiness, alpha_lossiness, pixel_payload_ptr, pixel_payload_len,
+          false, options);
+      if (status_message) {
+        return qoir_private_make_decode_result_error(status_message);
+      }
+    }
+
+    // Apply the fPIX chunks' changed tiles, up to and including frame_index.
+    // When resuming, the earlier frames are already in the pixel buffer.
+    sp = first_fpix_chunk_ptr;
+    for (uint32_t f = 1; f <= frame_index;) {
+      uint32_t chunk_type = qoir_private_peek_u32le(sp + 0);
+      size_t payload_len = (size_t)qoir_private_peek_u64le(sp + 4);
+      sp += 12;
+      if (chunk_type != 0x58495066) {  // "fPIX"le.
+        sp += payload_len;
+        continue;
+      } else if (!resume || (f == frame_index)) {
+        result.frame_delay_ms = qoir_private_peek_u32le(sp + 0);
+        const char* status_message = qoir_private_decode_pixels(
+            &result, src_pixfmt, tile_shift, width_in_pixels,
+            height_in_pixels, lossiness, alpha_lossiness, sp + 8,
+            payload_len - 8, true, options);
+        if (status_message) {
+          return qoir_private_make_decode_result_error(status_message);
+        }
+      }
+      sp += payload_len;
+      f++;
+    }
     return result;
   } while (false);
 
@@ -6377,41 +9166,1419 @@ fail_invalid_data:
       qoir_status_message__error_invalid_data);
 }
 
-// -------- QOIR Encode
+// qoir_private_decode_with_memory_funcs is qoir_decode but it ignores the
+// options' arena_etc fields, allocating memory with the memory functions.
+static qoir_decode_result               //
+qoir_private_decode_with_memory_funcs(  //
+    const uint8_t* src_ptr,             //
+    const size_t src_len,               //
+    const qoir_decode_options* options) {
+  qoir_private_header header;
+  const char* status_message =
+      qoir_private_decode_header(&header, src_ptr, src_len);
+  if (status_message) {
+    return qoir_private_make_decode_result_error(status_message);
+  }
+  return qoir_private_decode_with_header(&header, src_ptr, src_len, options);
+}
+
+QOIR_MAYBE_STATIC qoir_decode_result  //
+qoir_decode(                          //
+    const uint8_t* src_ptr,           //
+    const size_t src_len,             //
+    const qoir_decode_options* options) {
+  if (!options || !options->arena_ptr) {
+    return qoir_private_decode_with_memory_funcs(src_ptr, src_len, options);
+  }
+  qoir_private_arena arena = {0};
+  arena.ptr = options->arena_ptr;
+  arena.len = options->arena_len;
+  qoir_decode_options arena_options;
+  memcpy(&arena_options, options, sizeof(arena_options));
+  arena_options.contextual_malloc_func = &qoir_private_arena_malloc;
+  arena_options.contextual_free_func = &qoir_private_arena_free;
+  arena_options.memory_func_context = &arena;
+  arena_options.reusable_result = NULL;
+  qoir_decode_result result =
+      qoir_private_decode_with_memory_funcs(src_ptr, src_len, &arena_options);
+  result.owned_memory = NULL;
+  return result;
+}
+
+QOIR_MAYBE_STATIC qoir_size_result  //
+qoir_decode_arena_len(              //
+    const uint8_t* src_ptr,         //
+    size_t src_len,                 //
+    const qoir_decode_options* options) {
+  qoir_size_result result = {0};
+  qoir_decode_pixel_configuration_result config =
+      qoir_decode_pixel_configuration(src_ptr, src_len);
+  if (config.status_message) {
+    result.status_message = config.status_message;
+    return result;
+  }
+
+  // This follows qoir_decode's allocation order. The full sized image is at
+  // least as large as any mipmap level and a band is at most one tile high.
+  bool ok = true;
+  if (!options || qoir_pixel_buffer__is_zero(options->pixbuf)) {
+    qoir_pixel_format dst_pixfmt = (options && options->pixfmt)
+                                       ? options->pixfmt
+                                       : QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+    uint64_t height = config.dst_pixcfg.height_in_pixels;
+    if (options && options->band_func &&
+        (height > config.tile_size_in_pixels)) {
+      height = config.tile_size_in_pixels;
+    }
+    ok = qoir_private_arena_add_len(
+        &result.value, (uint64_t)config.dst_pixcfg.width_in_pixels *
+                           qoir_pixel_format__bytes_per_pixel(dst_pixfmt) *
+                           height);
+  }
+  uint32_t tile_shift =
+      qoir_private_decode_tile_shift(qoir_private_peek_u32le(src_ptr + 12));
+  if (!options ||
+      !qoir_private_supplied_scratch(QOIR_PRIVATE_SCRATCH__DECBUF, tile_shift,
+                                     options->decbuf, options->decbuf_len)) {
+    ok = ok && qoir_private_arena_add_len(
+                   &result.value,
+                   qoir_private_scratch_len(QOIR_PRIVATE_SCRATCH__DECBUF,
+                                            tile_shift));
+  }
+  // Whether an LZ4 history is needed depends on the tiles, not the header.
+  ok = ok && qoir_private_arena_add_len(
+                 &result.value,
+                 qoir_private_scratch_len(QOIR_PRIVATE_SCRATCH__LZ4_HISTORY,
+                                          tile_shift));
+  if (!ok) {
+    result.status_message =
+        qoir_status_message__error_unsupported_pixbuf_dimensions;
+    result.value = 0;
+  }
+  return result;
+}
+
+QOIR_MAYBE_STATIC qoir_decode_result  //
+qoir_decode_preview(                  //
+    const uint8_t* src_ptr,           //
+    const size_t src_len,             //
+    const qoir_decode_options* options) {
+  qoir_decode_pixel_configuration_result config =
+      qoir_decode_pixel_configuration(src_ptr, src_len);
+  if (config.status_message) {
+    return qoir_private_make_decode_result_error(config.status_message);
+  }
+  uint64_t qoir_chunk_payload_len = qoir_private_peek_u64le(src_ptr + 4);
+  if (qoir_chunk_payload_len > (src_len - 12)) {
+    return qoir_private_make_decode_result_error(
+        qoir_status_message__error_invalid_data);
+  }
+
+  const uint8_t* sp = src_ptr + (12 + qoir_chunk_payload_len);
+  size_t sn = src_len - (12 + qoir_chunk_payload_len);
+  while (1) {
+    if (sn < 12) {
+      break;
+    }
+    uint32_t chunk_type = qoir_private_peek_u32le(sp + 0);
+    uint64_t payload_len = qoir_private_peek_u64le(sp + 4);
+    if (payload_len > 0x7FFFFFFFFFFFFFFFull) {
+      break;
+    }
+    sp += 12;
+    sn -= 12;
+
+    if ((chunk_type == 0x58495051) ||  // "QPIX"le.
+        (chunk_type == 0x444E4551)) {  // "QEND"le.
+      return qoir_private_make_decode_result_error(
+          qoir_status_message__error_no_preview);
+    } else if ((sn < payload_len) || ((sn - payload_len) < 8)) {  // See §.
+      break;
+    } else if (chunk_type != 0x57565250) {  // "PRVW"le.
+      sp += payload_len;
+      sn -= payload_len;
+      continue;
+    } else if (payload_len < 8) {
+      break;
+    }
+
+    qoir_decode_result result = {0};
+    const char* status_message = qoir_private_decode_pixels(
+        &result, config.dst_pixcfg.pixfmt,
+        qoir_private_decode_tile_shift(qoir_private_peek_u32le(src_ptr + 12)),
+        0xFFFFFF & qoir_private_peek_u32le(sp + 0),
+        0xFFFFFF & qoir_private_peek_u32le(sp + 4), 0, -1, sp + 8,
+        payload_len - 8, false, options);
+    if (status_message) {
+      return qoir_private_make_decode_result_error(status_message);
+    }
+    return result;
+  }
+  return qoir_private_make_decode_result_error(
+      qoir_status_message__error_invalid_data);
+}
+
+QOIR_MAYBE_STATIC qoir_decode_batch_result  //
+qoir_decode_batch(                          //
+    qoir_decode_batch_item* items_ptr,      //
+    size_t items_len,                       //
+    uint8_t* arena_ptr,                     //
+    size_t arena_len,                       //
+    const qoir_decode_options* options) {
+  qoir_decode_batch_result batch_result = {0};
+  qoir_decode_options item_options = {0};
+  if (options) {
+    memcpy(&item_options, options, sizeof(*options));
+  }
+  item_options.use_src_clip_rectangle = false;
+  item_options.use_dst_clip_rectangle = false;
+  item_options.offset_x = 0;
+  item_options.offset_y = 0;
+  item_options.mipmap_min_width_in_pixels = 0;
+  item_options.mipmap_min_height_in_pixels = 0;
+  item_options.pixbuf_holds_previous_frame = false;
+  item_options.band_func = NULL;
+  qoir_pixel_format dst_pixfmt = item_options.pixfmt
+                                     ? item_options.pixfmt
+                                     : QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+  uint32_t bytes_per_pixel = qoir_pixel_format__bytes_per_pixel(dst_pixfmt);
+  if (!item_options.decbuf) {
+    item_options.decbuf = (qoir_decode_buffer*)QOIR_ACQUIRE_SCRATCH(
+        QOIR_PRIVATE_SCRATCH__DECBUF, QOIR_TILE_SHIFT);
+    item_options.decbuf_len = 0;
+    if (!item_options.decbuf) {
+      batch_result.status_message = qoir_status_message__error_out_of_memory;
+      for (size_t i = 0; i < items_len; i++) {
+        items_ptr[i].result =
+            qoir_private_make_decode_result_error(batch_result.status_message);
+      }
+      return batch_result;
+    }
+  }
+
+  for (size_t i = 0; i < items_len; i++) {
+    qoir_decode_batch_item* item = &items_ptr[i];
+    qoir_private_header header;
+    const char* status_message =
+        qoir_private_decode_header(&header, item->src_ptr, item->src_len);
+    if (status_message) {
+      item->result = qoir_private_make_decode_result_error(status_message);
+    } else {
+      uint32_t width_in_pixels = header.width_in_pixels;
+      uint32_t height_in_pixels = header.height_in_pixels;
+      uint64_t stride_in_bytes = (uint64_t)width_in_pixels * bytes_per_pixel;
+      uint64_t len = stride_in_bytes * height_in_pixels;
+      if (len > (arena_len - batch_result.arena_used_len)) {
+        item->result = qoir_private_make_decode_result_error(
+            qoir_status_message__error_out_of_memory);
+      } else {
+        item_options.pixbuf.pixcfg.pixfmt = dst_pixfmt;
+        item_options.pixbuf.pixcfg.width_in_pixels = width_in_pixels;
+        item_options.pixbuf.pixcfg.height_in_pixels = height_in_pixels;
+        item_options.pixbuf.data = arena_ptr + batch_result.arena_used_len;
+        item_options.pixbuf.stride_in_bytes = (size_t)stride_in_bytes;
+        item->result = qoir_private_decode_with_header(
+            &header, item->src_ptr, item->src_len, &item_options);
+        if (!item->result.status_message) {
+          batch_result.arena_used_len += (size_t)len;
+        }
+      }
+    }
+    if (item->result.status_message && !batch_result.status_message) {
+      batch_result.status_message = item->result.status_message;
+    }
+  }
+
+  if (!options || !options->decbuf) {
+    QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__DECBUF, QOIR_TILE_SHIFT,
+                         item_options.decbuf);
+  }
+  return batch_result;
+}
+
+static qoir_probe_result               //
+qoir_private_make_probe_result_error(  //
+    const char* status_message) {
+  qoir_probe_result result = {0};
+  result.status_message = status_message;
+  return result;
+}
+
+QOIR_MAYBE_STATIC qoir_probe_result  //
+qoir_probe(                          //
+    const uint8_t* src_ptr,          //
+    size_t src_len) {
+  qoir_decode_pixel_configuration_result config =
+      qoir_decode_pixel_configuration(src_ptr, src_len);
+  if (config.status_message) {
+    return qoir_private_make_probe_result_error(config.status_message);
+  }
+  uint64_t qoir_chunk_payload_len = qoir_private_peek_u64le(src_ptr + 4);
+  if (qoir_chunk_payload_len > (src_len - 12)) {
+    return qoir_private_make_probe_result_error(
+        qoir_status_message__error_invalid_data);
+  }
+
+  qoir_probe_result result = {0};
+  result.dst_pixcfg = config.dst_pixcfg;
+  result.tile_size_in_pixels = config.tile_size_in_pixels;
+  uint32_t header1 = qoir_private_peek_u32le(src_ptr + 16);
+  result.lossiness = 0x07 & (header1 >> 24);
+  if (header1 & 0x08000000) {
+    if (config.dst_pixcfg.pixfmt != QOIR_PIXEL_FORMAT__BGRA_NONPREMUL) {
+      return qoir_private_make_probe_result_error(
+          qoir_status_message__error_invalid_data);
+    }
+    result.separate_alpha_lossiness = true;
+    result.alpha_lossiness = 0x07 & (header1 >> 28);
+  }
+
+  const uint8_t* sp = src_ptr + (12 + qoir_chunk_payload_len);
+  size_t sn = src_len - (12 + qoir_chunk_payload_len);
+  while (1) {
+    if (sn < 12) {
+      goto fail_invalid_data;
+    }
+    uint32_t chunk_type = qoir_private_peek_u32le(sp + 0);
+    uint64_t payload_len = qoir_private_peek_u64le(sp + 4);
+    if (payload_len > 0x7FFFFFFFFFFFFFFFull) {
+      goto fail_invalid_data;
+    }
+    sp += 12;
+    sn -= 12;
+
+    if (chunk_type == 0x52494F51) {  // "QOIR"le.
+      goto fail_invalid_data;
+    } else if (chunk_type == 0x444E4551) {  // "QEND"le.
+      if ((payload_len != 0) || (sn != 0) || !result.qpix_payload_ptr) {
+        goto fail_invalid_data;
+      }
+      break;
+    }
+
+    // This chunk must be followed by at least the QEND chunk (12 bytes).
+    if ((sn < payload_len) || ((sn - payload_len) < 12)) {
+      goto fail_invalid_data;
+    }
+
+    if (chunk_type == 0x58495051) {  // "QPIX"le.
+      if (result.qpix_payload_ptr) {
+        goto fail_invalid_data;
+      }
+      result.qpix_payload_ptr = sp;
+      result.qpix_payload_len = payload_len;
+      result.num_frames++;
+
+    } else if (chunk_type == 0x58495066) {  // "fPIX"le.
+      if (!result.qpix_payload_ptr || (payload_len < 8) ||
+          (result.num_frames >= 0xFFFFFFFF)) {
+        goto fail_invalid_data;
+      }
+      result.num_frames++;
+
+    } else if (chunk_type == 0x5849506D) {  // "mPIX"le.
+      if (payload_len < 8) {
+        goto fail_invalid_data;
+      }
+      uint32_t m0 = qoir_private_peek_u32le(sp + 0);
+      uint32_t m1 = qoir_private_peek_u32le(sp + 4);
+      uint32_t level = m0 >> 24;
+      if ((level == 0) || (level > 24) ||
+          ((0xFFFFFF & m0) !=
+           qoir_private_mipmap_dimension(
+               result.dst_pixcfg.width_in_pixels, level)) ||
+          ((0xFFFFFF & m1) !=
+           qoir_private_mipmap_dimension(
+               result.dst_pixcfg.height_in_pixels, level))) {
+        goto fail_invalid_data;
+      }
+      result.num_mipmap_levels++;
+
+    } else if (chunk_type == 0x57565250) {  // "PRVW"le.
+      result.has_preview = true;
+
+    } else if (chunk_type == 0x50434943) {  // "CICP"le.
+      if (result.metadata_cicp_ptr) {
+        goto fail_invalid_data;
+      }
+      result.metadata_cicp_ptr = sp;
+      result.metadata_cicp_len = payload_len;
+
+    } else if (chunk_type == 0x50434349) {  // "ICCP"le.
+      if (result.metadata_iccp_ptr) {
+        goto fail_invalid_data;
+      }
+      result.metadata_iccp_ptr = sp;
+      result.metadata_iccp_len = payload_len;
+
+    } else if (chunk_type == 0x46495845) {  // "EXIF"le.
+      if (result.metadata_exif_ptr) {
+        goto fail_invalid_data;
+      }
+      result.metadata_exif_ptr = sp;
+      result.metadata_exif_len = payload_len;
+
+    } else if (chunk_type == 0x20504D58) {  // "XMP "le.
+      if (result.metadata_xmp_ptr) {
+        goto fail_invalid_data;
+      }
+      result.metadata_xmp_ptr = sp;
+      result.metadata_xmp_len = payload_len;
+    }
+
+    sp += payload_len;
+    sn -= payload_len;
+  }
+  return result;
+
+fail_invalid_data:
+  return qoir_private_make_probe_result_error(
+      qoir_status_message__error_invalid_data);
+}
+
+// qoir_private_executor_num_tasks returns how many tasks to divide work (of
+// num_items independent items) into.
+static uint32_t                          //
+qoir_private_executor_num_tasks(         //
+    const qoir_decode_options* options,  //
+    uint64_t num_items) {
+  uint64_t n = 1;
+  if (options && options->executor_func &&
+      (options->executor_concurrency > 1)) {
+    n = (options->executor_concurrency < QOIR_MAX_EXECUTOR_CONCURRENCY)
+            ? options->executor_concurrency
+            : QOIR_MAX_EXECUTOR_CONCURRENCY;
+  }
+  return (uint32_t)((n < num_items) ? n : ((num_items > 0) ? num_items : 1));
+}
+
+// qoir_private_make_task_scratches sets scratches[i] to task i's decode
+// scratch buffer, for tile_shift. The first is the options' decbuf, if
+// non-NULL and large enough. The others are allocated as one block, which the
+// caller should pass to QOIR_FREE.
+static const char*                    //
+qoir_private_make_task_scratches(     //
+    uint8_t** scratches,              //
+    uint8_t** allocated,              //
+    uint32_t num_tasks,               //
+    uint32_t tile_shift,              //
+    const qoir_decode_options* options) {
+  uint32_t num_supplied =
+      (options && qoir_private_supplied_scratch(QOIR_PRIVATE_SCRATCH__DECBUF,
+                                                tile_shift, options->decbuf,
+                                                options->decbuf_len))
+          ? 1
+          : 0;
+  size_t scratch_len =
+      qoir_private_scratch_len(QOIR_PRIVATE_SCRATCH__DECBUF, tile_shift);
+  *allocated = NULL;
+  if (num_tasks > num_supplied) {
+    *allocated =
+        (uint8_t*)QOIR_MALLOC((num_tasks - num_supplied) * scratch_len);
+    if (!*allocated) {
+      return qoir_status_message__error_out_of_memory;
+    }
+  }
+  for (uint32_t i = 0; i < num_tasks; i++) {
+    scratches[i] = (i < num_supplied)
+                       ? (uint8_t*)options->decbuf
+                       : (*allocated + ((i - num_supplied) * scratch_len));
+  }
+  return NULL;
+}
+
+// qoir_private_execute runs the num_tasks tasks, on the options' executor if
+// there is more than one.
+static void                                                      //
+qoir_private_execute(                                            //
+    const qoir_decode_options* options,                          //
+    void (*task_func)(void* task_context, uint32_t task_index),  //
+    void* task_context,                                          //
+    uint32_t num_tasks) {
+  if (num_tasks == 1) {
+    (*task_func)(task_context, 0);
+  } else {
+    (*options->executor_func)(options->executor_context, task_func,
+                              task_context, num_tasks);
+  }
+}
+
+typedef struct qoir_private_validate_context_struct {
+  const uint8_t* src_ptr;
+  const qoir_probe_result* probe;
+  const qoir_decode_options* options;
+  uint32_t tile_shift;
+  int32_t alpha_lossiness;
+  uint32_t num_tasks;
+  uint8_t* scratches[QOIR_MAX_EXECUTOR_CONCURRENCY];
+  uint8_t* lz4_histories[QOIR_MAX_EXECUTOR_CONCURRENCY];
+  const char* status_messages[QOIR_MAX_EXECUTOR_CONCURRENCY];
+} qoir_private_validate_context;
+
+// qoir_private_validate_pixels checks a pixel payload's tile rows. Every task
+// walks all of the rows (which is cheap) but only decodes every num_tasks'th
+// one, counting rows across all of the file's pixel payloads.
+static const char*                           //
+qoir_private_validate_pixels(                //
+    qoir_private_validate_context* context,  //
+    uint32_t task_index,                     //
+    uint64_t* row_index,                     //
+    uint32_t width_in_pixels,                //
+    uint32_t height_in_pixels,               //
+    uint32_t lossiness,                      //
+    int32_t alpha_lossiness,                 //
+    const uint8_t* payload_ptr,              //
+    size_t payload_len,                      //
+    bool unchanged_tiles_allowed) {
+  uint32_t tile_shift = context->tile_shift;
+  uint32_t width_in_tiles =
+      qoir_private_number_of_tiles_1d(width_in_pixels, tile_shift);
+  uint32_t height_in_tiles =
+      qoir_private_number_of_tiles_1d(height_in_pixels, tile_shift);
+  qoir_pixel_buffer no_pixbuf = {0};
+  for (uint32_t ty = 0; ty < height_in_tiles; ty++) {
+    qoir_size_result row =
+        qoir_private_tile_row_length(payload_ptr, payload_len, width_in_tiles);
+    if (row.status_message) {
+      return row.status_message;
+    } else if ((((*row_index)++) % context->num_tasks) == task_index) {
+      const char* status_message = qoir_private_decode_qpix_payload(
+          context->scratches[task_index], &context->lz4_histories[task_index],
+          no_pixbuf, qoir_make_rectangle(0, 0, 0, 0),
+          context->probe->dst_pixcfg.pixfmt, tile_shift, width_in_pixels,
+          qoir_private_tile_dimension(ty < (height_in_tiles - 1),
+                                      height_in_pixels, tile_shift),
+          payload_ptr, row.value + 8,  // See § for +8.
+          qoir_make_rectangle(0, 0, 0, 0), 0, 0, lossiness, alpha_lossiness,
+          unchanged_tiles_allowed, true, context->options);
+      if (status_message) {
+        return status_message;
+      }
+    }
+    payload_ptr += row.value;
+    payload_len -= row.value;
+  }
+  return (payload_len == 0) ? NULL : qoir_status_message__error_invalid_data;
+}
+
+// qoir_private_validate_chunks checks the pixel payloads of a file whose
+// chunk structure qoir_probe has already checked.
+static const char*                           //
+qoir_private_validate_chunks(                //
+    qoir_private_validate_context* context,  //
+    uint32_t task_index) {
+  const qoir_probe_result* probe = context->probe;
+  uint32_t width_in_pixels = probe->dst_pixcfg.width_in_pixels;
+  uint32_t height_in_pixels = probe->dst_pixcfg.height_in_pixels;
+  uint64_t row_index = 0;
+  const uint8_t* sp =
+      context->src_ptr + 12 + qoir_private_peek_u64le(context->src_ptr + 4);
+  while (1) {
+    uint32_t chunk_type = qoir_private_peek_u32le(sp + 0);
+    size_t payload_len = (size_t)qoir_private_peek_u64le(sp + 4);
+    sp += 12;
+
+    const char* status_message = NULL;
+    if (chunk_type == 0x444E4551) {  // "QEND"le.
+      return NULL;
+    } else if (chunk_type == 0x58495051) {  // "QPIX"le.
+      status_message = qoir_private_validate_pixels(
+          context, task_index, &row_index, width_in_pixels, height_in_pixels,
+          probe->lossiness, context->alpha_lossiness, sp, payload_len, false);
+    } else if (chunk_type == 0x58495066) {  // "fPIX"le.
+      status_message = qoir_private_validate_pixels(
+          context, task_index, &row_index, width_in_pixels, height_in_pixels,
+          probe->lossiness, context->alpha_lossiness, sp + 8,
+          payload_len - 8, true);
+    } else if (chunk_type == 0x5849506D) {  // "mPIX"le.
+      status_message = qoir_private_validate_pixels(
+          context, task_index, &row_index,
+          0xFFFFFF & qoir_private_peek_u32le(sp + 0),
+          0xFFFFFF & qoir_private_peek_u32le(sp + 4), probe->lossiness,
+          context->alpha_lossiness, sp + 8, payload_len - 8, false);
+    } else if (chunk_type == 0x57565250) {  // "PRVW"le.
+      status_message =
+          (payload_len < 8)
+              ? qoir_status_message__error_invalid_data
+              : qoir_private_validate_pixels(
+                    context, task_index, &row_index,
+                    0xFFFFFF & qoir_private_peek_u32le(sp + 0),
+                    0xFFFFFF & qoir_private_peek_u32le(sp + 4), 0, -1, sp + 8,
+                    payload_len - 8, false);
+    }
+    if (status_message) {
+      return status_message;
+    }
+    sp += payload_len;
+  }
+}
+
+static void                  //
+qoir_private_validate_task(  //
+    void* task_context,      //
+    uint32_t task_index) {
+  qoir_private_validate_context* context =
+      (qoir_private_validate_context*)task_context;
+  context->status_messages[task_index] =
+      qoir_private_validate_chunks(context, task_index);
+}
+
+QOIR_MAYBE_STATIC qoir_probe_result  //
+qoir_validate(                       //
+    const uint8_t* src_ptr,          //
+    size_t src_len,                  //
+    const qoir_decode_options* options) {
+  qoir_probe_result result = qoir_probe(src_ptr, src_len);
+  if (result.status_message) {
+    return result;
+  }
+
+  qoir_private_validate_context context = {0};
+  context.src_ptr = src_ptr;
+  context.probe = &result;
+  context.options = options;
+  context.tile_shift =
+      qoir_private_decode_tile_shift(qoir_private_peek_u32le(src_ptr + 12));
+  context.alpha_lossiness =
+      result.separate_alpha_lossiness ? (int32_t)result.alpha_lossiness : -1;
+  context.num_tasks = qoir_private_executor_num_tasks(options, UINT64_MAX);
+  uint8_t* allocated = NULL;
+  const char* status_message = qoir_private_make_task_scratches(
+      context.scratches, &allocated, context.num_tasks, context.tile_shift,
+      options);
+  if (status_message) {
+    return qoir_private_make_probe_result_error(status_message);
+  }
+  qoir_private_execute(options, qoir_private_validate_task, &context,
+                       context.num_tasks);
+  for (uint32_t i = 0; i < context.num_tasks; i++) {
+    QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__LZ4_HISTORY, context.tile_shift,
+                         context.lz4_histories[i]);
+  }
+  QOIR_FREE(allocated);
+
+  for (uint32_t i = 0; i < context.num_tasks; i++) {
+    if (context.status_messages[i]) {
+      return qoir_private_make_probe_result_error(context.status_messages[i]);
+    }
+  }
+  return result;
+}
+
+static int                            //
+qoir_private_compare_rectangle_tops(  //
+    const void* p,                    //
+    const void* q) {
+  const qoir_rectangle* a = (const qoir_rectangle*)p;
+  const qoir_rectangle* b = (const qoir_rectangle*)q;
+  if (a->y0 != b->y0) {
+    return (a->y0 > b->y0) - (a->y0 < b->y0);
+  }
+  return (a->x0 > b->x0) - (a->x0 < b->x0);
+}
+
+// qoir_private_rectangles_overlap returns whether any two of the n non-empty
+// rects overlap. It sorts rects (in place) by their top and then left edges
+// and sweeps down. Rectangles with the same top edge only need comparing
+// with their right neighbor. Otherwise, each rectangle is compared with those
+// starting further down but above its bottom edge, which is typically few.
+static bool                       //
+qoir_private_rectangles_overlap(  //
+    qoir_rectangle* rects,        //
+    size_t n) {
+  if (n < 2) {
+    return false;
+  }
+  qsort(rects, n, sizeof(rects[0]), &qoir_private_compare_rectangle_tops);
+  // rects[i .. run_end] (exclusive of run_end) all have the same top edge.
+  size_t run_end = 0;
+  for (size_t i = 0; i < n; i++) {
+    qoir_rectangle r = rects[i];
+    if (run_end <= i) {
+      run_end = i + 1;
+      while ((run_end < n) && (rects[run_end].y0 == r.y0)) {
+        run_end++;
+      }
+    }
+    if (((i + 1) < run_end) && (rects[i + 1].x0 < r.x1)) {
+      return true;
+    }
+    for (size_t j = run_end; (j < n) && (rects[j].y0 < r.y1); j++) {
+      if (!qoir_rectangle__is_empty(qoir_rectangle__intersect(r, rects[j]))) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+typedef struct qoir_private_atlas_context_struct {
+  const qoir_pixel_buffer* dst_pixbuf;
+  qoir_decode_atlas_item* items_ptr;
+  size_t items_len;
+  const qoir_decode_options* options;
+  uint32_t num_tasks;
+  uint8_t* scratches[QOIR_MAX_EXECUTOR_CONCURRENCY];
+} qoir_private_atlas_context;
+
+// qoir_private_atlas_task decodes every num_tasks'th item.
+static void               //
+qoir_private_atlas_task(  //
+    void* task_context,   //
+    uint32_t task_index) {
+  qoir_private_atlas_context* context =
+      (qoir_private_atlas_context*)task_context;
+  qoir_decode_options item_options = {0};
+  if (context->options) {
+    memcpy(&item_options, context->options, sizeof(item_options));
+  }
+  // Items with tiles larger than the scratch allocate their own. Only the
+  // options' decbuf (if used, as the first scratch) can be longer than
+  // sizeof(qoir_decode_buffer).
+  item_options.decbuf = (qoir_decode_buffer*)context->scratches[task_index];
+  if (!context->options ||
+      (item_options.decbuf != context->options->decbuf)) {
+    item_options.decbuf_len = 0;
+  }
+  item_options.pixbuf = *context->dst_pixbuf;
+  item_options.use_src_clip_rectangle = false;
+  item_options.use_dst_clip_rectangle = true;
+  item_options.pixbuf_holds_previous_frame = false;
+  item_options.band_func = NULL;
+
+  for (size_t i = task_index; i < context->items_len;
+       i += context->num_tasks) {
+    qoir_decode_atlas_item* item = &context->items_ptr[i];
+    item_options.dst_clip_rectangle = item->dst_rectangle;
+    item_options.offset_x = item->dst_rectangle.x0;
+    item_options.offset_y = item->dst_rectangle.y0;
+    qoir_decode_result result = qoir_private_decode_with_memory_funcs(
+        item->src_ptr, item->src_len, &item_options);
+    item->status_message = result.status_message;
+  }
+}
+
+QOIR_MAYBE_STATIC qoir_decode_atlas_result  //
+qoir_decode_atlas(                          //
+    const qoir_pixel_buffer* dst_pixbuf,    //
+    qoir_decode_atlas_item* items_ptr,      //
+    size_t items_len,                       //
+    const qoir_decode_options* options) {
+  qoir_decode_atlas_result result = {0};
+  if (!dst_pixbuf || qoir_pixel_buffer__is_zero(*dst_pixbuf)) {
+    result.status_message = qoir_status_message__error_invalid_argument;
+    return result;
+  }
+  if (items_len > (SIZE_MAX / sizeof(qoir_rectangle))) {
+    result.status_message = qoir_status_message__error_out_of_memory;
+    return result;
+  }
+  qoir_rectangle* rects =
+      (qoir_rectangle*)QOIR_MALLOC(items_len * sizeof(qoir_rectangle));
+  if (!rects && (items_len > 0)) {
+    result.status_message = qoir_status_message__error_out_of_memory;
+    return result;
+  }
+  size_t num_rects = 0;
+  for (size_t i = 0; i < items_len; i++) {
+    items_ptr[i].status_message = NULL;
+    if (!qoir_rectangle__is_empty(items_ptr[i].dst_rectangle)) {
+      rects[num_rects++] = items_ptr[i].dst_rectangle;
+    }
+  }
+  bool overlap = qoir_private_rectangles_overlap(rects, num_rects);
+  QOIR_FREE(rects);
+  if (overlap) {
+    result.status_message = qoir_status_message__error_invalid_argument;
+    return result;
+  }
+
+  qoir_private_atlas_context context = {0};
+  context.dst_pixbuf = dst_pixbuf;
+  context.items_ptr = items_ptr;
+  context.items_len = items_len;
+  context.options = options;
+  context.num_tasks = qoir_private_executor_num_tasks(options, items_len);
+  uint8_t* allocated = NULL;
+  result.status_message = qoir_private_make_task_scratches(
+      context.scratches, &allocated, context.num_tasks, QOIR_TILE_SHIFT,
+      options);
+  if (result.status_message) {
+    return result;
+  }
+  qoir_private_execute(options, qoir_private_atlas_task, &context,
+                       context.num_tasks);
+  QOIR_FREE(allocated);
+
+  for (size_t i = 0; i < items_len; i++) {
+    if (items_ptr[i].status_message) {
+      result.status_message = items_ptr[i].status_message;
+      break;
+    }
+  }
+  return result;
+}
+
+// -------- QOIR Decoder (Incremental)
+
+#define QOIR_PRIVATE_DECODER_STAGE__QOIR_CHUNK 0
+#define QOIR_PRIVATE_DECODER_STAGE__CHUNK_HEADER 1
+#define QOIR_PRIVATE_DECODER_STAGE__SKIP_PAYLOAD 2
+#define QOIR_PRIVATE_DECODER_STAGE__TILES 3
+#define QOIR_PRIVATE_DECODER_STAGE__DONE 4
+
+QOIR_MAYBE_STATIC void     //
+qoir_decoder__initialize(  //
+    qoir_decoder* self,    //
+    const qoir_decode_options* options) {
+  memset(self, 0, sizeof(*self));
+  if (options) {
+    memcpy(&self->private_impl.options, options, sizeof(*options));
+  }
+}
+
+QOIR_MAYBE_STATIC void  //
+qoir_decoder__destroy(  //
+    qoir_decoder* self) {
+  const qoir_decode_options* options = &self->private_impl.options;
+  QOIR_FREE(self->private_impl.owned_pixels);
+  QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__LZ4_HISTORY,
+                       self->private_impl.tile_shift,
+                       self->private_impl.lz4_history);
+  if (self->private_impl.owns_scratch) {
+    QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__DECBUF,
+                         self->private_impl.tile_shift,
+                         self->private_impl.scratch);
+  }
+  QOIR_FREE(self->private_impl.buf_ptr);
+  memset(self, 0, sizeof(*self));
+}
+
+// qoir_private_decoder_start_tiles sets up the destination pixel buffer and
+// the decode scratch buffer, once the QPIX chunk header has been received.
+static const char*                 //
+qoir_private_decoder_start_tiles(  //
+    qoir_decoder* self) {
+  const qoir_decode_options* options = &self->private_impl.options;
+  if ((options->pixbuf.pixcfg.width_in_pixels > 0xFFFFFF) ||
+      (options->pixbuf.pixcfg.height_in_pixels > 0xFFFFFF)) {
+    return qoir_status_message__error_unsupported_pixbuf_dimensions;
+  }
+
+  uint32_t width_in_pixels = self->private_impl.width_in_pixels;
+  uint32_t height_in_pixels = self->private_impl.height_in_pixels;
+  qoir_pixel_format dst_pixfmt =
+      !qoir_pixel_buffer__is_zero(options->pixbuf)
+          ? options->pixbuf.pixcfg.pixfmt
+          : (options->pixfmt ? options->pixfmt
+                             : QOIR_PIXEL_FORMAT__RGBA_NONPREMUL);
+  uint64_t dst_width_in_bytes =
+      width_in_pixels * qoir_pixel_format__bytes_per_pixel(dst_pixfmt);
+  uint64_t pixbuf_len = dst_width_in_bytes * (uint64_t)height_in_pixels;
+  if (pixbuf_len > SIZE_MAX) {
+    return qoir_status_message__error_unsupported_pixbuf_dimensions;
+  } else if (pixbuf_len == 0) {
+    return NULL;
+  }
+
+  if (!qoir_pixel_buffer__is_zero(options->pixbuf)) {
+    memcpy(&self->private_impl.dst_pixbuf, &options->pixbuf,
+           sizeof(options->pixbuf));
+  } else {
+    self->private_impl.owned_pixels = QOIR_MALLOC((size_t)pixbuf_len);
+    if (!self->private_impl.owned_pixels) {
+      return qoir_status_message__error_out_of_memory;
+    }
+    self->private_impl.dst_pixbuf.pixcfg.pixfmt = dst_pixfmt;
+    self->private_impl.dst_pixbuf.pixcfg.width_in_pixels = width_in_pixels;
+    self->private_impl.dst_pixbuf.pixcfg.height_in_pixels = height_in_pixels;
+    self->private_impl.dst_pixbuf.data =
+        (uint8_t*)self->private_impl.owned_pixels;
+    self->private_impl.dst_pixbuf.stride_in_bytes = dst_width_in_bytes;
+  }
+
+  uint32_t tile_shift = self->private_impl.tile_shift;
+  self->private_impl.scratch = qoir_private_supplied_scratch(
+      QOIR_PRIVATE_SCRATCH__DECBUF, tile_shift, options->decbuf,
+      options->decbuf_len);
+  if (!self->private_impl.scratch) {
+    self->private_impl.scratch =
+        QOIR_ACQUIRE_SCRATCH(QOIR_PRIVATE_SCRATCH__DECBUF, tile_shift);
+    if (!self->private_impl.scratch) {
+      return qoir_status_message__error_out_of_memory;
+    }
+    self->private_impl.owns_scratch = true;
+  }
+  return NULL;
+}
+
+// qoir_private_decoder_decode_tiles decodes the next run of tiles in the
+// current tile row, if all of its bytes are available: the rest of the row or,
+// if sooner, up to the next tile that is not LZ4-chained to its predecessor.
+// Per §, that decode also needs 8 more bytes (the next tile's prefix or the
+// next chunk's header). It sets *num_consumed to zero if it needs more input.
+static const char*                  //
+qoir_private_decoder_decode_tiles(  //
+    qoir_decoder* self,             //
+    const uint8_t* src_ptr,         //
+    size_t src_len,                 //
+    size_t* num_consumed) {
+  *num_consumed = 0;
+  uint32_t tile_shift = self->private_impl.tile_shift;
+  uint32_t width_in_pixels = self->private_impl.width_in_pixels;
+  uint32_t height_in_pixels = self->private_impl.height_in_pixels;
+  uint32_t width_in_tiles =
+      qoir_private_number_of_tiles_1d(width_in_pixels, tile_shift);
+  uint32_t height_in_tiles =
+      qoir_private_number_of_tiles_1d(height_in_pixels, tile_shift);
+  uint32_t tx = self->private_impl.tx;
+  uint32_t ty = self->private_impl.ty;
+
+  size_t run_len = 0;
+  uint32_t run_end = tx;
+  while (true) {
+    if ((src_len - run_len) < 4) {
+      return NULL;
+    }
+    uint32_t prefix = qoir_private_peek_u32le(src_ptr + run_len);
+    size_t tile_len = 4 + (prefix & 0xFFFFFF);
+    if ((run_len + tile_len) > self->private_impl.chunk_remaining) {
+      return qoir_status_message__error_invalid_data;
+    } else if ((src_len - run_len) < tile_len) {
+      return NULL;
+    }
+    run_len += tile_len;
+    run_end++;
+    if (run_end == width_in_tiles) {
+      break;
+    } else if ((src_len - run_len) < 4) {
+      return NULL;
+    } else if ((0x8F & (qoir_private_peek_u32le(src_ptr + run_len) >> 24)) !=
+               5) {  // LZ4-Chained-Ops tile format.
+      break;
+    }
+  }
+  if ((src_len - run_len) < 8) {
+    return NULL;
+  }
+
+  uint32_t x0 = tx << tile_shift;
+  uint32_t y0 = ty << tile_shift;
+  uint32_t run_width_in_pixels = (run_end == width_in_tiles)
+                                     ? (width_in_pixels - x0)
+                                     : ((run_end - tx) << tile_shift);
+  uint32_t run_height_in_pixels = qoir_private_tile_dimension(
+      ty < (height_in_tiles - 1), height_in_pixels, tile_shift);
+  // The offset places the run, decoded as if it was a small image of its own,
+  // at its position in the destination pixel buffer, which also clips it.
+  const char* status_message = qoir_private_decode_qpix_payload(
+      self->private_impl.scratch, &self->private_impl.lz4_history,
+      self->private_impl.dst_pixbuf,
+      qoir_make_rectangle(0, 0, 0xFFFFFF, 0xFFFFFF),
+      self->private_impl.src_pixfmt, tile_shift, run_width_in_pixels,
+      run_height_in_pixels, src_ptr, run_len + 8,
+      qoir_make_rectangle(0, 0, 0xFFFFFF, 0xFFFFFF), (int32_t)x0, (int32_t)y0,
+      self->private_impl.lossiness, self->private_impl.alpha_lossiness, false,
+      false, &self->private_impl.options);
+  if (status_message) {
+    return status_message;
+  }
+
+  self->private_impl.chunk_remaining -= run_len;
+  self->private_impl.num_decoded_tiles += run_end - tx;
+  if (run_end == width_in_tiles) {
+    self->private_impl.tx = 0;
+    self->private_impl.ty = ty + 1;
+  } else {
+    self->private_impl.tx = run_end;
+  }
+  *num_consumed = run_len;
+  return NULL;
+}
+
+// qoir_private_decoder_consume advances the decoder's state machine as far as
+// the src_ptr and src_len input allows, setting *num_consumed to how many
+// bytes of that input are no longer needed.
+static const char*             //
+qoir_private_decoder_consume(  //
+    qoir_decoder* self,        //
+    const uint8_t* src_ptr,    //
+    size_t src_len,            //
+    size_t* num_consumed) {
+  size_t pos = 0;
+  const char* status_message = NULL;
+  while (pos < src_len) {
+    const uint8_t* sp = src_ptr + pos;
+    size_t sn = src_len - pos;
+    switch (self->private_impl.stage) {
+      case QOIR_PRIVATE_DECODER_STAGE__QOIR_CHUNK: {
+        if (sn < 20) {
+          goto done;
+        } else if (qoir_private_peek_u32le(sp) != 0x52494F51) {  // "QOIR"le.
+          status_message = qoir_status_message__error_invalid_data;
+          goto done;
+        }
+        uint64_t qoir_chunk_payload_len = qoir_private_peek_u64le(sp + 4);
+        if ((qoir_chunk_payload_len < 8) ||
+            (qoir_chunk_payload_len > 0x7FFFFFFFFFFFFFFFull)) {
+          status_message = qoir_status_message__error_invalid_data;
+          goto done;
+        }
+        uint32_t header0 = qoir_private_peek_u32le(sp + 12);
+        qoir_pixel_format src_pixfmt = 0x0F & (header0 >> 24);
+        switch (src_pixfmt) {
+          case QOIR_PIXEL_FORMAT__BGRX:
+          case QOIR_PIXEL_FORMAT__BGRA_NONPREMUL:
+          case QOIR_PIXEL_FORMAT__BGRA_PREMUL:
+            break;
+          default:
+            status_message = qoir_status_message__error_invalid_data;
+            goto done;
+        }
+        uint32_t tile_shift = qoir_private_decode_tile_shift(header0);
+        if (tile_shift == 0) {
+          status_message = qoir_status_message__error_unsupported_tile_size;
+          goto done;
+        }
+        uint32_t header1 = qoir_private_peek_u32le(sp + 16);
+        int32_t alpha_lossiness = -1;
+        if (header1 & 0x08000000) {
+          if (src_pixfmt != QOIR_PIXEL_FORMAT__BGRA_NONPREMUL) {
+            status_message = qoir_status_message__error_invalid_data;
+            goto done;
+          }
+          alpha_lossiness = 0x07 & (header1 >> 28);
+        }
+        self->private_impl.src_pixfmt = src_pixfmt;
+        self->private_impl.tile_shift = tile_shift;
+        self->private_impl.width_in_pixels = 0xFFFFFF & header0;
+        self->private_impl.height_in_pixels = 0xFFFFFF & header1;
+        self->private_impl.lossiness = 0x07 & (header1 >> 24);
+        self->private_impl.alpha_lossiness = alpha_lossiness;
+        self->private_impl.chunk_remaining = qoir_chunk_payload_len - 8;
+        self->private_impl.stage = QOIR_PRIVATE_DECODER_STAGE__SKIP_PAYLOAD;
+        pos += 20;
+        break;
+      }
+
+      case QOIR_PRIVATE_DECODER_STAGE__CHUNK_HEADER: {
+        if (sn < 12) {
+          goto done;
+        }
+        uint32_t chunk_type = qoir_private_peek_u32le(sp + 0);
+        uint64_t payload_len = qoir_private_peek_u64le(sp + 4);
+        if ((payload_len > 0x7FFFFFFFFFFFFFFFull) ||
+            (chunk_type == 0x52494F51)) {  // "QOIR"le.
+          status_message = qoir_status_message__error_invalid_data;
+          goto done;
+        } else if (chunk_type == 0x444E4551) {  // "QEND"le.
+          if ((payload_len != 0) || !self->private_impl.seen_qpix) {
+            status_message = qoir_status_message__error_invalid_data;
+            goto done;
+          }
+          self->private_impl.stage = QOIR_PRIVATE_DECODER_STAGE__DONE;
+        } else if (chunk_type == 0x58495051) {  // "QPIX"le.
+          if (self->private_impl.seen_qpix) {
+            status_message = qoir_status_message__error_invalid_data;
+            goto done;
+          }
+          self->private_impl.seen_qpix = true;
+          status_message = qoir_private_decoder_start_tiles(self);
+          if (status_message) {
+            goto done;
+          }
+          self->private_impl.stage = QOIR_PRIVATE_DECODER_STAGE__TILES;
+        } else if ((chunk_type == 0x58495066) &&  // "fPIX"le.
+                   !self->private_impl.seen_qpix) {
+          status_message = qoir_status_message__error_invalid_data;
+          goto done;
+        } else {
+          self->private_impl.stage = QOIR_PRIVATE_DECODER_STAGE__SKIP_PAYLOAD;
+        }
+        self->private_impl.chunk_remaining = payload_len;
+        pos += 12;
+        break;
+      }
+
+      case QOIR_PRIVATE_DECODER_STAGE__SKIP_PAYLOAD: {
+        if (sn > self->private_impl.chunk_remaining) {
+          sn = (size_t)self->private_impl.chunk_remaining;
+        }
+        self->private_impl.chunk_remaining -= sn;
+        pos += sn;
+        if (self->private_impl.chunk_remaining == 0) {
+          self->private_impl.stage = QOIR_PRIVATE_DECODER_STAGE__CHUNK_HEADER;
+        }
+        break;
+      }
+
+      case QOIR_PRIVATE_DECODER_STAGE__TILES: {
+        uint32_t height_in_tiles = qoir_private_number_of_tiles_1d(
+            self->private_impl.height_in_pixels, self->private_impl.tile_shift);
+        if ((self->private_impl.ty >= height_in_tiles) ||
+            (self->private_impl.width_in_pixels == 0)) {
+          if (self->private_impl.chunk_remaining != 0) {
+            status_message = qoir_status_message__error_invalid_data;
+            goto done;
+          }
+          self->private_impl.stage = QOIR_PRIVATE_DECODER_STAGE__CHUNK_HEADER;
+          break;
+        }
+        size_t n = 0;
+        status_message = qoir_private_decoder_decode_tiles(self, sp, sn, &n);
+        if (status_message || (n == 0)) {
+          goto done;
+        }
+        pos += n;
+        break;
+      }
+
+      default:
+        // Nothing may follow the QEND chunk.
+        status_message = qoir_status_message__error_invalid_data;
+        goto done;
+    }
+  }
+
+done:
+  *num_consumed = pos;
+  return status_message;
+}
+
+static qoir_decoder_feed_result         //
+qoir_private_make_decoder_feed_result(  //
+    qoir_decoder* self) {
+  qoir_decoder_feed_result result = {0};
+  result.status_message = self->private_impl.status_message;
+  if (result.status_message) {
+    return result;
+  }
+  result.dst_pixbuf = self->private_impl.dst_pixbuf;
+  uint64_t h = (uint64_t)self->private_impl.ty << self->private_impl.tile_shift;
+  result.decoded_height_in_pixels =
+      (h < self->private_impl.height_in_pixels)
+          ? (uint32_t)h
+          : self->private_impl.height_in_pixels;
+  result.num_decoded_tiles = self->private_impl.num_decoded_tiles;
+  result.done = self->private_impl.stage == QOIR_PRIVATE_DECODER_STAGE__DONE;
+  return result;
+}
+
+QOIR_MAYBE_STATIC qoir_decoder_feed_result  //
+qoir_decoder__feed(                         //
+    qoir_decoder* self,                     //
+    const uint8_t* src_ptr,                 //
+    size_t src_len) {
+  const qoir_decode_options* options = &self->private_impl.options;
+  if (self->private_impl.status_message) {
+    return qoir_private_make_decoder_feed_result(self);
+  } else if (self->private_impl.stage == QOIR_PRIVATE_DECODER_STAGE__DONE) {
+    if (src_len > 0) {
+      self->private_impl.status_message =
+          qoir_status_message__error_invalid_data;
+    }
+    return qoir_private_make_decoder_feed_result(self);
+  }
+
+  // Consume directly from src_ptr when no earlier input is pending. Otherwise,
+  // append to that pending input first.
+  const uint8_t* p = src_ptr;
+  size_t n = src_len;
+  if (self->private_impl.buf_len > 0) {
+    size_t buf_len = self->private_impl.buf_len;
+    if (src_len > (SIZE_MAX - buf_len)) {
+      self->private_impl.status_message =
+          qoir_status_message__error_out_of_memory;
+      return qoir_private_make_decoder_feed_result(self);
+    } else if ((buf_len + src_len) > self->private_impl.buf_cap) {
+      size_t new_cap = 2 * self->private_impl.buf_cap;
+      if (new_cap < (buf_len + src_len)) {
+        new_cap = buf_len + src_len;
+      }
+      uint8_t* new_ptr = (uint8_t*)QOIR_MALLOC(new_cap);
+      if (!new_ptr) {
+        self->private_impl.status_message =
+            qoir_status_message__error_out_of_memory;
+        return qoir_private_make_decoder_feed_result(self);
+      }
+      memcpy(new_ptr, self->private_impl.buf_ptr, buf_len);
+      QOIR_FREE(self->private_impl.buf_ptr);
+      self->private_impl.buf_ptr = new_ptr;
+      self->private_impl.buf_cap = new_cap;
+    }
+    if (src_len > 0) {
+      memcpy(self->private_impl.buf_ptr + buf_len, src_ptr, src_len);
+    }
+    p = self->private_impl.buf_ptr;
+    n = buf_len + src_len;
+  }
+
+  size_t num_consumed = 0;
+  self->private_impl.status_message =
+      qoir_private_decoder_consume(self, p, n, &num_consumed);
+  if (self->private_impl.status_message) {
+    return qoir_private_make_decoder_feed_result(self);
+  }
+
+  // Keep the unconsumed input for the next call.
+  size_t remaining = n - num_consumed;
+  if (remaining > self->private_impl.buf_cap) {
+    uint8_t* new_ptr = (uint8_t*)QOIR_MALLOC(remaining);
+    if (!new_ptr) {
+      self->private_impl.status_message =
+          qoir_status_message__error_out_of_memory;
+      return qoir_private_make_decoder_feed_result(self);
+    }
+    QOIR_FREE(self->private_impl.buf_ptr);
+    self->private_impl.buf_ptr = new_ptr;
+    self->private_impl.buf_cap = remaining;
+  }
+  if (remaining > 0) {
+    memmove(self->private_impl.buf_ptr, p + num_consumed, remaining);
+  }
+  self->private_impl.buf_len = remaining;
+  return qoir_private_make_decoder_feed_result(self);
+}
+
+// -------- QOIR Encode
+
+#define QOIR_HASH_TABLE_SHIFT 10
+
+static QOIR_ALWAYS_INLINE void  //
+qoir_private_encode_dither(     //
+    uint8_t* ptr,               //
+    uint32_t lossiness,         //
+    uint32_t noise) {
+  if (*ptr >= 0xFF) {
+    *ptr = 0xFF >> lossiness;
+    return;
+  }
+
+  // Find the lower (inclusive) and upper (exclusive) quantized values that
+  // bracket the pixel value.
+  uint8_t low_shifted = 0;
+  uint8_t shifted = *ptr >> lossiness;
+  if (shifted > 0) {
+    low_shifted = shifted - 1;
+  }
+  uint8_t* unshift = qoir_private_table_unlossify[lossiness - 1];
+  uint8_t lower = unshift[low_shifted + 0];
+  uint8_t upper = unshift[low_shifted + 1];
+  if (*ptr >= upper) {
+    lower = unshift[low_shifted + 1];
+    upper = unshift[low_shifted + 2];
+  }
+
+  // Compare the pixel's position in that bracket to the noise.
+  uint32_t p = *ptr;
+  uint32_t l = lower;
+  uint32_t u = upper;
+  uint32_t m = ((256 * (p - l)) > (noise * (u - l))) ? u : l;
+  *ptr = (uint8_t)(m >> lossiness);
+}
+
+static QOIR_ALWAYS_INLINE int32_t  //
+qoir_private_clamp_i32(           //
+    int32_t x,                    //
+    int32_t lo,                   //
+    int32_t hi) {
+  return (x < lo) ? lo : (x > hi) ? hi : x;
+}
+
+// qoir_private_find_near_color returns the offset of the color_cache entry
+// closest to the pixel at sp, with the same alpha and with B, G and R values
+// within the tolerance, or -1 if there is none. Only entries that
+// color_indexes (keyed by the entry's hash) still points to are considered,
+// as only they can be encoded as a QOIR_OP_INDEX.
+static int32_t                     //
+qoir_private_find_near_color(      //
+    const uint8_t* color_cache,    //
+    const uint8_t* color_indexes,  //
+    const uint8_t* sp,             //
+    int32_t tolerance) {
+  // candidates has one bit per color_cache entry.
+  uint64_t candidates = 0;
+#if defined(QOIR_USE_SIMD_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i pixel = _mm_set1_epi32((int)qoir_private_peek_u32le(sp));
+  // The slack is zero for alpha, which must match exactly.
+  const __m128i slack =
+      _mm_set1_epi32((int)(0x010101u * (uint32_t)tolerance));
+  for (int i = 0; i < 16; i++) {
+    __m128i c = _mm_loadu_si128(
+        (const __m128i*)(const void*)(color_cache + (16 * i)));
+    __m128i d =
+        _mm_or_si128(_mm_subs_epu8(c, pixel), _mm_subs_epu8(pixel, c));
+    __m128i m = _mm_cmpeq_epi32(_mm_subs_epu8(d, slack), zero);
+    candidates |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(m)) << (4 * i);
+  }
+#else
+  for (int i = 0; i < 64; i++) {
+    const uint8_t* c = color_cache + (4 * i);
+    if ((c[3] == sp[3]) && (abs(c[0] - sp[0]) <= tolerance) &&
+        (abs(c[1] - sp[1]) <= tolerance) && (abs(c[2] - sp[2]) <= tolerance)) {
+      candidates |= (uint64_t)1 << i;
+    }
+  }
+#endif
+
+  int32_t best_offset = -1;
+  int32_t best_error = INT32_MAX;
+  for (int32_t offset = 0; candidates; offset += 4, candidates >>= 1) {
+    if (!(candidates & 1)) {
+      continue;
+    }
+    const uint8_t* c = color_cache + offset;
+    // 2654435761u is Knuth's magic constant.
+    uint32_t hash = (qoir_private_peek_u32le(c) * 2654435761u) >>
+                    (32 - QOIR_HASH_TABLE_SHIFT);
+    int32_t error = abs(c[0] - sp[0]) + abs(c[1] - sp[1]) + abs(c[2] - sp[2]);
+    if ((color_indexes[hash] == offset) && (best_error > error)) {
+      best_offset = offset;
+      best_error = error;
+    }
+  }
+  return best_offset;
+}
+
+// qoir_private_encode_near_lossless replaces, in place, each of the n BGRA
+// pixels (after the QOIR_LITERALS_PRE_PADDING at ptr) with one whose B, G and
+// R values are within the tolerance, where that lets the original op set use
+// a cheaper op: a run, a color cache index or a shorter delta. Alpha values
+// are unchanged and B, G and R values never exceed max_value (nor, if
+// premul, the alpha).
+//
+// The error does not accumulate, as each replacement is measured against the
+// original pixel. It simulates qoir_private_encode_tile_ops' color cache, so
+// that every later encoding (of the replaced pixels) is lossless.
+static void                         //
+qoir_private_encode_near_lossless(  //
+    uint8_t* ptr,                   //
+    size_t n,                       //
+    int32_t tolerance,              //
+    int32_t max_value,              //
+    bool premul) {
+  uint8_t color_cache[256];
+  for (int i = 0; i < 256; i += 4) {
+    color_cache[i + 0] = 0x00;
+    color_cache[i + 1] = 0x00;
+    color_cache[i + 2] = 0x00;
+    color_cache[i + 3] = 0xFF;
+  }
+  uint8_t next_color_index = 0;
+  uint8_t color_indexes[1 << QOIR_HASH_TABLE_SHIFT] = {0};
+
+  int32_t k = tolerance;
+  uint8_t* sp = ptr + QOIR_LITERALS_PRE_PADDING;
+  uint8_t* sq = sp + (4 * n);
+  for (; sp < sq; sp += 4) {
+    int32_t d0 = (int32_t)sp[0] - (int32_t)sp[-4];
+    int32_t d1 = (int32_t)sp[1] - (int32_t)sp[-3];
+    int32_t d2 = (int32_t)sp[2] - (int32_t)sp[-2];
+    bool same_alpha = sp[3] == sp[-1];
+    if (same_alpha && (abs(d0) <= k) && (abs(d1) <= k) && (abs(d2) <= k)) {
+      // Use a run: repeat the previous pixel.
+      memcpy(sp, sp - 4, 4);
+      continue;
+    }
+
+    // 2654435761u is Knuth's magic constant.
+    uint32_t hash = (qoir_private_peek_u32le(sp) * 2654435761u) >>
+                    (32 - QOIR_HASH_TABLE_SHIFT);
+    if (!memcmp(color_cache + color_indexes[hash], sp, 4)) {
+      continue;
+    }
 
-#define QOIR_HASH_TABLE_SHIFT 10
+    // Clamping a delta to the QOIR_OP_BGR2 range moves it towards zero: the
+    // replacement lies between the original and previous pixels, so it is
+    // within range. A 1 byte QOIR_OP_BGR2 that needs no replacement is as
+    // cheap as a QOIR_OP_INDEX and has no error.
+    int32_t t0 = qoir_private_clamp_i32(d0, -2, 1);
+    int32_t t1 = qoir_private_clamp_i32(d1, -2, 1);
+    int32_t t2 = qoir_private_clamp_i32(d2, -2, 1);
+    if (!same_alpha || (t0 != d0) || (t1 != d1) || (t2 != d2)) {
+      int32_t offset =
+          qoir_private_find_near_color(color_cache, color_indexes, sp, k);
+      if (offset >= 0) {
+        memcpy(sp, color_cache + offset, 4);
+        continue;
+      }
+    }
 
-static QOIR_ALWAYS_INLINE void  //
-qoir_private_encode_dither(     //
-    uint8_t* ptr,               //
-    uint32_t lossiness,         //
-    uint32_t noise) {
-  if (*ptr >= 0xFF) {
-    *ptr = 0xFF >> lossiness;
-    return;
-  }
+    if (same_alpha) {
+      // Try the QOIR_OP_BGR2, QOIR_OP_LUMA and QOIR_OP_BGR7 delta ranges, in
+      // order.
+      if ((abs(t0 - d0) > k) || (abs(t1 - d1) > k) || (abs(t2 - d2) > k)) {
+        // QOIR_OP_LUMA codes the G delta and the B and R deltas relative to
+        // it. Pick the G delta (closest to the original) that keeps all
+        // three within tolerance. This replacement can leave the range.
+        int32_t lo = d1 - k;
+        lo = (lo > -32) ? lo : -32;
+        lo = (lo > (d0 - 7 - k)) ? lo : (d0 - 7 - k);
+        lo = (lo > (d2 - 7 - k)) ? lo : (d2 - 7 - k);
+        int32_t hi = d1 + k;
+        hi = (hi < 31) ? hi : 31;
+        hi = (hi < (d0 + 8 + k)) ? hi : (d0 + 8 + k);
+        hi = (hi < (d2 + 8 + k)) ? hi : (d2 + 8 + k);
+        t1 = qoir_private_clamp_i32(d1, lo, hi);
+        t0 = t1 + qoir_private_clamp_i32(d0 - t1, -8, 7);
+        t2 = t1 + qoir_private_clamp_i32(d2 - t1, -8, 7);
+        int32_t v0 = sp[-4] + t0;
+        int32_t v1 = sp[-3] + t1;
+        int32_t v2 = sp[-2] + t2;
+        int32_t vmax = (premul && (sp[3] < max_value)) ? sp[3] : max_value;
+        if ((lo > hi) || ((v0 | v1 | v2) < 0) ||  //
+            (v0 > vmax) || (v1 > vmax) || (v2 > vmax)) {
+          t0 = qoir_private_clamp_i32(d0, -64, 63);
+          t1 = qoir_private_clamp_i32(d1, -64, 63);
+          t2 = qoir_private_clamp_i32(d2, -64, 63);
+          if ((abs(t0 - d0) > k) || (abs(t1 - d1) > k) ||
+              (abs(t2 - d2) > k)) {
+            t0 = d0;
+            t1 = d1;
+            t2 = d2;
+          }
+        }
+      }
+      sp[0] = (uint8_t)(sp[-4] + t0);
+      sp[1] = (uint8_t)(sp[-3] + t1);
+      sp[2] = (uint8_t)(sp[-2] + t2);
+
+      hash = (qoir_private_peek_u32le(sp) * 2654435761u) >>
+             (32 - QOIR_HASH_TABLE_SHIFT);
+      if (!memcmp(color_cache + color_indexes[hash], sp, 4)) {
+        continue;
+      }
+    }
 
-  // Find the lower (inclusive) and upper (exclusive) quantized values that
-  // bracket the pixel value.
-  uint8_t low_shifted = 0;
-  uint8_t shifted = *ptr >> lossiness;
-  if (shifted > 0) {
-    low_shifted = shifted - 1;
-  }
-  uint8_t* unshift = qoir_private_table_unlossify[lossiness - 1];
-  uint8_t lower = unshift[low_shifted + 0];
-  uint8_t upper = unshift[low_shifted + 1];
-  if (*ptr >= upper) {
-    lower = unshift[low_shifted + 1];
-    upper = unshift[low_shifted + 2];
+    color_indexes[hash] = next_color_index;
+    memcpy(color_cache + next_color_index, sp, 4);
+    next_color_index += 4;
   }
+}
 
-  // Compare the pixel's position in that bracket to the noise.
-  uint32_t p = *ptr;
-  uint32_t l = lower;
-  uint32_t u = upper;
-  uint32_t m = ((256 * (p - l)) > (noise * (u - l))) ? u : l;
-  *ptr = (uint8_t)(m >> lossiness);
+// qoir_private_encode_run writes a QOIR_OP_RUNS, QOIR_OP_RUNL or (for Ops2)
+// QOIR_OP_RUNV op. For the original op set, run_length must be at most 256.
+static QOIR_ALWAYS_INLINE uint8_t*  //
+qoir_private_encode_run(            //
+    uint8_t* dp,                    //
+    uint32_t run_length,            //
+    bool ops2) {
+  if (run_length <= (ops2 ? 25u : 26u)) {
+    *dp++ = (uint8_t)(0x07 | ((run_length - 1) << 0x03));  // QOIR_OP_RUNS
+  } else if (!ops2) {
+    *dp++ = 0xD7;  // QOIR_OP_RUNL
+    *dp++ = (uint8_t)(run_length - 1);
+  } else {
+    *dp++ = 0xD7;  // QOIR_OP_RUNV
+    uint32_t n = run_length - 1;
+    while (n >= 0x80) {
+      *dp++ = (uint8_t)(0x80 | n);
+      n >>= 7;
+    }
+    *dp++ = (uint8_t)n;
+  }
+  return dp;
 }
 
 static QOIR_ALWAYS_INLINE qoir_size_result  //
@@ -6420,7 +10587,8 @@ qoir_private_encode_tile_ops(               //
     const uint8_t* src_ptr,                 //
     uint32_t tw,                            //
     uint32_t th,                            //
-    bool has_alpha) {
+    bool has_alpha,                         //
+    bool ops2) {
   // dists holds the log2 distance from zero (with modular arithmetic).
   //  - There is    1 element  such that (dists[i] <   1).
   //  - There are   2 elements such that (dists[i] <   2).
@@ -6482,6 +10650,15 @@ qoir_private_encode_tile_ops(               //
   }
   uint8_t next_color_index = 0;
   uint8_t color_indexes[1 << QOIR_HASH_TABLE_SHIFT] = {0};
+  uint8_t color_cache2[1024];
+  if (ops2) {
+    for (int i = 0; i < 1024; i += 4) {
+      color_cache2[i + 0] = 0x00;
+      color_cache2[i + 1] = 0x00;
+      color_cache2[i + 2] = 0x00;
+      color_cache2[i + 3] = 0xFF;
+    }
+  }
 
   uint8_t* dp = dst_ptr;
   const uint8_t* sp = src_ptr + QOIR_LITERALS_PRE_PADDING;
@@ -6490,7 +10667,7 @@ qoir_private_encode_tile_ops(               //
   for (; sp < sq; sp += 4) {
     if (!memcmp(sp, sp - 4, 4)) {
       run_length++;
-      if (run_length == 256) {
+      if (!ops2 && (run_length == 256)) {
         *dp++ = 0xD7;  // QOIR_OP_RUNL
         *dp++ = 0xFF;
         run_length = 0;
@@ -6499,14 +10676,8 @@ qoir_private_encode_tile_ops(               //
     }
 
     if (run_length > 0) {
-      if (run_length <= 26) {
-        *dp++ = (uint8_t)(0x07 | ((run_length - 1) << 0x03));  // QOIR_OP_RUNS
-        run_length = 0;
-      } else {
-        *dp++ = 0xD7;  // QOIR_OP_RUNL
-        *dp++ = (uint8_t)(run_length - 1);
-        run_length = 0;
-      }
+      dp = qoir_private_encode_run(dp, run_length, ops2);
+      run_length = 0;
     }
 
     // 2654435761u is Knuth's magic constant.
@@ -6522,6 +10693,23 @@ qoir_private_encode_tile_ops(               //
     memcpy(color_cache + next_color_index, sp, 4);
     next_color_index += 4;
 
+    if (ops2) {
+      uint32_t offset2 = qoir_private_color_cache2_offset(sp);
+      if (!memcmp(color_cache2 + offset2, sp, 4)) {
+        // Prefer a 1 byte QOIR_OP_BGR2 (below) to a 2 byte QOIR_OP_INDEX2.
+        uint8_t d0 = sp[0] - sp[-4] + 2;
+        uint8_t d1 = sp[1] - sp[-3] + 2;
+        uint8_t d2 = sp[2] - sp[-2] + 2;
+        if ((sp[3] != sp[-1]) || ((d0 | d1 | d2) >= 4)) {
+          *dp++ = 0xCF;  // QOIR_OP_INDEX2
+          *dp++ = (uint8_t)(offset2 >> 2);
+          continue;
+        }
+      } else {
+        memcpy(color_cache2 + offset2, sp, 4);
+      }
+    }
+
     uint8_t delta[4];
     uint32_t cp8x4;  // Current pixel.
     uint32_t pl8x4;  // Pixel left.
@@ -6604,14 +10792,7 @@ qoir_private_encode_tile_ops(               //
   }
 
   if (run_length > 0) {
-    if (run_length <= 26) {
-      *dp++ = (uint8_t)(0x07 | ((run_length - 1) << 0x03));  // QOIR_OP_RUNS
-      run_length = 0;
-    } else {
-      *dp++ = 0xD7;  // QOIR_OP_RUNL
-      *dp++ = (uint8_t)(run_length - 1);
-      run_length = 0;
-    }
+    dp = qoir_private_encode_run(dp, run_length, ops2);
   }
 
   result.value = (size_t)(dp - dst_ptr);
@@ -6624,7 +10805,7 @@ qoir_private_encode_tile_ops_sans_alpha(  //
     const uint8_t* src_ptr,               //
     uint32_t tw,                          //
     uint32_t th) {
-  return qoir_private_encode_tile_ops(dst_ptr, src_ptr, tw, th, false);
+  return qoir_private_encode_tile_ops(dst_ptr, src_ptr, tw, th, false, false);
 }
 
 static qoir_size_result                   //
@@ -6633,66 +10814,393 @@ qoir_private_encode_tile_ops_with_alpha(  //
     const uint8_t* src_ptr,               //
     uint32_t tw,                          //
     uint32_t th) {
-  return qoir_private_encode_tile_ops(dst_ptr, src_ptr, tw, th, true);
+  return qoir_private_encode_tile_ops(dst_ptr, src_ptr, tw, th, true, false);
+}
+
+static qoir_size_result                    //
+qoir_private_encode_tile_ops2_sans_alpha(  //
+    uint8_t* dst_ptr,                      //
+    const uint8_t* src_ptr,                //
+    uint32_t tw,                           //
+    uint32_t th) {
+  return qoir_private_encode_tile_ops(dst_ptr, src_ptr, tw, th, false, true);
+}
+
+static qoir_size_result                    //
+qoir_private_encode_tile_ops2_with_alpha(  //
+    uint8_t* dst_ptr,                      //
+    const uint8_t* src_ptr,                //
+    uint32_t tw,                           //
+    uint32_t th) {
+  return qoir_private_encode_tile_ops(dst_ptr, src_ptr, tw, th, true, true);
+}
+
+static qoir_private_swizzle_func          //
+qoir_private_choose_encode_swizzle_func(  //
+    qoir_pixel_format src_pixfmt) {
+  switch (src_pixfmt) {
+    case QOIR_PIXEL_FORMAT__BGRX:
+    case QOIR_PIXEL_FORMAT__BGRA_NONPREMUL:
+    case QOIR_PIXEL_FORMAT__BGRA_PREMUL:
+      return qoir_private_swizzle__copy_4;
+    case QOIR_PIXEL_FORMAT__BGR:
+      return qoir_private_swizzle__bgra__bgr;
+    case QOIR_PIXEL_FORMAT__RGBX:
+    case QOIR_PIXEL_FORMAT__RGBA_NONPREMUL:
+    case QOIR_PIXEL_FORMAT__RGBA_PREMUL:
+      return qoir_private_swizzle__bgra__rgba;
+    case QOIR_PIXEL_FORMAT__RGB:
+      return qoir_private_swizzle__bgra__rgb;
+  }
+  return NULL;
+}
+
+// qoir_private_encode_tile_average writes the average of a tile's n BGRX or
+// BGRA pixels to dst_ptr. For nonpremultiplied alpha, the color channels are
+// weighted by alpha, so that transparent pixels do not bleed color.
+static void                        //
+qoir_private_encode_tile_average(  //
+    uint8_t* dst_ptr,              //
+    const uint8_t* src_ptr,        //
+    size_t n,                      //
+    bool nonpremul) {
+  uint64_t sum[4] = {0};
+  uint64_t weighted[3] = {0};
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t* p = src_ptr + (4 * i);
+    sum[0] += p[0];
+    sum[1] += p[1];
+    sum[2] += p[2];
+    sum[3] += p[3];
+    weighted[0] += (uint64_t)p[0] * (uint64_t)p[3];
+    weighted[1] += (uint64_t)p[1] * (uint64_t)p[3];
+    weighted[2] += (uint64_t)p[2] * (uint64_t)p[3];
+  }
+  if (nonpremul && (sum[3] > 0)) {
+    dst_ptr[0] = (uint8_t)((weighted[0] + (sum[3] / 2)) / sum[3]);
+    dst_ptr[1] = (uint8_t)((weighted[1] + (sum[3] / 2)) / sum[3]);
+    dst_ptr[2] = (uint8_t)((weighted[2] + (sum[3] / 2)) / sum[3]);
+  } else {
+    dst_ptr[0] = (uint8_t)((sum[0] + (n / 2)) / n);
+    dst_ptr[1] = (uint8_t)((sum[1] + (n / 2)) / n);
+    dst_ptr[2] = (uint8_t)((sum[2] + (n / 2)) / n);
+  }
+  dst_ptr[3] = (uint8_t)((sum[3] + (n / 2)) / n);
+}
+
+// qoir_private_encode_tile_gray returns zero if any of the n BGRA pixels at
+// src_ptr have differing B, G and R values. Otherwise, it writes (for the
+// LZ4-Gray tile format) the n gray values, each minus the previous one, to
+// dst_ptr and returns n. If any alpha value is not 0xFF, it also writes (for
+// the LZ4-Gray-Alpha tile format) the n similarly delta-coded alpha values
+// and returns (2 * n).
+static size_t                   //
+qoir_private_encode_tile_gray(  //
+    uint8_t* dst_ptr,           //
+    const uint8_t* src_ptr,     //
+    size_t n) {
+  uint8_t alpha_and = 0xFF;
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t* p = src_ptr + (4 * i);
+    if ((p[0] != p[1]) || (p[1] != p[2])) {
+      return 0;
+    }
+    alpha_and &= p[3];
+  }
+
+  uint8_t gray = 0x00;
+  uint8_t alpha = 0xFF;
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t* p = src_ptr + (4 * i);
+    dst_ptr[i] = p[0] - gray;
+    gray = p[0];
+    if (alpha_and != 0xFF) {
+      dst_ptr[n + i] = p[3] - alpha;
+      alpha = p[3];
+    }
+  }
+  return (alpha_and != 0xFF) ? (2 * n) : n;
+}
+
+// qoir_private_encode_tile_alpha_plane writes (for the Alpha-Plane tile
+// formats) the n BGRA pixels at src_ptr as an alpha plane's runs and then the
+// ops for the pixels that are not fully transparent, returning the number of
+// bytes written. dst_ptr must have room for ((5 * n) + 12) bytes, which it may
+// use as scratch space even when it returns zero. It returns zero if no pixel
+// is fully transparent, if those pixels' B, G and R values differ or if the
+// runs would take more than n bytes.
+static size_t                          //
+qoir_private_encode_tile_alpha_plane(  //
+    uint8_t* dst_ptr,                  //
+    const uint8_t* src_ptr,            //
+    size_t n) {
+  // Gather the other pixels' colors (with opaque alpha) at colors_ptr, past
+  // the runs' maximum length. Making their ops (below) works in place, as each
+  // pixel's ops take at most 4 bytes.
+  uint8_t* colors_ptr = dst_ptr + n + 8;
+  for (int i = 0; i < QOIR_LITERALS_PRE_PADDING; i += 4) {
+    colors_ptr[i + 0] = 0x00;
+    colors_ptr[i + 1] = 0x00;
+    colors_ptr[i + 2] = 0x00;
+    colors_ptr[i + 3] = 0xFF;
+  }
+  uint8_t* cp = colors_ptr + QOIR_LITERALS_PRE_PADDING;
+
+  // transparent is the fully transparent pixels' B, G and R values, or
+  // 0xFFFFFFFF if there are no such pixels (yet).
+  uint32_t transparent = 0xFFFFFFFF;
+  uint8_t* dp = dst_ptr + 3;
+  uint8_t* dq = dst_ptr + 3 + n;
+  for (size_t i = 0; i < n;) {
+    uint8_t alpha = src_ptr[(4 * i) + 3];
+    size_t j = i;
+    if (alpha == 0) {
+      for (; (j < n) && (src_ptr[(4 * j) + 3] == 0); j++) {
+        uint32_t bgr = qoir_private_peek_u32le(src_ptr + (4 * j)) & 0x00FFFFFF;
+        if (transparent != bgr) {
+          if (transparent != 0xFFFFFFFF) {
+            return 0;
+          }
+          transparent = bgr;
+        }
+      }
+    } else {
+      for (; (j < n) && (src_ptr[(4 * j) + 3] == alpha); j++) {
+        qoir_private_poke_u32le(
+            cp, qoir_private_peek_u32le(src_ptr + (4 * j)) | 0xFF000000);
+        cp += 4;
+      }
+    }
+
+    if ((dq - dp) < 4) {
+      return 0;
+    }
+    *dp++ = alpha;
+    size_t run = j - i - 1;
+    while (run >= 0x80) {
+      *dp++ = (uint8_t)(0x80 | run);
+      run >>= 7;
+    }
+    *dp++ = (uint8_t)run;
+    i = j;
+  }
+  if (transparent == 0xFFFFFFFF) {
+    return 0;
+  }
+  dst_ptr[0] = (uint8_t)(transparent >> 0);
+  dst_ptr[1] = (uint8_t)(transparent >> 8);
+  dst_ptr[2] = (uint8_t)(transparent >> 16);
+
+  size_t m = (size_t)(cp - colors_ptr - QOIR_LITERALS_PRE_PADDING) / 4;
+  qoir_size_result r =
+      qoir_private_encode_tile_ops_sans_alpha(dp, colors_ptr, (uint32_t)m, 1);
+  return (size_t)(dp - dst_ptr) + r.value;
+}
+
+// qoir_private_encode_plane_med is the inverse of
+// qoir_private_decode_plane_med. It replaces, in place, a w × h plane of
+// values with their residuals, working backwards so that each prediction still
+// sees the original values.
+static void                     //
+qoir_private_encode_plane_med(  //
+    uint8_t* p,                 //
+    size_t w,                   //
+    size_t h) {
+  for (size_t y = h - 1; y > 0; y--) {
+    uint8_t* q = p + (y * w);
+    for (size_t x = w - 1; x > 0; x--) {
+      q[x] -= (uint8_t)qoir_private_predict_med(q[x - 1], q[x - w],
+                                                 q[x - w - 1]);
+    }
+    q[0] -= p[(y - 1) * w];
+  }
+  for (size_t x = w - 1; x > 0; x--) {
+    p[x] -= p[x - 1];
+  }
+  p[0] -= 0x80;
+}
+
+// qoir_private_divide_rounding returns (num / den), rounded to the nearest
+// integer (with halves rounded away from zero). den must be positive.
+static inline int32_t          //
+qoir_private_divide_rounding(  //
+    int32_t num,               //
+    int32_t den) {
+  return (num >= 0) ? ((num + (den / 2)) / den) : -((-num + (den / 2)) / den);
+}
+
+// qoir_private_encode_tile_ycocg writes (for the YCoCg-420 tile formats) the
+// tw × th BGRA pixels at src_ptr as residual planes (see
+// qoir_private_decode_tile_ycocg), returning their length. Each 2 × 2 block of
+// pixels shares its Co and Cg values: their average, weighted by alpha. Any
+// alpha value other than alpha_max_value adds an alpha plane.
+static size_t                    //
+qoir_private_encode_tile_ycocg(  //
+    uint8_t* dst_ptr,            //
+    const uint8_t* src_ptr,      //
+    size_t tw,                   //
+    size_t th,                   //
+    uint32_t alpha_max_value) {
+  size_t n = tw * th;
+  size_t cw = (tw + 1) / 2;
+  size_t ch = (th + 1) / 2;
+  uint8_t* y_ptr = dst_ptr;
+  uint8_t* co_ptr = y_ptr + n;
+  uint8_t* cg_ptr = co_ptr + (cw * ch);
+  uint8_t* alpha_ptr = cg_ptr + (cw * ch);
+
+  bool has_alpha = false;
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t* p = src_ptr + (4 * i);
+    y_ptr[i] = (uint8_t)((p[0] + (2 * p[1]) + p[2] + 2) >> 2);
+    alpha_ptr[i] = p[3];
+    has_alpha |= p[3] != alpha_max_value;
+  }
+
+  for (size_t cy = 0; cy < ch; cy++) {
+    for (size_t cx = 0; cx < cw; cx++) {
+      int32_t sum_co = 0;
+      int32_t sum_cg = 0;
+      int32_t sum_weight = 0;
+      for (size_t y = 2 * cy; y < ((2 * cy) + 2) && (y < th); y++) {
+        for (size_t x = 2 * cx; x < ((2 * cx) + 2) && (x < tw); x++) {
+          const uint8_t* p = src_ptr + (4 * ((y * tw) + x));
+          int32_t weight = has_alpha ? p[3] : 1;
+          sum_co += weight * ((int32_t)p[2] - (int32_t)p[0]);
+          sum_cg += weight * ((2 * (int32_t)p[1]) - p[2] - p[0]);
+          sum_weight += weight;
+        }
+      }
+      int32_t co = 0;
+      int32_t cg = 0;
+      if (sum_weight > 0) {
+        co = qoir_private_divide_rounding(sum_co, 2 * sum_weight);
+        cg = qoir_private_divide_rounding(sum_cg, 4 * sum_weight);
+      }
+      *co_ptr++ = (uint8_t)(0x80 + ((co > 0x7F) ? 0x7F : co));
+      *cg_ptr++ = (uint8_t)(0x80 + ((cg > 0x7F) ? 0x7F : cg));
+    }
+  }
+  co_ptr -= cw * ch;
+  cg_ptr -= cw * ch;
+
+  qoir_private_encode_plane_med(y_ptr, tw, th);
+  qoir_private_encode_plane_med(co_ptr, cw, ch);
+  qoir_private_encode_plane_med(cg_ptr, cw, ch);
+  if (has_alpha) {
+    qoir_private_encode_plane_med(alpha_ptr, tw, th);
+    return (2 * n) + (2 * cw * ch);
+  }
+  return n + (2 * cw * ch);
 }
 
+#if defined(QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS)
+// qoir_private_split_ops converts src_len bytes of ops to the "split ops"
+// layout (see qoir_private_decode_tile_split_ops), which is 3 bytes longer.
+// It returns that length. The src ops are assumed to be valid.
+static size_t                //
+qoir_private_split_ops(      //
+    uint8_t* dst_ptr,        //
+    const uint8_t* src_ptr,  //
+    size_t src_len) {
+  size_t num_ops = 0;
+  for (size_t i = 0; i < src_len;) {
+    i += qoir_private_table_op_lengths[src_ptr[i]];
+    num_ops++;
+  }
+  qoir_private_poke_u32le(dst_ptr, (uint32_t)num_ops);
+  uint8_t* op_ptr = dst_ptr + 3;
+  uint8_t* payload_ptr = op_ptr + num_ops;
+  for (size_t i = 0; i < src_len;) {
+    size_t n = qoir_private_table_op_lengths[src_ptr[i]];
+    *op_ptr++ = src_ptr[i];
+    memcpy(payload_ptr, src_ptr + i + 1, n - 1);
+    payload_ptr += n - 1;
+    i += n;
+  }
+  return src_len + 3;
+}
+#endif  // defined(QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS)
+
+// qoir_private_encode_qpix_payload writes a sequence of encoded tiles. If
+// tile_averages is non-NULL then it also writes each tile's average pixel (4
+// bytes per tile, in the natural order) there. If prev_pixbuf is non-NULL (it
+// must have the same pixel configuration as src_pixbuf) then tiles whose
+// pixels are the same in both use the Unchanged tile format. If
+// tile_lossinesses is non-NULL then it holds each tile's lossiness (at least
+// the image's lossiness), in the natural order. A non-negative
+// alpha_lossiness applies to the alpha channel of every tile instead.
+// scratch_ptr is an encode scratch buffer for tile_shift. lz4_history_ptr is
+// an LZ4 history scratch buffer for tile_shift, which is only needed (and may
+// otherwise be NULL) if lz4_tile_group_size is more than one.
 static qoir_size_result                   //
 qoir_private_encode_qpix_payload(         //
-    qoir_encode_buffer* encbuf,           //
+    uint8_t* scratch_ptr,                 //
+    uint8_t* lz4_history_ptr,             //
     uint8_t* dst_ptr,                     //
     const qoir_pixel_buffer* src_pixbuf,  //
+    uint32_t tile_shift,                  //
     uint32_t lossiness,                   //
-    bool dither) {
+    int32_t alpha_lossiness,              //
+    bool dither,                          //
+    uint32_t near_lossless_tolerance,     //
+    uint32_t lz4_tile_group_size,         //
+    bool huffman_coding,                  //
+    bool split_ops,                       //
+    bool ops2,                            //
+    bool chroma_subsampling,              //
+    bool alpha_plane,                     //
+    uint8_t* tile_averages,               //
+    const uint8_t* tile_lossinesses,      //
+    const qoir_pixel_buffer* prev_pixbuf) {
   qoir_size_result result = {0};
 
-  size_t height_in_tiles =
-      qoir_calculate_number_of_tiles_1d(src_pixbuf->pixcfg.height_in_pixels);
-  size_t width_in_tiles =
-      qoir_calculate_number_of_tiles_1d(src_pixbuf->pixcfg.width_in_pixels);
+  size_t height_in_tiles = qoir_private_number_of_tiles_1d(
+      src_pixbuf->pixcfg.height_in_pixels, tile_shift);
+  size_t width_in_tiles = qoir_private_number_of_tiles_1d(
+      src_pixbuf->pixcfg.width_in_pixels, tile_shift);
   if ((height_in_tiles == 0) || (width_in_tiles == 0)) {
     return result;
   }
-  size_t ty1 = (height_in_tiles - 1) << QOIR_TILE_SHIFT;
-  size_t tx1 = (width_in_tiles - 1) << QOIR_TILE_SHIFT;
+  size_t ty1 = (height_in_tiles - 1) << tile_shift;
+  size_t tx1 = (width_in_tiles - 1) << tile_shift;
+  size_t tile_size = (size_t)1 << tile_shift;
+  size_t lz4_worst_case = QOIR_TILE_LZ4_COMPRESSION_WORST_CASE(tile_shift);
+  qoir_private_scratch_view scratch = qoir_private_make_scratch_view(
+      QOIR_PRIVATE_SCRATCH__ENCBUF, tile_shift, scratch_ptr);
+  if (lz4_tile_group_size > 1) {
+    qoir_private_scratch_view__use_lz4_history(&scratch, lz4_history_ptr);
+  }
 
-  qoir_private_swizzle_func swizzle_func = NULL;
-  switch (src_pixbuf->pixcfg.pixfmt) {
-    case QOIR_PIXEL_FORMAT__BGRX:
-    case QOIR_PIXEL_FORMAT__BGRA_NONPREMUL:
-    case QOIR_PIXEL_FORMAT__BGRA_PREMUL:
-      swizzle_func = qoir_private_swizzle__copy_4;
-      break;
-    case QOIR_PIXEL_FORMAT__BGR:
-      swizzle_func = qoir_private_swizzle__bgra__bgr;
-      break;
-    case QOIR_PIXEL_FORMAT__RGBX:
-    case QOIR_PIXEL_FORMAT__RGBA_NONPREMUL:
-    case QOIR_PIXEL_FORMAT__RGBA_PREMUL:
-      swizzle_func = qoir_private_swizzle__bgra__rgba;
-      break;
-    case QOIR_PIXEL_FORMAT__RGB:
-      swizzle_func = qoir_private_swizzle__bgra__rgb;
-      break;
-    default:
-      result.status_message = qoir_status_message__error_unsupported_pixfmt;
-      return result;
+  qoir_private_swizzle_func swizzle_func =
+      qoir_private_choose_encode_swizzle_func(src_pixbuf->pixcfg.pixfmt);
+  if (!swizzle_func) {
+    result.status_message = qoir_status_message__error_unsupported_pixfmt;
+    return result;
   }
 
+  bool has_alpha = (src_pixbuf->pixcfg.pixfmt &
+                    QOIR_PIXEL_FORMAT__MASK_FOR_ALPHA_TRANSPARENCY) !=
+                   QOIR_PIXEL_ALPHA_TRANSPARENCY__OPAQUE;
+  // Lossy chroma could exceed a premultiplied alpha.
+  chroma_subsampling = chroma_subsampling &&
+                       ((src_pixbuf->pixcfg.pixfmt &
+                         QOIR_PIXEL_FORMAT__MASK_FOR_ALPHA_TRANSPARENCY) !=
+                        QOIR_PIXEL_ALPHA_TRANSPARENCY__PREMULTIPLIED_ALPHA);
   qoir_size_result (*encode_func)(uint8_t * dst_ptr,       //
                                   const uint8_t* src_ptr,  //
                                   uint32_t tw,             //
                                   uint32_t th) =
-      ((src_pixbuf->pixcfg.pixfmt &
-        QOIR_PIXEL_FORMAT__MASK_FOR_ALPHA_TRANSPARENCY) ==
-       QOIR_PIXEL_ALPHA_TRANSPARENCY__OPAQUE)
-          ? qoir_private_encode_tile_ops_sans_alpha
-          : qoir_private_encode_tile_ops_with_alpha;
+      has_alpha ? (ops2 ? qoir_private_encode_tile_ops2_with_alpha
+                        : qoir_private_encode_tile_ops_with_alpha)
+                : (ops2 ? qoir_private_encode_tile_ops2_sans_alpha
+                        : qoir_private_encode_tile_ops_sans_alpha);
 
   size_t num_src_channels =
       qoir_pixel_format__bytes_per_pixel(src_pixbuf->pixcfg.pixfmt);
   uint8_t* dp = dst_ptr;
 
-  uint8_t* literals_pre_padding = encbuf->private_impl.literals;
+  uint8_t* literals_pre_padding = scratch.literals;
   for (int i = 0; i < QOIR_LITERALS_PRE_PADDING; i += 4) {
     literals_pre_padding[i + 0] = 0x00;
     literals_pre_padding[i + 1] = 0x00;
@@ -6702,93 +11210,553 @@ qoir_private_encode_qpix_payload(         //
 
   // ty, tx, tw and th are the tile's top-left offset, width and height, all
   // measured in pixels.
-  for (size_t ty = 0; ty <= ty1; ty += QOIR_TILE_SIZE) {
-    for (size_t tx = 0; tx <= tx1; tx += QOIR_TILE_SIZE) {
+  for (size_t ty = 0; ty <= ty1; ty += tile_size) {
+    // lz4_history_len is the length of the LZ4 tile group's history: the
+    // previous tiles' ops, ending at scratch.ops.
+    size_t lz4_history_len = 0;
+
+    for (size_t tx = 0; tx <= tx1; tx += tile_size) {
       size_t tw = qoir_private_tile_dimension(
-          tx < tx1, src_pixbuf->pixcfg.width_in_pixels);
+          tx < tx1, src_pixbuf->pixcfg.width_in_pixels, tile_shift);
       size_t th = qoir_private_tile_dimension(
-          ty < ty1, src_pixbuf->pixcfg.height_in_pixels);
+          ty < ty1, src_pixbuf->pixcfg.height_in_pixels, tile_shift);
+
+      size_t prev_lz4_history_len = lz4_history_len;
+      lz4_history_len = 0;
+      if ((lz4_tile_group_size <= 1) ||
+          (((tx >> tile_shift) % lz4_tile_group_size) == 0)) {
+        prev_lz4_history_len = 0;
+      }
 
       const uint8_t* sp = src_pixbuf->data +
                           (src_pixbuf->stride_in_bytes * ty) +
                           (num_src_channels * tx);
-      (*swizzle_func)(encbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING,
+      if (prev_pixbuf) {
+        const uint8_t* pp = prev_pixbuf->data +
+                            (prev_pixbuf->stride_in_bytes * ty) +
+                            (num_src_channels * tx);
+        size_t y = 0;
+        while ((y < th) &&
+               !memcmp(sp + (y * src_pixbuf->stride_in_bytes),
+                       pp + (y * prev_pixbuf->stride_in_bytes),
+                       num_src_channels * tw)) {
+          y++;
+        }
+        if (y == th) {
+          // Use the Unchanged tile format.
+          qoir_private_poke_u32le(dp, 0x04000000);
+          dp += 4;
+          continue;
+        }
+      }
+
+      (*swizzle_func)(scratch.literals + QOIR_LITERALS_PRE_PADDING,
                       4 * tw,                           //
                       sp, src_pixbuf->stride_in_bytes,  //
                       tw, th);
+      if (tile_averages) {
+        qoir_private_encode_tile_average(
+            tile_averages, scratch.literals + QOIR_LITERALS_PRE_PADDING,
+            tw * th,
+            (src_pixbuf->pixcfg.pixfmt &
+             QOIR_PIXEL_FORMAT__MASK_FOR_ALPHA_TRANSPARENCY) ==
+                QOIR_PIXEL_ALPHA_TRANSPARENCY__NONPREMULTIPLIED_ALPHA);
+        tile_averages += 4;
+      }
+
+      uint32_t tile_lossiness =
+          tile_lossinesses
+              ? tile_lossinesses[((ty >> tile_shift) * width_in_tiles) +
+                                 (tx >> tile_shift)]
+              : lossiness;
+      uint32_t tile_alpha_lossiness = (alpha_lossiness >= 0)
+                                          ? (uint32_t)alpha_lossiness
+                                          : tile_lossiness;
+      if ((tile_lossiness == 0) && (tile_alpha_lossiness == 0)) {
+        // No-op.
+      } else if (!dither && (tile_lossiness == tile_alpha_lossiness)) {
+        for (size_t i = 0; i < 4 * tw * th; i++) {
+          scratch.literals[i + QOIR_LITERALS_PRE_PADDING] >>= tile_lossiness;
+        }
+      } else if (!dither) {
+        uint8_t* ptr = &scratch.literals[QOIR_LITERALS_PRE_PADDING];
+        for (size_t i = 0; i < tw * th; i++) {
+          ptr[0] >>= tile_lossiness;
+          ptr[1] >>= tile_lossiness;
+          ptr[2] >>= tile_lossiness;
+          ptr[3] >>= tile_alpha_lossiness;
+          ptr += 4;
+        }
+      } else {
+        uint8_t* ptr = &scratch.literals[QOIR_LITERALS_PRE_PADDING];
+        for (size_t y = 0; y < th; y++) {
+          for (size_t x = 0; x < tw; x++) {
+            uint8_t noise = qoir_private_table_noise[y & 15][x & 15];
+            if (tile_lossiness > 0) {
+              qoir_private_encode_dither(ptr + 0, tile_lossiness, noise);
+              qoir_private_encode_dither(ptr + 1, tile_lossiness, noise);
+              qoir_private_encode_dither(ptr + 2, tile_lossiness, noise);
+            }
+            if (tile_alpha_lossiness > 0) {
+              qoir_private_encode_dither(ptr + 3, tile_alpha_lossiness, noise);
+            }
+            ptr += 4;
+          }
+        }
+      }
+
+      size_t gray_len = qoir_private_encode_tile_gray(
+          scratch.ops, scratch.literals + QOIR_LITERALS_PRE_PADDING, tw * th);
+      if (gray_len > 0) {
+        // Use the LZ4-Gray or LZ4-Gray-Alpha tile format.
+        qoir_size_result r = qoir_lz4_block_encode(dp + 4, lz4_worst_case,
+                                                   scratch.ops, gray_len);
+        if (!r.status_message) {
+          uint32_t tile_format = (gray_len > (tw * th)) ? 0x0B : 0x0A;
+          qoir_private_poke_u32le(dp, (tile_format << 24) | (uint32_t)r.value);
+          dp += 4 + r.value;
+          continue;
+        }
+      }
+
+      // Gray tiles (above) are already compact and stay lossless, as
+      // near-lossless replacements could make them no longer gray.
+      if (near_lossless_tolerance > 0) {
+        qoir_private_encode_near_lossless(
+            scratch.literals, tw * th,
+            (near_lossless_tolerance < 0xFF) ? (int32_t)near_lossless_tolerance
+                                             : 0xFF,
+            0xFF >> tile_lossiness,
+            (src_pixbuf->pixcfg.pixfmt &
+             QOIR_PIXEL_FORMAT__MASK_FOR_ALPHA_TRANSPARENCY) ==
+                QOIR_PIXEL_ALPHA_TRANSPARENCY__PREMULTIPLIED_ALPHA);
+      }
+
+      size_t literals_len = 4 * tw * th;
+
+      // Provisionally write an alternative tile format, which is kept if its
+      // alt_len is less than both the (uncompressed) ops' and literals'
+      // lengths. With chroma subsampling, that is a (lossy) YCoCg-420 tile
+      // format. Otherwise, with the alpha_plane option and for tiles with
+      // fully transparent pixels, it is an Alpha-Plane tile format.
+      uint32_t alt_prefix = 0;
+      size_t alt_len = 0;
+      if (chroma_subsampling) {
+        size_t planes_len = qoir_private_encode_tile_ycocg(
+            scratch.ops, scratch.literals + QOIR_LITERALS_PRE_PADDING, tw, th,
+            0xFF >> tile_alpha_lossiness);
+        qoir_size_result r = qoir_lz4_block_encode(dp + 4, lz4_worst_case,
+                                                   scratch.ops, planes_len);
+        if (!r.status_message) {
+          alt_prefix = 0x0E000000 | (uint32_t)r.value;
+          alt_len = r.value;
+          // The ops array has room for the planes twice over.
+          uint8_t* huffman_ptr = scratch.ops + planes_len;
+          qoir_size_result r2 = qoir_private_huffman_encode(
+              huffman_ptr, (alt_len <= planes_len) ? (alt_len - 1) : planes_len,
+              scratch.ops, planes_len);
+          if (!r2.status_message) {
+            memcpy(dp + 4, huffman_ptr, r2.value);
+            alt_prefix = 0x0F000000 | (uint32_t)r2.value;
+            alt_len = r2.value;
+          }
+        }
+      } else if (alpha_plane && has_alpha) {
+        size_t alpha_plane_len = qoir_private_encode_tile_alpha_plane(
+            scratch.ops, scratch.literals + QOIR_LITERALS_PRE_PADDING, tw * th);
+        if ((alpha_plane_len > 0) && (alpha_plane_len < literals_len)) {
+          qoir_size_result r = qoir_lz4_block_encode(
+              dp + 4, lz4_worst_case, scratch.ops, alpha_plane_len);
+          if (!r.status_message && (r.value < alpha_plane_len)) {
+            alt_prefix = 0x0D000000 | (uint32_t)r.value;
+          } else {
+            memcpy(dp + 4, scratch.ops, alpha_plane_len);
+            alt_prefix = 0x0C000000 | (uint32_t)alpha_plane_len;
+          }
+          alt_len = alpha_plane_len;
+        }
+      }
+
+      qoir_size_result r0 =
+          (*encode_func)(scratch.ops, scratch.literals, tw, th);
+      if (r0.status_message) {
+        result.status_message = r0.status_message;
+        return r0;
+      }
+      if (alt_prefix && (alt_len < r0.value) && (alt_len < literals_len)) {
+        qoir_private_poke_u32le(dp, alt_prefix);
+        dp += 4 + (alt_prefix & 0xFFFFFF);
+        continue;
+      }
+      if (r0.value >= literals_len) {
+        // Use the Literals or LZ4-Literals tile format. LZ4 can grow
+        // incompressible literals, so keep the EncodedTileLength at most
+        // literals_len, within the spec's (4 * TileSize * TileSize) limit.
+        qoir_size_result r1 = qoir_lz4_block_encode(
+            dp + 4, lz4_worst_case,
+            scratch.literals + QOIR_LITERALS_PRE_PADDING, literals_len);
+        if (!r1.status_message && (r1.value < literals_len)) {
+          qoir_private_poke_u32le(dp, 0x02000000 | (uint32_t)r1.value);
+          dp += 4 + r1.value;
+        } else {
+          memcpy(dp + 4, scratch.literals + QOIR_LITERALS_PRE_PADDING,
+                 literals_len);
+          qoir_private_poke_u32le(dp, 0x00000000 | (uint32_t)literals_len);
+          dp += 4 + literals_len;
+        }
+
+      } else {
+        // Use the Ops, LZ4-Ops, LZ4-Chained-Ops, Huffman-Ops, Ops2 or LZ4-Ops2
+        // tile format (or split ops).
+        uint32_t tile_format = ops2 ? 0x08 : 0x01;
+        const uint8_t* tile_ptr = scratch.ops;
+        size_t tile_len = r0.value;
+        qoir_size_result r1 = {0};
+        if (ops2) {
+          r1 = qoir_lz4_block_encode(dp + 4, lz4_worst_case, scratch.ops,
+                                     r0.value);
+          if (!r1.status_message && (r1.value < tile_len)) {
+            tile_format = 0x09;
+            tile_ptr = dp + 4;
+            tile_len = r1.value;
+          }
+#if defined(QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS)
+        } else if (split_ops && (prev_lz4_history_len == 0) &&
+                   ((r0.value + 3) < literals_len)) {
+          // The literals are no longer needed, so re-use that buffer.
+          uint8_t* split_ptr = scratch.literals + QOIR_LITERALS_PRE_PADDING;
+          size_t split_len =
+              qoir_private_split_ops(split_ptr, scratch.ops, r0.value);
+          r1 = qoir_lz4_block_encode(dp + 4, lz4_worst_case, split_ptr,
+                                     split_len);
+          if (!r1.status_message && (r1.value < tile_len)) {
+            tile_format = 0x07;
+            tile_ptr = dp + 4;
+            tile_len = r1.value;
+          }
+#endif  // defined(QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS)
+        } else {
+          r1 = qoir_lz4_block_encode_with_prefix(dp + 4, lz4_worst_case,
+                                                 scratch.ops, r0.value,
+                                                 prev_lz4_history_len);
+          if (!r1.status_message && (r1.value < tile_len)) {
+            tile_format = (prev_lz4_history_len > 0) ? 0x05 : 0x03;
+            tile_ptr = dp + 4;
+            tile_len = r1.value;
+          }
+        }
+        if (huffman_coding && !ops2) {
+          // The literals are no longer needed, so re-use that buffer.
+          uint8_t* huffman_ptr = scratch.literals + QOIR_LITERALS_PRE_PADDING;
+          qoir_size_result r2 = qoir_private_huffman_encode(
+              huffman_ptr, tile_len - 1, scratch.ops, r0.value);
+          if (!r2.status_message) {
+            tile_format = 0x06;
+            tile_ptr = huffman_ptr;
+            tile_len = r2.value;
+          }
+        }
+        if (tile_ptr != (dp + 4)) {
+          memcpy(dp + 4, tile_ptr, tile_len);
+        }
+        qoir_private_poke_u32le(dp, (tile_format << 24) | (uint32_t)tile_len);
+        dp += 4 + tile_len;
+        if (tile_format != 0x05) {
+          // Other ops tile formats start a new LZ4 tile group history.
+          prev_lz4_history_len = 0;
+        }
+
+        if ((lz4_tile_group_size > 1) && (tile_format <= 0x06)) {
+          lz4_history_len = qoir_private_append_lz4_history(
+              scratch.lz4_history, prev_lz4_history_len, scratch.ops,
+              r0.value);
+        }
+      }
+    }
+  }
+
+  if (tile_lossinesses) {
+    // Record each tile's extra lossiness in its format byte's bits 4 to 6.
+    uint8_t* p = dst_ptr;
+    for (size_t i = 0; i < (width_in_tiles * height_in_tiles); i++) {
+      p[3] |= (uint8_t)((tile_lossinesses[i] - lossiness) << 4);
+      p += 4 + (qoir_private_peek_u32le(p) & 0xFFFFFF);
+    }
+  }
+
+  result.value = (size_t)(dp - dst_ptr);
+  return result;
+}
+
+// qoir_private_encode_downsample_row produces one row of a half-sized (rounding
+// up) image from two rows (or, at the bottom edge, the same row twice) of 4
+// bytes per pixel BGRX / BGRA values. Each output pixel is the average of a
+// 2 × 2 box (or, at the right edge, a 1 × 2 box) of input pixels.
+//
+// For nonpremultiplied alpha, the color channels are alpha-weighted, so that
+// transparent pixels' (arbitrary) colors do not bleed into their neighbors.
+//
+// The output row may overlap the input rows, provided that dst_ptr is at or
+// before src_ptr0, as each output pixel is computed before it is written.
+static void                          //
+qoir_private_encode_downsample_row(  //
+    uint8_t* dst_ptr,                //
+    const uint8_t* src_ptr0,         //
+    const uint8_t* src_ptr1,         //
+    size_t src_width_in_pixels,      //
+    bool nonpremul) {
+  for (size_t x = 0; x < src_width_in_pixels; x += 2) {
+    const uint8_t* p[4];
+    uint32_t n = 0;
+    p[n++] = src_ptr0 + (4 * x);
+    if ((x + 1) < src_width_in_pixels) {
+      p[n++] = src_ptr0 + (4 * x) + 4;
+    }
+    if (src_ptr1 != src_ptr0) {
+      p[n++] = src_ptr1 + (4 * x);
+      if ((x + 1) < src_width_in_pixels) {
+        p[n++] = src_ptr1 + (4 * x) + 4;
+      }
+    }
+
+    uint32_t sum[4] = {0};
+    for (uint32_t i = 0; i < n; i++) {
+      sum[0] += p[i][0];
+      sum[1] += p[i][1];
+      sum[2] += p[i][2];
+      sum[3] += p[i][3];
+    }
+
+    uint8_t pixel[4];
+    if (nonpremul && (sum[3] > 0) && (sum[3] < (0xFF * n))) {
+      uint32_t weighted[3] = {0};
+      for (uint32_t i = 0; i < n; i++) {
+        weighted[0] += (uint32_t)p[i][0] * (uint32_t)p[i][3];
+        weighted[1] += (uint32_t)p[i][1] * (uint32_t)p[i][3];
+        weighted[2] += (uint32_t)p[i][2] * (uint32_t)p[i][3];
+      }
+      pixel[0] = (uint8_t)((weighted[0] + (sum[3] / 2)) / sum[3]);
+      pixel[1] = (uint8_t)((weighted[1] + (sum[3] / 2)) / sum[3]);
+      pixel[2] = (uint8_t)((weighted[2] + (sum[3] / 2)) / sum[3]);
+    } else {
+      pixel[0] = (uint8_t)((sum[0] + (n / 2)) / n);
+      pixel[1] = (uint8_t)((sum[1] + (n / 2)) / n);
+      pixel[2] = (uint8_t)((sum[2] + (n / 2)) / n);
+    }
+    pixel[3] = (uint8_t)((sum[3] + (n / 2)) / n);
+    memcpy(dst_ptr, pixel, 4);
+    dst_ptr += 4;
+  }
+}
+
+// qoir_private_encode_mpix_chunks writes num_mipmap_levels "mPIX" chunks
+// (headers and payloads) to dst_ptr, returning the number of bytes written.
+// Like qoir_private_encode_fpix_chunks, it takes the (rate controlled)
+// lossiness and alpha_lossiness but otherwise reads the options.
+//
+// The full sized image is only read once, to produce level 1. Each subsequent
+// level is produced in place from its predecessor.
+static qoir_size_result                   //
+qoir_private_encode_mpix_chunks(          //
+    uint8_t* scratch,                     //
+    uint8_t* lz4_history,                 //
+    uint8_t* dst_ptr,                     //
+    const qoir_pixel_buffer* src_pixbuf,  //
+    qoir_pixel_format dst_pixfmt,         //
+    uint32_t tile_shift,                  //
+    uint32_t num_mipmap_levels,           //
+    uint32_t lossiness,                   //
+    int32_t alpha_lossiness,              //
+    const qoir_encode_options* options) {
+  qoir_size_result result = {0};
 
-      if (lossiness == 0) {
-        // No-op.
-      } else if (!dither) {
-        for (size_t i = 0; i < 4 * tw * th; i++) {
-          encbuf->private_impl.literals[i + QOIR_LITERALS_PRE_PADDING] >>=
-              lossiness;
-        }
-      } else {
-        uint8_t* ptr =
-            &encbuf->private_impl.literals[QOIR_LITERALS_PRE_PADDING];
-        for (size_t y = 0; y < th; y++) {
-          for (size_t x = 0; x < tw; x++) {
-            uint8_t noise = qoir_private_table_noise[y & 15][x & 15];
-            qoir_private_encode_dither(ptr + 0, lossiness, noise);
-            qoir_private_encode_dither(ptr + 1, lossiness, noise);
-            qoir_private_encode_dither(ptr + 2, lossiness, noise);
-            qoir_private_encode_dither(ptr + 3, lossiness, noise);
-            ptr += 4;
-          }
-        }
-      }
+  uint32_t w0 = src_pixbuf->pixcfg.width_in_pixels;
+  uint32_t h0 = src_pixbuf->pixcfg.height_in_pixels;
+  uint32_t w = qoir_private_mipmap_dimension(w0, 1);
+  uint32_t h = qoir_private_mipmap_dimension(h0, 1);
+  size_t level_len = 4 * (size_t)w * (size_t)h;
+  size_t rows_len = 8 * (size_t)w0;
+  uint8_t* level_ptr = (uint8_t*)QOIR_MALLOC(level_len + rows_len);
+  if (!level_ptr) {
+    result.status_message = qoir_status_message__error_out_of_memory;
+    return result;
+  }
+  uint8_t* rows_ptr = level_ptr + level_len;
+  bool nonpremul = dst_pixfmt == QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
+
+  qoir_private_swizzle_func swizzle_func =
+      qoir_private_choose_encode_swizzle_func(src_pixbuf->pixcfg.pixfmt);
+  for (uint32_t y = 0; y < h; y++) {
+    size_t num_rows = (((2 * y) + 1) < h0) ? 2 : 1;
+    (*swizzle_func)(rows_ptr, 4 * (size_t)w0,
+                    src_pixbuf->data + (2 * y * src_pixbuf->stride_in_bytes),
+                    src_pixbuf->stride_in_bytes, w0, num_rows);
+    qoir_private_encode_downsample_row(
+        level_ptr + (4 * (size_t)w * y), rows_ptr,
+        rows_ptr + ((num_rows == 2) ? (4 * (size_t)w0) : 0), w0, nonpremul);
+  }
 
-      qoir_size_result r0 = (*encode_func)(
-          encbuf->private_impl.ops, encbuf->private_impl.literals, tw, th);
-      if (r0.status_message) {
-        result.status_message = r0.status_message;
-        return r0;
-      }
-      size_t literals_len = 4 * tw * th;
-      if (r0.value >= literals_len) {
-        // Use the Literals or LZ4-Literals tile format.
-        qoir_size_result r1 = qoir_lz4_block_encode(
-            dp + 4, QOIR_TILE_LZ4_COMPRESSION_WORST_CASE,
-            encbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING,
-            literals_len);
-        if (!r1.status_message && (r1.value < r0.value)) {
-          qoir_private_poke_u32le(dp, 0x02000000 | (uint32_t)r1.value);
-          dp += 4 + r1.value;
-        } else {
-          memcpy(dp + 4,
-                 encbuf->private_impl.literals + QOIR_LITERALS_PRE_PADDING,
-                 literals_len);
-          qoir_private_poke_u32le(dp, 0x00000000 | (uint32_t)literals_len);
-          dp += 4 + literals_len;
-        }
+  uint8_t* dp = dst_ptr;
+  for (uint32_t level = 1; true; level++) {
+    qoir_pixel_buffer level_pixbuf;
+    level_pixbuf.pixcfg.pixfmt = dst_pixfmt;
+    level_pixbuf.pixcfg.width_in_pixels = w;
+    level_pixbuf.pixcfg.height_in_pixels = h;
+    level_pixbuf.data = level_ptr;
+    level_pixbuf.stride_in_bytes = 4 * (size_t)w;
+
+    qoir_private_poke_u32le(dp + 0, 0x5849506D);  // "mPIX"le.
+    qoir_private_poke_u32le(dp + 12, w | (level << 24));
+    qoir_private_poke_u32le(dp + 16, h);
+    qoir_size_result r = qoir_private_encode_qpix_payload(
+        scratch, lz4_history, dp + 20, &level_pixbuf, tile_shift, lossiness,
+        alpha_lossiness,
+        options->dither, options->near_lossless_tolerance,
+        options->lz4_tile_group_size, options->huffman_coding,
+        options->split_ops, options->ops_version == 2,
+        options->chroma_subsampling, options->alpha_plane, NULL, NULL,
+        NULL);
+    if (r.status_message) {
+      QOIR_FREE(level_ptr);
+      return r;
+    }
+    qoir_private_poke_u64le(dp + 4, 8 + (uint64_t)r.value);
+    dp += 20 + r.value;
 
-      } else {
-        // Use the Ops or LZ4-Ops tile format.
-        qoir_size_result r1 =
-            qoir_lz4_block_encode(dp + 4, QOIR_TILE_LZ4_COMPRESSION_WORST_CASE,
-                                  encbuf->private_impl.ops, r0.value);
-        if (!r1.status_message && (r1.value < r0.value)) {
-          qoir_private_poke_u32le(dp, 0x03000000 | (uint32_t)r1.value);
-          dp += 4 + r1.value;
-        } else {
-          memcpy(dp + 4, encbuf->private_impl.ops, r0.value);
-          qoir_private_poke_u32le(dp, 0x01000000 | (uint32_t)r0.value);
-          dp += 4 + r0.value;
-        }
-      }
+    if (level >= num_mipmap_levels) {
+      break;
     }
+    uint32_t next_w = qoir_private_mipmap_dimension(w0, level + 1);
+    uint32_t next_h = qoir_private_mipmap_dimension(h0, level + 1);
+    for (uint32_t y = 0; y < next_h; y++) {
+      const uint8_t* row0 = level_ptr + (4 * (size_t)w * (2 * y));
+      const uint8_t* row1 =
+          (((2 * y) + 1) < h) ? (row0 + (4 * (size_t)w)) : row0;
+      qoir_private_encode_downsample_row(level_ptr + (4 * (size_t)next_w * y),
+                                         row0, row1, w, nonpremul);
+    }
+    w = next_w;
+    h = next_h;
   }
 
+  QOIR_FREE(level_ptr);
   result.value = (size_t)(dp - dst_ptr);
   return result;
 }
 
-QOIR_MAYBE_STATIC qoir_encode_result      //
-qoir_encode(                              //
+// qoir_private_encode_fpix_chunks writes one "fPIX" chunk (header and
+// payload) per options->animation_frames_ptr element to dst_ptr, returning
+// the number of bytes written.
+static qoir_size_result                   //
+qoir_private_encode_fpix_chunks(          //
+    uint8_t* scratch,                     //
+    uint8_t* lz4_history,                 //
+    uint8_t* dst_ptr,                     //
     const qoir_pixel_buffer* src_pixbuf,  //
+    uint32_t tile_shift,                  //
+    uint32_t lossiness,                   //
+    int32_t alpha_lossiness,              //
     const qoir_encode_options* options) {
-  qoir_encode_result result = {0};
+  qoir_size_result result = {0};
+  uint8_t* dp = dst_ptr;
+  const qoir_pixel_buffer* prev_pixbuf = src_pixbuf;
+  for (size_t i = 0; i < options->animation_frames_len; i++) {
+    const qoir_pixel_buffer* frame_pixbuf = &options->animation_frames_ptr[i];
+    qoir_private_poke_u32le(dp + 0, 0x58495066);  // "fPIX"le.
+    qoir_private_poke_u32le(dp + 12, options->animation_delays_ms_ptr
+                                         ? options->animation_delays_ms_ptr[i]
+                                         : 0);
+    qoir_private_poke_u32le(dp + 16, 0);
+    qoir_size_result r = qoir_private_encode_qpix_payload(
+        scratch, lz4_history, dp + 20, frame_pixbuf, tile_shift, lossiness,
+        alpha_lossiness,
+        options->dither, options->near_lossless_tolerance,
+        options->lz4_tile_group_size, options->huffman_coding,
+        options->split_ops, options->ops_version == 2,
+        options->chroma_subsampling, options->alpha_plane, NULL, NULL,
+        prev_pixbuf);
+    if (r.status_message) {
+      return r;
+    }
+    qoir_private_poke_u64le(dp + 4, 8 + (uint64_t)r.value);
+    dp += 20 + r.value;
+    prev_pixbuf = frame_pixbuf;
+  }
+  result.value = (size_t)(dp - dst_ptr);
+  return result;
+}
+
+// qoir_private_encode_prvw_chunk writes a "PRVW" chunk (header and payload) to
+// dst_ptr, returning the number of bytes written. The preview image starts as
+// one pixel per tile (the tile_averages, which it modifies in place) and is
+// halved until it is at most QOIR_PREVIEW_MAX_DIMENSION pixels wide and high.
+static qoir_size_result            //
+qoir_private_encode_prvw_chunk(    //
+    uint8_t* scratch,              //
+    uint8_t* dst_ptr,              //
+    uint8_t* tile_averages,        //
+    uint32_t width_in_tiles,       //
+    uint32_t height_in_tiles,      //
+    qoir_pixel_format dst_pixfmt,  //
+    uint32_t tile_shift) {
+  bool nonpremul = dst_pixfmt == QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
+  uint32_t w = width_in_tiles;
+  uint32_t h = height_in_tiles;
+  while ((w > QOIR_PREVIEW_MAX_DIMENSION) || (h > QOIR_PREVIEW_MAX_DIMENSION)) {
+    uint32_t next_w = qoir_private_mipmap_dimension(w, 1);
+    uint32_t next_h = qoir_private_mipmap_dimension(h, 1);
+    for (uint32_t y = 0; y < next_h; y++) {
+      const uint8_t* row0 = tile_averages + (4 * (size_t)w * (2 * y));
+      const uint8_t* row1 =
+          (((2 * y) + 1) < h) ? (row0 + (4 * (size_t)w)) : row0;
+      qoir_private_encode_downsample_row(
+          tile_averages + (4 * (size_t)next_w * y), row0, row1, w, nonpremul);
+    }
+    w = next_w;
+    h = next_h;
+  }
+
+  qoir_pixel_buffer preview_pixbuf;
+  preview_pixbuf.pixcfg.pixfmt = dst_pixfmt;
+  preview_pixbuf.pixcfg.width_in_pixels = w;
+  preview_pixbuf.pixcfg.height_in_pixels = h;
+  preview_pixbuf.data = tile_averages;
+  preview_pixbuf.stride_in_bytes = 4 * (size_t)w;
+
+  qoir_private_poke_u32le(dst_ptr + 0, 0x57565250);  // "PRVW"le.
+  qoir_private_poke_u32le(dst_ptr + 12, w);
+  qoir_private_poke_u32le(dst_ptr + 16, h);
+  qoir_size_result r = qoir_private_encode_qpix_payload(
+      scratch, NULL, dst_ptr + 20, &preview_pixbuf, tile_shift, 0, -1, false,
+      0, 0, false, false, false, false, false, NULL, NULL, NULL);
+  if (r.status_message) {
+    return r;
+  }
+  qoir_private_poke_u64le(dst_ptr + 4, 8 + (uint64_t)r.value);
+  r.value += 20;
+  return r;
+}
+
+typedef struct qoir_private_encode_plan_result_struct {
+  const char* status_message;
+  qoir_pixel_format dst_pixfmt;
+  uint32_t tile_shift;
+  uint64_t width_in_tiles;
+  uint64_t height_in_tiles;
+  uint32_t num_mipmap_levels;
+  bool preview;
+  uint64_t preview_gap;
+  uint64_t dst_len_worst_case;
+} qoir_private_encode_plan_result;
+
+// qoir_private_encode_plan validates the src_pixbuf and options and works
+// out the encoding's geometry, including the worst case (longest possible)
+// encoded length.
+static qoir_private_encode_plan_result    //
+qoir_private_encode_plan(                 //
+    const qoir_pixel_buffer* src_pixbuf,  //
+    const qoir_encode_options* options) {
+  qoir_private_encode_plan_result result = {0};
   if (!src_pixbuf) {
     result.status_message = qoir_status_message__error_invalid_argument;
     return result;
@@ -6820,19 +11788,103 @@ qoir_encode(                              //
       return result;
   }
 
-  uint64_t width_in_tiles =
-      qoir_calculate_number_of_tiles_1d(src_pixbuf->pixcfg.width_in_pixels);
-  uint64_t height_in_tiles =
-      qoir_calculate_number_of_tiles_1d(src_pixbuf->pixcfg.height_in_pixels);
+  uint32_t tile_shift = QOIR_TILE_SHIFT;
+  if (options) {
+    switch (options->tile_size_in_pixels) {
+      case 0:
+      case 64:
+        break;
+      case 128:
+        tile_shift = 7;
+        break;
+      case 256:
+        tile_shift = 8;
+        break;
+      default:
+        result.status_message =
+            qoir_status_message__error_unsupported_tile_size;
+        return result;
+    }
+    if (options->ops_version > 2) {
+      result.status_message = qoir_status_message__error_invalid_argument;
+      return result;
+    }
+  }
+
+  uint64_t width_in_tiles = qoir_private_number_of_tiles_1d(
+      src_pixbuf->pixcfg.width_in_pixels, tile_shift);
+  uint64_t height_in_tiles = qoir_private_number_of_tiles_1d(
+      src_pixbuf->pixcfg.height_in_pixels, tile_shift);
   uint64_t tile_len_worst_case =
-      4 + (4 * QOIR_TS2);  // Prefix + literal format.
+      4 + (4u << (2 * tile_shift));  // Prefix + literal format.
   uint64_t dst_len_worst_case =
       (width_in_tiles * height_in_tiles * tile_len_worst_case) +
       44 +  // QOIR, QPIX and QEND chunk headers are 12 bytes each.
             // QOIR also has an 8 byte payload.
-      (QOIR_TILE_LZ4_COMPRESSION_WORST_CASE -
-       (4 * QOIR_TS2));  // We might temporarily write more than (4 * QOIR_TS2)
-                         // bytes when LZ4 compressing each tile.
+      (QOIR_TILE_LZ4_COMPRESSION_WORST_CASE(tile_shift) -
+       (4u << (2 * tile_shift)));  // We might temporarily write more than a
+                                   // tile's literals when LZ4 compressing it.
+  if (options && (options->animation_frames_len > 0)) {
+    if (!options->animation_frames_ptr) {
+      result.status_message = qoir_status_message__error_invalid_argument;
+      return result;
+    }
+    for (size_t i = 0; i < options->animation_frames_len; i++) {
+      const qoir_pixel_buffer* frame_pixbuf = &options->animation_frames_ptr[i];
+      if ((frame_pixbuf->pixcfg.pixfmt != src_pixbuf->pixcfg.pixfmt) ||
+          (frame_pixbuf->pixcfg.width_in_pixels !=
+           src_pixbuf->pixcfg.width_in_pixels) ||
+          (frame_pixbuf->pixcfg.height_in_pixels !=
+           src_pixbuf->pixcfg.height_in_pixels)) {
+        result.status_message = qoir_status_message__error_invalid_argument;
+        return result;
+      }
+    }
+    // Each fPIX chunk is the 12 byte chunk header, an 8 byte payload header
+    // and then the same worst case as the QPIX chunk's payload.
+    uint64_t fpix_len_worst_case =
+        20 + (width_in_tiles * height_in_tiles * tile_len_worst_case);
+    if ((options->animation_frames_len >
+         (0xFFFFFFFFFFFFFFFFull / fpix_len_worst_case)) ||
+        qoir_private_u64_overflow_add(
+            &dst_len_worst_case,
+            fpix_len_worst_case * options->animation_frames_len)) {
+      result.status_message =
+          qoir_status_message__error_unsupported_pixbuf_dimensions;
+      return result;
+    }
+  }
+  uint32_t num_mipmap_levels = 0;
+  if (options && (src_pixbuf->pixcfg.width_in_pixels > 0) &&
+      (src_pixbuf->pixcfg.height_in_pixels > 0)) {
+    while (num_mipmap_levels < options->mipmap_levels) {
+      uint32_t w = qoir_private_mipmap_dimension(
+          src_pixbuf->pixcfg.width_in_pixels, num_mipmap_levels);
+      uint32_t h = qoir_private_mipmap_dimension(
+          src_pixbuf->pixcfg.height_in_pixels, num_mipmap_levels);
+      if ((w == 1) && (h == 1)) {
+        break;
+      }
+      num_mipmap_levels++;
+      dst_len_worst_case +=
+          20 +  // The mPIX chunk header is 12 bytes, plus 8 bytes of payload.
+          (tile_len_worst_case *
+           qoir_private_number_of_tiles_1d(qoir_private_mipmap_dimension(w, 1),
+                                           tile_shift) *
+           qoir_private_number_of_tiles_1d(qoir_private_mipmap_dimension(h, 1),
+                                           tile_shift));
+    }
+  }
+  // The preview fits in a single tile. We reserve room for the worst case
+  // "PRVW" chunk, before the QPIX chunk, and shift the QOIR chunk forward
+  // (closing up the gap) once the preview's actual length is known.
+  bool preview = options && options->preview && (width_in_tiles > 0) &&
+                 (height_in_tiles > 0);
+  uint64_t preview_gap =
+      preview ? (24 +  // 12 + 8 byte PRVW chunk header, 4 byte tile prefix.
+                 QOIR_TILE_LZ4_COMPRESSION_WORST_CASE(tile_shift))
+              : 0;
+  dst_len_worst_case += preview_gap;
   if (options) {
     bool overflow = false;
     if (options->metadata_cicp_len) {
@@ -6870,6 +11922,41 @@ qoir_encode(                              //
         qoir_status_message__error_unsupported_pixbuf_dimensions;
     return result;
   }
+  result.dst_pixfmt = dst_pixfmt;
+  result.tile_shift = tile_shift;
+  result.width_in_tiles = width_in_tiles;
+  result.height_in_tiles = height_in_tiles;
+  result.num_mipmap_levels = num_mipmap_levels;
+  result.preview = preview;
+  result.preview_gap = preview_gap;
+  result.dst_len_worst_case = dst_len_worst_case;
+  return result;
+}
+
+// qoir_private_encode is qoir_encode without rate control. If
+// tile_lossinesses is non-NULL then it holds each QPIX tile's lossiness. The
+// QOIR chunk's lossiness is the minimum of those and the lossiness option.
+static qoir_encode_result                 //
+qoir_private_encode(                      //
+    const qoir_pixel_buffer* src_pixbuf,  //
+    const qoir_encode_options* options,   //
+    const uint8_t* tile_lossinesses) {
+  qoir_encode_result result = {0};
+  qoir_private_encode_plan_result plan =
+      qoir_private_encode_plan(src_pixbuf, options);
+  if (plan.status_message) {
+    result.status_message = plan.status_message;
+    return result;
+  }
+  qoir_pixel_format dst_pixfmt = plan.dst_pixfmt;
+  uint32_t tile_shift = plan.tile_shift;
+  uint64_t width_in_tiles = plan.width_in_tiles;
+  uint64_t height_in_tiles = plan.height_in_tiles;
+  uint32_t num_mipmap_levels = plan.num_mipmap_levels;
+  bool preview = plan.preview;
+  uint64_t preview_gap = plan.preview_gap;
+  uint64_t dst_len_worst_case = plan.dst_len_worst_case;
+
   uint8_t* const original_dst_ptr =
       (uint8_t*)QOIR_MALLOC((size_t)dst_len_worst_case);
   if (!original_dst_ptr) {
@@ -6883,6 +11970,19 @@ qoir_encode(                              //
       lossiness = 7;
     }
   }
+  if (tile_lossinesses) {
+    for (uint64_t i = 0; i < (width_in_tiles * height_in_tiles); i++) {
+      if (lossiness > tile_lossinesses[i]) {
+        lossiness = tile_lossinesses[i];
+      }
+    }
+  }
+  int32_t alpha_lossiness = -1;
+  if (options && options->separate_alpha_lossiness &&
+      (dst_pixfmt == QOIR_PIXEL_FORMAT__BGRA_NONPREMUL)) {
+    alpha_lossiness =
+        (options->alpha_lossiness < 7) ? (int32_t)options->alpha_lossiness : 7;
+  }
   uint8_t* dst_ptr = original_dst_ptr;
 
   // QOIR chunk.
@@ -6890,9 +11990,11 @@ qoir_encode(                              //
   qoir_private_poke_u64le(dst_ptr + 4, 8);
   qoir_private_poke_u32le(dst_ptr + 12, src_pixbuf->pixcfg.width_in_pixels);
   qoir_private_poke_u32le(dst_ptr + 16, src_pixbuf->pixcfg.height_in_pixels);
-  dst_ptr[15] = dst_pixfmt;
-  dst_ptr[19] = lossiness;
-  dst_ptr += 20;
+  dst_ptr[15] = dst_pixfmt | ((tile_shift - QOIR_TILE_SHIFT) << 4);
+  dst_ptr[19] = (uint8_t)(lossiness | ((alpha_lossiness >= 0)
+                                            ? (0x08 | (alpha_lossiness << 4))
+                                            : 0));
+  dst_ptr += 20 + preview_gap;
 
   // CICP chunk.
   if (options && options->metadata_cicp_len) {
@@ -6914,35 +12016,139 @@ qoir_encode(                              //
 
   // QPIX chunk.
   qoir_private_poke_u32le(dst_ptr, 0x58495051);  // "QPIX"le.
-  qoir_encode_buffer* encbuf = options ? options->encbuf : NULL;
-  bool free_encbuf = false;
-  if (!encbuf) {
-    encbuf = (qoir_encode_buffer*)QOIR_MALLOC(sizeof(qoir_encode_buffer));
-    if (!encbuf) {
+  uint8_t* scratch =
+      options ? qoir_private_supplied_scratch(QOIR_PRIVATE_SCRATCH__ENCBUF,
+                                              tile_shift, options->encbuf,
+                                              options->encbuf_len)
+              : NULL;
+  bool free_scratch = false;
+  if (!scratch) {
+    scratch = QOIR_ACQUIRE_SCRATCH(QOIR_PRIVATE_SCRATCH__ENCBUF, tile_shift);
+    if (!scratch) {
+      result.status_message = qoir_status_message__error_out_of_memory;
+      QOIR_FREE(original_dst_ptr);
+      return result;
+    }
+    free_scratch = true;
+  }
+  uint8_t* lz4_history = NULL;
+  if (options && (options->lz4_tile_group_size > 1)) {
+    lz4_history =
+        QOIR_ACQUIRE_SCRATCH(QOIR_PRIVATE_SCRATCH__LZ4_HISTORY, tile_shift);
+    if (!lz4_history) {
+      result.status_message = qoir_status_message__error_out_of_memory;
+      if (free_scratch) {
+        QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__ENCBUF, tile_shift, scratch);
+      }
+      QOIR_FREE(original_dst_ptr);
+      return result;
+    }
+  }
+  uint8_t* tile_averages = NULL;
+  if (preview) {
+    tile_averages =
+        (uint8_t*)QOIR_MALLOC(4 * width_in_tiles * height_in_tiles);
+    if (!tile_averages) {
       result.status_message = qoir_status_message__error_out_of_memory;
+      QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__LZ4_HISTORY, tile_shift,
+                           lz4_history);
+      if (free_scratch) {
+        QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__ENCBUF, tile_shift, scratch);
+      }
       QOIR_FREE(original_dst_ptr);
       return result;
     }
-    free_encbuf = true;
   }
   qoir_size_result r = qoir_private_encode_qpix_payload(
-      encbuf, dst_ptr + 12, src_pixbuf, lossiness, options && options->dither);
-  if (free_encbuf) {
-    QOIR_FREE(encbuf);
+      scratch, lz4_history, dst_ptr + 12, src_pixbuf, tile_shift, lossiness,
+      alpha_lossiness,
+      options && options->dither,
+      options ? options->near_lossless_tolerance : 0,
+      options ? options->lz4_tile_group_size : 0,
+      options && options->huffman_coding, options && options->split_ops,
+      options && (options->ops_version == 2),
+      options && options->chroma_subsampling,
+      options && options->alpha_plane, tile_averages, tile_lossinesses, NULL);
+  if (!r.status_message && ((uint64_t)r.value > 0x7FFFFFFFFFFFFFFFull)) {
+    r.status_message = qoir_status_message__error_unsupported_pixbuf_dimensions;
   }
   if (r.status_message) {
     result.status_message = r.status_message;
-    QOIR_FREE(original_dst_ptr);
-    return result;
-  } else if ((uint64_t)r.value > 0x7FFFFFFFFFFFFFFFull) {
-    result.status_message =
-        qoir_status_message__error_unsupported_pixbuf_dimensions;
+    QOIR_FREE(tile_averages);
+    QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__LZ4_HISTORY, tile_shift,
+                         lz4_history);
+    if (free_scratch) {
+      QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__ENCBUF, tile_shift, scratch);
+    }
     QOIR_FREE(original_dst_ptr);
     return result;
   }
   qoir_private_poke_u64le(dst_ptr + 4, r.value);
   dst_ptr += 12 + r.value;
 
+  // PRVW chunk.
+  uint8_t* head_ptr = original_dst_ptr;
+  if (preview) {
+    r = qoir_private_encode_prvw_chunk(
+        scratch, original_dst_ptr + 20, tile_averages,
+        (uint32_t)width_in_tiles, (uint32_t)height_in_tiles, dst_pixfmt,
+        tile_shift);
+    QOIR_FREE(tile_averages);
+    if (r.status_message) {
+      result.status_message = r.status_message;
+      QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__LZ4_HISTORY, tile_shift,
+                           lz4_history);
+      if (free_scratch) {
+        QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__ENCBUF, tile_shift, scratch);
+      }
+      QOIR_FREE(original_dst_ptr);
+      return result;
+    }
+    head_ptr += preview_gap - r.value;
+    memmove(head_ptr, original_dst_ptr, 20 + r.value);
+  }
+
+  // fPIX chunks.
+  if (options && (options->animation_frames_len > 0)) {
+    r = qoir_private_encode_fpix_chunks(scratch, lz4_history, dst_ptr,
+                                        src_pixbuf, tile_shift, lossiness,
+                                        alpha_lossiness, options);
+    if (r.status_message) {
+      result.status_message = r.status_message;
+      QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__LZ4_HISTORY, tile_shift,
+                           lz4_history);
+      if (free_scratch) {
+        QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__ENCBUF, tile_shift, scratch);
+      }
+      QOIR_FREE(original_dst_ptr);
+      return result;
+    }
+    dst_ptr += r.value;
+  }
+
+  // mPIX chunks.
+  if (num_mipmap_levels > 0) {
+    r = qoir_private_encode_mpix_chunks(
+        scratch, lz4_history, dst_ptr, src_pixbuf, dst_pixfmt, tile_shift,
+        num_mipmap_levels, lossiness, alpha_lossiness, options);
+    if (r.status_message) {
+      result.status_message = r.status_message;
+      QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__LZ4_HISTORY, tile_shift,
+                           lz4_history);
+      if (free_scratch) {
+        QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__ENCBUF, tile_shift, scratch);
+      }
+      QOIR_FREE(original_dst_ptr);
+      return result;
+    }
+    dst_ptr += r.value;
+  }
+  QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__LZ4_HISTORY, tile_shift,
+                       lz4_history);
+  if (free_scratch) {
+    QOIR_RELEASE_SCRATCH(QOIR_PRIVATE_SCRATCH__ENCBUF, tile_shift, scratch);
+  }
+
   // EXIF chunk.
   if (options && options->metadata_exif_len) {
     qoir_private_poke_u32le(dst_ptr + 0, 0x46495845);  // "EXIF"le.
@@ -6966,8 +12172,511 @@ qoir_encode(                              //
   dst_ptr += 12;
 
   result.owned_memory = original_dst_ptr;
-  result.dst_ptr = original_dst_ptr;
-  result.dst_len = dst_ptr - original_dst_ptr;
+  result.dst_ptr = head_ptr;
+  result.dst_len = dst_ptr - head_ptr;
+  return result;
+}
+
+// -------- QOIR Encode Per-Tile Lossiness
+
+// qoir_private_encode_tile_shift returns the tile shift for the options,
+// which have already been validated.
+static uint32_t                  //
+qoir_private_encode_tile_shift(  //
+    const qoir_encode_options* options) {
+  if (options) {
+    if (options->tile_size_in_pixels == 128) {
+      return 7;
+    } else if (options->tile_size_in_pixels == 256) {
+      return 8;
+    }
+  }
+  return QOIR_TILE_SHIFT;
+}
+
+// qoir_private_tile_looks_synthetic returns whether at least three quarters
+// of the tile's pixels exactly repeat their left neighbor or a recently seen
+// color (one that is still in a QOI-like 64 entry color cache). That is
+// typical for text, line art and flat user interface elements but not for
+// (noisy) photographic content.
+static bool                               //
+qoir_private_tile_looks_synthetic(        //
+    const qoir_pixel_buffer* src_pixbuf,  //
+    size_t x0,                            //
+    size_t y0,                            //
+    size_t tw,                            //
+    size_t th) {
+  size_t num_src_channels =
+      qoir_pixel_format__bytes_per_pixel(src_pixbuf->pixcfg.pixfmt);
+  uint32_t alpha_mask = (num_src_channels == 4) ? 0xFFFFFFFF : 0x00FFFFFF;
+  uint32_t color_cache[64] = {0};
+  size_t num_repeats = 0;
+  size_t max_num_others = (tw * th) / 4;
+  for (size_t y = 0; y < th; y++) {
+    // Stop early when the answer is already known.
+    if ((4 * num_repeats) >= (3 * tw * th)) {
+      return true;
+    } else if (((y * tw) - num_repeats) > max_num_others) {
+      return false;
+    }
+    const uint8_t* sp = src_pixbuf->data +
+                        (src_pixbuf->stride_in_bytes * (y0 + y)) +
+                        (num_src_channels * x0);
+    uint32_t prev = 0;
+    for (size_t x = 0; x < tw; x++) {
+      uint32_t cur = ((uint32_t)sp[0] << 0x00) |  //
+                     ((uint32_t)sp[1] << 0x08) |  //
+                     ((uint32_t)sp[2] << 0x10) |  //
+                     ((uint32_t)sp[num_src_channels - 1] << 0x18);
+      cur &= alpha_mask;
+      // 2654435761u is Knuth's magic constant.
+      uint32_t hash = (cur * 2654435761u) >> 26;
+      num_repeats += ((x > 0) && (cur == prev)) || (color_cache[hash] == cur);
+      color_cache[hash] = cur;
+      prev = cur;
+      sp += num_src_channels;
+    }
+  }
+  return (4 * num_repeats) >= (3 * tw * th);
+}
+
+// qoir_private_make_tile_lossinesses sets *out_tile_lossinesses to a newly
+// allocated array of each tile's lossiness, per the lossiness,
+// tile_lossiness_map and lossless_synthetic_tiles options. If the src_pixbuf
+// or options are invalid, it leaves *out_tile_lossinesses as NULL, so that
+// qoir_private_encode can report why.
+static const char*                        //
+qoir_private_make_tile_lossinesses(       //
+    uint8_t** out_tile_lossinesses,       //
+    const qoir_pixel_buffer* src_pixbuf,  //
+    const qoir_encode_options* options) {
+  uint32_t width = src_pixbuf->pixcfg.width_in_pixels;
+  uint32_t height = src_pixbuf->pixcfg.height_in_pixels;
+  uint32_t tile_size = options->tile_size_in_pixels;
+  if ((width > 0xFFFFFF) || (height > 0xFFFFFF) ||
+      (qoir_pixel_format__bytes_per_pixel(src_pixbuf->pixcfg.pixfmt) < 3) ||
+      ((tile_size != 0) && (tile_size != 64) && (tile_size != 128) &&
+       (tile_size != 256))) {
+    return NULL;
+  }
+  uint32_t tile_shift = qoir_private_encode_tile_shift(options);
+  size_t height_in_tiles = qoir_private_number_of_tiles_1d(height, tile_shift);
+  size_t width_in_tiles = qoir_private_number_of_tiles_1d(width, tile_shift);
+  uint8_t* tile_lossinesses =
+      (uint8_t*)QOIR_MALLOC(width_in_tiles * height_in_tiles);
+  if (!tile_lossinesses) {
+    return qoir_status_message__error_out_of_memory;
+  }
+
+  uint32_t lossiness = (options->lossiness < 7) ? options->lossiness : 7;
+  for (size_t ty = 0; ty < height_in_tiles; ty++) {
+    size_t th = qoir_private_tile_dimension(ty < (height_in_tiles - 1), height,
+                                            tile_shift);
+    for (size_t tx = 0; tx < width_in_tiles; tx++) {
+      size_t tw = qoir_private_tile_dimension(tx < (width_in_tiles - 1),
+                                              width, tile_shift);
+      size_t i = (ty * width_in_tiles) + tx;
+      uint32_t tl = lossiness;
+      if (options->tile_lossiness_map) {
+        uint32_t m = options->tile_lossiness_map[i];
+        tl = (tl > m) ? tl : (m < 7) ? m : 7;
+      }
+      if ((tl > 0) && options->lossless_synthetic_tiles &&
+          qoir_private_tile_looks_synthetic(src_pixbuf, tx << tile_shift,
+                                            ty << tile_shift, tw, th)) {
+        tl = 0;
+      }
+      tile_lossinesses[i] = (uint8_t)tl;
+    }
+  }
+  *out_tile_lossinesses = tile_lossinesses;
+  return NULL;
+}
+
+// -------- QOIR Encode Rate Control
+
+typedef struct qoir_private_tile_estimate_struct {
+  // The estimated encoded length (including the 4 byte prefix) at each
+  // lossiness level.
+  uint64_t costs[8];
+  uint32_t num_pixels;
+} qoir_private_tile_estimate;
+
+// qoir_private_estimate_op_cost estimates, in eighths of a byte, the cost of
+// the op for the cur pixel (after the prev pixel) at the given lossiness. It
+// ignores the color cache. Both pixels are BGRA packed as a little-endian
+// uint32_t.
+static QOIR_ALWAYS_INLINE uint32_t  //
+qoir_private_estimate_op_cost(      //
+    uint32_t cur,                   //
+    uint32_t prev,                  //
+    uint32_t lossiness) {
+  int32_t d[4];
+  int32_t m[4];
+  for (int i = 0; i < 4; i++) {
+    d[i] = (int8_t)(uint8_t)((((cur >> (8 * i)) & 0xFF) >> lossiness) -
+                             (((prev >> (8 * i)) & 0xFF) >> lossiness));
+    m[i] = (d[i] < 0) ? -d[i] : d[i];
+  }
+  int32_t m012 = (m[0] > m[1]) ? m[0] : m[1];
+  m012 = (m012 > m[2]) ? m012 : m[2];
+
+  if ((m012 | m[3]) == 0) {  // QOIR_OP_RUNS, amortized.
+    return 1;
+  } else if (m[3] != 0) {
+    int32_t m0123 = (m012 > m[3]) ? m012 : m[3];
+    return (m0123 <= 2) ? 16 : (m0123 <= 8) ? 24 : 40;
+  } else if (m012 <= 2) {  // QOIR_OP_BGR2.
+    return 8;
+  } else if ((m[1] <= 32) && ((d[0] - d[1]) >= -8) && ((d[0] - d[1]) <= 7) &&
+             ((d[2] - d[1]) >= -8) && ((d[2] - d[1]) <= 7)) {  // QOIR_OP_LUMA.
+    return 16;
+  }
+  return (m012 <= 64) ? 24 : 32;  // QOIR_OP_BGR7 or QOIR_OP_BGR8.
+}
+
+// qoir_private_estimate_tiles sets each tile's (in the natural order)
+// estimate. The model is cheap: it only looks at every eighth row and ignores
+// the color cache and any compression, but its relative costs (between
+// lossiness levels) are roughly right. qoir_private_calibrate_tiles corrects
+// the absolute costs.
+static void                               //
+qoir_private_estimate_tiles(              //
+    qoir_private_tile_estimate* ests,     //
+    const qoir_pixel_buffer* src_pixbuf,  //
+    uint32_t tile_shift) {
+  uint32_t width = src_pixbuf->pixcfg.width_in_pixels;
+  uint32_t height = src_pixbuf->pixcfg.height_in_pixels;
+  size_t height_in_tiles = qoir_private_number_of_tiles_1d(height, tile_shift);
+  size_t width_in_tiles = qoir_private_number_of_tiles_1d(width, tile_shift);
+  size_t tile_size = (size_t)1 << tile_shift;
+  size_t num_src_channels =
+      qoir_pixel_format__bytes_per_pixel(src_pixbuf->pixcfg.pixfmt);
+  bool has_alpha = (src_pixbuf->pixcfg.pixfmt &
+                    QOIR_PIXEL_FORMAT__MASK_FOR_ALPHA_TRANSPARENCY) !=
+                   QOIR_PIXEL_ALPHA_TRANSPARENCY__OPAQUE;
+
+  for (size_t ty = 0; ty < height_in_tiles; ty++) {
+    size_t th = qoir_private_tile_dimension(ty < (height_in_tiles - 1), height,
+                                            tile_shift);
+    for (size_t tx = 0; tx < width_in_tiles; tx++) {
+      size_t tw = qoir_private_tile_dimension(tx < (width_in_tiles - 1),
+                                              width, tile_shift);
+      uint64_t sums[8] = {0};
+      size_t num_rows = 0;
+      for (size_t y = 0; y < th; y += 8) {
+        const uint8_t* sp = src_pixbuf->data +
+                            (src_pixbuf->stride_in_bytes *
+                             ((ty * tile_size) + y)) +
+                            (num_src_channels * tx * tile_size);
+        uint32_t prev = 0xFF000000;  // Opaque black.
+        for (size_t x = 0; x < tw; x++) {
+          // The B and R order does not matter here.
+          uint32_t cur = ((uint32_t)sp[0] << 0x00) |  //
+                         ((uint32_t)sp[1] << 0x08) |  //
+                         ((uint32_t)sp[2] << 0x10) |  //
+                         ((uint32_t)(has_alpha ? sp[3] : 0xFF) << 0x18);
+          for (uint32_t lossiness = 0; lossiness < 8; lossiness++) {
+            sums[lossiness] +=
+                qoir_private_estimate_op_cost(cur, prev, lossiness);
+          }
+          prev = cur;
+          sp += num_src_channels;
+        }
+        num_rows++;
+      }
+
+      qoir_private_tile_estimate* est =
+          &ests[(ty * width_in_tiles) + tx];
+      for (int i = 0; i < 8; i++) {
+        est->costs[i] = 4 + ((sums[i] * th) / (8 * num_rows));
+      }
+      est->num_pixels = (uint32_t)(tw * th);
+    }
+  }
+}
+
+// qoir_private_calibrate_tiles scales each tile's estimated costs so that the
+// cost at that tile's lossiness matches its actual encoded length, read from
+// the tile prefixes in the QPIX payload at qpix_ptr. Higher lossinesses are
+// scaled by the same factor. Lower ones, down to the tile's minimum lossiness
+// (whose cost is assumed to already be exact), are scaled by an interpolated
+// factor.
+static void                               //
+qoir_private_calibrate_tiles(             //
+    qoir_private_tile_estimate* ests,     //
+    size_t num_tiles,                     //
+    const uint8_t* tile_lossinesses,      //
+    const uint8_t* min_tile_lossinesses,  //
+    const uint8_t* qpix_ptr) {
+  for (size_t i = 0; i < num_tiles; i++) {
+    uint64_t actual = 4 + (qoir_private_peek_u32le(qpix_ptr) & 0xFFFFFF);
+    qpix_ptr += actual;
+    uint32_t base_lossiness = min_tile_lossinesses[i];
+    uint32_t tl = tile_lossinesses[i];
+    // factor is a 16.16 fixed point number.
+    uint64_t factor = (actual << 16) / ests[i].costs[tl];
+    for (uint32_t j = base_lossiness; j < 8; j++) {
+      uint64_t f = factor;
+      if (j < tl) {
+        f = ((0x10000 * (uint64_t)(tl - j)) +
+             (factor * (uint64_t)(j - base_lossiness))) /
+            (tl - base_lossiness);
+      }
+      ests[i].costs[j] = ((ests[i].costs[j] * f) + 0x8000) >> 16;
+    }
+    ests[i].costs[tl] = actual;
+  }
+}
+
+// qoir_private_choose_tile_lossinesses picks each tile's lossiness, from its
+// minimum to 7, for the least distortion (roughly proportional to the
+// number of pixels times 4**lossiness) whose total estimated cost is at most
+// the budget. It minimizes (cost + lambda × distortion) per tile, searching
+// for the largest lambda (favoring quality) that fits.
+static void                                  //
+qoir_private_choose_tile_lossinesses(        //
+    uint8_t* tile_lossinesses,               //
+    const qoir_private_tile_estimate* ests,  //
+    size_t num_tiles,                        //
+    const uint8_t* min_tile_lossinesses,     //
+    uint64_t budget) {
+  // lambda is a 16.16 fixed point number.
+  uint64_t lo = 0;
+  uint64_t hi = (uint64_t)1 << 32;
+  for (int iteration = 0; iteration <= 32; iteration++) {
+    uint64_t lambda = (iteration < 32) ? ((lo + hi) / 2) : lo;
+    uint64_t total = 0;
+    for (size_t i = 0; i < num_tiles; i++) {
+      uint32_t best_lossiness = min_tile_lossinesses[i];
+      uint64_t best_score = UINT64_MAX;
+      for (uint32_t j = best_lossiness; j < 8; j++) {
+        uint64_t distortion = (uint64_t)ests[i].num_pixels *
+                              ((uint64_t)(1u << (2 * j)) - 1);
+        uint64_t score = (ests[i].costs[j] << 16) + (lambda * distortion);
+        if (best_score > score) {
+          best_lossiness = j;
+          best_score = score;
+        }
+      }
+      tile_lossinesses[i] = (uint8_t)best_lossiness;
+      total += ests[i].costs[best_lossiness];
+    }
+    if (iteration == 32) {
+      break;
+    } else if (total <= budget) {
+      lo = lambda;
+    } else {
+      hi = lambda;
+    }
+  }
+}
+
+// qoir_private_find_qpix_payload returns a pointer to the QPIX chunk's
+// payload in the chunks at ptr (which have been validated by their encoder).
+static const uint8_t*            //
+qoir_private_find_qpix_payload(  //
+    const uint8_t* ptr) {
+  while (qoir_private_peek_u32le(ptr) != 0x58495051) {  // "QPIX"le.
+    ptr += 12 + qoir_private_peek_u64le(ptr + 4);
+  }
+  return ptr + 12;
+}
+
+// qoir_private_encode_rate_controlled encodes with per-tile lossiness chosen
+// to meet options->target_dst_len, given that the result (with each tile at
+// its minimum lossiness, per the options) does not. That result calibrates
+// the estimates at every lossiness.
+// Each later pass re-calibrates the lossinesses at or above the ones it used
+// (as the estimates are least accurate there) and a further pass runs if the
+// target was missed or more than 1/32 of it was left unused. It returns the
+// highest quality pass that meets the target (or else the shortest pass).
+static qoir_encode_result                 //
+qoir_private_encode_rate_controlled(      //
+    const qoir_pixel_buffer* src_pixbuf,  //
+    const qoir_encode_options* options,   //
+    qoir_encode_result result) {
+  uint32_t tile_shift = qoir_private_encode_tile_shift(options);
+  size_t num_tiles = (size_t)qoir_private_number_of_tiles_1d(
+                         src_pixbuf->pixcfg.width_in_pixels, tile_shift) *
+                     (size_t)qoir_private_number_of_tiles_1d(
+                         src_pixbuf->pixcfg.height_in_pixels, tile_shift);
+  size_t target = options->target_dst_len;
+
+  qoir_private_tile_estimate* ests = (qoir_private_tile_estimate*)QOIR_MALLOC(
+      num_tiles * sizeof(qoir_private_tile_estimate));
+  uint8_t* tile_lossinesses = (uint8_t*)QOIR_MALLOC(2 * num_tiles);
+  if (!ests || !tile_lossinesses) {
+    QOIR_FREE(tile_lossinesses);
+    QOIR_FREE(ests);
+    QOIR_FREE(result.owned_memory);
+    memset(&result, 0, sizeof(result));
+    result.status_message = qoir_status_message__error_out_of_memory;
+    return result;
+  }
+  qoir_private_estimate_tiles(ests, src_pixbuf, tile_shift);
+
+  // The minimum lossinesses are those of the initial result: the QOIR chunk's
+  // lossiness plus each tile's extra lossiness.
+  uint8_t* min_tile_lossinesses = tile_lossinesses + num_tiles;
+  {
+    const uint8_t* p = qoir_private_find_qpix_payload(result.dst_ptr);
+    for (size_t i = 0; i < num_tiles; i++) {
+      min_tile_lossinesses[i] =
+          (uint8_t)((result.dst_ptr[19] & 7) + (7 & (p[3] >> 4)));
+      p += 4 + (qoir_private_peek_u32le(p) & 0xFFFFFF);
+    }
+  }
+  memcpy(tile_lossinesses, min_tile_lossinesses, num_tiles);
+
+  // margin accumulates a quarter of each overshoot. Re-calibrating corrects
+  // for most, but not all, of it. Subsequent passes aim below the target.
+  uint64_t margin = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    const uint8_t* qpix_ptr = qoir_private_find_qpix_payload(result.dst_ptr);
+    uint64_t overhead = result.dst_len - qoir_private_peek_u64le(qpix_ptr - 8);
+    qoir_private_calibrate_tiles(ests, num_tiles, tile_lossinesses,
+                                 min_tile_lossinesses, qpix_ptr);
+    qoir_private_choose_tile_lossinesses(
+        tile_lossinesses, ests, num_tiles, min_tile_lossinesses,
+        (target > (overhead + margin)) ? (target - (overhead + margin)) : 0);
+
+    qoir_encode_result r =
+        qoir_private_encode(src_pixbuf, options, tile_lossinesses);
+    if (r.dst_len > target) {
+      margin += (r.dst_len - target) / 4;
+    }
+    if (r.status_message) {
+      QOIR_FREE(result.owned_memory);
+      result = r;
+      break;
+    } else if ((r.dst_len <= target) ||
+               ((result.dst_len > target) && (r.dst_len < result.dst_len))) {
+      QOIR_FREE(result.owned_memory);
+      result = r;
+    } else {
+      QOIR_FREE(r.owned_memory);
+      break;
+    }
+    if ((result.dst_len <= target) &&
+        (result.dst_len >= (target - (target / 32)))) {
+      break;
+    }
+  }
+
+  QOIR_FREE(tile_lossinesses);
+  QOIR_FREE(ests);
+  return result;
+}
+
+// qoir_private_encode_with_memory_funcs is qoir_encode but it ignores the
+// options' arena_etc fields, allocating memory with the memory functions.
+static qoir_encode_result                 //
+qoir_private_encode_with_memory_funcs(    //
+    const qoir_pixel_buffer* src_pixbuf,  //
+    const qoir_encode_options* options) {
+  uint8_t* tile_lossinesses = NULL;
+  if (src_pixbuf && options &&
+      (options->tile_lossiness_map || options->lossless_synthetic_tiles)) {
+    const char* status_message = qoir_private_make_tile_lossinesses(
+        &tile_lossinesses, src_pixbuf, options);
+    if (status_message) {
+      qoir_encode_result result = {0};
+      result.status_message = status_message;
+      return result;
+    }
+  }
+  qoir_encode_result result =
+      qoir_private_encode(src_pixbuf, options, tile_lossinesses);
+  QOIR_FREE(tile_lossinesses);
+  if (result.status_message || !options ||
+      (options->target_dst_len == 0) ||
+      (result.dst_len <= options->target_dst_len)) {
+    return result;
+  }
+  return qoir_private_encode_rate_controlled(src_pixbuf, options, result);
+}
+
+QOIR_MAYBE_STATIC qoir_encode_result      //
+qoir_encode(                              //
+    const qoir_pixel_buffer* src_pixbuf,  //
+    const qoir_encode_options* options) {
+  if (!options || !options->arena_ptr) {
+    return qoir_private_encode_with_memory_funcs(src_pixbuf, options);
+  } else if (options->target_dst_len) {
+    qoir_encode_result result = {0};
+    result.status_message = qoir_status_message__error_invalid_argument;
+    return result;
+  }
+  qoir_private_arena arena = {0};
+  arena.ptr = options->arena_ptr;
+  arena.len = options->arena_len;
+  qoir_encode_options arena_options;
+  memcpy(&arena_options, options, sizeof(arena_options));
+  arena_options.contextual_malloc_func = &qoir_private_arena_malloc;
+  arena_options.contextual_free_func = &qoir_private_arena_free;
+  arena_options.memory_func_context = &arena;
+  qoir_encode_result result =
+      qoir_private_encode_with_memory_funcs(src_pixbuf, &arena_options);
+  result.owned_memory = NULL;
+  return result;
+}
+
+QOIR_MAYBE_STATIC qoir_size_result        //
+qoir_encode_arena_len(                    //
+    const qoir_pixel_buffer* src_pixbuf,  //
+    const qoir_encode_options* options) {
+  qoir_size_result result = {0};
+  if (options && options->target_dst_len) {
+    result.status_message = qoir_status_message__error_invalid_argument;
+    return result;
+  }
+  qoir_private_encode_plan_result plan =
+      qoir_private_encode_plan(src_pixbuf, options);
+  if (plan.status_message) {
+    result.status_message = plan.status_message;
+    return result;
+  }
+
+  // This follows qoir_encode's allocation order.
+  uint64_t num_tiles = plan.width_in_tiles * plan.height_in_tiles;
+  bool ok = true;
+  if (options &&
+      (options->tile_lossiness_map || options->lossless_synthetic_tiles)) {
+    ok = qoir_private_arena_add_len(&result.value, num_tiles);
+  }
+  ok = ok && qoir_private_arena_add_len(&result.value, plan.dst_len_worst_case);
+  if (!options || !qoir_private_supplied_scratch(
+                      QOIR_PRIVATE_SCRATCH__ENCBUF, plan.tile_shift,
+                      options->encbuf, options->encbuf_len)) {
+    ok = ok && qoir_private_arena_add_len(
+                   &result.value,
+                   qoir_private_scratch_len(QOIR_PRIVATE_SCRATCH__ENCBUF,
+                                            plan.tile_shift));
+  }
+  if (options && (options->lz4_tile_group_size > 1)) {
+    ok = ok && qoir_private_arena_add_len(
+                   &result.value,
+                   qoir_private_scratch_len(QOIR_PRIVATE_SCRATCH__LZ4_HISTORY,
+                                            plan.tile_shift));
+  }
+  if (plan.preview) {
+    ok = ok && qoir_private_arena_add_len(&result.value, 4 * num_tiles);
+  }
+  if (plan.num_mipmap_levels > 0) {
+    uint64_t w0 = src_pixbuf->pixcfg.width_in_pixels;
+    uint64_t w = qoir_private_mipmap_dimension(
+        src_pixbuf->pixcfg.width_in_pixels, 1);
+    uint64_t h = qoir_private_mipmap_dimension(
+        src_pixbuf->pixcfg.height_in_pixels, 1);
+    ok = ok && qoir_private_arena_add_len(&result.value,
+                                          (4 * w * h) + (8 * w0));
+  }
+  if (!ok) {
+    result.status_message =
+        qoir_status_message__error_unsupported_pixbuf_dimensions;
+    result.value = 0;
+  }
   return result;
 }
 
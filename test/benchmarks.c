@@ -41,7 +41,10 @@ const char error_not_implemented[] =  //
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
 
+int g_count_allocs;
+int g_lz4_tile_group_size;
 int g_number_of_reps;
+int g_tile_size;
 int g_verbose;
 
 typedef struct timings_struct {
@@ -80,14 +83,9 @@ print_timings(               //
   double dspeed = t->decode_micros
                       ? (t->decode_pixels / ((double)(t->decode_micros)))
                       : nan;
-#if defined(CONFIG_FULL_BENCHMARKS)
   printf(
-      "%-16s%6.4f CmpRatio  %8.2f EncMPixels/s  %8.2f DecMPixels/s  %s%s%s\n",
+      "%-18s%6.4f CmpRatio  %8.2f EncMPixels/s  %8.2f DecMPixels/s  %s%s%s\n",
       formatname, cratio, espeed, dspeed, name0, name1, name2);
-#else
-  printf("%-8s%6.4f CmpRatio  %8.2f EncMPixels/s  %8.2f DecMPixels/s  %s%s%s\n",
-         formatname, cratio, espeed, dspeed, name0, name1, name2);
-#endif
 }
 
 typedef struct timings_result_struct {
@@ -129,6 +127,95 @@ my_encode_qoir_lossless(     //
 
   qoir_encode_options encopts = {0};
   encopts.encbuf = &encbuf;
+  encopts.tile_size_in_pixels = g_tile_size;
+  encopts.lz4_tile_group_size = g_lz4_tile_group_size;
+  return qoir_encode(src_pixbuf, &encopts);
+}
+
+static qoir_encode_result    //
+my_encode_qoir_huffman(      //
+    const uint8_t* png_ptr,  //
+    const size_t png_len,    //
+    qoir_pixel_buffer* src_pixbuf) {
+  // static avoids an allocation every time this function is called, but it
+  // means that this function is not thread-safe.
+  static qoir_encode_buffer encbuf;
+
+  qoir_encode_options encopts = {0};
+  encopts.encbuf = &encbuf;
+  encopts.tile_size_in_pixels = g_tile_size;
+  encopts.lz4_tile_group_size = g_lz4_tile_group_size;
+  encopts.huffman_coding = true;
+  return qoir_encode(src_pixbuf, &encopts);
+}
+
+static qoir_encode_result    //
+my_encode_qoir_ops2(         //
+    const uint8_t* png_ptr,  //
+    const size_t png_len,    //
+    qoir_pixel_buffer* src_pixbuf) {
+  // static avoids an allocation every time this function is called, but it
+  // means that this function is not thread-safe.
+  static qoir_encode_buffer encbuf;
+
+  qoir_encode_options encopts = {0};
+  encopts.encbuf = &encbuf;
+  encopts.tile_size_in_pixels = g_tile_size;
+  encopts.lz4_tile_group_size = g_lz4_tile_group_size;
+  encopts.ops_version = 2;
+  return qoir_encode(src_pixbuf, &encopts);
+}
+
+#if defined(QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS)
+static qoir_encode_result    //
+my_encode_qoir_split_ops(    //
+    const uint8_t* png_ptr,  //
+    const size_t png_len,    //
+    qoir_pixel_buffer* src_pixbuf) {
+  // static avoids an allocation every time this function is called, but it
+  // means that this function is not thread-safe.
+  static qoir_encode_buffer encbuf;
+
+  qoir_encode_options encopts = {0};
+  encopts.encbuf = &encbuf;
+  encopts.tile_size_in_pixels = g_tile_size;
+  encopts.lz4_tile_group_size = g_lz4_tile_group_size;
+  encopts.split_ops = true;
+  return qoir_encode(src_pixbuf, &encopts);
+}
+#endif  // defined(QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS)
+
+static qoir_encode_result    //
+my_encode_qoir_chroma(       //
+    const uint8_t* png_ptr,  //
+    const size_t png_len,    //
+    qoir_pixel_buffer* src_pixbuf) {
+  // static avoids an allocation every time this function is called, but it
+  // means that this function is not thread-safe.
+  static qoir_encode_buffer encbuf;
+
+  qoir_encode_options encopts = {0};
+  encopts.encbuf = &encbuf;
+  encopts.tile_size_in_pixels = g_tile_size;
+  encopts.lz4_tile_group_size = g_lz4_tile_group_size;
+  encopts.chroma_subsampling = true;
+  return qoir_encode(src_pixbuf, &encopts);
+}
+
+static qoir_encode_result      //
+my_encode_qoir_near_lossless(  //
+    const uint8_t* png_ptr,    //
+    const size_t png_len,      //
+    qoir_pixel_buffer* src_pixbuf) {
+  // static avoids an allocation every time this function is called, but it
+  // means that this function is not thread-safe.
+  static qoir_encode_buffer encbuf;
+
+  qoir_encode_options encopts = {0};
+  encopts.encbuf = &encbuf;
+  encopts.tile_size_in_pixels = g_tile_size;
+  encopts.lz4_tile_group_size = g_lz4_tile_group_size;
+  encopts.near_lossless_tolerance = 2;
   return qoir_encode(src_pixbuf, &encopts);
 }
 
@@ -145,6 +232,8 @@ my_encode_qoir_lossy(        //
   qoir_encode_options encopts = {0};
   encopts.encbuf = &encbuf;
   encopts.lossiness = 2;
+  encopts.tile_size_in_pixels = g_tile_size;
+  encopts.lz4_tile_group_size = g_lz4_tile_group_size;
   return qoir_encode(src_pixbuf, &encopts);
 }
 #endif
@@ -174,8 +263,15 @@ format my_formats[] = {
     {"PNG/stb", &my_decode_png_stb, &my_encode_png_stb},
     {"PNG/wuffs", &my_decode_png_wuffs, &my_encode_png_wuffs},
     {"QOI", &my_decode_qoi, &my_encode_qoi},
+    {"QOIR_Chroma", &my_decode_qoir, &my_encode_qoir_chroma},
+    {"QOIR_Huffman", &my_decode_qoir, &my_encode_qoir_huffman},
     {"QOIR_Lossless", &my_decode_qoir, &my_encode_qoir_lossless},
     {"QOIR_Lossy", &my_decode_qoir, &my_encode_qoir_lossy},
+    {"QOIR_NearLossless", &my_decode_qoir, &my_encode_qoir_near_lossless},
+    {"QOIR_Ops2", &my_decode_qoir, &my_encode_qoir_ops2},
+#if defined(QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS)
+    {"QOIR_SplitOps", &my_decode_qoir, &my_encode_qoir_split_ops},
+#endif
     {"WebP_Lossless", &my_decode_webp, &my_encode_webp_lossless},
     {"WebP_Lossy", &my_decode_webp, &my_encode_webp_lossy},
     {"WebP_Lossy2", &my_decode_webp, &my_encode_webp_lossy2},
@@ -184,10 +280,17 @@ format my_formats[] = {
     {"ZPNG_NofilLsl", &my_decode_zpng, &my_encode_zpng_nofilter_lossless},
 #else
     {"QOIR", &my_decode_qoir, &my_encode_qoir_lossless},
+    {"QOIR_Chroma", &my_decode_qoir, &my_encode_qoir_chroma},
+    {"QOIR_Huffman", &my_decode_qoir, &my_encode_qoir_huffman},
+    {"QOIR_NearLossless", &my_decode_qoir, &my_encode_qoir_near_lossless},
+    {"QOIR_Ops2", &my_decode_qoir, &my_encode_qoir_ops2},
+#if defined(QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS)
+    {"QOIR_SplitOps", &my_decode_qoir, &my_encode_qoir_split_ops},
+#endif
 #endif
 };
 
-#define MAX_INCL_NUMBER_OF_FORMATS 22
+#define MAX_INCL_NUMBER_OF_FORMATS 27
 
 static inline size_t  //
 number_of_formats() {
@@ -280,6 +383,80 @@ encode_decode(               //
 
 // ----
 
+// With -count_allocs, instead of timing each format, this counts the memory
+// allocations made by qoir_encode and qoir_decode calls that pass no encbuf
+// or decbuf, averaged over the repetitions. Compare building with and without
+// -DQOIR_CONFIG__CACHE_SCRATCH_BUFFERS.
+
+typedef struct alloc_counts_struct {
+  uint64_t num_mallocs;
+  uint64_t num_bytes;
+} alloc_counts;
+
+static void*        //
+counting_malloc(    //
+    void* context,  //
+    size_t len) {
+  alloc_counts* c = (alloc_counts*)context;
+  c->num_mallocs++;
+  c->num_bytes += len;
+  return malloc(len);
+}
+
+static void         //
+counting_free(      //
+    void* context,  //
+    void* ptr) {
+  free(ptr);
+}
+
+static const char*      //
+count_allocs(           //
+    const char* name0,  //
+    const char* name1,  //
+    const char* name2,  //
+    const qoir_pixel_buffer* src_pixbuf) {
+  alloc_counts enc_counts = {0};
+  alloc_counts dec_counts = {0};
+  qoir_encode_options encopts = {0};
+  encopts.contextual_malloc_func = &counting_malloc;
+  encopts.contextual_free_func = &counting_free;
+  encopts.memory_func_context = &enc_counts;
+  qoir_decode_options decopts = {0};
+  decopts.contextual_malloc_func = &counting_malloc;
+  decopts.contextual_free_func = &counting_free;
+  decopts.memory_func_context = &dec_counts;
+
+  int n = (g_number_of_reps > 0) ? g_number_of_reps : 1;
+  for (int i = 0; i < n; i++) {
+    qoir_encode_result enc = qoir_encode(src_pixbuf, &encopts);
+    if (enc.status_message) {
+      printf("%s%s%s: could not encode: %s\n", name0, name1, name2,
+             enc.status_message);
+      return enc.status_message;
+    }
+    qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &decopts);
+    free(enc.owned_memory);
+    if (dec.status_message) {
+      printf("%s%s%s: could not decode: %s\n", name0, name1, name2,
+             dec.status_message);
+      return dec.status_message;
+    }
+    free(dec.owned_memory);
+  }
+  qoir_free_cached_scratch_buffers();
+
+  printf("%-18s%8.2f EncMallocs  %10.0f EncBytes  %8.2f DecMallocs  %10.0f "
+         "DecBytes  %s%s%s\n",
+         "QOIR_Lossless", enc_counts.num_mallocs / ((double)n),
+         enc_counts.num_bytes / ((double)n),
+         dec_counts.num_mallocs / ((double)n),
+         dec_counts.num_bytes / ((double)n), name0, name1, name2);
+  return NULL;
+}
+
+// ----
+
 typedef struct my_context_struct {
   const char* benchname;
   timings timings[MAX_INCL_NUMBER_OF_FORMATS][WALK_DIRECTORY_MAX_EXCL_DEPTH];
@@ -324,6 +501,11 @@ bench_one_png(               //
   pixbuf.stride_in_bytes = (size_t)channels * (size_t)width;
 
   const char* ret = NULL;
+  if (g_count_allocs) {
+    ret = count_allocs(z->benchname, dirname, filename, &pixbuf);
+    stbi_image_free(pixbuf_data);
+    return ret;
+  }
   for (size_t i = 0; i < number_of_formats(); i++) {
     timings_result t = encode_decode(z->benchname, dirname, filename,
                                      &my_formats[i], src_ptr, src_len, &pixbuf);
@@ -392,7 +574,7 @@ my_file_callback(         //
       memset(&z->timings[i][depth], 0, sizeof(z->timings[i][depth]));
     }
     result = bench_one_png(z, depth, dirname, filename, r.dst_ptr, r.dst_len);
-    if (g_verbose || (z->benchname[0] == '\x00')) {
+    if (!g_count_allocs && (g_verbose || (z->benchname[0] == '\x00'))) {
       for (size_t i = 0; i < number_of_formats(); i++) {
         print_timings(&z->timings[i][depth], my_formats[i].name, z->benchname,
                       dirname, filename);
@@ -439,7 +621,10 @@ int            //
 main(          //
     int argc,  //
     char** argv) {
+  g_count_allocs = 0;
+  g_lz4_tile_group_size = 0;
   g_number_of_reps = 5;
+  g_tile_size = 0;
   g_verbose = 0;
 
   if (ARRAY_SIZE(my_formats) > MAX_INCL_NUMBER_OF_FORMATS) {
@@ -461,11 +646,17 @@ main(          //
       arg++;
     }
 
-    if (!strncmp(arg, "n=", 2)) {
+    if (!strcmp(arg, "count_allocs")) {
+      g_count_allocs = 1;
+    } else if (!strncmp(arg, "lz4_tile_group_size=", 20)) {
+      g_lz4_tile_group_size = atoi(arg + 20);
+    } else if (!strncmp(arg, "n=", 2)) {
       int x = atoi(arg + 2);
       if (x >= 0) {
         g_number_of_reps = x;
       }
+    } else if (!strncmp(arg, "tile_size=", 10)) {
+      g_tile_size = atoi(arg + 10);
     } else if (!strncmp(arg, "v", 2)) {
       g_verbose = 1;
     } else {
@@ -206,7 +206,7 @@ test_swizzle(  //
 
 // ----
 
-int                        //
+int                       //
 do_test_round_trip(        //
     const char* testname,  //
     const char* filename) {
@@ -239,10 +239,2547 @@ test_round_trip(  //
 
 // ----
 
+int           //
+test_mipmap(  //
+    void) {
+  // Make a 100 × 70 opaque gradient. Its mipmap levels are 50 × 35, 25 × 18,
+  // 13 × 9, 7 × 5, 4 × 3, 2 × 2 and then 1 × 1.
+  enum { W = 100, H = 70 };
+  static uint8_t pixels[4 * W * H];
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      p[0] = (uint8_t)(2 * x);
+      p[1] = (uint8_t)(3 * y);
+      p[2] = (uint8_t)((x * y) >> 3);
+      p[3] = 0xFF;
+    }
+  }
+
+  qoir_encode_options enc_opts = {0};
+  enc_opts.mipmap_levels = 99;
+  qoir_pixel_buffer src_pixbuf = {0};
+  src_pixbuf.pixcfg.pixfmt = QOIR_PIXEL_FORMAT__BGRX;
+  src_pixbuf.pixcfg.width_in_pixels = W;
+  src_pixbuf.pixcfg.height_in_pixels = H;
+  src_pixbuf.data = pixels;
+  src_pixbuf.stride_in_bytes = 4 * W;
+  qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+  if (enc.status_message) {
+    printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+    return 1;
+  }
+
+  // Count the "mPIX" chunks.
+  uint32_t num_levels = 0;
+  for (size_t i = 0; (i + 4) <= enc.dst_len; i++) {
+    num_levels += memcmp(enc.dst_ptr + i, "mPIX", 4) == 0;
+  }
+  if (num_levels != 7) {
+    printf("%s: num_levels: have %u, want 7\n", __func__, num_levels);
+    free(enc.owned_memory);
+    return 1;
+  }
+
+  // The smallest level that is at least 20 × 10 is level 2 (25 × 18).
+  qoir_decode_options dec_opts = {0};
+  dec_opts.pixfmt = QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
+  dec_opts.mipmap_min_width_in_pixels = 20;
+  dec_opts.mipmap_min_height_in_pixels = 10;
+  qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &dec_opts);
+  free(enc.owned_memory);
+  if (dec.status_message) {
+    printf("%s: qoir_decode: %s\n", __func__, dec.status_message);
+    return 1;
+  } else if ((dec.dst_pixbuf.pixcfg.width_in_pixels != 25) ||
+             (dec.dst_pixbuf.pixcfg.height_in_pixels != 18)) {
+    printf("%s: dimensions: have %u × %u, want 25 × 18\n", __func__,
+           dec.dst_pixbuf.pixcfg.width_in_pixels,
+           dec.dst_pixbuf.pixcfg.height_in_pixels);
+    free(dec.owned_memory);
+    return 1;
+  }
+
+  // Check level 2 against a reference box filter, applied twice.
+  static uint8_t want[4 * W * H];
+  memcpy(want, pixels, sizeof(pixels));
+  uint32_t w = W;
+  uint32_t h = H;
+  for (int level = 0; level < 2; level++) {
+    uint32_t half_w = (w + 1) / 2;
+    uint32_t half_h = (h + 1) / 2;
+    for (uint32_t y = 0; y < half_h; y++) {
+      for (uint32_t x = 0; x < half_w; x++) {
+        for (uint32_t c = 0; c < 4; c++) {
+          uint32_t sum = 0;
+          uint32_t n = 0;
+          for (uint32_t yy = 2 * y; (yy < h) && (yy <= (2 * y) + 1); yy++) {
+            for (uint32_t xx = 2 * x; (xx < w) && (xx <= (2 * x) + 1); xx++) {
+              sum += want[(4 * ((w * yy) + xx)) + c];
+              n++;
+            }
+          }
+          want[(4 * ((half_w * y) + x)) + c] = (uint8_t)((sum + (n / 2)) / n);
+        }
+      }
+    }
+    w = half_w;
+    h = half_h;
+  }
+  const uint8_t* have = dec.dst_pixbuf.data;
+  for (uint32_t y = 0; y < h; y++) {
+    if (memcmp(have + (y * dec.dst_pixbuf.stride_in_bytes), want + (4 * w * y),
+               4 * w)) {
+      printf("%s: pixels differ in row %u\n", __func__, y);
+      free(dec.owned_memory);
+      return 1;
+    }
+  }
+  free(dec.owned_memory);
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+// ----
+
+int            //
+test_preview(  //
+    void) {
+  // Make a 1100 × 70 image: 18 × 2 tiles, so the preview is 9 × 1. The left
+  // half is opaque blue and the right half is transparent red.
+  enum { W = 1100, H = 70 };
+  static uint8_t pixels[4 * W * H];
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      bool left = x < (W / 2);
+      p[0] = left ? 0xFF : 0x00;
+      p[1] = 0x00;
+      p[2] = left ? 0x00 : 0xFF;
+      p[3] = left ? 0xFF : 0x00;
+    }
+  }
+
+  qoir_encode_options enc_opts = {0};
+  enc_opts.preview = true;
+  qoir_pixel_buffer src_pixbuf = {0};
+  src_pixbuf.pixcfg.pixfmt = QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
+  src_pixbuf.pixcfg.width_in_pixels = W;
+  src_pixbuf.pixcfg.height_in_pixels = H;
+  src_pixbuf.data = pixels;
+  src_pixbuf.stride_in_bytes = 4 * W;
+  qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+  if (enc.status_message) {
+    printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+    return 1;
+  }
+
+  // The full sized image should still round trip.
+  const char* status_message =
+      check_round_trip_3(&src_pixbuf, enc.dst_ptr, enc.dst_len);
+  if (status_message) {
+    printf("%s: check_round_trip_3: %s\n", __func__, status_message);
+    free(enc.owned_memory);
+    return 1;
+  }
+
+  // The preview should be decodable from only the first few hundred bytes.
+  qoir_decode_options dec_opts = {0};
+  dec_opts.pixfmt = QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
+  qoir_decode_result dec = qoir_decode_preview(enc.dst_ptr, 300, &dec_opts);
+  free(enc.owned_memory);
+  if (dec.status_message) {
+    printf("%s: qoir_decode_preview: %s\n", __func__, dec.status_message);
+    return 1;
+  } else if ((dec.dst_pixbuf.pixcfg.width_in_pixels != 9) ||
+             (dec.dst_pixbuf.pixcfg.height_in_pixels != 1)) {
+    printf("%s: dimensions: have %u × %u, want 9 × 1\n", __func__,
+           dec.dst_pixbuf.pixcfg.width_in_pixels,
+           dec.dst_pixbuf.pixcfg.height_in_pixels);
+    free(dec.owned_memory);
+    return 1;
+  }
+
+  // The 5th preview pixel straddles the boundary (38 of its 128 columns are
+  // opaque). Its color should not be polluted by the transparent red.
+  static const uint8_t want[36] = {
+      0xFF, 0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00, 0xFF,
+      0xFF, 0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00, 0x4C, 0x00, 0x00, 0xFF, 0x00,
+      0x00, 0x00, 0xFF, 0x00, 0x00, 0x00, 0xFF, 0x00, 0x00, 0x00, 0xFF, 0x00,
+  };
+  if (memcmp(dec.dst_pixbuf.data, want, 36)) {
+    printf("%s: pixels differ\n", __func__);
+    free(dec.owned_memory);
+    return 1;
+  }
+  free(dec.owned_memory);
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+// ----
+
+int              //
+test_tile_size(  //
+    void) {
+  enum { W = 300, H = 200 };
+  static uint8_t pixels[4 * W * H];
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      p[0] = (uint8_t)((x * y) >> 4);
+      p[1] = (uint8_t)(x ^ y);
+      p[2] = (uint8_t)(((x / 7) * 13) + (y / 5));
+      p[3] = 0xFF;
+    }
+  }
+  qoir_pixel_buffer src_pixbuf = {0};
+  src_pixbuf.pixcfg.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+  src_pixbuf.pixcfg.width_in_pixels = W;
+  src_pixbuf.pixcfg.height_in_pixels = H;
+  src_pixbuf.data = pixels;
+  src_pixbuf.stride_in_bytes = 4 * W;
+
+  // Caller supplied buffers are sized for 64 pixel tiles. Larger tiles
+  // should ignore them and allocate larger scratch space.
+  static qoir_encode_buffer encbuf;
+  static qoir_decode_buffer decbuf;
+  static const uint32_t tile_sizes[3] = {64, 128, 256};
+  for (int i = 0; i < 3; i++) {
+    qoir_encode_options enc_opts = {0};
+    enc_opts.encbuf = &encbuf;
+    enc_opts.tile_size_in_pixels = tile_sizes[i];
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+    if (enc.status_message) {
+      printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+      return 1;
+    }
+
+    qoir_decode_pixel_configuration_result config =
+        qoir_decode_pixel_configuration(enc.dst_ptr, enc.dst_len);
+    if (config.tile_size_in_pixels != tile_sizes[i]) {
+      printf("%s: tile_size_in_pixels: have %u, want %u\n", __func__,
+             config.tile_size_in_pixels, tile_sizes[i]);
+      free(enc.owned_memory);
+      return 1;
+    }
+
+    const char* status_message =
+        check_round_trip_3(&src_pixbuf, enc.dst_ptr, enc.dst_len);
+    if (status_message) {
+      printf("%s: tile size %u: %s\n", __func__, tile_sizes[i],
+             status_message);
+      free(enc.owned_memory);
+      return 1;
+    }
+
+    qoir_decode_options dec_opts = {0};
+    dec_opts.decbuf = &decbuf;
+    const char* problem = NULL;
+    if (qoir_validate(enc.dst_ptr, enc.dst_len, &dec_opts).status_message) {
+      problem = "qoir_validate failed";
+    }
+
+    qoir_decoder decoder;
+    qoir_decoder__initialize(&decoder, &dec_opts);
+    qoir_decoder_feed_result res =
+        qoir_decoder__feed(&decoder, enc.dst_ptr, enc.dst_len);
+    if (!problem && (res.status_message || !res.done ||
+                     !pixbufs_are_equal(&src_pixbuf, &res.dst_pixbuf))) {
+      problem = "qoir_decoder__feed failed";
+    }
+    qoir_decoder__destroy(&decoder);
+
+    qoir_size_result arena_len =
+        qoir_decode_arena_len(enc.dst_ptr, enc.dst_len, &dec_opts);
+    uint8_t* arena = arena_len.status_message ? NULL : malloc(arena_len.value);
+    qoir_decode_options arena_opts = dec_opts;
+    arena_opts.arena_ptr = arena;
+    arena_opts.arena_len = arena_len.value;
+    qoir_decode_result arena_dec =
+        qoir_decode(enc.dst_ptr, enc.dst_len, &arena_opts);
+    if (!problem && (!arena || arena_dec.status_message ||
+                     !pixbufs_are_equal(&src_pixbuf, &arena_dec.dst_pixbuf))) {
+      problem = "arena decode failed";
+    }
+    free(arena);
+    if (problem) {
+      printf("%s: tile size %u: %s\n", __func__, tile_sizes[i], problem);
+      free(enc.owned_memory);
+      return 1;
+    }
+
+    // Decode a clipped region that straddles tile boundaries.
+    static uint8_t clipped[4 * W * H];
+    memset(clipped, 0, sizeof(clipped));
+    dec_opts.pixbuf = src_pixbuf;
+    dec_opts.pixbuf.data = clipped;
+    dec_opts.use_src_clip_rectangle = true;
+    dec_opts.src_clip_rectangle = qoir_make_rectangle(100, 50, 270, 190);
+    qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &dec_opts);
+    free(enc.owned_memory);
+    if (dec.status_message) {
+      printf("%s: qoir_decode: %s\n", __func__, dec.status_message);
+      return 1;
+    }
+    for (uint32_t y = 50; y < 190; y++) {
+      size_t offset = 4 * ((W * y) + 100);
+      if (memcmp(clipped + offset, pixels + offset, 4 * 170)) {
+        printf("%s: tile size %u: clipped pixels differ\n", __func__,
+               tile_sizes[i]);
+        return 1;
+      }
+    }
+  }
+
+  // A noisy tile's EncodedTileLength stays within (4 * TileSize * TileSize),
+  // even though LZ4 grows incompressible literals. Conversely, decoding an
+  // (otherwise valid) LZ4-Literals tile longer than that is rejected, except
+  // for 64 pixel tiles, which earlier encoders could write.
+  for (int i = 0; i < 3; i++) {
+    uint32_t ts = tile_sizes[i];
+    uint32_t max_tile_len = 4 * ts * ts;
+    static uint8_t noise[4 * 256 * 256];
+    qoir_pixel_buffer noise_pixbuf = make_noise_pixbuf(
+        noise, QOIR_PIXEL_FORMAT__BGRA_NONPREMUL, ts, ts, 0x12345678);
+    qoir_encode_options enc_opts = {0};
+    enc_opts.tile_size_in_pixels = ts;
+    qoir_encode_result enc = qoir_encode(&noise_pixbuf, &enc_opts);
+    if (enc.status_message) {
+      printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+      return 1;
+    }
+    // The QPIX chunk's only tile starts at offset 32.
+    uint32_t tile_len = enc.dst_ptr[32] | (enc.dst_ptr[33] << 8) |
+                        (enc.dst_ptr[34] << 16);
+    if (tile_len > max_tile_len) {
+      printf("%s: tile size %u: tile_len: have %u, want <= %u\n", __func__,
+             ts, tile_len, max_tile_len);
+      free(enc.owned_memory);
+      return 1;
+    }
+    const char* status_message =
+        check_round_trip_3(&noise_pixbuf, enc.dst_ptr, enc.dst_len);
+    if (status_message) {
+      printf("%s: tile size %u: noise: %s\n", __func__, ts, status_message);
+      free(enc.owned_memory);
+      return 1;
+    }
+
+    // Re-code the tile as a single LZ4 literal run. Its literal length takes
+    // one 0xF0 token and ((max_tile_len - 15) / 255) + 1 extension bytes.
+    static uint8_t crafted[(4 * 256 * 256) + 2048];
+    size_t n = 20;
+    memcpy(crafted, enc.dst_ptr, n);  // The QOIR chunk.
+    uint32_t num_ext = ((max_tile_len - 15) / 255) + 1;
+    uint32_t lz4_len = 1 + num_ext + max_tile_len;
+    uint32_t payload_len = 4 + lz4_len;
+    memcpy(crafted + n, "QPIX", 4);
+    for (int k = 0; k < 8; k++) {
+      crafted[n + 4 + k] = (uint8_t)((k < 4) ? (payload_len >> (8 * k)) : 0);
+    }
+    n += 12;
+    crafted[n++] = (uint8_t)(lz4_len >> 0);
+    crafted[n++] = (uint8_t)(lz4_len >> 8);
+    crafted[n++] = (uint8_t)(lz4_len >> 16);
+    crafted[n++] = 0x02;  // LZ4-Literals.
+    crafted[n++] = 0xF0;
+    memset(crafted + n, 0xFF, num_ext - 1);
+    n += num_ext - 1;
+    crafted[n++] = (uint8_t)((max_tile_len - 15) % 255);
+    memcpy(crafted + n, noise, max_tile_len);
+    n += max_tile_len;
+    memcpy(crafted + n, "QEND\x00\x00\x00\x00\x00\x00\x00\x00", 12);
+    n += 12;
+    free(enc.owned_memory);
+
+    qoir_decode_result dec = qoir_decode(crafted, n, NULL);
+    free(dec.owned_memory);
+    const char* want =
+        (ts == 64) ? NULL : qoir_status_message__error_invalid_data;
+    if (dec.status_message != want) {
+      printf("%s: tile size %u: over-long LZ4 tile: have \"%s\"\n", __func__,
+             ts, dec.status_message);
+      return 1;
+    }
+  }
+
+  // Tile size codes above 2 (i.e. above 256 pixels) are unsupported.
+  qoir_encode_result enc = qoir_encode(&src_pixbuf, NULL);
+  if (enc.status_message) {
+    printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+    return 1;
+  }
+  enc.dst_ptr[15] |= 0x30;
+  qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, NULL);
+  free(enc.owned_memory);
+  free(dec.owned_memory);
+  if (dec.status_message != qoir_status_message__error_unsupported_tile_size) {
+    printf("%s: unsupported tile size: have \"%s\"\n", __func__,
+           dec.status_message);
+    return 1;
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+// ----
+
+int                   //
+test_lz4_tile_group(  //
+    void) {
+  // Every tile in a tile row is the same noisy pattern, which LZ4 can't
+  // compress on a per-tile basis but can across tiles.
+  enum { W = 512, H = 100 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__RGBA_NONPREMUL, W, H, 0x12345678);
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      if (x < 64) {
+        p[3] = 0xFF;
+      } else {
+        memcpy(p, p - (4 * 64), 4);
+      }
+    }
+  }
+
+  size_t dst_lens[2] = {0};
+  static const uint32_t group_sizes[2] = {0, 8};
+  for (int i = 0; i < 2; i++) {
+    qoir_encode_options enc_opts = {0};
+    enc_opts.lz4_tile_group_size = group_sizes[i];
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+    if (enc.status_message) {
+      printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+      return 1;
+    }
+    dst_lens[i] = enc.dst_len;
+
+    // The second tile should be LZ4-Chained-Ops.
+    int format = encoded_tile_format(enc.dst_ptr, enc.dst_len, 1);
+    if ((format == 5) != (group_sizes[i] > 1)) {
+      printf("%s: group size %u: unexpected tile format %d\n", __func__,
+             group_sizes[i], format);
+      free(enc.owned_memory);
+      return 1;
+    }
+
+    const char* status_message =
+        check_round_trip_3(&src_pixbuf, enc.dst_ptr, enc.dst_len);
+    if (status_message) {
+      printf("%s: group size %u: %s\n", __func__, group_sizes[i],
+             status_message);
+      free(enc.owned_memory);
+      return 1;
+    }
+
+    // Decode a clipped region that excludes the start of each tile group.
+    static uint8_t clipped[4 * W * H];
+    memset(clipped, 0, sizeof(clipped));
+    qoir_decode_options dec_opts = {0};
+    dec_opts.pixbuf = src_pixbuf;
+    dec_opts.pixbuf.data = clipped;
+    dec_opts.use_src_clip_rectangle = true;
+    dec_opts.src_clip_rectangle = qoir_make_rectangle(300, 70, 500, 100);
+    qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &dec_opts);
+    free(enc.owned_memory);
+    if (dec.status_message) {
+      printf("%s: qoir_decode: %s\n", __func__, dec.status_message);
+      return 1;
+    }
+    for (uint32_t y = 70; y < 100; y++) {
+      size_t offset = 4 * ((W * y) + 300);
+      if (memcmp(clipped + offset, pixels + offset, 4 * 200)) {
+        printf("%s: group size %u: clipped pixels differ\n", __func__,
+               group_sizes[i]);
+        return 1;
+      }
+    }
+  }
+
+  if ((dst_lens[1] * 4) > dst_lens[0]) {
+    printf("%s: dst_len: have %zu (grouped) vs %zu (ungrouped)\n", __func__,
+           dst_lens[1], dst_lens[0]);
+    return 1;
+  }
+
+  // A huge (raw) Ops tile followed by an LZ4-Chained-Ops tile is rejected,
+  // rather than copying the first tile's ops into the LZ4 history. Clipping
+  // out the first tile still needs its ops, for the second tile.
+  {
+    qoir_pixel_buffer small_pixbuf = src_pixbuf;
+    small_pixbuf.pixcfg.pixfmt = QOIR_PIXEL_FORMAT__BGRX;
+    small_pixbuf.pixcfg.width_in_pixels = 128;
+    small_pixbuf.pixcfg.height_in_pixels = 64;
+    qoir_encode_result enc = qoir_encode(&small_pixbuf, NULL);
+    if (enc.status_message) {
+      printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+      return 1;
+    }
+    enum { HUGE_TILE_LEN = 600000 };
+    static uint8_t crafted[HUGE_TILE_LEN + 1024];
+    memset(crafted, 0, sizeof(crafted));
+    size_t n = 20;
+    memcpy(crafted, enc.dst_ptr, n);  // The QOIR chunk.
+    free(enc.owned_memory);
+    uint32_t payload_len = 4 + HUGE_TILE_LEN + 4 + 2;
+    memcpy(crafted + n, "QPIX", 4);
+    for (int k = 0; k < 4; k++) {
+      crafted[n + 4 + k] = (uint8_t)(payload_len >> (8 * k));
+    }
+    n += 12;
+    crafted[n++] = (uint8_t)(HUGE_TILE_LEN >> 0);
+    crafted[n++] = (uint8_t)(HUGE_TILE_LEN >> 8);
+    crafted[n++] = (uint8_t)(HUGE_TILE_LEN >> 16);
+    crafted[n++] = 0x01;  // Ops.
+    n += HUGE_TILE_LEN;
+    crafted[n++] = 0x02;
+    crafted[n++] = 0x00;
+    crafted[n++] = 0x00;
+    crafted[n++] = 0x05;  // LZ4-Chained-Ops.
+    crafted[n++] = 0x10;
+    crafted[n++] = 0x00;
+    memcpy(crafted + n, "QEND\x00\x00\x00\x00\x00\x00\x00\x00", 12);
+    n += 12;
+
+    qoir_decode_options dec_opts = {0};
+    dec_opts.use_src_clip_rectangle = true;
+    dec_opts.src_clip_rectangle = qoir_make_rectangle(64, 0, 128, 64);
+    qoir_decode_result dec = qoir_decode(crafted, n, &dec_opts);
+    free(dec.owned_memory);
+    if (dec.status_message != qoir_status_message__error_invalid_data) {
+      printf("%s: huge chained tile: have \"%s\"\n", __func__,
+             dec.status_message);
+      return 1;
+    }
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+// ----
+
+int            //
+test_huffman(  //
+    void) {
+  // A smooth gradient plus a little noise gives a skewed distribution of op
+  // bytes, which suits entropy coding.
+  enum { W = 200, H = 150 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__RGBA_NONPREMUL, W, H, 0x9E3779B9);
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      p[0] = (uint8_t)(x + (p[0] & 3));
+      p[1] = (uint8_t)(y + (p[1] & 3));
+      p[2] = (uint8_t)((x + y) / 2);
+      p[3] = 0xFF;
+    }
+  }
+
+  qoir_encode_result plain = qoir_encode(&src_pixbuf, NULL);
+  free(plain.owned_memory);
+  qoir_encode_options enc_opts = {0};
+  enc_opts.huffman_coding = true;
+  qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+  if (plain.status_message || enc.status_message) {
+    printf("%s: qoir_encode failed\n", __func__);
+    free(enc.owned_memory);
+    return 1;
+  } else if (enc.dst_len >= plain.dst_len) {
+    printf("%s: dst_len: have %zu (Huffman) vs %zu (LZ4)\n", __func__,
+           enc.dst_len, plain.dst_len);
+    free(enc.owned_memory);
+    return 1;
+  } else if (encoded_tile_format(enc.dst_ptr, enc.dst_len, 0) != 6) {
+    printf("%s: unexpected tile format %d\n", __func__,
+           encoded_tile_format(enc.dst_ptr, enc.dst_len, 0));
+    free(enc.owned_memory);
+    return 1;
+  }
+
+  const char* status_message =
+      check_round_trip_3(&src_pixbuf, enc.dst_ptr, enc.dst_len);
+  if (status_message) {
+    printf("%s: %s\n", __func__, status_message);
+    free(enc.owned_memory);
+    return 1;
+  }
+
+  // Corrupting the Huffman header or bitstreams should fail gracefully (or,
+  // for some bitstream bytes, silently produce different pixels).
+  for (size_t i = 36; i < 36 + 400; i += 3) {
+    enc.dst_ptr[i] ^= 0x5A;
+    qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, NULL);
+    free(dec.owned_memory);
+    enc.dst_ptr[i] ^= 0x5A;
+  }
+  free(enc.owned_memory);
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+// ----
+
+int              //
+test_split_ops(  //
+    void) {
+  // Noise gives a mix of ops with and without payloads. The image is wider
+  // than one tile so that some tiles hold many blocks of 16 ops.
+  enum { W = 150, H = 70 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__RGBA_NONPREMUL, W, H, 0x12345678);
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      p[0] = (uint8_t)(x + (p[0] & 7));
+      p[1] = (uint8_t)(y + (p[1] & 1));
+      p[2] = (uint8_t)((x < 40) ? 0x80 : p[2]);
+      p[3] = (uint8_t)((y < 20) ? 0xFF : (0xC0 | (p[3] >> 2)));
+    }
+  }
+
+#if !defined(QOIR_CONFIG__EXPERIMENTAL_SPLIT_OPS)
+  // Without that macro, the split_ops option should be ignored.
+  qoir_encode_options plain_opts = {0};
+  qoir_encode_result plain = qoir_encode(&src_pixbuf, &plain_opts);
+  if (plain.status_message) {
+    printf("%s: qoir_encode: %s\n", __func__, plain.status_message);
+    return 1;
+  }
+  qoir_encode_options split_opts = {0};
+  split_opts.split_ops = true;
+  qoir_encode_result split = qoir_encode(&src_pixbuf, &split_opts);
+  bool same = !split.status_message && (split.dst_len == plain.dst_len) &&
+              !memcmp(split.dst_ptr, plain.dst_ptr, plain.dst_len);
+  free(split.owned_memory);
+  free(plain.owned_memory);
+  if (!same) {
+    printf("%s: split_ops was not ignored\n", __func__);
+    return 1;
+  }
+#else
+  for (uint32_t group_size = 0; group_size <= 2; group_size += 2) {
+    qoir_encode_options enc_opts = {0};
+    enc_opts.lz4_tile_group_size = group_size;
+    enc_opts.split_ops = true;
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+    if (enc.status_message) {
+      printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+      return 1;
+    } else if (encoded_tile_format(enc.dst_ptr, enc.dst_len, 0) != 7) {
+      printf("%s: unexpected tile format %d\n", __func__,
+             encoded_tile_format(enc.dst_ptr, enc.dst_len, 0));
+      free(enc.owned_memory);
+      return 1;
+    }
+
+    const char* status_message =
+        check_round_trip_3(&src_pixbuf, enc.dst_ptr, enc.dst_len);
+    if (status_message) {
+      printf("%s: group_size=%u: %s\n", __func__, group_size, status_message);
+      free(enc.owned_memory);
+      return 1;
+    }
+
+    // Corrupting the opcodes or payloads should fail gracefully (or silently
+    // produce different pixels).
+    for (size_t i = 36; i < 36 + 400; i += 3) {
+      enc.dst_ptr[i] ^= 0x5A;
+      qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, NULL);
+      free(dec.owned_memory);
+      enc.dst_ptr[i] ^= 0x5A;
+    }
+    free(enc.owned_memory);
+  }
+#endif
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int         //
+test_ops2(  //
+    void) {
+  // A flat region (for QOIR_OP_RUNV) is above a region speckled with more
+  // than 64 colors (for QOIR_OP_INDEX2).
+  enum { W = 200, H = 130 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__RGBA_NONPREMUL, W, H, 0x2468ACE0);
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      uint32_t c = ((y >= 50) && (p[0] < 16)) ? (p[1] % 150) : 0;
+      p[0] = (uint8_t)(c * 0x35);
+      p[1] = (uint8_t)(c * 0x71);
+      p[2] = (uint8_t)(c * 0x13);
+      p[3] = (uint8_t)((x < 100) ? 0xFF : (0x80 + (c & 0x0F)));
+    }
+  }
+
+  for (uint32_t tile_size = 64; tile_size <= 256; tile_size *= 4) {
+    qoir_encode_options enc_opts = {0};
+    enc_opts.tile_size_in_pixels = tile_size;
+    enc_opts.ops_version = 2;
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+    if (enc.status_message) {
+      printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+      return 1;
+    }
+    int format = encoded_tile_format(enc.dst_ptr, enc.dst_len, 0);
+    if ((format != 8) && (format != 9)) {
+      printf("%s: unexpected tile format %d\n", __func__, format);
+      free(enc.owned_memory);
+      return 1;
+    }
+
+    const char* status_message =
+        check_round_trip_3(&src_pixbuf, enc.dst_ptr, enc.dst_len);
+    if (status_message) {
+      printf("%s: tile_size=%u: %s\n", __func__, tile_size, status_message);
+      free(enc.owned_memory);
+      return 1;
+    }
+    free(enc.owned_memory);
+  }
+
+  qoir_encode_options enc_opts = {0};
+  enc_opts.ops_version = 3;
+  qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+  free(enc.owned_memory);
+  if (enc.status_message != qoir_status_message__error_invalid_argument) {
+    printf("%s: ops_version=3: have \"%s\"\n", __func__, enc.status_message);
+    return 1;
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int         //
+test_gray(  //
+    void) {
+  // The image width (and therefore the tile width) is not a multiple of 16.
+  enum { W = 70, H = 90 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = {0};
+
+  for (int has_alpha = 0; has_alpha < 2; has_alpha++) {
+    src_pixbuf = make_noise_pixbuf(pixels, QOIR_PIXEL_FORMAT__RGBA_NONPREMUL,
+                                   W, H, 0x13579BDF);
+    for (uint32_t y = 0; y < H; y++) {
+      for (uint32_t x = 0; x < W; x++) {
+        uint8_t* p = pixels + (4 * ((W * y) + x));
+        p[0] = (uint8_t)((3 * x) + y + (p[0] & 3));
+        p[1] = p[0];
+        p[2] = p[0];
+        p[3] = (uint8_t)(has_alpha ? (x + (2 * y)) : 0xFF);
+      }
+    }
+
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, NULL);
+    if (enc.status_message) {
+      printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+      return 1;
+    } else if (encoded_tile_format(enc.dst_ptr, enc.dst_len, 0) !=
+               (has_alpha ? 11 : 10)) {
+      printf("%s: unexpected tile format %d\n", __func__,
+             encoded_tile_format(enc.dst_ptr, enc.dst_len, 0));
+      free(enc.owned_memory);
+      return 1;
+    }
+
+    const char* status_message =
+        check_round_trip_3(&src_pixbuf, enc.dst_ptr, enc.dst_len);
+    if (status_message) {
+      printf("%s: has_alpha=%d: %s\n", __func__, has_alpha, status_message);
+      free(enc.owned_memory);
+      return 1;
+    }
+    free(enc.owned_memory);
+  }
+
+  // A single non-gray pixel means that its tile is not gray.
+  pixels[4 * ((W * 10) + 10)] ^= 1;
+  qoir_encode_result enc = qoir_encode(&src_pixbuf, NULL);
+  int tile_format = encoded_tile_format(enc.dst_ptr, enc.dst_len, 0);
+  free(enc.owned_memory);
+  if ((tile_format == 10) || (tile_format == 11)) {
+    printf("%s: unexpected gray tile format %d\n", __func__, tile_format);
+    return 1;
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int                //
+test_alpha_plane(  //
+    void) {
+  // Make a sprite sheet: noisy discs (with soft edges) on a transparent
+  // background, whose B, G and R values are all the same.
+  enum { W = 100, H = 70 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__RGBA_NONPREMUL, W, H, 0x2468ACE0);
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      int32_t dx = (int32_t)(x % 32) - 16;
+      int32_t dy = (int32_t)(y % 32) - 16;
+      int32_t d = (dx * dx) + (dy * dy);
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      p[0] = (uint8_t)(x + (p[0] & 7));
+      p[1] = (uint8_t)(y + (p[1] & 7));
+      p[2] = (uint8_t)(x ^ y);
+      p[3] = (d < 150) ? 0xFF : (d < 200) ? (uint8_t)(d - 150) : 0x00;
+      if (p[3] == 0) {
+        p[0] = 0x12;
+        p[1] = 0x34;
+        p[2] = 0x56;
+      }
+    }
+  }
+
+  // The Alpha-Plane tile formats are off by default.
+  qoir_encode_result enc = qoir_encode(&src_pixbuf, NULL);
+  int tile_format = encoded_tile_format(enc.dst_ptr, enc.dst_len, 0);
+  free(enc.owned_memory);
+  if ((tile_format == 12) || (tile_format == 13)) {
+    printf("%s: unexpected default tile format %d\n", __func__, tile_format);
+    return 1;
+  }
+
+  qoir_encode_options enc_opts = {0};
+  enc_opts.alpha_plane = true;
+  enc = qoir_encode(&src_pixbuf, &enc_opts);
+  if (enc.status_message) {
+    printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+    return 1;
+  }
+  tile_format = encoded_tile_format(enc.dst_ptr, enc.dst_len, 0);
+  if ((tile_format != 12) && (tile_format != 13)) {
+    printf("%s: unexpected tile format %d\n", __func__, tile_format);
+    free(enc.owned_memory);
+    return 1;
+  }
+  const char* status_message =
+      check_round_trip_3(&src_pixbuf, enc.dst_ptr, enc.dst_len);
+  free(enc.owned_memory);
+  if (status_message) {
+    printf("%s: %s\n", __func__, status_message);
+    return 1;
+  }
+
+  // Transparent pixels with differing colors need the other tile formats.
+  pixels[0] ^= 1;
+  enc = qoir_encode(&src_pixbuf, &enc_opts);
+  tile_format = encoded_tile_format(enc.dst_ptr, enc.dst_len, 0);
+  free(enc.owned_memory);
+  if ((tile_format == 12) || (tile_format == 13)) {
+    printf("%s: unexpected alpha plane tile format %d\n", __func__,
+           tile_format);
+    return 1;
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int                       //
+test_chroma_subsampling(  //
+    void) {
+  // Make a noisy (so that the lossless tile formats compress poorly) but
+  // smoothly colored image. The right half has a varying alpha.
+  enum { W = 100, H = 70 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__BGRA_NONPREMUL, W, H, 0x13579BDF);
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      uint32_t noise = p[0] & 15;
+      p[0] = (uint8_t)(0x40 + x + noise);
+      p[1] = (uint8_t)(0x30 + y + noise);
+      p[2] = (uint8_t)(0x20 + x + y + noise);
+      p[3] = (x < (W / 2)) ? 0xFF : (uint8_t)(x + y);
+    }
+  }
+
+  qoir_encode_options encopts = {0};
+  encopts.chroma_subsampling = true;
+  qoir_encode_result enc = qoir_encode(&src_pixbuf, &encopts);
+  if (enc.status_message) {
+    printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+    return 1;
+  }
+  int tile_format = encoded_tile_format(enc.dst_ptr, enc.dst_len, 0);
+  if ((tile_format != 14) && (tile_format != 15)) {
+    printf("%s: unexpected tile format %d\n", __func__, tile_format);
+    free(enc.owned_memory);
+    return 1;
+  }
+
+  qoir_decode_options decopts = {0};
+  decopts.pixfmt = QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
+  qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &decopts);
+  free(enc.owned_memory);
+  if (dec.status_message) {
+    printf("%s: qoir_decode: %s\n", __func__, dec.status_message);
+    return 1;
+  }
+
+  // The color is lossy but close. The alpha is lossless.
+  int max_diff = 0;
+  for (uint32_t y = 0; y < H; y++) {
+    const uint8_t* p = pixels + (4 * W * y);
+    const uint8_t* q =
+        dec.dst_pixbuf.data + (dec.dst_pixbuf.stride_in_bytes * y);
+    for (uint32_t i = 0; i < (4 * W); i++) {
+      int diff = (p[i] > q[i]) ? (p[i] - q[i]) : (q[i] - p[i]);
+      if ((i & 3) == 3) {
+        diff *= 1000;
+      }
+      max_diff = (max_diff > diff) ? max_diff : diff;
+    }
+  }
+  free(dec.owned_memory);
+  if (max_diff > 20) {
+    printf("%s: max_diff: have %d, want <= 20\n", __func__, max_diff);
+    return 1;
+  }
+
+  // Chroma subsampling has no effect on premultiplied alpha.
+  src_pixbuf.pixcfg.pixfmt = QOIR_PIXEL_FORMAT__BGRA_PREMUL;
+  for (uint32_t i = 0; i < (4 * W * H); i += 4) {
+    pixels[i + 3] = 0xFF;
+  }
+  enc = qoir_encode(&src_pixbuf, &encopts);
+  if (enc.status_message) {
+    printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+    return 1;
+  }
+  const char* status_message =
+      check_round_trip_3(&src_pixbuf, enc.dst_ptr, enc.dst_len);
+  free(enc.owned_memory);
+  if (status_message) {
+    printf("%s: %s\n", __func__, status_message);
+    return 1;
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int                  //
+test_near_lossless(  //
+    void) {
+  // Make a noisy but smoothly varying image, with some translucent pixels.
+  enum { W = 100, H = 70 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__BGRA_NONPREMUL, W, H, 0x0F1E2D3C);
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      p[0] = (uint8_t)(0x40 + x + (p[0] & 3));
+      p[1] = (uint8_t)(0x30 + y + (p[1] & 3));
+      p[2] = (uint8_t)(0x20 + x + y + (p[2] & 3));
+      p[3] = (y < (H / 2)) ? 0xFF : (uint8_t)(0x80 + (x & 1));
+    }
+  }
+
+  size_t lossless_len = 0;
+  for (uint32_t tolerance = 0; tolerance <= 2; tolerance += 2) {
+    qoir_encode_options encopts = {0};
+    encopts.near_lossless_tolerance = tolerance;
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &encopts);
+    if (enc.status_message) {
+      printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+      return 1;
+    } else if (tolerance == 0) {
+      lossless_len = enc.dst_len;
+    } else if (enc.dst_len >= lossless_len) {
+      printf("%s: dst_len: have %zu, want < %zu\n", __func__, enc.dst_len,
+             lossless_len);
+      free(enc.owned_memory);
+      return 1;
+    }
+
+    qoir_decode_options decopts = {0};
+    decopts.pixfmt = QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
+    qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &decopts);
+    free(enc.owned_memory);
+    if (dec.status_message) {
+      printf("%s: qoir_decode: %s\n", __func__, dec.status_message);
+      return 1;
+    }
+
+    // B, G and R are within the tolerance. Alpha is lossless.
+    uint32_t max_diff = 0;
+    for (uint32_t y = 0; y < H; y++) {
+      const uint8_t* p = pixels + (4 * W * y);
+      const uint8_t* q =
+          dec.dst_pixbuf.data + (dec.dst_pixbuf.stride_in_bytes * y);
+      for (uint32_t i = 0; i < (4 * W); i++) {
+        uint32_t diff = (p[i] > q[i]) ? (p[i] - q[i]) : (q[i] - p[i]);
+        if ((i & 3) == 3) {
+          diff *= 1000;
+        }
+        max_diff = (max_diff > diff) ? max_diff : diff;
+      }
+    }
+    free(dec.owned_memory);
+    if (max_diff > tolerance) {
+      printf("%s: max_diff: have %u, want <= %u\n", __func__, max_diff,
+             tolerance);
+      return 1;
+    }
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int                 //
+test_rate_control(  //
+    void) {
+  // Make a noisy image, 3 × 2 tiles in size, whose left half is smoother.
+  enum { W = 192, H = 128 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__BGRA_NONPREMUL, W, H, 0x13579BDF);
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint32_t mask = (x < (W / 2)) ? 0x03 : 0x3F;
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      p[0] = (uint8_t)(0x40 + (x / 2) + (p[0] & mask));
+      p[1] = (uint8_t)(0x30 + (y / 2) + (p[1] & mask));
+      p[2] = (uint8_t)(0x20 + (x / 4) + (p[2] & mask));
+      p[3] = 0xFF;
+    }
+  }
+
+  qoir_encode_options encopts = {0};
+  qoir_encode_result lossless = qoir_encode(&src_pixbuf, &encopts);
+  if (lossless.status_message) {
+    printf("%s: qoir_encode: %s\n", __func__, lossless.status_message);
+    return 1;
+  }
+
+  // A target that the lossless encoding already meets changes nothing.
+  encopts.target_dst_len = lossless.dst_len;
+  qoir_encode_result enc = qoir_encode(&src_pixbuf, &encopts);
+  if (enc.status_message) {
+    printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+    free(lossless.owned_memory);
+    return 1;
+  } else if ((enc.dst_len != lossless.dst_len) ||
+             memcmp(enc.dst_ptr, lossless.dst_ptr, enc.dst_len)) {
+    printf("%s: generous target: output differs\n", __func__);
+    free(enc.owned_memory);
+    free(lossless.owned_memory);
+    return 1;
+  }
+  free(enc.owned_memory);
+
+  encopts.target_dst_len = (lossless.dst_len * 7) / 10;
+  free(lossless.owned_memory);
+  enc = qoir_encode(&src_pixbuf, &encopts);
+  if (enc.status_message) {
+    printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+    return 1;
+  } else if (enc.dst_len > encopts.target_dst_len) {
+    printf("%s: dst_len: have %zu, want <= %zu\n", __func__, enc.dst_len,
+           encopts.target_dst_len);
+    free(enc.owned_memory);
+    return 1;
+  }
+
+  // The tiles' lossiness should vary. It is held in bits 4, 5 and 6 of each
+  // tile's format byte. The first tile starts after the QOIR and QPIX chunk
+  // headers.
+  uint32_t lossinesses_seen = 0;
+  const uint8_t* p = enc.dst_ptr + 32;
+  for (int i = 0; i < 6; i++) {
+    lossinesses_seen |= 1u << (7 & (p[3] >> 4));
+    p += 4 + (p[0] | (p[1] << 8) | (p[2] << 16));
+  }
+  if ((lossinesses_seen & (lossinesses_seen - 1)) == 0) {
+    printf("%s: lossinesses_seen: have 0x%02X, want several bits set\n",
+           __func__, lossinesses_seen);
+    free(enc.owned_memory);
+    return 1;
+  }
+
+  qoir_decode_options decopts = {0};
+  decopts.pixfmt = QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
+  qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &decopts);
+  free(enc.owned_memory);
+  if (dec.status_message) {
+    printf("%s: qoir_decode: %s\n", __func__, dec.status_message);
+    return 1;
+  }
+  free(dec.owned_memory);
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int                       //
+test_tile_lossiness_map(  //
+    void) {
+  // Make an image, 2 × 1 tiles in size, whose left tile is noisy and whose
+  // right tile looks like black text on a white background.
+  enum { W = 128, H = 64 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__BGRA_NONPREMUL, W, H, 0x2468ACE0);
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      if (x < (W / 2)) {
+        p[0] = (uint8_t)(0x40 + x + (p[0] & 15));
+        p[1] = (uint8_t)(0x30 + y + (p[1] & 15));
+        p[2] = (uint8_t)(0x20 + x + y + (p[2] & 15));
+      } else {
+        uint8_t v = (((y & 7) < 5) && ((x % 6) < 2)) ? 0x00 : 0xFF;
+        p[0] = v;
+        p[1] = v;
+        p[2] = v;
+      }
+      p[3] = 0xFF;
+    }
+  }
+
+  static const uint8_t map[2] = {3, 0};
+  static const struct {
+    uint32_t lossiness;
+    const uint8_t* tile_lossiness_map;
+    bool lossless_synthetic_tiles;
+    uint8_t want_lossinesses[2];
+  } test_cases[] = {
+      {2, NULL, false, {2, 2}},
+      {2, NULL, true, {2, 0}},
+      {1, map, false, {3, 1}},
+      {0, map, false, {3, 0}},
+  };
+
+  for (size_t tc = 0; tc < (sizeof(test_cases) / sizeof(test_cases[0]));
+       tc++) {
+    qoir_encode_options encopts = {0};
+    encopts.lossiness = test_cases[tc].lossiness;
+    encopts.tile_lossiness_map = test_cases[tc].tile_lossiness_map;
+    encopts.lossless_synthetic_tiles = test_cases[tc].lossless_synthetic_tiles;
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &encopts);
+    if (enc.status_message) {
+      printf("%s: tc=%zu: qoir_encode: %s\n", __func__, tc,
+             enc.status_message);
+      return 1;
+    }
+
+    // Each tile's lossiness is the QOIR chunk's lossiness (the low 3 bits of
+    // its last byte) plus the tile's extra lossiness (bits 4, 5 and 6 of its
+    // format byte).
+    const uint8_t* p = enc.dst_ptr + 32;
+    for (int i = 0; i < 2; i++) {
+      uint32_t have = (enc.dst_ptr[19] & 7) + (7 & (p[3] >> 4));
+      uint32_t want = test_cases[tc].want_lossinesses[i];
+      if (have != want) {
+        printf("%s: tc=%zu, i=%d: lossiness: have %u, want %u\n", __func__,
+               tc, i, have, want);
+        free(enc.owned_memory);
+        return 1;
+      }
+      p += 4 + (p[0] | (p[1] << 8) | (p[2] << 16));
+    }
+
+    qoir_decode_options decopts = {0};
+    decopts.pixfmt = QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
+    qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &decopts);
+    free(enc.owned_memory);
+    if (dec.status_message) {
+      printf("%s: tc=%zu: qoir_decode: %s\n", __func__, tc,
+             dec.status_message);
+      return 1;
+    }
+
+    // Lossless tiles decode exactly.
+    for (int i = 0; i < 2; i++) {
+      if (test_cases[tc].want_lossinesses[i] != 0) {
+        continue;
+      }
+      for (uint32_t y = 0; y < H; y++) {
+        size_t x0 = 4 * (W / 2) * i;
+        if (memcmp(pixels + (4 * W * y) + x0,
+                   dec.dst_pixbuf.data +
+                       (dec.dst_pixbuf.stride_in_bytes * y) + x0,
+                   4 * (W / 2))) {
+          printf("%s: tc=%zu, i=%d: pixels differ\n", __func__, tc, i);
+          free(dec.owned_memory);
+          return 1;
+        }
+      }
+    }
+    free(dec.owned_memory);
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int                    //
+test_alpha_lossiness(  //
+    void) {
+  // Make a noisy image with a translucent, noisy alpha gradient.
+  enum { W = 80, H = 40 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__BGRA_NONPREMUL, W, H, 0x0BADCAFE);
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      p[0] = (uint8_t)(0x40 + x + (p[0] & 7));
+      p[1] = (uint8_t)(0x30 + y + (p[1] & 7));
+      p[2] = (uint8_t)(0x20 + x + y + (p[2] & 7));
+      p[3] = (uint8_t)(0x60 + (2 * x) + (p[3] & 7));
+    }
+  }
+
+  static const struct {
+    uint32_t lossiness;
+    uint32_t alpha_lossiness;
+    bool chroma_subsampling;
+  } test_cases[] = {
+      {2, 0, false},
+      {0, 3, false},
+      {1, 4, false},
+      {3, 0, true},
+  };
+
+  for (size_t tc = 0; tc < (sizeof(test_cases) / sizeof(test_cases[0]));
+       tc++) {
+    qoir_encode_options encopts = {0};
+    encopts.lossiness = test_cases[tc].lossiness;
+    encopts.separate_alpha_lossiness = true;
+    encopts.alpha_lossiness = test_cases[tc].alpha_lossiness;
+    encopts.chroma_subsampling = test_cases[tc].chroma_subsampling;
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &encopts);
+    if (enc.status_message) {
+      printf("%s: tc=%zu: qoir_encode: %s\n", __func__, tc,
+             enc.status_message);
+      return 1;
+    }
+
+    qoir_decode_options decopts = {0};
+    decopts.pixfmt = QOIR_PIXEL_FORMAT__BGRA_NONPREMUL;
+    qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &decopts);
+    free(enc.owned_memory);
+    if (dec.status_message) {
+      printf("%s: tc=%zu: qoir_decode: %s\n", __func__, tc,
+             dec.status_message);
+      return 1;
+    }
+
+    // Each channel's error is less than (1 << its lossiness). Chroma
+    // subsampling adds more error to B, G and R but not to alpha.
+    uint32_t max_diffs[2] = {0};
+    for (uint32_t y = 0; y < H; y++) {
+      const uint8_t* p = pixels + (4 * W * y);
+      const uint8_t* q =
+          dec.dst_pixbuf.data + (dec.dst_pixbuf.stride_in_bytes * y);
+      for (uint32_t i = 0; i < (4 * W); i++) {
+        uint32_t diff = (p[i] > q[i]) ? (p[i] - q[i]) : (q[i] - p[i]);
+        uint32_t* m = &max_diffs[(i & 3) == 3];
+        *m = (*m > diff) ? *m : diff;
+      }
+    }
+    free(dec.owned_memory);
+    if (!test_cases[tc].chroma_subsampling &&
+        (max_diffs[0] >= (1u << test_cases[tc].lossiness))) {
+      printf("%s: tc=%zu: color max_diff: have %u, want < %u\n", __func__,
+             tc, max_diffs[0], 1u << test_cases[tc].lossiness);
+      return 1;
+    } else if (max_diffs[1] >= (1u << test_cases[tc].alpha_lossiness)) {
+      printf("%s: tc=%zu: alpha max_diff: have %u, want < %u\n", __func__,
+             tc, max_diffs[1], 1u << test_cases[tc].alpha_lossiness);
+      return 1;
+    }
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int                     //
+test_streaming_decoder(  //
+    void) {
+  // Make a 300 × 150 image (5 × 3 tiles) whose tile rows repeat a noisy
+  // pattern, so that LZ4 tile groups chain tiles together.
+  enum { W = 300, H = 150 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__RGBA_NONPREMUL, W, H, 0x31415926);
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      if (x < 64) {
+        p[3] = 0xFF;
+      } else {
+        memcpy(p, p - (4 * 64), 4);
+      }
+    }
+  }
+
+  static const uint8_t exif[5] = {'E', 'x', 'i', 'f', 0};
+  qoir_encode_options enc_opts = {0};
+  enc_opts.metadata_exif_ptr = exif;
+  enc_opts.metadata_exif_len = sizeof(exif);
+  enc_opts.lz4_tile_group_size = 8;
+  enc_opts.mipmap_levels = 1;
+  qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+  if (enc.status_message) {
+    printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+    return 1;
+  }
+
+  // Feed the file in pieces of various sizes. Rows should become available
+  // before the whole file has arrived.
+  static const size_t piece_sizes[4] = {1, 7, 1000, SIZE_MAX};
+  for (int i = 0; i < 4; i++) {
+    qoir_decoder dec;
+    qoir_decoder__initialize(&dec, NULL);
+    qoir_decoder_feed_result res = {0};
+    uint32_t prev_height = 0;
+    bool saw_partial = false;
+    for (size_t pos = 0; pos < enc.dst_len;) {
+      size_t n = enc.dst_len - pos;
+      n = (n < piece_sizes[i]) ? n : piece_sizes[i];
+      res = qoir_decoder__feed(&dec, enc.dst_ptr + pos, n);
+      pos += n;
+      if (res.status_message) {
+        break;
+      } else if (res.done != (pos == enc.dst_len)) {
+        res.status_message = "done was set too early or too late";
+        break;
+      } else if (res.decoded_height_in_pixels < prev_height) {
+        res.status_message = "decoded_height_in_pixels went backwards";
+        break;
+      }
+      prev_height = res.decoded_height_in_pixels;
+      saw_partial |= (0 < prev_height) && (prev_height < H);
+    }
+    if (!res.status_message && !saw_partial && (piece_sizes[i] < 1000)) {
+      res.status_message = "no partially decoded image was seen";
+    } else if (!res.status_message &&
+               ((res.decoded_height_in_pixels != H) ||
+                (res.num_decoded_tiles != 15) ||
+                !pixbufs_are_equal(&src_pixbuf, &res.dst_pixbuf))) {
+      res.status_message = "decoded image differs";
+    }
+    // Nothing may follow the QEND chunk.
+    if (!res.status_message &&
+        !qoir_decoder__feed(&dec, exif, 1).status_message) {
+      res.status_message = "trailing data was accepted";
+    }
+    qoir_decoder__destroy(&dec);
+    if (res.status_message) {
+      printf("%s: piece_size=%zu: %s\n", __func__, piece_sizes[i],
+             res.status_message);
+      free(enc.owned_memory);
+      return 1;
+    }
+  }
+
+  // A truncated file is never done. A corrupted one is an error.
+  qoir_decoder dec;
+  qoir_decoder__initialize(&dec, NULL);
+  qoir_decoder_feed_result res =
+      qoir_decoder__feed(&dec, enc.dst_ptr, enc.dst_len - 1);
+  qoir_decoder__destroy(&dec);
+  if (res.status_message || res.done) {
+    printf("%s: truncated file: bad result\n", __func__);
+    free(enc.owned_memory);
+    return 1;
+  }
+  enc.dst_ptr[15] &= 0xF0;  // Invalidate the pixel format.
+  qoir_decoder__initialize(&dec, NULL);
+  res = qoir_decoder__feed(&dec, enc.dst_ptr, enc.dst_len);
+  qoir_decoder__destroy(&dec);
+  free(enc.owned_memory);
+  if (!res.status_message) {
+    printf("%s: corrupted file: no error\n", __func__);
+    return 1;
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+typedef struct band_test_context_struct {
+  uint8_t* canvas;
+  size_t canvas_stride_in_bytes;
+  uint32_t next_y;
+  uint32_t num_bands;
+  uint32_t abort_after;
+} band_test_context;
+
+const char*                                //
+band_test_func(                            //
+    void* context,                         //
+    const qoir_pixel_buffer* band_pixbuf,  //
+    uint32_t band_y_in_pixels) {
+  band_test_context* c = (band_test_context*)context;
+  if (band_y_in_pixels != c->next_y) {
+    return "#band_test_func: bands out of order";
+  }
+  for (uint32_t y = 0; y < band_pixbuf->pixcfg.height_in_pixels; y++) {
+    memcpy(c->canvas + (c->canvas_stride_in_bytes * (band_y_in_pixels + y)),
+           band_pixbuf->data + (band_pixbuf->stride_in_bytes * y),
+           4 * band_pixbuf->pixcfg.width_in_pixels);
+  }
+  c->next_y += band_pixbuf->pixcfg.height_in_pixels;
+  c->num_bands++;
+  return (c->num_bands == c->abort_after) ? "#band_test_func: abort" : NULL;
+}
+
+int                //
+test_band_decode(  //
+    void) {
+  // Make a 200 × 150 image, which is three 64 pixel high bands (the last one
+  // only 22 pixels high).
+  enum { W = 200, H = 150 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__RGBA_NONPREMUL, W, H, 0x0A0B0C0D);
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      p[0] = (uint8_t)(x + y + (p[0] & 1));
+      p[1] = (uint8_t)(x ^ y);
+      p[2] = (uint8_t)(x * y);
+      p[3] = (uint8_t)(0x80 + x);
+    }
+  }
+
+  qoir_encode_options enc_opts = {0};
+  enc_opts.tile_size_in_pixels = 64;
+  enc_opts.lz4_tile_group_size = 8;
+  qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+  if (enc.status_message) {
+    printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+    return 1;
+  }
+
+  // Decode with a dynamically allocated band buffer and then with a
+  // caller-supplied one, re-assembling the bands into a canvas.
+  static uint8_t canvas[4 * W * H];
+  static uint8_t band[4 * W * 64];
+  for (int i = 0; i < 2; i++) {
+    memset(canvas, 0, sizeof(canvas));
+    band_test_context context = {0};
+    context.canvas = canvas;
+    context.canvas_stride_in_bytes = 4 * W;
+    qoir_decode_options dec_opts = {0};
+    dec_opts.band_func = band_test_func;
+    dec_opts.band_func_context = &context;
+    if (i == 1) {
+      dec_opts.pixbuf = src_pixbuf;
+      dec_opts.pixbuf.pixcfg.height_in_pixels = 64;
+      dec_opts.pixbuf.data = band;
+    }
+    qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &dec_opts);
+    qoir_pixel_buffer canvas_pixbuf = src_pixbuf;
+    canvas_pixbuf.data = canvas;
+    if (dec.status_message) {
+      printf("%s: i=%d: qoir_decode: %s\n", __func__, i, dec.status_message);
+      free(enc.owned_memory);
+      return 1;
+    } else if (dec.owned_memory || (context.num_bands != 3) ||
+               !pixbufs_are_equal(&src_pixbuf, &canvas_pixbuf)) {
+      printf("%s: i=%d: bad bands\n", __func__, i);
+      free(enc.owned_memory);
+      return 1;
+    }
+  }
+
+  // The band_func can abort decoding. A too-short band buffer is rejected.
+  band_test_context context = {0};
+  context.canvas = canvas;
+  context.canvas_stride_in_bytes = 4 * W;
+  context.abort_after = 2;
+  qoir_decode_options dec_opts = {0};
+  dec_opts.band_func = band_test_func;
+  dec_opts.band_func_context = &context;
+  qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &dec_opts);
+  if ((dec.status_message == NULL) ||
+      strcmp(dec.status_message, "#band_test_func: abort") ||
+      (context.num_bands != 2)) {
+    printf("%s: band_func did not abort decoding\n", __func__);
+    free(enc.owned_memory);
+    return 1;
+  }
+  dec_opts.pixbuf = src_pixbuf;
+  dec_opts.pixbuf.pixcfg.height_in_pixels = 63;
+  dec_opts.pixbuf.data = band;
+  dec = qoir_decode(enc.dst_ptr, enc.dst_len, &dec_opts);
+  free(enc.owned_memory);
+  if (dec.status_message != qoir_status_message__error_invalid_argument) {
+    printf("%s: short band buffer: have %s\n", __func__, dec.status_message);
+    return 1;
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int          //
+test_probe(  //
+    void) {
+  enum { W = 100, H = 70 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__BGRA_NONPREMUL, W, H, 0x70B3C0DE);
+
+  static const uint8_t iccp[3] = {'i', 'c', 'c'};
+  static const uint8_t exif[5] = {'E', 'x', 'i', 'f', 0};
+  qoir_encode_options enc_opts = {0};
+  enc_opts.metadata_iccp_ptr = iccp;
+  enc_opts.metadata_iccp_len = sizeof(iccp);
+  enc_opts.metadata_exif_ptr = exif;
+  enc_opts.metadata_exif_len = sizeof(exif);
+  enc_opts.lossiness = 1;
+  enc_opts.separate_alpha_lossiness = true;
+  enc_opts.alpha_lossiness = 2;
+  enc_opts.mipmap_levels = 2;
+  enc_opts.preview = true;
+  qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+  if (enc.status_message) {
+    printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+    return 1;
+  }
+
+  qoir_probe_result probe = qoir_probe(enc.dst_ptr, enc.dst_len);
+  const char* problem = NULL;
+  if (probe.status_message) {
+    problem = probe.status_message;
+  } else if ((probe.dst_pixcfg.pixfmt != QOIR_PIXEL_FORMAT__BGRA_NONPREMUL) ||
+             (probe.dst_pixcfg.width_in_pixels != W) ||
+             (probe.dst_pixcfg.height_in_pixels != H) ||
+             (probe.tile_size_in_pixels != 64)) {
+    problem = "bad pixel configuration";
+  } else if ((probe.lossiness != 1) || !probe.separate_alpha_lossiness ||
+             (probe.alpha_lossiness != 2)) {
+    problem = "bad lossiness";
+  } else if ((probe.num_frames != 1) || (probe.num_mipmap_levels != 2) ||
+             !probe.has_preview) {
+    problem = "bad chunk counts";
+  } else if ((probe.metadata_iccp_len != sizeof(iccp)) ||
+             memcmp(probe.metadata_iccp_ptr, iccp, sizeof(iccp)) ||
+             (probe.metadata_exif_len != sizeof(exif)) ||
+             memcmp(probe.metadata_exif_ptr, exif, sizeof(exif)) ||
+             probe.metadata_cicp_ptr || probe.metadata_xmp_ptr) {
+    problem = "bad metadata";
+  } else if (!probe.qpix_payload_ptr ||
+             memcmp(probe.qpix_payload_ptr - 12, "QPIX", 4) ||
+             ((probe.qpix_payload_ptr + probe.qpix_payload_len) >
+              (enc.dst_ptr + enc.dst_len))) {
+    problem = "bad QPIX payload";
+  } else if (!qoir_probe(enc.dst_ptr, enc.dst_len - 1).status_message) {
+    problem = "truncated file was accepted";
+  }
+  free(enc.owned_memory);
+  if (problem) {
+    printf("%s: %s\n", __func__, problem);
+    return 1;
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+void                                                    //
+validate_test_executor(                                 //
+    void* executor_context,                             //
+    void (*task_func)(void* task_context, uint32_t i),  //
+    void* task_context,                                 //
+    uint32_t num_tasks) {
+  // Run the tasks in reverse order, to check that they are independent.
+  *(uint32_t*)executor_context = num_tasks;
+  for (uint32_t i = num_tasks; i > 0; i--) {
+    (*task_func)(task_context, i - 1);
+  }
+}
+
+int             //
+test_validate(  //
+    void) {
+  enum { W = 150, H = 100 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__BGRA_NONPREMUL, W, H, 0x27182818);
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      p[0] = (uint8_t)(x + (p[0] & 3));
+      p[1] = (uint8_t)(y * 2);
+      p[2] = (uint8_t)(x ^ y);
+      p[3] = (uint8_t)(0xC0 + (x & 0x3F));
+    }
+  }
+
+  uint32_t num_tasks = 0;
+  qoir_decode_options dec_opts = {0};
+  dec_opts.executor_func = validate_test_executor;
+  dec_opts.executor_context = &num_tasks;
+  dec_opts.executor_concurrency = 3;
+
+  for (int i = 0; i < 4; i++) {
+    qoir_encode_options enc_opts = {0};
+    enc_opts.lz4_tile_group_size = (i == 0) ? 8 : 0;
+    enc_opts.lossiness = (i == 1) ? 2 : 0;
+    enc_opts.chroma_subsampling = (i == 1);
+    enc_opts.mipmap_levels = (i == 2) ? 2 : 0;
+    enc_opts.preview = (i == 2);
+    enc_opts.animation_frames_ptr = &src_pixbuf;
+    enc_opts.animation_frames_len = (i == 3) ? 1 : 0;
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+    if (enc.status_message) {
+      printf("%s: i=%d: qoir_encode: %s\n", __func__, i, enc.status_message);
+      return 1;
+    }
+
+    qoir_probe_result v0 = qoir_validate(enc.dst_ptr, enc.dst_len, NULL);
+    qoir_probe_result v1 = qoir_validate(enc.dst_ptr, enc.dst_len, &dec_opts);
+    if (v0.status_message || v1.status_message || (num_tasks != 3) ||
+        (v1.dst_pixcfg.width_in_pixels != W)) {
+      printf("%s: i=%d: valid file: have %s, %s\n", __func__, i,
+             v0.status_message, v1.status_message);
+      free(enc.owned_memory);
+      return 1;
+    }
+
+    // Corrupting the file makes qoir_validate fail if and only if it makes
+    // qoir_decode fail. Check both ways of dividing up the work.
+    uint32_t rng = 0x27182818;
+    for (int j = 0; (i < 2) && (j < 300); j++) {
+      uint32_t r = next_random(&rng);
+      size_t pos = (r >> 8) % enc.dst_len;
+      uint8_t old = enc.dst_ptr[pos];
+      enc.dst_ptr[pos] ^= (uint8_t)(1 + ((r >> 4) & 0x7F));
+      qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, NULL);
+      free(dec.owned_memory);
+      for (int k = 0; k < 2; k++) {
+        qoir_probe_result v = qoir_validate(enc.dst_ptr, enc.dst_len,
+                                            (k == 0) ? NULL : &dec_opts);
+        if (!dec.status_message != !v.status_message) {
+          printf("%s: i=%d, pos=%zu, k=%d: have %s, want %s\n", __func__, i,
+                 pos, k, v.status_message, dec.status_message);
+          free(enc.owned_memory);
+          return 1;
+        }
+      }
+      enc.dst_ptr[pos] = old;
+    }
+    free(enc.owned_memory);
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int                 //
+test_clipped_tiles(  //
+    void) {
+  // Decoding only the top rows of each tile row lets the ops VMs stop early.
+  // The pixels that are decoded must match a full decode.
+  enum { W = 200, H = 150 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__RGBA_NONPREMUL, W, H, 0x16180339);
+  for (uint32_t y = 0; y < H; y++) {
+    for (uint32_t x = 0; x < W; x++) {
+      uint8_t* p = pixels + (4 * ((W * y) + x));
+      p[0] = (uint8_t)((x / 5) + (p[0] & 1));
+      p[1] = (uint8_t)(y / 3);
+      p[2] = (uint8_t)((x * y) >> 6);
+      p[3] = (uint8_t)(((x / 8) & 1) ? 0xFF : (0x80 + y));
+    }
+  }
+
+  static const qoir_rectangle clips[4] = {
+      {0, 0, W, 1},
+      {30, 5, 170, 40},
+      {0, 60, W, 100},
+      {10, 64, 190, 129},
+  };
+  for (int i = 0; i < 4; i++) {
+    qoir_encode_options enc_opts = {0};
+    enc_opts.split_ops = (i == 1);
+    enc_opts.ops_version = (i == 2) ? 2 : 0;
+    enc_opts.lossiness = (i == 3) ? 2 : 0;
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+    if (enc.status_message) {
+      printf("%s: i=%d: qoir_encode: %s\n", __func__, i, enc.status_message);
+      return 1;
+    }
+    qoir_decode_result full = qoir_decode(enc.dst_ptr, enc.dst_len, NULL);
+    if (full.status_message) {
+      printf("%s: i=%d: qoir_decode: %s\n", __func__, i, full.status_message);
+      free(enc.owned_memory);
+      return 1;
+    }
+
+    for (int j = 0; j < 4; j++) {
+      qoir_decode_options dec_opts = {0};
+      dec_opts.src_clip_rectangle = clips[j];
+      dec_opts.use_src_clip_rectangle = true;
+      qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &dec_opts);
+      bool ok = !dec.status_message;
+      for (int32_t y = clips[j].y0; ok && (y < clips[j].y1); y++) {
+        size_t offset = (4 * W * (size_t)y) + (4 * (size_t)clips[j].x0);
+        ok = !memcmp(dec.dst_pixbuf.data + offset,
+                     full.dst_pixbuf.data + offset,
+                     4 * (size_t)(clips[j].x1 - clips[j].x0));
+      }
+      free(dec.owned_memory);
+      if (!ok) {
+        printf("%s: i=%d, j=%d: pixels differ\n", __func__, i, j);
+        free(full.owned_memory);
+        free(enc.owned_memory);
+        return 1;
+      }
+    }
+    free(full.owned_memory);
+    free(enc.owned_memory);
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int                 //
+test_decode_batch(  //
+    void) {
+  // Encode five small images of different sizes. The fourth is corrupted.
+  enum { N = 5 };
+  static const uint32_t sizes[N] = {16, 32, 7, 64, 24};
+  static uint8_t pixels[4 * 64 * 64];
+  qoir_pixel_buffer noise_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__BGRA_NONPREMUL, 64, 64, 0x0DEC0DE5);
+  qoir_encode_result encs[N];
+  qoir_decode_batch_item items[N];
+  memset(items, 0, sizeof(items));
+  for (int i = 0; i < N; i++) {
+    qoir_pixel_buffer src_pixbuf = noise_pixbuf;
+    src_pixbuf.pixcfg.width_in_pixels = sizes[i];
+    src_pixbuf.pixcfg.height_in_pixels = sizes[i];
+    encs[i] = qoir_encode(&src_pixbuf, NULL);
+    if (encs[i].status_message) {
+      printf("%s: qoir_encode: %s\n", __func__, encs[i].status_message);
+      return 1;
+    }
+    items[i].src_ptr = encs[i].dst_ptr;
+    items[i].src_len = encs[i].dst_len;
+  }
+  encs[3].dst_ptr[0] ^= 0xFF;
+
+  // The arena is too small for the fifth image. The clip rectangle and offset
+  // options are ignored: every image is decoded whole.
+  static uint8_t arena[4 * ((16 * 16) + (32 * 32) + (7 * 7) + (20 * 20))];
+  qoir_decode_options dec_opts = {0};
+  dec_opts.use_src_clip_rectangle = true;
+  dec_opts.src_clip_rectangle = qoir_make_rectangle(1, 2, 3, 4);
+  dec_opts.use_dst_clip_rectangle = true;
+  dec_opts.dst_clip_rectangle = qoir_make_rectangle(0, 0, 5, 5);
+  dec_opts.offset_x = 6;
+  dec_opts.offset_y = 7;
+  qoir_decode_batch_result batch =
+      qoir_decode_batch(items, N, arena, sizeof(arena), &dec_opts);
+
+  const char* problem = NULL;
+  if (batch.status_message != qoir_status_message__error_invalid_data) {
+    problem = "bad batch status message";
+  } else if (batch.arena_used_len != (4 * ((16 * 16) + (32 * 32) + (7 * 7)))) {
+    problem = "bad arena_used_len";
+  } else if (!items[3].result.status_message ||
+             (items[4].result.status_message !=
+              qoir_status_message__error_out_of_memory)) {
+    problem = "bad item status messages";
+  }
+  for (int i = 0; !problem && (i < 3); i++) {
+    qoir_decode_result dec =
+        qoir_decode(encs[i].dst_ptr, encs[i].dst_len, NULL);
+    if (items[i].result.status_message || items[i].result.owned_memory ||
+        (items[i].result.dst_pixbuf.data < arena) ||
+        (items[i].result.dst_pixbuf.data >= (arena + sizeof(arena))) ||
+        !pixbufs_are_equal(&dec.dst_pixbuf, &items[i].result.dst_pixbuf)) {
+      problem = "decoded image differs";
+    }
+    free(dec.owned_memory);
+  }
+  for (int i = 0; i < N; i++) {
+    free(encs[i].owned_memory);
+  }
+  if (problem) {
+    printf("%s: %s\n", __func__, problem);
+    return 1;
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int                 //
+test_decode_atlas(  //
+    void) {
+  // Decode six sprites into a 160 × 100 atlas. The last sprite's rectangle
+  // is smaller than the sprite, which is clipped.
+  enum { N = 6, AW = 160, AH = 100 };
+  static const qoir_rectangle rects[N] = {
+      {0, 0, 40, 40},   {40, 0, 72, 20},   {72, 0, 160, 50},
+      {0, 40, 40, 100}, {40, 20, 70, 50},  {80, 60, 100, 80},
+  };
+  static const uint32_t sizes[N][2] = {
+      {40, 40}, {32, 20}, {88, 50}, {33, 60}, {30, 30}, {50, 50},
+  };
+  static uint8_t pixels[4 * 88 * 60];
+  qoir_pixel_buffer noise_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__BGRA_NONPREMUL, 88, 60, 0x5EED1E55);
+  qoir_encode_result encs[N];
+  qoir_decode_atlas_item items[N];
+  memset(items, 0, sizeof(items));
+  for (int i = 0; i < N; i++) {
+    qoir_pixel_buffer src_pixbuf = noise_pixbuf;
+    src_pixbuf.pixcfg.width_in_pixels = sizes[i][0];
+    src_pixbuf.pixcfg.height_in_pixels = sizes[i][1];
+    src_pixbuf.data = pixels + (4 * i);
+    encs[i] = qoir_encode(&src_pixbuf, NULL);
+    if (encs[i].status_message) {
+      printf("%s: qoir_encode: %s\n", __func__, encs[i].status_message);
+      return 1;
+    }
+    items[i].src_ptr = encs[i].dst_ptr;
+    items[i].src_len = encs[i].dst_len;
+    items[i].dst_rectangle = rects[i];
+  }
+
+  static uint8_t atlas[4 * AW * AH];
+  memset(atlas, 0x5A, sizeof(atlas));
+  qoir_pixel_buffer atlas_pixbuf = {0};
+  atlas_pixbuf.pixcfg.pixfmt = QOIR_PIXEL_FORMAT__RGBA_NONPREMUL;
+  atlas_pixbuf.pixcfg.width_in_pixels = AW;
+  atlas_pixbuf.pixcfg.height_in_pixels = AH;
+  atlas_pixbuf.data = atlas;
+  atlas_pixbuf.stride_in_bytes = 4 * AW;
+
+  uint32_t num_tasks = 0;
+  qoir_decode_options dec_opts = {0};
+  dec_opts.executor_func = validate_test_executor;
+  dec_opts.executor_context = &num_tasks;
+  dec_opts.executor_concurrency = 4;
+  qoir_decode_atlas_result atlas_result =
+      qoir_decode_atlas(&atlas_pixbuf, items, N, &dec_opts);
+
+  // Every atlas pixel should either match its sprite's pixel or, outside of
+  // the sprites, be unchanged.
+  const char* problem = NULL;
+  if (atlas_result.status_message || (num_tasks != 4)) {
+    problem = "qoir_decode_atlas failed";
+  }
+  for (int i = 0; !problem && (i < N); i++) {
+    qoir_decode_result dec =
+        qoir_decode(encs[i].dst_ptr, encs[i].dst_len, NULL);
+    for (int32_t y = rects[i].y0; !problem && (y < rects[i].y1); y++) {
+      for (int32_t x = rects[i].x0; x < rects[i].x1; x++) {
+        uint32_t sx = (uint32_t)(x - rects[i].x0);
+        uint32_t sy = (uint32_t)(y - rects[i].y0);
+        const uint8_t* p = atlas + (4 * ((AW * y) + x));
+        const uint8_t* q =
+            dec.dst_pixbuf.data + (4 * ((sizes[i][0] * sy) + sx));
+        bool inside = (sx < sizes[i][0]) && (sy < sizes[i][1]);
+        if (inside ? memcmp(p, q, 4)
+                   : (qoir_private_peek_u32le(p) != 0x5A5A5A5A)) {
+          problem = "atlas pixels differ";
+          break;
+        }
+      }
+    }
+    free(dec.owned_memory);
+  }
+  if (!problem && (atlas[4 * ((AW * 99) + 159)] != 0x5A)) {
+    problem = "pixels outside of the rectangles changed";
+  }
+
+  // Overlapping rectangles are rejected.
+  items[5].dst_rectangle = qoir_make_rectangle(60, 40, 90, 70);
+  if (!problem && (qoir_decode_atlas(&atlas_pixbuf, items, N, NULL)
+                       .status_message !=
+                   qoir_status_message__error_invalid_argument)) {
+    problem = "overlapping rectangles were accepted";
+  }
+
+  // Compare the overlap check with comparing every pair, for random (and
+  // sometimes empty) rectangles with few distinct edges. The items have no
+  // source data, so without overlap each fails with invalid_data.
+  uint32_t rng = 0x12345678;
+  for (int trial = 0; !problem && (trial < 1000); trial++) {
+    enum { M = 12 };
+    qoir_decode_atlas_item random_items[M];
+    memset(random_items, 0, sizeof(random_items));
+    bool want_overlap = false;
+    for (int i = 0; i < M; i++) {
+      int32_t e[4];
+      for (int k = 0; k < 4; k++) {
+        e[k] = (int32_t)((next_random(&rng) >> 16) % 24);
+      }
+      random_items[i].dst_rectangle = qoir_make_rectangle(
+          4 * e[0], 4 * e[1], 4 * (e[0] + (e[2] / 4)), 4 * (e[1] + (e[3] / 4)));
+      for (int j = 0; j < i; j++) {
+        want_overlap |= !qoir_rectangle__is_empty(
+            qoir_rectangle__intersect(random_items[i].dst_rectangle,
+                                      random_items[j].dst_rectangle));
+      }
+    }
+    const char* status_message =
+        qoir_decode_atlas(&atlas_pixbuf, random_items, M, NULL).status_message;
+    if (want_overlap != (status_message ==
+                         qoir_status_message__error_invalid_argument)) {
+      problem = "random rectangles: wrong overlap check";
+    }
+  }
+
+  for (int i = 0; i < N; i++) {
+    free(encs[i].owned_memory);
+  }
+  if (problem) {
+    printf("%s: %s\n", __func__, problem);
+    return 1;
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+typedef struct counting_memory_context_struct {
+  int num_mallocs;
+  int num_scratch_mallocs;
+  int num_outstanding;
+} counting_memory_context;
+
+void*                  //
+counting_malloc_func(  //
+    void* context,     //
+    size_t len) {
+  counting_memory_context* c = (counting_memory_context*)context;
+  c->num_mallocs++;
+  for (uint32_t t = QOIR_TILE_SIZE; t <= QOIR_MAX_TILE_SIZE; t *= 2) {
+    if ((len == qoir_decode_buffer_len(t)) ||
+        (len == qoir_encode_buffer_len(t))) {
+      c->num_scratch_mallocs++;
+      break;
+    }
+  }
+  c->num_outstanding++;
+  return malloc(len);
+}
+
+void                 //
+counting_free_func(  //
+    void* context,   //
+    void* ptr) {
+  counting_memory_context* c = (counting_memory_context*)context;
+  if (ptr) {
+    c->num_outstanding--;
+  }
+  free(ptr);
+}
+
+int                         //
+test_scratch_buffer_cache(  //
+    void) {
+  // Start from an empty cache, as earlier tests used other memory functions.
+  qoir_free_cached_scratch_buffers();
+
+  static uint8_t pixels[4 * 40 * 30];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__RGBA_NONPREMUL, 40, 30, 0xCAC4E000);
+
+  counting_memory_context context = {0};
+  qoir_encode_options enc_opts = {0};
+  enc_opts.contextual_malloc_func = counting_malloc_func;
+  enc_opts.contextual_free_func = counting_free_func;
+  enc_opts.memory_func_context = &context;
+  qoir_decode_options dec_opts = {0};
+  dec_opts.contextual_malloc_func = counting_malloc_func;
+  dec_opts.contextual_free_func = counting_free_func;
+  dec_opts.memory_func_context = &context;
+
+  // Each encode or decode needs one scratch buffer. With the cache, only the
+  // first of each allocates it.
+  const char* problem = NULL;
+  for (int i = 0; !problem && (i < 3); i++) {
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+    if (enc.status_message) {
+      problem = enc.status_message;
+      break;
+    }
+    qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &dec_opts);
+    if (dec.status_message) {
+      problem = dec.status_message;
+    } else if (!pixbufs_are_equal(&src_pixbuf, &dec.dst_pixbuf)) {
+      problem = "decoded image differs";
+    }
+    counting_free_func(&context, enc.owned_memory);
+    counting_free_func(&context, dec.owned_memory);
+  }
+#if defined(QOIR_CONFIG__CACHE_SCRATCH_BUFFERS)
+  const int want_scratch_mallocs = 2;
+  const int want_outstanding = 2;
+#else
+  const int want_scratch_mallocs = 6;
+  const int want_outstanding = 0;
+#endif
+  if (problem) {
+    // No-op.
+  } else if (context.num_scratch_mallocs != want_scratch_mallocs) {
+    problem = "bad num_scratch_mallocs";
+  } else if (context.num_outstanding != want_outstanding) {
+    problem = "bad num_outstanding (before freeing the cache)";
+  }
+
+  qoir_free_cached_scratch_buffers();
+  if (!problem && (context.num_outstanding != 0)) {
+    problem = "bad num_outstanding (after freeing the cache)";
+  }
+  if (problem) {
+    printf("%s: %s\n", __func__, problem);
+    return 1;
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int                  //
+test_lz4_history(  //
+    void) {
+  // Start from an empty cache, as earlier tests used other memory functions.
+  qoir_free_cached_scratch_buffers();
+
+  // The second tile repeats the first (noisy) tile, so that grouping them
+  // makes the second one LZ4-Chained-Ops.
+  enum { W = 128, H = 64 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__RGBA_NONPREMUL, W, H, 0x12345678);
+  for (uint32_t y = 0; y < H; y++) {
+    uint8_t* row = pixels + (4 * W * y);
+    for (uint32_t i = 3; i < (4 * 64); i += 4) {
+      row[i] = 0xFF;
+    }
+    memcpy(row + (4 * 64), row, 4 * 64);
+  }
+
+  // With caller supplied buffers, the encoder only allocates its result and,
+  // for LZ4 tile groups, an LZ4 history. So does the decoder (other than the
+  // result). With the cache, the encoder's LZ4 history is re-used.
+#if defined(QOIR_CONFIG__CACHE_SCRATCH_BUFFERS)
+  const int num_lz4_history_mallocs = 1;
+#else
+  const int num_lz4_history_mallocs = 2;
+#endif
+  static qoir_encode_buffer encbuf;
+  static qoir_decode_buffer decbuf;
+  static uint8_t dst_pixels[4 * W * H];
+  const char* problem = NULL;
+  for (uint32_t group_size = 0; !problem && (group_size <= 2);
+       group_size += 2) {
+    counting_memory_context context = {0};
+    qoir_encode_options enc_opts = {0};
+    enc_opts.contextual_malloc_func = counting_malloc_func;
+    enc_opts.contextual_free_func = counting_free_func;
+    enc_opts.memory_func_context = &context;
+    enc_opts.encbuf = &encbuf;
+    enc_opts.lz4_tile_group_size = group_size;
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+    if (enc.status_message) {
+      problem = enc.status_message;
+      break;
+    }
+
+    qoir_decode_options dec_opts = {0};
+    dec_opts.contextual_malloc_func = counting_malloc_func;
+    dec_opts.contextual_free_func = counting_free_func;
+    dec_opts.memory_func_context = &context;
+    dec_opts.decbuf = &decbuf;
+    dec_opts.pixbuf = src_pixbuf;
+    dec_opts.pixbuf.data = dst_pixels;
+    qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &dec_opts);
+
+    bool chained = encoded_tile_format(enc.dst_ptr, enc.dst_len, 1) == 5;
+    int want_mallocs = 1 + ((group_size > 1) ? num_lz4_history_mallocs : 0);
+    counting_free_func(&context, enc.owned_memory);
+    qoir_free_cached_scratch_buffers();
+
+    if (dec.status_message) {
+      problem = dec.status_message;
+    } else if (!pixbufs_are_equal(&src_pixbuf, &dec.dst_pixbuf)) {
+      problem = "decoded image differs";
+    } else if (chained != (group_size > 1)) {
+      problem = "unexpected tile format";
+    } else if (context.num_mallocs != want_mallocs) {
+      problem = "bad num_mallocs";
+    } else if (context.num_outstanding != 0) {
+      problem = "bad num_outstanding";
+    }
+  }
+  if (problem) {
+    printf("%s: %s\n", __func__, problem);
+    return 1;
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int                       //
+test_scratch_buffer_len(  //
+    void) {
+  if ((qoir_decode_buffer_len(QOIR_TILE_SIZE) != sizeof(qoir_decode_buffer)) ||
+      (qoir_encode_buffer_len(QOIR_TILE_SIZE) != sizeof(qoir_encode_buffer)) ||
+      (qoir_decode_buffer_len(100) != 0) ||
+      (qoir_encode_buffer_len(512) != 0)) {
+    printf("%s: bad qoir_etc_buffer_len\n", __func__);
+    return 1;
+  }
+
+  // Start from an empty cache, as earlier tests used other memory functions.
+  qoir_free_cached_scratch_buffers();
+
+  enum { W = 300, H = 200 };
+  static uint8_t pixels[4 * W * H];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__RGBA_NONPREMUL, W, H, 0x5CA7C400);
+
+  // Buffers of the qoir_etc_buffer_len length are used for every tile size,
+  // so that no scratch space is allocated. Shorter buffers are ignored for
+  // larger tiles.
+  size_t encbuf_len = qoir_encode_buffer_len(QOIR_MAX_TILE_SIZE);
+  size_t decbuf_len = qoir_decode_buffer_len(QOIR_MAX_TILE_SIZE);
+  void* encbuf = malloc(encbuf_len);
+  void* decbuf = malloc(decbuf_len);
+  static const uint32_t tile_sizes[3] = {64, 128, 256};
+  const char* problem = (encbuf && decbuf) ? NULL : "out of memory";
+  for (int i = 0; !problem && (i < 6); i++) {
+    bool too_short = i >= 3;
+    uint32_t tile_size = tile_sizes[i % 3];
+    counting_memory_context context = {0};
+    qoir_encode_options enc_opts = {0};
+    enc_opts.contextual_malloc_func = counting_malloc_func;
+    enc_opts.contextual_free_func = counting_free_func;
+    enc_opts.memory_func_context = &context;
+    enc_opts.encbuf = (qoir_encode_buffer*)encbuf;
+    enc_opts.encbuf_len = too_short ? 0 : qoir_encode_buffer_len(tile_size);
+    enc_opts.tile_size_in_pixels = tile_size;
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+    if (enc.status_message) {
+      problem = enc.status_message;
+      break;
+    }
+
+    qoir_decode_options dec_opts = {0};
+    dec_opts.contextual_malloc_func = counting_malloc_func;
+    dec_opts.contextual_free_func = counting_free_func;
+    dec_opts.memory_func_context = &context;
+    dec_opts.decbuf = (qoir_decode_buffer*)decbuf;
+    dec_opts.decbuf_len = too_short ? 0 : qoir_decode_buffer_len(tile_size);
+    qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &dec_opts);
+    if (dec.status_message) {
+      problem = dec.status_message;
+    } else if (!pixbufs_are_equal(&src_pixbuf, &dec.dst_pixbuf)) {
+      problem = "decoded image differs";
+    } else if (qoir_validate(enc.dst_ptr, enc.dst_len, &dec_opts)
+                   .status_message) {
+      problem = "qoir_validate failed";
+    }
+    counting_free_func(&context, dec.owned_memory);
+
+    qoir_decoder decoder;
+    qoir_decoder__initialize(&decoder, &dec_opts);
+    qoir_decoder_feed_result res =
+        qoir_decoder__feed(&decoder, enc.dst_ptr, enc.dst_len);
+    if (!problem && (res.status_message || !res.done ||
+                     !pixbufs_are_equal(&src_pixbuf, &res.dst_pixbuf))) {
+      problem = "qoir_decoder__feed failed";
+    }
+    qoir_decoder__destroy(&decoder);
+    counting_free_func(&context, enc.owned_memory);
+    qoir_free_cached_scratch_buffers();
+
+    bool want_scratch_mallocs = too_short && (tile_size > QOIR_TILE_SIZE);
+    if (problem) {
+      // No-op.
+    } else if (want_scratch_mallocs != (context.num_scratch_mallocs > 0)) {
+      problem = "bad num_scratch_mallocs";
+    } else if (context.num_outstanding != 0) {
+      problem = "bad num_outstanding";
+    }
+    if (problem) {
+      printf("%s: tile size %u%s: %s\n", __func__, tile_size,
+             too_short ? " (too short)" : "", problem);
+      free(encbuf);
+      free(decbuf);
+      return 1;
+    }
+  }
+  free(encbuf);
+  free(decbuf);
+  if (problem) {
+    printf("%s: %s\n", __func__, problem);
+    return 1;
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int          //
+test_arena(  //
+    void) {
+  static uint8_t pixels[4 * 150 * 100];
+  qoir_pixel_buffer src_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__RGBA_NONPREMUL, 150, 100, 0xA4E4A000);
+
+  // The memory functions should not be called when there is an arena.
+  counting_memory_context context = {0};
+  qoir_encode_options enc_opts = {0};
+  enc_opts.contextual_malloc_func = counting_malloc_func;
+  enc_opts.contextual_free_func = counting_free_func;
+  enc_opts.memory_func_context = &context;
+  enc_opts.lossiness = 1;
+  enc_opts.preview = true;
+  enc_opts.mipmap_levels = 2;
+  enc_opts.tile_lossiness_map = (const uint8_t*)"\x00\x02\x00\x03\x00\x01";
+  qoir_decode_options dec_opts = {0};
+  dec_opts.contextual_malloc_func = counting_malloc_func;
+  dec_opts.contextual_free_func = counting_free_func;
+  dec_opts.memory_func_context = &context;
+  dec_opts.pixfmt = QOIR_PIXEL_FORMAT__BGRA_PREMUL;
+
+  qoir_encode_result want_enc = qoir_encode(&src_pixbuf, &enc_opts);
+  if (want_enc.status_message) {
+    printf("%s: qoir_encode: %s\n", __func__, want_enc.status_message);
+    return 1;
+  }
+  qoir_decode_result want_dec =
+      qoir_decode(want_enc.dst_ptr, want_enc.dst_len, &dec_opts);
+  if (want_dec.status_message) {
+    printf("%s: qoir_decode: %s\n", __func__, want_dec.status_message);
+    return 1;
+  }
+  int num_mallocs = context.num_mallocs;
+
+  const char* problem = NULL;
+  qoir_size_result enc_len = qoir_encode_arena_len(&src_pixbuf, &enc_opts);
+  qoir_size_result dec_len =
+      qoir_decode_arena_len(want_enc.dst_ptr, want_enc.dst_len, &dec_opts);
+  uint8_t* arena = NULL;
+  if (enc_len.status_message || dec_len.status_message) {
+    problem = "arena_len failed";
+  } else if (!(arena = malloc(enc_len.value + dec_len.value))) {
+    problem = "out of memory";
+  }
+
+  if (!problem) {
+    enc_opts.arena_ptr = arena;
+    enc_opts.arena_len = enc_len.value;
+    qoir_encode_result enc = qoir_encode(&src_pixbuf, &enc_opts);
+    if (enc.status_message) {
+      problem = enc.status_message;
+    } else if (enc.owned_memory || (enc.dst_ptr < arena) ||
+               ((enc.dst_ptr + enc.dst_len) > (arena + enc_len.value)) ||
+               (enc.dst_len != want_enc.dst_len) ||
+               memcmp(enc.dst_ptr, want_enc.dst_ptr, enc.dst_len)) {
+      problem = "arena encoding differs";
+    }
+  }
+
+  if (!problem) {
+    dec_opts.arena_ptr = arena + enc_len.value;
+    dec_opts.arena_len = dec_len.value;
+    qoir_decode_result dec =
+        qoir_decode(want_enc.dst_ptr, want_enc.dst_len, &dec_opts);
+    if (dec.status_message) {
+      problem = dec.status_message;
+    } else if (dec.owned_memory ||
+               (dec.dst_pixbuf.data != dec_opts.arena_ptr) ||
+               !pixbufs_are_equal(&dec.dst_pixbuf, &want_dec.dst_pixbuf)) {
+      problem = "arena decoding differs";
+    }
+  }
+
+  if (!problem) {
+    enc_opts.arena_len = enc_len.value / 2;
+    dec_opts.arena_len = dec_len.value / 2;
+    if (qoir_encode(&src_pixbuf, &enc_opts).status_message !=
+        qoir_status_message__error_out_of_memory) {
+      problem = "short encode arena: bad status message";
+    } else if (qoir_decode(want_enc.dst_ptr, want_enc.dst_len, &dec_opts)
+                   .status_message !=
+               qoir_status_message__error_out_of_memory) {
+      problem = "short decode arena: bad status message";
+    }
+  }
+
+  if (!problem) {
+    enc_opts.target_dst_len = want_enc.dst_len / 2;
+    if (qoir_encode(&src_pixbuf, &enc_opts).status_message !=
+        qoir_status_message__error_invalid_argument) {
+      problem = "rate control: bad status message";
+    } else if (context.num_mallocs != num_mallocs) {
+      problem = "memory functions were called";
+    }
+  }
+
+  free(arena);
+  counting_free_func(&context, want_enc.owned_memory);
+  counting_free_func(&context, want_dec.owned_memory);
+  qoir_free_cached_scratch_buffers();
+  if (problem) {
+    printf("%s: %s\n", __func__, problem);
+    return 1;
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int                    //
+test_reusable_result(  //
+    void) {
+  // Encode three images: 40 × 30, 20 × 20 and 50 × 40.
+  enum { N = 3 };
+  static const uint32_t widths[N] = {40, 20, 50};
+  static const uint32_t heights[N] = {30, 20, 40};
+  static uint8_t pixels[4 * 50 * 40];
+  qoir_pixel_buffer noise_pixbuf = make_noise_pixbuf(
+      pixels, QOIR_PIXEL_FORMAT__RGBA_NONPREMUL, 50, 40, 0x4E05AB1E);
+  qoir_encode_result encs[N];
+  for (int i = 0; i < N; i++) {
+    qoir_pixel_buffer src_pixbuf = noise_pixbuf;
+    src_pixbuf.pixcfg.width_in_pixels = widths[i];
+    src_pixbuf.pixcfg.height_in_pixels = heights[i];
+    encs[i] = qoir_encode(&src_pixbuf, NULL);
+    if (encs[i].status_message) {
+      printf("%s: qoir_encode: %s\n", __func__, encs[i].status_message);
+      return 1;
+    }
+  }
+
+  counting_memory_context context = {0};
+  static qoir_decode_buffer decbuf;
+  qoir_decode_options opts = {0};
+  opts.contextual_malloc_func = counting_malloc_func;
+  opts.contextual_free_func = counting_free_func;
+  opts.memory_func_context = &context;
+  opts.decbuf = &decbuf;
+
+  // The second image fits in the first's memory. The third does not.
+  const char* problem = NULL;
+  qoir_decode_result prev = {0};
+  for (int i = 0; !problem && (i < N); i++) {
+    void* prev_memory = prev.owned_memory;
+    int num_mallocs = context.num_mallocs;
+    opts.reusable_result = &prev;
+    qoir_decode_result dec =
+        qoir_decode(encs[i].dst_ptr, encs[i].dst_len, &opts);
+    opts.reusable_result = NULL;
+    qoir_decode_result want =
+        qoir_decode(encs[i].dst_ptr, encs[i].dst_len, &opts);
+    // Comparing pointers can't tell that memory was not re-used, as malloc
+    // may return what was just freed, but num_mallocs can.
+    bool reused = (i == 1);
+    if (dec.status_message || want.status_message) {
+      problem = "qoir_decode failed";
+    } else if (prev.owned_memory ||
+               !qoir_pixel_buffer__is_zero(prev.dst_pixbuf)) {
+      problem = "earlier result was not taken over";
+    } else if (reused && (dec.owned_memory != prev_memory)) {
+      problem = "bad re-use";
+    } else if ((context.num_mallocs - num_mallocs) != (reused ? 1 : 2)) {
+      problem = "bad num_mallocs";
+    } else if (!pixbufs_are_equal(&dec.dst_pixbuf, &want.dst_pixbuf)) {
+      problem = "decoded image differs";
+    }
+    counting_free_func(&context, want.owned_memory);
+    counting_free_func(&context, prev.owned_memory);
+    prev = dec;
+  }
+
+  // Clipping, into re-used memory that still holds the third image, should
+  // zero exactly the pixels outside the clip.
+  if (!problem) {
+    qoir_decode_result want =
+        qoir_decode(encs[0].dst_ptr, encs[0].dst_len, &opts);
+    opts.reusable_result = &prev;
+    opts.use_dst_clip_rectangle = true;
+    opts.dst_clip_rectangle = qoir_make_rectangle(5, 7, 33, 21);
+    qoir_decode_result dec =
+        qoir_decode(encs[0].dst_ptr, encs[0].dst_len, &opts);
+    if (dec.status_message || want.status_message) {
+      problem = "qoir_decode failed (clipped)";
+    }
+    for (uint32_t y = 0; !problem && (y < heights[0]); y++) {
+      for (uint32_t x = 0; !problem && (x < widths[0]); x++) {
+        const uint8_t* d = dec.dst_pixbuf.data +
+                           (y * dec.dst_pixbuf.stride_in_bytes) + (4 * x);
+        const uint8_t* w = want.dst_pixbuf.data +
+                           (y * want.dst_pixbuf.stride_in_bytes) + (4 * x);
+        bool inside = (5 <= x) && (x < 33) && (7 <= y) && (y < 21);
+        static const uint8_t zeroes[4] = {0};
+        if (memcmp(d, inside ? w : zeroes, 4)) {
+          problem = "decoded image differs (clipped)";
+        }
+      }
+    }
+    counting_free_func(&context, want.owned_memory);
+    counting_free_func(&context, prev.owned_memory);
+    prev = dec;
+  }
+
+  counting_free_func(&context, prev.owned_memory);
+  for (int i = 0; i < N; i++) {
+    free(encs[i].owned_memory);
+  }
+  if (!problem && (context.num_outstanding != 0)) {
+    problem = "bad num_outstanding";
+  }
+  if (problem) {
+    printf("%s: %s\n", __func__, problem);
+    return 1;
+  }
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+int              //
+test_animation(  //
+    void) {
+  // Make three 200 × 150 frames (4 × 3 tiles). The second frame changes a
+  // small rectangle within one tile. The third frame repeats the second.
+  enum { W = 200, H = 150 };
+  static uint8_t pixels[3][4 * W * H];
+  qoir_pixel_buffer pixbufs[3];
+  pixbufs[0] = make_noise_pixbuf(
+      pixels[0], QOIR_PIXEL_FORMAT__BGRA_NONPREMUL, W, H, 0xF4A3E500);
+  memcpy(pixels[1], pixels[0], sizeof(pixels[0]));
+  for (uint32_t y = 70; y < 90; y++) {
+    memset(pixels[1] + (4 * ((W * y) + 140)), 0xC0, 4 * 30);
+  }
+  memcpy(pixels[2], pixels[1], sizeof(pixels[1]));
+  for (int i = 1; i < 3; i++) {
+    pixbufs[i] = pixbufs[0];
+    pixbufs[i].data = pixels[i];
+  }
+  static const uint32_t delays_ms[2] = {40, 50};
+  qoir_encode_options enc_opts = {0};
+  enc_opts.animation_frames_ptr = &pixbufs[1];
+  enc_opts.animation_frames_len = 2;
+  enc_opts.animation_delays_ms_ptr = delays_ms;
+  qoir_encode_result enc = qoir_encode(&pixbufs[0], &enc_opts);
+  if (enc.status_message) {
+    printf("%s: qoir_encode: %s\n", __func__, enc.status_message);
+    return 1;
+  }
+
+  // The last fPIX chunk (just before the 12 byte QEND chunk) should consist
+  // only of Unchanged tiles: 20 bytes of headers and 12 tile prefixes.
+  if ((enc.dst_len < (12 + 20 + 48)) ||
+      memcmp(enc.dst_ptr + enc.dst_len - (12 + 20 + 48), "fPIX", 4)) {
+    printf("%s: the final frame was not 68 bytes long\n", __func__);
+    free(enc.owned_memory);
+    return 1;
+  }
+
+  // Decode each frame from scratch and then, re-using the pixel buffer, by
+  // applying only the changes from the previous frame.
+  static uint8_t canvas[4 * W * H];
+  qoir_decode_options dec_opts = {0};
+  dec_opts.pixbuf = pixbufs[0];
+  dec_opts.pixbuf.data = canvas;
+  for (int resume = 0; resume < 2; resume++) {
+    for (uint32_t i = 0; i < 3; i++) {
+      dec_opts.frame_index = i;
+      dec_opts.pixbuf_holds_previous_frame = resume;
+      qoir_decode_result dec = qoir_decode(enc.dst_ptr, enc.dst_len, &dec_opts);
+      if (dec.status_message) {
+        printf("%s: qoir_decode: %s\n", __func__, dec.status_message);
+        free(enc.owned_memory);
+        return 1;
+      } else if ((dec.num_frames != 3) ||
+                 (dec.frame_delay_ms != ((i == 0) ? 0 : delays_ms[i - 1]))) {
+        printf("%s: frame %u: bad num_frames or frame_delay_ms\n", __func__,
+               i);
+        free(enc.owned_memory);
+        return 1;
+      } else if (!pixbufs_are_equal(&pixbufs[i], &dec.dst_pixbuf)) {
+        printf("%s: frame %u (resume=%d): pixels differ\n", __func__, i,
+               resume);
+        free(enc.owned_memory);
+        return 1;
+      }
+    }
+  }
+  free(enc.owned_memory);
+
+  printf("%s: OK\n", __func__);
+  return 0;
+}
+
+// ----
+
 int            //
 main(          //
     int argc,  //
     char** argv) {
-  return test_swizzle() ||  //
-         test_round_trip();
+  return test_swizzle() ||               //
+         test_round_trip() ||            //
+         test_mipmap() ||                //
+         test_preview() ||               //
+         test_tile_size() ||             //
+         test_lz4_tile_group() ||        //
+         test_huffman() ||               //
+         test_split_ops() ||             //
+         test_ops2() ||                  //
+         test_gray() ||                  //
+         test_alpha_plane() ||           //
+         test_chroma_subsampling() ||    //
+         test_near_lossless() ||         //
+         test_rate_control() ||          //
+         test_tile_lossiness_map() ||    //
+         test_alpha_lossiness() ||       //
+         test_streaming_decoder() ||     //
+         test_band_decode() ||           //
+         test_probe() ||                 //
+         test_validate() ||              //
+         test_clipped_tiles() ||         //
+         test_decode_batch() ||          //
+         test_decode_atlas() ||          //
+         test_scratch_buffer_cache() ||  //
+         test_lz4_history() ||           //
+         test_scratch_buffer_len() ||    //
+         test_arena() ||                 //
+         test_reusable_result() ||       //
+         test_animation();
 }
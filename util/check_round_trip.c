@@ -43,6 +43,56 @@ check_round_trip_3(                 //
   return NULL;
 }
 
+// next_random advances a linear congruential generator's state, returning the
+// new state. Its high bits are more random than its low bits.
+uint32_t      //
+next_random(  //
+    uint32_t* rng) {
+  *rng = (*rng * 1103515245u) + 12345u;
+  return *rng;
+}
+
+// make_noise_pixbuf fills pixels, which must hold (4 * width * height) bytes,
+// with pseudo-random bytes seeded by seed. It returns a pixel buffer for them,
+// whose pixfmt must have 4 bytes per pixel. Callers typically reshape the
+// noise (e.g. masking it and adding a gradient) in place, before encoding.
+qoir_pixel_buffer              //
+make_noise_pixbuf(             //
+    uint8_t* pixels,           //
+    qoir_pixel_format pixfmt,  //
+    uint32_t width,            //
+    uint32_t height,           //
+    uint32_t seed) {
+  uint32_t rng = seed;
+  for (size_t i = 0; i < ((size_t)4 * width * height); i++) {
+    pixels[i] = (uint8_t)(next_random(&rng) >> 24);
+  }
+  qoir_pixel_buffer pixbuf = {0};
+  pixbuf.pixcfg.pixfmt = pixfmt;
+  pixbuf.pixcfg.width_in_pixels = width;
+  pixbuf.pixcfg.height_in_pixels = height;
+  pixbuf.data = pixels;
+  pixbuf.stride_in_bytes = (size_t)4 * width;
+  return pixbuf;
+}
+
+// encoded_tile_format returns the tile format byte (before masking) of the
+// tile_index'th tile of an encoded image's QPIX chunk, or -1 if enc_len is too
+// short. The first tile starts at offset 32, after the QOIR chunk and the QPIX
+// chunk header.
+int                          //
+encoded_tile_format(         //
+    const uint8_t* enc_ptr,  //
+    size_t enc_len,          //
+    uint32_t tile_index) {
+  size_t pos = 32;
+  for (uint32_t i = 0; (i < tile_index) && ((pos + 4) <= enc_len); i++) {
+    pos += 4 + (enc_ptr[pos + 0] | (enc_ptr[pos + 1] << 8) |
+                (enc_ptr[pos + 2] << 16));
+  }
+  return ((pos + 4) <= enc_len) ? enc_ptr[pos + 3] : -1;
+}
+
 const char*          //
 check_round_trip_2(  //
     qoir_pixel_buffer* src_pixbuf) {